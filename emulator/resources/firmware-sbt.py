@@ -11,6 +11,10 @@
 # Since we need some hints about basic blocks and data vs. code, we
 # take the SDCC ".rst" files as input, rather than the raw hex file.
 #
+# With --profile, every translated block also updates the cube's profiler
+# counters (if profiling is enabled at runtime with -p), so that the
+# firmware can be profiled at full SBT speed.
+#
 # Micah Elizabeth Scott <micah@misc.name>
 # 
 # Copyright (c) 2011 Sifteo, Inc.
@@ -62,8 +66,9 @@ def fixupImage(p):
 
 
 class CodeGenerator:
-    def __init__(self, parser):
+    def __init__(self, parser, profile=False):
         self.p = parser
+        self.profile = profile
         self.opTable = FirmwareLib.opcodeTable()
 
     def write(self, f):
@@ -73,10 +78,12 @@ class CodeGenerator:
                 "namespace Cube {\n"
                 "namespace CPU {\n"
                 "\n"
+                "extern const bool sbt_rom_profiled = %s;\n"
+                "\n"
                 "static int FASTCALL sbt_exception(em8051 *aCPU) {\n"
                 "\texcept(aCPU, EXCEPTION_SBT);\n"
                 "\treturn 1;\n"
-                "}\n")
+                "}\n" % (self.profile and 'true' or 'false'))
 
         self.writeCode(f)
         bin2c.writeArray(f, 'sbt_rom_data', self.p.dataMemory)
@@ -85,6 +92,7 @@ class CodeGenerator:
                 "};  // namespace Cube\n")
 
     def beginBlock(self, f, addr):
+        self.blockAddr = addr
         f.write("\nstatic int FASTCALL sbt_block_%04x(em8051 *aCPU)\n"
                 "{\n"
                 "\tunsigned clk = 0;\n"
@@ -92,6 +100,9 @@ class CodeGenerator:
                 % (addr, addr))
 
     def endBlock(self, f):
+        if self.profile:
+            f.write("\tif (UNLIKELY(aCPU->mProfileData != NULL))\n"
+                    "\t\tprofile_block(aCPU, 0x%04x, clk);\n" % self.blockAddr)
         f.write("\taCPU->mPC = pc & PC_MASK;\n"
                 "\treturn clk;\n"
                 "}\n")
@@ -190,9 +201,13 @@ class CodeGenerator:
 
 if __name__ == '__main__':
     p = FirmwareLib.RSTParser()
+    profile = False
     for f in sys.argv[1:]:
-        p.parseFile(f)
+        if f == '--profile':
+            profile = True
+        else:
+            p.parseFile(f)
 
     fixupImage(p)
-    gen = CodeGenerator(p)
+    gen = CodeGenerator(p, profile)
     gen.write(open('resources/firmware-sbt.cpp', 'w'))
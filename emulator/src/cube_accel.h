@@ -116,6 +116,16 @@ class I2CAccelerometer {
         regs.out_adc1 = value16;
     }
 
+    void getVector(int16_t &x, int16_t &y, int16_t &z) const {
+        x = regs.out_x;
+        y = regs.out_y;
+        z = regs.out_z;
+    }
+
+    uint16_t getADC1() const {
+        return regs.out_adc1;
+    }
+
     void i2cStart() {
         state = S_I2C_ADDRESS;
     }
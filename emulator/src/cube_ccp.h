@@ -48,18 +48,6 @@ public:
         return galoisFieldMultiply(cpu.mSFR[REG_CCPDATIA], cpu.mSFR[REG_CCPDATIB]);
     }
 
-private:
-    static ALWAYS_INLINE void gfmBit(uint8_t &a, uint8_t &b, uint8_t &p)
-    {
-        if (b & 1)
-            p ^= a;
-        uint8_t msb = a & 0x80;
-        a <<= 1;
-        if (msb)
-            a ^= 0x1b;
-        b >>= 1;
-    }
-
     /// GF(2^8) multiplier, using the AES polynomial
     static uint8_t galoisFieldMultiply(uint8_t a, uint8_t b)
     {
@@ -74,6 +62,18 @@ private:
         gfmBit(a, b, p);  // 7
         return p;
     }
+
+private:
+    static ALWAYS_INLINE void gfmBit(uint8_t &a, uint8_t &b, uint8_t &p)
+    {
+        if (b & 1)
+            p ^= a;
+        uint8_t msb = a & 0x80;
+        a <<= 1;
+        if (msb)
+            a ^= 0x1b;
+        b >>= 1;
+    }
 };
  
 
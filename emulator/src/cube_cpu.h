@@ -165,6 +165,10 @@ void op_setptrs(em8051 *aCPU);
 typedef int FASTCALL (*sbt_block_t)(em8051 *);
 extern const uint8_t sbt_rom_data[];
 extern const sbt_block_t sbt_rom_code[];
+extern const bool sbt_rom_profiled;     // Blocks call profile_block() themselves
+
+// Profiler accounting for one instruction, or one translated block
+void profile_block(em8051 *aCPU, unsigned pc, unsigned clk);
 
 enum EM8051_EXCEPTION
 {
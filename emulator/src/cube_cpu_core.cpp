@@ -47,8 +47,18 @@ NEVER_INLINE void trace_execution(em8051 *aCPU)
 
 NEVER_INLINE void profile_tick(em8051 *aCPU)
 {
-    struct profile_data *pd = &aCPU->mProfileData[aCPU->mPreviousPC];
-    pd->total_cycles += aCPU->mTickDelay;
+    profile_block(aCPU, aCPU->mPreviousPC, aCPU->mTickDelay);
+}
+
+NEVER_INLINE void profile_block(em8051 *aCPU, unsigned pc, unsigned clk)
+{
+    /*
+     * Profiled SBT blocks call this directly. In batched SBT loops the
+     * clock may lag by up to one batch, so loop lengths are approximate.
+     */
+
+    struct profile_data *pd = &aCPU->mProfileData[pc];
+    pd->total_cycles += clk;
     if (pd->loop_prev) {
         pd->loop_cycles += aCPU->vtime->clocks - pd->loop_prev;
         pd->loop_hits++;
@@ -277,6 +287,177 @@ NEVER_INLINE void timer_clklf_tick(em8051 *aCPU)
     }
 }
 
+static bool timers_idle(em8051 *aCPU)
+{
+    /*
+     * Are all of the 8051 timers stopped, or waiting for external edges?
+     * Edges only arrive with needTimerEdgeCheck, which is handled separately.
+     */
+
+    uint8_t tcon = aCPU->mSFR[REG_TCON];
+    uint8_t tmod = aCPU->mSFR[REG_TMOD];
+
+    if ((tcon & TCONMASK_TR0) && !(tmod & (TMODMASK_GATE_0 | TMODMASK_CT_0)))
+        return false;
+    if ((tcon & TCONMASK_TR1) && !(tmod & (TMODMASK_GATE_1 | TMODMASK_CT_1)))
+        return false;
+
+    switch (aCPU->mSFR[REG_T2CON] & 0x03) {
+        case 1:
+        case 3:
+            return false;
+    }
+
+    return true;
+}
+
+NEVER_INLINE unsigned timer_sleep_ticks(em8051 *aCPU)
+{
+    /*
+     * While the CPU is powered down, calculate how many ticks we can
+     * skip before anything happens which timer_sleep_skip() can't batch.
+     * This is the tick just before the next watchdog expiration or RTC2
+     * compare, or the next 1/12 prescaler tick if anything else is running.
+     *
+     * Wakeup by pin is handled outside the CPU core, and it isn't
+     * predictable. Our callers limit the latency for this.
+     */
+
+    static const unsigned MAX_TICKS = 0x1000000;
+    static const unsigned TICK12_PER_HALF_LF = 21;
+    static const unsigned TICK12_PER_LF = TICK12_PER_HALF_LF * 2;
+
+    ASSERT(aCPU->powerDown);
+
+    switch (aCPU->mSFR[REG_PWRDWN] & PWRDWN_MODE_MASK) {
+        case PWRDWN_DEEP_SLEEP:
+        case PWRDWN_MEMORY:
+            // All timers are off
+            return MAX_TICKS;
+    }
+
+    if (!timers_idle(aCPU))
+        return aCPU->prescaler12;
+
+    uint8_t clklf = aCPU->mSFR[REG_CLKLFCTRL];
+    switch (clklf & CLKLFMASK_SOURCE) {
+
+        case CLKLFSRC_NONE:
+            // Nothing to do, unless we owe the watchdog an exception
+            return aCPU->wdtEnabled ? aCPU->prescaler12 : MAX_TICKS;
+
+        case CLKLFSRC_RC:
+        case CLKLFSRC_SYNTH:
+            break;
+
+        default:
+            return aCPU->prescaler12;
+    }
+
+    // How many CLKLF ticks until something interesting happens?
+
+    unsigned lfTicks = MAX_TICKS;
+
+    if (aCPU->wdtEnabled)
+        lfTicks = std::min(lfTicks, aCPU->wdtCounter ? aCPU->wdtCounter : 0x1000000);
+
+    uint8_t rtc2con = aCPU->mSFR[REG_RTC2CON];
+    if ((rtc2con & (RTC2CON_ENABLE | RTC2CON_COMPARE_EN)) == (RTC2CON_ENABLE | RTC2CON_COMPARE_EN)) {
+        uint16_t cmp = aCPU->mSFR[REG_RTC2CMP0] | (aCPU->mSFR[REG_RTC2CMP1] << 8);
+        uint16_t distance = cmp - aCPU->rtc2;
+        lfTicks = std::min(lfTicks, distance ? (unsigned)distance : 0x10000U);
+    }
+
+    // How many 1/12 prescaler ticks until that happens?
+
+    uint64_t tick12s = aCPU->prescalerLF + 1;
+    if (clklf & CLKLFMASK_PHASE)
+        tick12s += TICK12_PER_HALF_LF;
+    tick12s += (uint64_t)(lfTicks - 1) * TICK12_PER_LF;
+
+    // Stop one clock tick short, so the event goes through timer_tick_work()
+    uint64_t ticks = aCPU->prescaler12 + (tick12s - 1) * 12 - 1;
+
+    return (unsigned) std::max<uint64_t>(1, std::min<uint64_t>(ticks, MAX_TICKS));
+}
+
+NEVER_INLINE void timer_sleep_skip(em8051 *aCPU, unsigned numTicks)
+{
+    /*
+     * Advance the timers of a sleeping CPU by 'numTicks', in constant time.
+     * Must not be called with more ticks than timer_sleep_ticks() allows.
+     */
+
+    static const unsigned TICK12_PER_HALF_LF = 21;
+    static const unsigned TICK12_PER_LF = TICK12_PER_HALF_LF * 2;
+
+    ASSERT(aCPU->powerDown);
+    ASSERT(numTicks > aCPU->prescaler12);
+
+    // Number of times timer_tick() would have called timer_tick_work(tick12=true)
+    unsigned tick12s = 1 + (numTicks - aCPU->prescaler12) / 12;
+    aCPU->prescaler12 = 12 - (numTicks - aCPU->prescaler12) % 12;
+
+    // Sample any pending edges, and clear the neighbor input.
+    timer_tick_work(aCPU, false);
+
+    switch (aCPU->mSFR[REG_PWRDWN] & PWRDWN_MODE_MASK) {
+        case PWRDWN_DEEP_SLEEP:
+        case PWRDWN_MEMORY:
+            return;
+    }
+
+    aCPU->prescaler24 = (aCPU->prescaler24 + tick12s) & 1;
+
+    uint8_t clklf = aCPU->mSFR[REG_CLKLFCTRL];
+    switch (clklf & CLKLFMASK_SOURCE) {
+        case CLKLFSRC_RC:
+        case CLKLFSRC_SYNTH:
+            break;
+        default:
+            return;
+    }
+
+    // Same CLKLF synthesis as timer_tick_work(), skipping whole periods at once
+
+    unsigned lfTicks = 0;
+    while (tick12s) {
+        if (aCPU->prescalerLF >= tick12s) {
+            aCPU->prescalerLF -= tick12s;
+            break;
+        }
+
+        tick12s -= aCPU->prescalerLF + 1;
+        aCPU->prescalerLF = TICK12_PER_HALF_LF - 1;
+
+        clklf |= CLKLFMASK_XOSC16M;
+        clklf |= CLKLFMASK_READY;
+        clklf ^= CLKLFMASK_PHASE;
+
+        if (clklf & CLKLFMASK_PHASE) {
+            unsigned periods = tick12s / TICK12_PER_LF;
+            lfTicks += 1 + periods;
+            tick12s -= periods * TICK12_PER_LF;
+        }
+    }
+    aCPU->mSFR[REG_CLKLFCTRL] = clklf;
+
+    if (!lfTicks)
+        return;
+
+    // Batched timer_clklf_tick(), known not to reach any WDT or RTC2 events
+
+    if (aCPU->wdtEnabled) {
+        ASSERT(aCPU->wdtCounter == 0 || aCPU->wdtCounter > lfTicks);
+        aCPU->wdtCounter = (aCPU->wdtCounter - lfTicks) & 0xFFFFFF;
+    }
+
+    if (aCPU->mSFR[REG_RTC2CON] & RTC2CON_ENABLE)
+        aCPU->rtc2 += lfTicks;
+    else
+        aCPU->rtc2 = 0;
+}
+
 NEVER_INLINE void timer_tick_work(em8051 *aCPU, bool tick12)
 {
     /*
@@ -41,6 +41,8 @@ NEVER_INLINE void trace_execution(em8051 *mCPU);
 NEVER_INLINE void profile_tick(em8051 *mCPU);
 NEVER_INLINE void timer_tick_work(em8051 *aCPU, bool tick12);
 NEVER_INLINE void wake_from_sleep(em8051 *aCPU, uint8_t reason);
+NEVER_INLINE unsigned timer_sleep_ticks(em8051 *aCPU);
+NEVER_INLINE void timer_sleep_skip(em8051 *aCPU, unsigned numTicks);
 
 static ALWAYS_INLINE void timer_tick(em8051 *aCPU, unsigned numTicks)
 {
@@ -68,9 +70,16 @@ static ALWAYS_INLINE void em8051_tick(em8051 *aCPU, unsigned numTicks,
                                       bool *ticked)
 {
     if (aCPU->powerDown) {
-        // Arbitrary large batch size when we're off.
+        // Latency for resuming execution after wakeup
         aCPU->mTickDelay = 1024;
 
+        /*
+         * Batches longer than the 1/12 prescaler are only possible while
+         * we're asleep, and only up to the limit from timer_sleep_ticks().
+         */
+        if (UNLIKELY(numTicks > aCPU->prescaler12))
+            return timer_sleep_skip(aCPU, numTicks);
+
     } else {
         // CPU core is awake
 
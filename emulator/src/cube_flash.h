@@ -34,6 +34,7 @@
 #include "cube_flash_model.h"
 #include "flash_storage.h"
 #include "tracer.h"
+#include "snapshot.h"
 
 namespace Cube {
 
@@ -86,6 +87,17 @@ class Flash {
         return storage;
     }
 
+    void saveState(SnapshotWriter &snap) const {
+        // Only the model state; storage contents are saved by the System
+        snap.put(*this);
+    }
+
+    void loadState(SnapshotReader &snap) {
+        FlashStorage::CubeRecord *s = storage;
+        snap.get(*this);
+        storage = s;
+    }
+
     uint32_t getCycleCount() {
         uint32_t c = cycle_count;
         cycle_count = 0;
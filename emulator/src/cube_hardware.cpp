@@ -24,6 +24,7 @@
  * THE SOFTWARE.
  */
 
+#include <stddef.h>
 #include "cube_hardware.h"
 #include "cube_debug.h"
 #include "cube_cpu_callbacks.h"
@@ -58,6 +59,7 @@ bool Hardware::init(VirtualTime *masterTimer, const char *firmwareFile,
     }
 
     flash.init(flashStorage);
+    hle.disable();
     spi.radio.init(&cpu);
     spi.init(&cpu);
     adc.init();
@@ -90,6 +92,8 @@ uint64_t Hardware::getHWID() const
 void Hardware::reset()
 {
     CPU::em8051_reset(&cpu, false);
+    if (hle.isEnabled())
+        hle.reset();
 }
 
 void Hardware::fullReset()
@@ -424,6 +428,70 @@ void Hardware::traceExecution()
         assembly);
 }
 
+void Hardware::saveState(SnapshotWriter &snap) const
+{
+    /*
+     * Everything this cube needs to pick up where it left off. Flash
+     * memory contents and the master clock are saved by System.
+     *
+     * Everything in em8051 up to callbackData is register and timer
+     * state. After that, only XDATA and the IRQ stack matter; code
+     * memory and the handler tables come from the firmware image.
+     */
+
+    snap.put(&cpu, offsetof(CPU::em8051, callbackData));
+    snap.put(cpu.mExtData);
+    snap.put(cpu.irql);
+
+    snap.put(lcd);
+    snap.put(backlight);
+    snap.put(adc);
+    snap.put(mdu);
+    snap.put(rng);
+    spi.saveState(snap);
+    i2c.saveState(snap);
+    flash.saveState(snap);
+    neighbors.saveState(snap);
+    hle.saveState(snap);
+
+    snap.put(lat1);
+    snap.put(lat2);
+    snap.put(bus);
+    snap.put(prev_ctrl_port);
+    snap.put(flash_drv);
+    snap.put(rfcken);
+    snap.put(exceptionCount);
+}
+
+void Hardware::loadState(SnapshotReader &snap)
+{
+    snap.get(&cpu, offsetof(CPU::em8051, callbackData));
+    snap.get(cpu.mExtData);
+    snap.get(cpu.irql);
+
+    snap.get(lcd);
+    snap.get(backlight);
+    snap.get(adc);
+    snap.get(mdu);
+    snap.get(rng);
+    spi.loadState(snap);
+    i2c.loadState(snap);
+    flash.loadState(snap);
+    neighbors.loadState(snap);
+    hle.loadState(snap);
+
+    snap.get(lat1);
+    snap.get(lat2);
+    snap.get(bus);
+    snap.get(prev_ctrl_port);
+    snap.get(flash_drv);
+    snap.get(rfcken);
+    snap.get(exceptionCount);
+
+    // Peripherals re-arm their own deadlines on the next hardware tick
+    hwDeadline.initTo(time, 0);
+}
+
 void Hardware::initVCD(VCDWriter &vcd)
 {
     /*
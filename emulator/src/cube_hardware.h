@@ -41,11 +41,13 @@
 #include "cube_backlight.h"
 #include "cube_flash.h"
 #include "cube_neighbors.h"
+#include "cube_hle.h"
 #include "cube_cpu_core.h"
 #include "cube_debug.h"
 #include "vtime.h"
 #include "tracer.h"
 #include "flash_storage.h"
+#include "snapshot.h"
 
 
 namespace Cube {
@@ -95,6 +97,7 @@ class Hardware {
     Flash flash;
     Neighbors neighbors;
     RNG rng;
+    HLE hle;
 
     bool init(VirtualTime *masterTimer, const char *firmwareFile,
         FlashStorage::CubeRecord *flashStorage);
@@ -114,7 +117,9 @@ class Hardware {
     }
 
     ALWAYS_INLINE void tick(bool *cpuTicked=NULL) {
-        CPU::em8051_tick(&cpu, 1, cpu.sbt, cpu.mProfileData != NULL, Tracer::isEnabled(), cpu.mBreakpoint != 0, cpuTicked);
+        // Profiled SBT code does its own profiler accounting
+        bool isProfiling = cpu.mProfileData != NULL && !(cpu.sbt && CPU::sbt_rom_profiled);
+        CPU::em8051_tick(&cpu, 1, cpu.sbt, isProfiling, Tracer::isEnabled(), cpu.mBreakpoint != 0, cpuTicked);
         hardwareTick();
     }
 
@@ -130,14 +135,31 @@ class Hardware {
          * fewer ticks than possible. So, this is always safe, and it's highly important for performance
          * when we're running on 32-bit platforms.
          *
+         * While the CPU is powered down, the batch can extend all the way to
+         * the next timer event. See CPU::timer_sleep_ticks().
+         *
          * Assumes the caller has already checked isSleeping().
          */
         
         CPU::em8051_tick(&cpu, tickBatch, true, false, false, false, NULL);
         hardwareTick();
-                    
-        return std::min(std::min(cpu.mTickDelay, (unsigned)cpu.prescaler12),
-                        (unsigned)hwDeadline.remaining());
+
+        unsigned cpuTicks = UNLIKELY(cpu.powerDown) ? CPU::timer_sleep_ticks(&cpu)
+            : std::min(cpu.mTickDelay, (unsigned)cpu.prescaler12);
+
+        return std::min(cpuTicks, (unsigned)hwDeadline.remaining());
+    }
+
+    void setClock(VirtualTime *clock) {
+        /*
+         * Rebind this cube to a different VirtualTime, which must currently
+         * read the same number of clocks. Used by SystemCubes to give each
+         * worker thread its own private copy of the master clock.
+         */
+        time = clock;
+        cpu.vtime = clock;
+        hwDeadline.setClock(clock);
+        hle.setClock(clock);
     }
 
     void lcdPulseTE() {
@@ -151,6 +173,9 @@ class Hardware {
     bool isDebugging();
     void initVCD(VCDWriter &vcd);
 
+    void saveState(SnapshotWriter &snap) const;
+    void loadState(SnapshotReader &snap);
+
     // SFR side-effects
     void sfrWrite(int reg);
     int sfrRead(int reg);
@@ -165,6 +190,19 @@ class Hardware {
         return rfcken && !cpu.powerDown;
     }
 
+    bool hasRadioAddress(uint64_t packed) {
+        if (hle.isEnabled())
+            return hle.hasRadioAddress(packed);
+        return spi.radio.getPackedRXAddr() == packed;
+    }
+
+    bool handleRadioPacket(Radio::Packet &packet, Radio::Packet &reply) {
+        // Route a packet to whichever model is running this cube's firmware
+        if (hle.isEnabled())
+            return hle.handlePacket(packet, reply);
+        return isRadioClockRunning() && spi.radio.handlePacket(packet, reply);
+    }
+
     uint32_t getExceptionCount();
     void incExceptionCount();
     void logWatchdogReset();
@@ -0,0 +1,1052 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2011 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "cube_hle.h"
+#include "cube_hardware.h"
+#include "mc_neighbor.h"
+#include "radioaddrfactory.h"
+
+namespace Cube {
+
+
+void HLE::init(Hardware *hw)
+{
+    this->hw = hw;
+    enabled = true;
+
+    FlashStorage::CubeRecord *storage = hw->flash.getStorage();
+    lsdec.init(storage->ext, sizeof storage->ext);
+    deadline.init(hw->time);
+
+    reset();
+}
+
+void HLE::loadState(SnapshotReader &snap)
+{
+    /*
+     * Restore everything but our links back into the Hardware object,
+     * which belong to this process rather than the one that saved.
+     */
+
+    Hardware *h = hw;
+    snap.get(*this);
+    hw = h;
+
+    if (hw) {
+        FlashStorage::CubeRecord *storage = hw->flash.getStorage();
+        lsdec.setBuffer(storage->ext, sizeof storage->ext);
+        deadline.setClock(hw->time);
+    } else {
+        enabled = false;
+    }
+}
+
+void HLE::reset()
+{
+    /*
+     * Equivalent to a cold boot of the cube firmware: program an HWID if
+     * we don't have one yet, clear all RAM-resident state, and enter
+     * disconnected mode. VRAM lives in xdata, and survives like it would
+     * on real hardware.
+     */
+
+    initHWID();
+
+    memset(ackData, 0, sizeof ackData);
+    ackBits = 0;
+    nextAck = 0;
+    txHead = 0;
+    txCount = 0;
+
+    rxState = RX_DEFAULT;
+    rxSample = 0;
+    rxDiff = 0;
+    rxLow = 0;
+    rxHigh = 0;
+    rxPtr = 0;
+    stateResetNotPending = false;
+
+    sleeping = false;
+    frameEndTime = ~(uint64_t)0;
+    disconnectTime = ~(uint64_t)0;
+    sleepPollTime = ~(uint64_t)0;
+
+    lsdec.reset();
+    hw->lcd.init();
+
+    enterDisconnected();
+    schedule();
+}
+
+_SYSVideoRAM &HLE::vram()
+{
+    return *reinterpret_cast<_SYSVideoRAM*>(hw->cpu.mExtData);
+}
+
+void HLE::initHWID()
+{
+    /*
+     * Like params_init() in the firmware, program any HWID bytes that are
+     * still erased. The first byte is our hardware revision.
+     */
+
+    uint8_t *hwid = hw->flash.getStorage()->nvm;
+
+    if (hwid[0] == 0xFF)
+        hwid[0] = CUBE_VERSION_LATEST;
+
+    for (unsigned i = 1; i < HWID_LEN; i++)
+        while (hwid[i] == 0xFF)
+            hwid[i] = rand();
+}
+
+void HLE::schedule()
+{
+    deadline.resetTo(std::min(frameEndTime, std::min(disconnectTime, sleepPollTime)));
+}
+
+void HLE::deadlineWork()
+{
+    uint64_t now = deadline.clock();
+
+    if (sleepPollTime <= now) {
+        // Deep sleep. Touch wakes us up, with a full reset.
+        sleepPollTime = ~(uint64_t)0;
+        if (hw->cpu.mSFR[MISC_PORT] & MISC_TOUCH)
+            return reset();
+        sleepPollTime = now + VirtualTime::msec(SLEEP_POLL_MSEC);
+    }
+
+    if (disconnectTime <= now) {
+        disconnectTime = ~(uint64_t)0;
+        frameEndTime = ~(uint64_t)0;
+        enterDisconnected();
+    }
+
+    if (frameEndTime <= now) {
+        frameEndTime = ~(uint64_t)0;
+        graphicsAck();
+        graphicsPoll();
+    }
+
+    schedule();
+}
+
+void HLE::enterDisconnected()
+{
+    /*
+     * Simplified version of disconnected_init(). We draw the same
+     * first frame (a cleared screen with our logo), but we skip the
+     * battery indicator, the bouncing-logo animation, and the idle
+     * sleep timer.
+     */
+
+    static const unsigned LOGO_ADDR = 0x2e67;
+    static const unsigned LOGO_X = 1;
+    static const unsigned LOGO_Y = 5;
+
+    connected = false;
+    hw->cpu.mSFR[0xA1 - 0x80] = 0;      // nb_tx_id, see Hardware::getNeighborID()
+
+    RadioAddress addr;
+    RadioAddrFactory::fromHardwareID(addr, hw->getHWID());
+    rxAddr = addr.pack();
+
+    _SYSVideoRAM &v = vram();
+    memset(v.bytes, 0, _SYS_VA_MODE);
+    v.mode = _SYS_VM_BG0_ROM;
+    v.flags = _SYS_VF_TOGGLE;
+
+    const uint8_t *img = &hw->cpu.mCodeMem[LOGO_ADDR];
+    unsigned width = img[0], height = img[1];
+    img += 3;
+    for (unsigned y = 0; y < height; y++)
+        for (unsigned x = 0; x < width; x++, img += 2) {
+            unsigned index = img[0] | (img[1] << 8);
+            v.words[(LOGO_Y + y) * _SYS_VRAM_BG0_WIDTH + LOGO_X + x] =
+                ((index << 2) & 0xFE00) | ((index << 1) & 0xFE);
+        }
+
+    v.num_lines = 128;
+
+    nextAck = (nextAck & ~FRAME_ACK_COUNT) | ((nextAck + 1) & FRAME_ACK_COUNT);
+    renderFrame();
+}
+
+bool HLE::isBaseNeighbored(unsigned &key) const
+{
+    for (unsigned side = 0; side < Neighbors::NUM_SIDES; side++) {
+        uint8_t nb = ackData[RF_ACK_NEIGHBOR + side];
+        if ((nb & NB_BASE_MASK) == NB_BASE_MASK) {
+            key = nb & 7;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HLE::hasRadioAddress(uint64_t packed) const
+{
+    if (sleeping)
+        return false;
+
+    if (packed == rxAddr)
+        return true;
+
+    if (connected)
+        return false;
+
+    /*
+     * While disconnected, the firmware alternates between its primary and
+     * alternate channels, and it listens on a pairing channel while a base
+     * is neighbored. We simply listen everywhere at once.
+     */
+
+    RadioAddress addr;
+    RadioAddrFactory::fromHardwareID(addr, hw->getHWID());
+    RadioAddrFactory::convertPrimaryToAlternateChannel(addr, hw->getHWID() & 0xFF);
+    if (packed == addr.pack())
+        return true;
+
+    unsigned key;
+    if (isBaseNeighbored(key)) {
+        static const uint8_t channels[] = RF_PAIRING_CHANNELS;
+        RadioAddress pairing = { channels[key], RF_PAIRING_ADDRESS };
+        if (packed == pairing.pack())
+            return true;
+    }
+
+    return false;
+}
+
+bool HLE::handlePacket(const Radio::Packet &incoming, Radio::Packet &ack)
+{
+    if (sleeping)
+        return false;
+
+    // The hardware sends whatever ACK was already queued
+    if (txCount) {
+        unsigned tail = (txHead + TX_FIFO_SIZE - txCount) % TX_FIFO_SIZE;
+        ack = txFifo[tail];
+        txCount--;
+    } else {
+        ack.len = 0;
+    }
+
+    updateSensors();
+    disconnectTime = deadline.clock() + VirtualTime::msec(DISCONNECT_MSEC);
+
+    if (!connected || !stateResetNotPending)
+        stateReset();
+
+    unsigned len = incoming.len;
+    if (len == 0 || len > Radio::PAYLOAD_MAX) {
+        // Empty packets only cause an ACK and a state reset
+        stateResetNotPending = false;
+
+    } else {
+        if (len != Radio::PAYLOAD_MAX)
+            stateResetNotPending = false;
+
+        for (unsigned i = 0; i < len * 2; i++) {
+            uint8_t byte = incoming.payload[i >> 1];
+            RXResult r = rxNybble((i & 1) ? (byte >> 4) : (byte & 0xF));
+            if (r == RX_NEXT)
+                continue;
+
+            // Escapes take byte arguments, and end the packet
+            const uint8_t *args = incoming.payload + (i >> 1) + 1;
+            unsigned count = len - (i >> 1) - 1;
+
+            switch (r) {
+                case RX_ESC_EXPLICIT_ACK:   ackBits = 0xFF; break;
+                case RX_ESC_HOP:            rxHop(args, count); break;
+                case RX_ESC_FLASH:          rxFlash(args, count); break;
+                default:                    break;
+            }
+            break;
+        }
+    }
+
+    writeACK();
+
+    // Copy touch state after the ACK, like the firmware's radio ISR
+    uint8_t touch = (hw->cpu.mSFR[MISC_PORT] & MISC_TOUCH) ? NB0_FLAG_TOUCH : 0;
+    if ((ackData[RF_ACK_NEIGHBOR] ^ touch) & NB0_FLAG_TOUCH) {
+        ackData[RF_ACK_NEIGHBOR] ^= NB0_FLAG_TOUCH;
+        ackBits |= ACK_BIT_NEIGHBOR;
+    }
+
+    // If we're idle, the main loop would notice a new frame trigger right away
+    if (connected && frameEndTime == ~(uint64_t)0)
+        graphicsPoll();
+
+    schedule();
+    return true;
+}
+
+void HLE::stateReset()
+{
+    stateResetNotPending = true;
+    rxState = RX_DEFAULT;
+    rxPtr = 0;
+}
+
+HLE::RXResult HLE::rxNybble(uint8_t nybble)
+{
+    /*
+     * One step of the nybble codec state machine from radio_isr.c.
+     * See protocol.h for a description of the codes.
+     */
+
+    switch (rxState) {
+
+    case RX_RLE:
+        if (nybble & 0xC) {
+            // Plain RLE code; write the run, then handle this nybble normally
+            rxState = RX_DEFAULT;
+            rxWriteDeltas((rxLow & 3) + 1);
+            break;
+        }
+
+        if (!(rxLow & 2)) {
+            // 000n 00nn: Skip n+1 words
+            rxPtr = (rxPtr + ((((nybble & 3) << 1) | (rxLow & 1)) + 1)) & _SYS_VRAM_WORD_MASK;
+            rxState = RX_DEFAULT;
+        } else if (!(rxLow & 1)) {
+            // 0010 00nn nnnn: Write n+5 delta-words
+            rxLow = (nybble & 3) << 4;
+            rxState = RX_WRDELTA;
+        } else if (!(nybble & 2)) {
+            // 0011 000x: Set 9-bit word address
+            rxHigh = nybble & 1;
+            rxState = RX_WORD9_1;
+        } else if (!(nybble & 1)) {
+            // 0011 0010: Literal 16-bit word
+            rxState = RX_WORD16_1;
+        } else {
+            // 0011 0011: Escape to flash mode
+            rxState = RX_DEFAULT;
+            return RX_ESC_FLASH;
+        }
+        return RX_NEXT;
+
+    case RX_DIFF:
+        rxState = RX_DEFAULT;
+        if (nybble == RF_VRAM_DIFF_BASE) {
+            // Redundant copy encoding, used for escapes
+            static const RXResult escapes[] = {
+                RX_ESC_TIME_SYNC, RX_ESC_EXPLICIT_ACK, RX_ESC_HOP, RX_ESC_NAP
+            };
+            return escapes[rxSample & 3];
+        }
+        rxDiff = nybble;
+        rxWriteDeltas(1);
+        return RX_NEXT;
+
+    case RX_LITERAL_1:
+        rxLow = nybble;
+        rxState = RX_LITERAL_2;
+        return RX_NEXT;
+
+    case RX_LITERAL_2:
+        rxLow |= nybble << 4;
+        rxState = RX_LITERAL_3;
+        return RX_NEXT;
+
+    case RX_LITERAL_3: {
+        unsigned index = (rxHigh << 6) | (nybble << 8) | rxLow;
+        vram().words[rxPtr] = ((index << 2) & 0xFE00) | ((index << 1) & 0xFE);
+        rxPtr = (rxPtr + 1) & _SYS_VRAM_WORD_MASK;
+        rxState = RX_DEFAULT;
+        return RX_NEXT;
+    }
+
+    case RX_WRDELTA:
+        rxState = RX_DEFAULT;
+        rxWriteDeltas((rxLow | nybble) + 5);
+        return RX_NEXT;
+
+    case RX_WORD9_1:
+        rxLow = nybble;
+        rxState = RX_WORD9_2;
+        return RX_NEXT;
+
+    case RX_WORD9_2:
+        rxPtr = (rxHigh << 8) | (nybble << 4) | rxLow;
+        rxState = RX_DEFAULT;
+        return RX_NEXT;
+
+    case RX_WORD16_1:
+        rxLow = nybble;
+        rxState = RX_WORD16_2;
+        return RX_NEXT;
+
+    case RX_WORD16_2:
+        rxLow |= nybble << 4;
+        rxState = RX_WORD16_3;
+        return RX_NEXT;
+
+    case RX_WORD16_3:
+        rxHigh = nybble;
+        rxState = RX_WORD16_4;
+        return RX_NEXT;
+
+    case RX_WORD16_4:
+        rxHigh |= nybble << 4;
+        vram().words[rxPtr] = rxLow | (rxHigh << 8);
+        rxPtr = (rxPtr + 1) & _SYS_VRAM_WORD_MASK;
+        rxSample = 0;
+        rxDiff = RF_VRAM_DIFF_BASE;
+        rxState = RX_DEFAULT;
+        return RX_NEXT;
+    }
+
+    // RX_DEFAULT: Initial nybble
+
+    switch (nybble & 0xC) {
+
+    case 0x0:       // 00nn: RLE
+        rxLow = nybble;
+        rxState = RX_RLE;
+        break;
+
+    case 0x4:       // 01ss: Copy
+        rxSample = nybble & 3;
+        rxDiff = RF_VRAM_DIFF_BASE;
+        rxWriteDeltas(1);
+        break;
+
+    case 0x8:       // 10ss: Diff
+        rxSample = nybble & 3;
+        rxState = RX_DIFF;
+        break;
+
+    case 0xC:       // 11xx: Literal 14-bit index
+        rxHigh = (nybble & 3) << 6;
+        rxSample = 0;
+        rxDiff = RF_VRAM_DIFF_BASE;
+        rxState = RX_LITERAL_1;
+        break;
+    }
+
+    return RX_NEXT;
+}
+
+void HLE::rxWriteDeltas(unsigned count)
+{
+    /*
+     * Copy 'count' words from our current sample point, adding the
+     * current diff to each. The arithmetic is done on the 7:7 encoded
+     * bytes, exactly like the firmware's rx_write_deltas.
+     */
+
+    static const uint8_t distance[] = {
+        RF_VRAM_SAMPLE_0, RF_VRAM_SAMPLE_1, RF_VRAM_SAMPLE_2, RF_VRAM_SAMPLE_3
+    };
+
+    uint8_t *bytes = vram().bytes;
+    int diff = (int)(rxDiff & 0xF) - RF_VRAM_DIFF_BASE;
+    uint8_t diff2 = diff << 1;
+
+    while (count--) {
+        unsigned src = ((rxPtr - distance[rxSample & 3]) & _SYS_VRAM_WORD_MASK) << 1;
+        unsigned dest = rxPtr << 1;
+
+        unsigned low = bytes[src] + diff2;
+        uint8_t high = bytes[src + 1];
+        if (diff >= 0) {
+            if (low > 0xFF) high += 2;
+        } else {
+            if (low <= 0xFF) high -= 2;
+        }
+
+        bytes[dest] = low;
+        bytes[dest + 1] = high;
+        rxPtr = (rxPtr + 1) & _SYS_VRAM_WORD_MASK;
+    }
+}
+
+void HLE::rxHop(const uint8_t *args, unsigned count)
+{
+    /*
+     * Radio hop: Up to 7 bytes of channel, address, and neighbor ID.
+     * Always connects us, and always causes a state reset.
+     */
+
+    stateResetNotPending = false;
+    connected = true;
+
+    if (count == 0)
+        return;
+    if (count > 7)
+        count = 7;
+
+    rxAddr = (rxAddr & ~(0xFFULL << 56)) | ((uint64_t)(args[0] & 0x7F) << 56);
+
+    if (count >= 6) {
+        uint64_t addr = 0;
+        for (int i = 5; i >= 1; i--)
+            addr = (addr << 8) | args[i];
+        rxAddr = (rxAddr & (0xFFULL << 56)) | addr;
+    }
+
+    if (count == 7)
+        hw->cpu.mSFR[0xA1 - 0x80] = args[6];
+}
+
+void HLE::rxFlash(const uint8_t *args, unsigned count)
+{
+    if (count == 0) {
+        // Flash reset. Acknowledged with a toggle, and a full ACK.
+        lsdec.reset();
+        ackData[RF_ACK_NEIGHBOR + 1] ^= NB1_FLAG_FLS_RESET;
+        ackBits |= ACK_BIT_HWID;
+        return;
+    }
+
+    while (count--) {
+        if (lsdec.isHung()) {
+            // After a failed CHECK_QUERY, bytes are never acknowledged
+            return;
+        }
+
+        lsdec.handleByte(*(args++));
+        ackData[RF_ACK_FLASH_FIFO]++;
+        ackBits |= ACK_BIT_FLASH_FIFO;
+
+        const uint8_t *response = lsdec.takeQueryResponse();
+        if (response)
+            queueACK(response, LoadstreamDecoder::QUERY_RESPONSE_LEN);
+    }
+}
+
+void HLE::updateSensors()
+{
+    /*
+     * The firmware samples its sensors continuously, in the background.
+     * We sample them once per packet, and flag any changes in ackBits.
+     */
+
+    int16_t accel[3];
+    hw->i2c.accel.getVector(accel[0], accel[1], accel[2]);
+    for (unsigned i = 0; i < 3; i++) {
+        uint8_t value = accel[i] >> 8;
+        if (value != ackData[RF_ACK_ACCEL + i]) {
+            ackData[RF_ACK_ACCEL + i] = value;
+            ackBits |= ACK_BIT_ACCEL;
+        }
+    }
+
+    for (unsigned side = 0; side < Neighbors::NUM_SIDES; side++) {
+        unsigned id = MCNeighbor::getContactID(hw->id(), side);
+        if (!id)
+            id = hw->neighbors.getContactID(side);
+
+        uint8_t &nb = ackData[RF_ACK_NEIGHBOR + side];
+        uint8_t value = (nb & ~(NB_FLAG_SIDE_ACTIVE | NB_ID_MASK))
+            | (id ? (NB_FLAG_SIDE_ACTIVE | (id & NB_ID_MASK)) : 0);
+        if (value != nb) {
+            nb = value;
+            ackBits |= ACK_BIT_NEIGHBOR;
+        }
+    }
+
+    // Same conversion as i2c_battery_store_results_begin_a21()
+    uint8_t battery = 0x7F - (hw->i2c.accel.getADC1() >> 8);
+    if (!battery)
+        battery = 1;
+    if (battery != ackData[RF_ACK_BATTERY_V]) {
+        ackData[RF_ACK_BATTERY_V] = battery;
+        ackBits |= ACK_BIT_BATTERY_V;
+    }
+}
+
+void HLE::writeACK()
+{
+    /*
+     * Queue the ACK for the next packet, with a length determined by the
+     * highest pending ackBits. Disconnected cubes always send everything.
+     */
+
+    uint8_t bits = connected ? ackBits : 0xFF;
+    if (!bits)
+        return;
+    ackBits = 0;
+
+    uint8_t packet[RF_ACK_LEN_MAX];
+    unsigned len;
+
+    if (bits & ACK_BIT_HWID) {
+        len = RF_ACK_LEN_HWID;
+        memcpy(packet + RF_ACK_HWID, hw->flash.getStorage()->nvm, HWID_LEN);
+    } else if (bits & ACK_BIT_BATTERY_V) {
+        len = RF_ACK_LEN_BATTERY_V;
+    } else if (bits & ACK_BIT_FLASH_FIFO) {
+        len = RF_ACK_LEN_FLASH_FIFO;
+    } else if (bits & ACK_BIT_NEIGHBOR) {
+        len = RF_ACK_LEN_NEIGHBOR;
+    } else if (bits & ACK_BIT_ACCEL) {
+        len = RF_ACK_LEN_ACCEL;
+    } else {
+        len = RF_ACK_LEN_FRAME;
+    }
+
+    memcpy(packet, ackData, std::min<unsigned>(len, RF_MEM_ACK_LEN));
+    queueACK(packet, len);
+}
+
+void HLE::queueACK(const uint8_t *data, unsigned len)
+{
+    // Like the nRF's W_ACK_PAYLOAD, drop anything past the FIFO's capacity
+    if (txCount >= TX_FIFO_SIZE)
+        return;
+
+    Radio::Packet &p = txFifo[txHead];
+    p.len = len;
+    memcpy(p.payload, data, len);
+    txHead = (txHead + 1) % TX_FIFO_SIZE;
+    txCount++;
+}
+
+void HLE::graphicsPoll()
+{
+    /*
+     * Equivalent to the top of graphics_render(). Check for a frame
+     * trigger, and if we have one, render it right away. The frame is
+     * acknowledged after FRAME_USEC of virtual time.
+     */
+
+    uint8_t flags = vram().flags;
+
+    nextAck |= FRAME_ACK_CONTINUOUS;
+    if (!(flags & _SYS_VF_CONTINUOUS)) {
+        nextAck &= ~FRAME_ACK_CONTINUOUS;
+        if (!(((flags >> 1) ^ nextAck) & 1))
+            return graphicsAck();
+    }
+
+    nextAck = (nextAck & ~FRAME_ACK_COUNT) | ((nextAck + 1) & FRAME_ACK_COUNT);
+
+    renderFrame();
+    frameEndTime = deadline.clock() + VirtualTime::usec(FRAME_USEC);
+}
+
+void HLE::graphicsAck()
+{
+    if (nextAck != ackData[RF_ACK_FRAME]) {
+        ackData[RF_ACK_FRAME] = nextAck;
+        ackBits |= ACK_BIT_FRAME;
+    }
+}
+
+void HLE::renderFrame()
+{
+    _SYSVideoRAM &v = vram();
+    uint8_t mode = v.mode & _SYS_VM_MASK;
+
+    switch (mode) {
+
+    case _SYS_VM_SLEEP:
+        // Fade out and power down. Touch brings us back with a reset.
+        hw->lcd.hleSleep();
+        sleeping = true;
+        sleepPollTime = deadline.clock() + VirtualTime::msec(SLEEP_POLL_MSEC);
+        return;
+
+    case _SYS_VM_BG0_ROM:
+    case _SYS_VM_SOLID:
+    case _SYS_VM_FB32:
+    case _SYS_VM_FB64:
+    case _SYS_VM_FB128:
+    case _SYS_VM_BG0:
+    case _SYS_VM_BG0_BG1:
+    case _SYS_VM_BG0_SPR_BG1:
+    case _SYS_VM_BG2:
+    case _SYS_VM_STAMP:
+        break;
+
+    default:
+        hw->lcd.hleSleep();
+        return;
+    }
+
+    uint16_t *fb = hw->lcd.fb_mem;
+    unsigned numLines = v.num_lines ? v.num_lines : 256;
+    unsigned firstLine = v.first_line & (LCD::HEIGHT - 1);
+    unsigned row = firstLine;
+
+    for (unsigned line = 0; line < numLines; line++) {
+        uint16_t pixels[LCD::WIDTH];
+
+        switch (mode) {
+
+        case _SYS_VM_BG0_ROM:
+            renderBG0ROM(line, pixels);
+            break;
+
+        case _SYS_VM_SOLID:
+            for (unsigned x = 0; x < LCD::WIDTH; x++)
+                pixels[x] = colormap(0);
+            break;
+
+        case _SYS_VM_FB32:
+            renderFB32(line, pixels);
+            break;
+
+        case _SYS_VM_FB64:
+            renderFB64(line, pixels);
+            break;
+
+        case _SYS_VM_FB128:
+            renderFB128(line, pixels);
+            break;
+
+        case _SYS_VM_BG0:
+            renderBG0(line, pixels);
+            break;
+
+        case _SYS_VM_BG0_BG1:
+            renderBG0(line, pixels);
+            renderBG1(line, pixels);
+            break;
+
+        case _SYS_VM_BG0_SPR_BG1:
+            renderBG0(line, pixels);
+            renderSprites(line, pixels);
+            renderBG1(line, pixels);
+            break;
+
+        case _SYS_VM_BG2:
+            renderBG2(line, pixels);
+            break;
+
+        case _SYS_VM_STAMP:
+            // Keyed pixels leave the LCD untouched
+            for (unsigned x = 0; x < LCD::WIDTH; x++)
+                pixels[x] = fb[lcdAddress(row, x)];
+            renderStamp(line, pixels);
+            break;
+        }
+
+        for (unsigned x = 0; x < LCD::WIDTH; x++)
+            fb[lcdAddress(row, x)] = pixels[x];
+
+        // The LCD window wraps within first_line through the bottom
+        if (++row == LCD::HEIGHT)
+            row = firstLine;
+    }
+
+    hw->lcd.hleFrame(numLines * LCD::WIDTH);
+}
+
+unsigned HLE::lcdAddress(unsigned row, unsigned col)
+{
+    // Frame orientation, as the firmware programs the LCD's MADCTR
+    uint8_t flags = vram().flags;
+
+    if (flags & _SYS_VF_XY_SWAP)
+        std::swap(row, col);
+    if (flags & _SYS_VF_Y_FLIP)
+        row = LCD::HEIGHT - 1 - row;
+    if (flags & _SYS_VF_X_FLIP)
+        col = LCD::WIDTH - 1 - col;
+
+    return (col + (row << LCD::FB_ROW_SHIFT)) & LCD::FB_MASK;
+}
+
+const uint8_t *HLE::tilePixel(uint16_t tile77, unsigned x, unsigned y)
+{
+    /*
+     * Address of one pixel in flash, given a tile index in 7:7 format.
+     * Each 128-byte tile holds 8x8 big-endian RGB565 pixels.
+     */
+
+    unsigned index = ((tile77 & 0xFE00) >> 2) | ((tile77 & 0xFE) >> 1);
+    unsigned addr = (index << 7) | (y << 4) | (x << 1);
+    if (vram().flags & _SYS_VF_A21)
+        addr |= 1 << 21;
+
+    return &hw->flash.getStorage()->ext[addr & (FlashModel::SIZE - 1)];
+}
+
+uint16_t HLE::colormap(unsigned index)
+{
+    const uint8_t *bytes = &vram().bytes[_SYS_VA_COLORMAP + (index << 1)];
+    return bytes[0] | (bytes[1] << 8);
+}
+
+void HLE::renderBG0(unsigned line, uint16_t *pixels)
+{
+    _SYSVideoRAM &v = vram();
+    unsigned by = (v.bg0_y + line) % (_SYS_VRAM_BG0_WIDTH * 8);
+
+    for (unsigned x = 0; x < LCD::WIDTH; x++) {
+        unsigned bx = (v.bg0_x + x) % (_SYS_VRAM_BG0_WIDTH * 8);
+        uint16_t tile = v.bg0_tiles[(by >> 3) * _SYS_VRAM_BG0_WIDTH + (bx >> 3)];
+        const uint8_t *p = tilePixel(tile, bx & 7, by & 7);
+        pixels[x] = (p[0] << 8) | p[1];
+    }
+}
+
+void HLE::renderBG0ROM(unsigned line, uint16_t *pixels)
+{
+    /*
+     * BG0 geometry, but with 2-color or 4-color tiles from the
+     * firmware's tile ROM, and 16 palettes also from ROM.
+     */
+
+    static const unsigned ROM_TILES = 0x3000;
+    static const unsigned ROM_PALETTES = 0x2f00;
+
+    _SYSVideoRAM &v = vram();
+    const uint8_t *code = hw->cpu.mCodeMem;
+    unsigned by = (v.bg0_y + line) % (_SYS_VRAM_BG0_WIDTH * 8);
+    unsigned ty = by & 7;
+
+    for (unsigned x = 0; x < LCD::WIDTH; x++) {
+        unsigned bx = (v.bg0_x + x) % (_SYS_VRAM_BG0_WIDTH * 8);
+        uint16_t tile = v.bg0_tiles[(by >> 3) * _SYS_VRAM_BG0_WIDTH + (bx >> 3)];
+        uint8_t lo = tile, hi = tile >> 8;
+
+        uint8_t dpl = (lo & 0xFE) | (ty & 1);
+        uint8_t dph = (hi & 0x06) | ((ty >> 1) & 1) | (((ty >> 2) & 1) << 3);
+        unsigned a = ROM_TILES + ((dph << 8) | dpl);
+        unsigned bit = bx & 7;
+        unsigned p0 = (code[a] >> bit) & 1;
+        unsigned p1 = (code[(a + 2) & (CODE_SIZE - 1)] >> bit) & 1;
+        unsigned index = (hi & 0x08) ? (p1 * 2 + p0) : p0;
+
+        const uint8_t *pal = &code[ROM_PALETTES + (hi >> 4) * 16];
+        switch (index) {
+            case 0: pixels[x] = pal[1] | (pal[1] << 8); break;
+            case 1: pixels[x] = pal[3] | (pal[5] << 8); break;
+            case 2: pixels[x] = pal[7] | (pal[9] << 8); break;
+            case 3: pixels[x] = pal[11] | (pal[13] << 8); break;
+        }
+    }
+}
+
+void HLE::renderBG1(unsigned line, uint16_t *pixels)
+{
+    /*
+     * BG1 is a 16x16 bitmap of opaque tiles, with tile indices packed
+     * in order of the set bits. Transparent pixels use the chroma key;
+     * a keyed pixel with the EOL bit set ends the tile's row.
+     */
+
+    _SYSVideoRAM &v = vram();
+    unsigned by = (line + v.bg1_y) & 0xFF;
+    if (by >= _SYS_VRAM_BG1_WIDTH * 8)
+        return;
+
+    unsigned ty = by >> 3;
+    uint16_t rowBits = v.bg1_bitmap[ty];
+    unsigned rowBase = 0;
+    for (unsigned i = 0; i < ty; i++)
+        rowBase += __builtin_popcount(v.bg1_bitmap[i]);
+
+    unsigned eolTile = ~0U;
+
+    for (unsigned x = 0; x < LCD::WIDTH; x++) {
+        unsigned bx = (x + v.bg1_x) & 0xFF;
+        if (bx >= _SYS_VRAM_BG1_WIDTH * 8)
+            continue;
+
+        unsigned tx = bx >> 3;
+        if (!(rowBits & (1 << tx)) || tx == eolTile)
+            continue;
+
+        unsigned index = rowBase + __builtin_popcount(rowBits & ((1 << tx) - 1));
+        uint16_t tile = v.words[(_SYS_VA_BG1_TILES / 2 + index) & _SYS_VRAM_WORD_MASK];
+        const uint8_t *p = tilePixel(tile, bx & 7, by & 7);
+
+        if (p[0] == _SYS_CHROMA_KEY) {
+            if (p[1] & 0x40)
+                eolTile = tx;
+            continue;
+        }
+        pixels[x] = (p[0] << 8) | p[1];
+    }
+}
+
+void HLE::renderSprites(unsigned line, uint16_t *pixels)
+{
+    /*
+     * Up to _SYS_SPRITES_PER_LINE linear sprites per scanline, chosen in
+     * order. Lower-numbered sprites are on top, so draw in reverse.
+     */
+
+    _SYSVideoRAM &v = vram();
+    unsigned active[_SYS_SPRITES_PER_LINE];
+    unsigned numActive = 0;
+
+    for (unsigned i = 0; i < _SYS_VRAM_SPRITES && numActive < _SYS_SPRITES_PER_LINE; i++) {
+        const _SYSSpriteInfo &s = v.spr[i];
+        uint8_t maskY = s.mask_y, maskX = s.mask_x;
+        uint8_t posY = s.pos_y, posX = s.pos_x;
+
+        if (!maskY || (((posY + line) & 0xFF) & maskY))
+            continue;
+        if ((posX & maskX) && posX + 127 <= 255)
+            continue;
+
+        active[numActive++] = i;
+    }
+
+    while (numActive--) {
+        const _SYSSpriteInfo &s = v.spr[active[numActive]];
+        uint8_t maskX = s.mask_x;
+        uint8_t posX = s.pos_x;
+        unsigned oy = (uint8_t)(s.pos_y + line);
+
+        unsigned tw = !(maskX & 0x40) ? 16 :
+                      !(maskX & 0x20) ? 8 :
+                      !(maskX & 0x10) ? 4 :
+                      !(maskX & 0x08) ? 2 : 1;
+        unsigned base = ((s.tile & 0xFE00) >> 2) | ((s.tile & 0xFE) >> 1);
+
+        for (unsigned x = 0; x < LCD::WIDTH; x++) {
+            unsigned ox = (posX + x) & 0xFF;
+            if (ox & maskX)
+                continue;
+
+            unsigned index = (base + (oy >> 3) * tw + (ox >> 3)) & 0x3FFF;
+            uint16_t tile = ((index << 2) & 0xFE00) | ((index << 1) & 0xFE);
+            const uint8_t *p = tilePixel(tile, ox & 7, oy & 7);
+
+            if (p[0] != _SYS_CHROMA_KEY)
+                pixels[x] = (p[0] << 8) | p[1];
+        }
+    }
+}
+
+void HLE::renderBG2(unsigned line, uint16_t *pixels)
+{
+    /*
+     * Affine-transformed 16x16 tile grid, in 8.8 fixed point. The
+     * origin is accumulated per-line, like the firmware does.
+     */
+
+    _SYSVideoRAM &v = vram();
+    _SYSAffine &m = v.bg2_affine;
+    const uint8_t *border = &v.bytes[_SYS_VA_BG2_BORDER];
+
+    if (line == 0) {
+        bg2CX = m.cx;
+        bg2CY = m.cy;
+    }
+
+    int16_t x = bg2CX, y = bg2CY;
+    int prevXH = -1;
+    uint16_t prevPixel = 0;
+
+    for (unsigned col = 0; col < LCD::WIDTH; col++) {
+        x += m.xx;
+        y += m.xy;
+
+        uint8_t xh = (uint16_t)x >> 8;
+        uint8_t yh = (uint16_t)y >> 8;
+
+        if ((xh | yh) & 0x80) {
+            pixels[col] = border[0] | (border[1] << 8);
+            prevXH = -1;
+            continue;
+        }
+
+        // Quirk: Within a run, the firmware only resamples when X changes
+        if (xh != prevXH) {
+            uint16_t tile = v.bg2_tiles[((yh >> 3) & 15) * _SYS_VRAM_BG2_WIDTH + ((xh >> 3) & 15)];
+            const uint8_t *p = tilePixel(tile, xh & 7, yh & 7);
+            prevPixel = (p[0] << 8) | p[1];
+            prevXH = xh;
+        }
+        pixels[col] = prevPixel;
+    }
+
+    bg2CX += m.yx;
+    bg2CY += m.yy;
+}
+
+void HLE::renderFB32(unsigned line, uint16_t *pixels)
+{
+    // 32x32 pixels, 16 colors, each pixel drawn 4x4
+    const uint8_t *fb = &vram().fb[((line >> 2) * 16) & _SYS_VRAM_BYTE_MASK];
+
+    for (unsigned x = 0; x < LCD::WIDTH; x++) {
+        uint8_t byte = fb[x >> 3];
+        pixels[x] = colormap((x & 4) ? (byte >> 4) : (byte & 0xF));
+    }
+}
+
+void HLE::renderFB64(unsigned line, uint16_t *pixels)
+{
+    // 64x64 pixels, 2 colors, each pixel drawn 2x2
+    const uint8_t *fb = &vram().fb[((line >> 1) * 8) & _SYS_VRAM_BYTE_MASK];
+
+    for (unsigned x = 0; x < LCD::WIDTH; x++)
+        pixels[x] = colormap((fb[x >> 4] >> ((x >> 1) & 7)) & 1);
+}
+
+void HLE::renderFB128(unsigned line, uint16_t *pixels)
+{
+    // 128x48 pixels, 2 colors, wrapping vertically
+    const uint8_t *fb = &vram().fb[(line * 16) % sizeof vram().fb];
+
+    for (unsigned x = 0; x < LCD::WIDTH; x++)
+        pixels[x] = colormap((fb[x >> 3] >> (x & 7)) & 1);
+}
+
+void HLE::renderStamp(unsigned line, uint16_t *pixels)
+{
+    /*
+     * A 16-color framebuffer of configurable size and position,
+     * repeated vertically, with one color index used as a key.
+     */
+
+    _SYSVideoRAM &v = vram();
+    unsigned pitch = v.stamp_pitch;
+    unsigned height = v.stamp_height ? v.stamp_height : 256;
+
+    if (!pitch)
+        return;
+
+    unsigned src = ((line % height) * pitch) & _SYS_VRAM_BYTE_MASK;
+
+    for (unsigned i = 0; i < v.stamp_width; i++) {
+        unsigned col = v.stamp_x + i;
+        if (col >= LCD::WIDTH)
+            break;
+
+        uint8_t byte = v.bytes[(src + ((i >> 1) % pitch)) & _SYS_VRAM_BYTE_MASK];
+        uint8_t nybble = (i & 1) ? (byte >> 4) : (byte & 0xF);
+        if (nybble != v.stamp_key)
+            pixels[col] = colormap(nybble);
+    }
+}
+
+
+};  // namespace Cube
@@ -0,0 +1,224 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2011 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _CUBE_HLE_H
+#define _CUBE_HLE_H
+
+#include <stdint.h>
+#include <sifteo/abi.h>
+#include <protocol.h>
+
+#include "macros.h"
+#include "vtime.h"
+#include "cube_radio.h"
+#include "lsdec.h"
+#include "snapshot.h"
+
+namespace Cube {
+
+class Hardware;
+
+
+/*
+ * High-level emulation of the cube firmware.
+ *
+ * Instead of running the 8051 and letting the real firmware bit-bang
+ * the LCD and flash buses, we decode the radio protocol directly into
+ * VRAM, feed flash loadstreams to our LoadstreamDecoder, and rasterize
+ * each frame natively into the LCD framebuffer.
+ *
+ * Everything the master can observe is modeled after the firmware: the
+ * ACK packet contents and the order in which they change, frame
+ * acknowledgment, flash FIFO accounting, CRC queries, and radio
+ * addressing. Timing is modeled only at the frame level: a frame is
+ * rasterized as soon as it's triggered, and acknowledged after a fixed
+ * amount of virtual render time.
+ *
+ * This object lives inside Hardware, and it's inert unless init() is
+ * called. All entry points run either on the cube thread, or on the MC
+ * thread while the cube thread is stopped at a DeadlineSynchronizer
+ * deadline, same as the Radio model.
+ */
+
+class HLE {
+ public:
+    void init(Hardware *hw);
+    void reset();
+
+    void disable() {
+        enabled = false;
+    }
+
+    ALWAYS_INLINE bool isEnabled() const {
+        return enabled;
+    }
+
+    void setClock(VirtualTime *clock) {
+        deadline.setClock(clock);
+    }
+
+    void saveState(SnapshotWriter &snap) const {
+        snap.put(*this);
+    }
+
+    void loadState(SnapshotReader &snap);
+
+    ALWAYS_INLINE uint64_t tick() {
+        /*
+         * Run any work that's come due, and return the number of
+         * clock ticks until we need to be called again.
+         */
+        if (deadline.hasPassed())
+            deadlineWork();
+        return deadline.remaining();
+    }
+
+    bool isRadioListening() const {
+        return !sleeping;
+    }
+
+    bool hasRadioAddress(uint64_t packed) const;
+    bool handlePacket(const Radio::Packet &incoming, Radio::Packet &ack);
+
+ private:
+    // Virtual time for one rendered frame, and our disconnect timeout
+    static const unsigned FRAME_USEC = 12000;
+    static const unsigned DISCONNECT_MSEC = 3500;
+    static const unsigned SLEEP_POLL_MSEC = 10;
+
+    // Bits in ackBits, mirroring the firmware's ack_bits
+    static const uint8_t ACK_BIT_FRAME       = 0x01;
+    static const uint8_t ACK_BIT_ACCEL       = 0x02;
+    static const uint8_t ACK_BIT_NEIGHBOR    = 0x04;
+    static const uint8_t ACK_BIT_FLASH_FIFO  = 0x08;
+    static const uint8_t ACK_BIT_BATTERY_V   = 0x10;
+    static const uint8_t ACK_BIT_HWID        = 0x20;
+
+    static const unsigned TX_FIFO_SIZE = 3;
+
+    // Nybble codec states
+    enum RXState {
+        RX_DEFAULT = 0,
+        RX_RLE,
+        RX_DIFF,
+        RX_LITERAL_1,
+        RX_LITERAL_2,
+        RX_LITERAL_3,
+        RX_WRDELTA,
+        RX_WORD9_1,
+        RX_WORD9_2,
+        RX_WORD16_1,
+        RX_WORD16_2,
+        RX_WORD16_3,
+        RX_WORD16_4,
+    };
+
+    // Results from rxNybble(), anything other than RX_NEXT ends the packet
+    enum RXResult {
+        RX_NEXT = 0,
+        RX_ESC_TIME_SYNC,
+        RX_ESC_EXPLICIT_ACK,
+        RX_ESC_HOP,
+        RX_ESC_NAP,
+        RX_ESC_FLASH,
+    };
+
+    Hardware *hw;
+    bool enabled;
+    TickDeadline deadline;
+    LoadstreamDecoder lsdec;
+
+    // Absolute clock times of pending events, or ~0
+    uint64_t frameEndTime;
+    uint64_t disconnectTime;
+    uint64_t sleepPollTime;
+
+    // Radio and connection state
+    uint64_t rxAddr;
+    bool connected;
+    bool sleeping;
+    bool stateResetNotPending;
+
+    // Codec registers, named after the firmware's
+    uint8_t rxState;
+    uint8_t rxSample;
+    uint8_t rxDiff;
+    uint8_t rxLow;
+    uint8_t rxHigh;
+    uint16_t rxPtr;
+
+    // ACK buffer, and the hardware's queue of pending ACK payloads
+    uint8_t ackData[RF_MEM_ACK_LEN];
+    uint8_t ackBits;
+    uint8_t nextAck;
+    Radio::Packet txFifo[TX_FIFO_SIZE];
+    uint8_t txHead;
+    uint8_t txCount;
+
+    // BG2 affine origin, accumulated across scanlines
+    int16_t bg2CX;
+    int16_t bg2CY;
+
+    _SYSVideoRAM &vram();
+    void schedule();
+    void deadlineWork();
+
+    void initHWID();
+    void enterDisconnected();
+    bool isBaseNeighbored(unsigned &key) const;
+
+    void stateReset();
+    RXResult rxNybble(uint8_t nybble);
+    void rxWriteDeltas(unsigned count);
+    void rxHop(const uint8_t *args, unsigned count);
+    void rxFlash(const uint8_t *args, unsigned count);
+
+    void updateSensors();
+    void writeACK();
+    void queueACK(const uint8_t *data, unsigned len);
+
+    void graphicsPoll();
+    void graphicsAck();
+    void renderFrame();
+    void renderBG0(unsigned line, uint16_t *pixels);
+    void renderBG0ROM(unsigned line, uint16_t *pixels);
+    void renderBG1(unsigned line, uint16_t *pixels);
+    void renderSprites(unsigned line, uint16_t *pixels);
+    void renderBG2(unsigned line, uint16_t *pixels);
+    void renderFB32(unsigned line, uint16_t *pixels);
+    void renderFB64(unsigned line, uint16_t *pixels);
+    void renderFB128(unsigned line, uint16_t *pixels);
+    void renderStamp(unsigned line, uint16_t *pixels);
+
+    const uint8_t *tilePixel(uint16_t tile77, unsigned x, unsigned y);
+    uint16_t colormap(unsigned index);
+    unsigned lcdAddress(unsigned row, unsigned col);
+};
+
+
+};  // namespace Cube
+
+#endif
@@ -38,6 +38,7 @@
 #include "cube_cpu.h"
 #include "cube_accel.h"
 #include "cube_testjig.h"
+#include "snapshot.h"
 
 namespace Cube {
 
@@ -58,6 +59,35 @@ class I2CBus {
         rx_buffer_full = false;
     }
 
+    /*
+     * The test jig's buffers are shared with the Lua thread, and they
+     * aren't part of the cube itself, so they're left out of snapshots.
+     */
+
+    void saveState(SnapshotWriter &snap) const {
+        snap.put(accel);
+        snap.put(timer);
+        snap.put(state);
+        snap.put(iex3);
+        snap.put(next_ack_status);
+        snap.put(tx_buffer);
+        snap.put(tx_buffer_full);
+        snap.put(rx_buffer);
+        snap.put(rx_buffer_full);
+    }
+
+    void loadState(SnapshotReader &snap) {
+        snap.get(accel);
+        snap.get(timer);
+        snap.get(state);
+        snap.get(iex3);
+        snap.get(next_ack_status);
+        snap.get(tx_buffer);
+        snap.get(tx_buffer_full);
+        snap.get(rx_buffer);
+        snap.get(rx_buffer_full);
+    }
+
     ALWAYS_INLINE void tick(TickDeadline &deadline, CPU::em8051 *cpu) {
         uint8_t w2con0 = cpu->mSFR[REG_W2CON0];
         uint8_t w2con1 = cpu->mSFR[REG_W2CON1];
@@ -132,6 +132,20 @@ class LCD {
         return mode_awake && mode_display_on;
     }
 
+    void hleFrame(unsigned pixels) {
+        // High-level emulation wrote a frame directly into fb_mem
+        mode_power_on = 1;
+        mode_awake = 1;
+        mode_display_on = 1;
+        frame_count++;
+        pixel_count += pixels;
+    }
+
+    void hleSleep() {
+        mode_awake = 0;
+        mode_display_on = 0;
+    }
+
     void pulseTE(TickDeadline &deadline) {
         if (mode_te) {
             // This runs on the GUI thread, use a lock-free timer.
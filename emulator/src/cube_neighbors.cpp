@@ -39,6 +39,31 @@ void Neighbors::attachCubes(Cube::Hardware *cubes)
     otherCubes = cubes;
 }
 
+unsigned Neighbors::getContactID(unsigned mySide) const
+{
+    /*
+     * For high-level emulation: Instead of exchanging pulses, report the
+     * neighbor ID of the first cube in contact with this side which is
+     * currently transmitting one. Returns zero if there is none.
+     */
+
+    if (!otherCubes)
+        return 0;
+
+    uint32_t mask = 0;
+    for (unsigned otherSide = 0; otherSide < NUM_SIDES; otherSide++)
+        mask |= mySides[mySide].otherSides[otherSide];
+
+    for (unsigned cube = 0; mask; cube++, mask >>= 1)
+        if (mask & 1) {
+            unsigned id = otherCubes[cube].getNeighborID();
+            if (id)
+                return id;
+        }
+
+    return 0;
+}
+
 void Neighbors::ioTick(CPU::em8051 &cpu)
 {
     static const uint8_t outPinLUT[] = { PIN_0_TOP, PIN_1_LEFT, PIN_2_BOTTOM, PIN_3_RIGHT };
@@ -120,6 +145,16 @@ void Neighbors::transmitPulse(CPU::em8051 &cpu, unsigned otherCube, uint8_t othe
 {
     Hardware &dest = otherCubes[otherCube];
 
+    if (!(localCubes & (1 << otherCube))) {
+        /*
+         * The other cube is running on a different thread. Hold on to
+         * the pulse until both threads are stopped at the same point.
+         */
+        Tracer::log(&cpu, "NEIGHBOR: Deferring pulse to %d.%d", otherCube, otherSide);
+        deferredPulses[otherSide] |= 1 << otherCube;
+        return;
+    }
+
     if (dest.neighbors.isSideReceiving(otherSide)) {
         Tracer::log(&cpu, "NEIGHBOR: Sending pulse to %d.%d", otherCube, otherSide);
         receivedPulse(dest.cpu);
@@ -128,5 +163,30 @@ void Neighbors::transmitPulse(CPU::em8051 &cpu, unsigned otherCube, uint8_t othe
     }
 }
 
+void Neighbors::deliverDeferredPulses(CPU::em8051 &cpu)
+{
+    /*
+     * Called by SystemCubes while no cubes are running, to deliver
+     * pulses that transmitPulse() couldn't deliver directly.
+     * Cubes are always visited in the same order, so the result
+     * doesn't depend on thread scheduling.
+     */
+
+    for (unsigned otherSide = 0; otherSide < NUM_SIDES; otherSide++) {
+        uint32_t sideMask = deferredPulses[otherSide];
+        deferredPulses[otherSide] = 0;
+
+        while (sideMask) {
+            int otherCube = __builtin_ffs(sideMask) - 1;
+            Hardware &dest = otherCubes[otherCube];
+            if (dest.neighbors.isSideReceiving(otherSide)) {
+                Tracer::log(&cpu, "NEIGHBOR: Delivering deferred pulse to %d.%d", otherCube, otherSide);
+                receivedPulse(dest.cpu);
+            }
+            sideMask ^= 1 << otherCube;
+        }
+    }
+}
+
 
 };  // namespace Cube
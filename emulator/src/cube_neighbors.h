@@ -33,6 +33,7 @@
 #include "cube_cpu.h"
 #include "cube_cpu_reg.h"
 #include "vtime.h"
+#include "snapshot.h"
 
 namespace Cube {
 
@@ -74,10 +75,22 @@ class Neighbors {
 
     void init() {
         memset(&mySides, 0, sizeof mySides);
+        memset(&deferredPulses, 0, sizeof deferredPulses);
+        localCubes = 0xFFFFFFFF;
     };
     
     void attachCubes(Hardware *cubes);
 
+    void saveState(SnapshotWriter &snap) const {
+        snap.put(*this);
+    }
+
+    void loadState(SnapshotReader &snap) {
+        Hardware *cubes = otherCubes;
+        snap.get(*this);
+        otherCubes = cubes;
+    }
+
     void setContact(unsigned mySide, unsigned otherSide, unsigned otherCube) {
         /* Mark two neighbor sensors as in-range. ONLY called by the UI thread. */
         mySides[mySide].otherSides[otherSide] |= 1 << otherCube;
@@ -107,6 +120,27 @@ class Neighbors {
         return 1 & (inputMask >> side);
     }
 
+    uint32_t getContactMask() const {
+        /* Bitmap of all cubes that are in range of any of our sides */
+        uint32_t mask = 0;
+        for (unsigned mySide = 0; mySide < NUM_SIDES; mySide++)
+            for (unsigned otherSide = 0; otherSide < NUM_SIDES; otherSide++)
+                mask |= mySides[mySide].otherSides[otherSide];
+        return mask;
+    }
+
+    unsigned getContactID(unsigned mySide) const;
+
+    void setLocalCubes(uint32_t mask) {
+        /*
+         * Set the bitmap of cubes that are ticked on the same thread as us.
+         * Pulses to any other cube are deferred until deliverDeferredPulses().
+         */
+        localCubes = mask;
+    }
+
+    void deliverDeferredPulses(CPU::em8051 &cpu);
+
     void ioTick(CPU::em8051 &cpu);
 
     static const unsigned PIN_0_TOP_IDX     = 0;
@@ -133,6 +167,9 @@ class Neighbors {
         uint32_t otherSides[NUM_SIDES];
     } mySides[NUM_SIDES];
 
+    uint32_t localCubes;
+    uint32_t deferredPulses[NUM_SIDES];
+
     Hardware *otherCubes;
 };
 
@@ -37,6 +37,7 @@
 #include "vtime.h"
 #include "tracer.h"
 #include "cube_cpu.h"
+#include "snapshot.h"
 
 namespace Cube {
 
@@ -252,6 +253,17 @@ class Radio {
 
         return hasACK;
     }
+
+    void saveState(SnapshotWriter &snap) const {
+        snap.put(*this);
+    }
+
+    void loadState(SnapshotReader &snap) {
+        // Keep our CPU pointer; the one in the snapshot is from another process
+        CPU::em8051 *c = cpu;
+        snap.get(*this);
+        cpu = c;
+    }
     
     void initVCD(VCDWriter &vcd)
     {
@@ -90,6 +90,30 @@ class SPIBus {
         status_dirty = 1;
     }
 
+    void saveState(SnapshotWriter &snap) const {
+        radio.saveState(snap);
+        snap.put(tx_fifo);
+        snap.put(rx_fifo);
+        snap.put(tx_count);
+        snap.put(rx_count);
+        snap.put(tx_mosi);
+        snap.put(timer);
+        snap.put(irq_state);
+        snap.put(status_dirty);
+    }
+
+    void loadState(SnapshotReader &snap) {
+        radio.loadState(snap);
+        snap.get(tx_fifo);
+        snap.get(rx_fifo);
+        snap.get(tx_count);
+        snap.get(rx_count);
+        snap.get(tx_mosi);
+        snap.get(timer);
+        snap.get(irq_state);
+        snap.get(status_dirty);
+    }
+
     void writeData(uint8_t mosi) {
         if (tx_count < SPI_FIFO_SIZE) {
             memmove(tx_fifo + 1, tx_fifo, SPI_FIFO_SIZE - 1);
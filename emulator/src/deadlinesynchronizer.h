@@ -50,6 +50,7 @@ public:
         mThreadWaiting = false;
         mInEvent = false;
         mTickRunFlag = tickRunFlag;
+        mRunner = NULL;
 
         /*
          * Note 1: Must reset to 0 so that we don't run at all until the
@@ -69,6 +70,22 @@ public:
         mDeadline.initTo(vtime, 0);
     }
 
+    /**
+     * Switch to lockstep mode, in which there is no separate simulation
+     * thread. beginEvent() instead calls 'runner' on the calling thread,
+     * which must simulate up until the new deadline. tick() never blocks.
+     */
+    void setLockstep(void (*runner)(void *), void *param)
+    {
+        mRunner = runner;
+        mRunnerParam = param;
+    }
+
+    bool isLockstep() const
+    {
+        return mRunner != NULL;
+    }
+
     /**
      * Wake up waiters on this DeadlineSynchronizer.
      * From the outside, this has no effect other than to give up
@@ -96,6 +113,11 @@ public:
         mDeadline.resetTo(deadline);
         mInEvent = true;
 
+        if (mRunner) {
+            mRunner(mRunnerParam);
+            return;
+        }
+
         while (!mThreadWaiting && runFlag) {
             wake();
             mCond.wait(mMutex);
@@ -173,6 +195,10 @@ public:
 private:
     NEVER_INLINE void deadlineWork()
     {
+        // In lockstep mode, the runner notices the deadline and returns instead
+        if (mRunner)
+            return;
+
         DEBUG_LOG(("SYNC: +deadlineWork (run=%d)\n", *mTickRunFlag));
 
         tthread::lock_guard<tthread::mutex> guard(mMutex);
@@ -197,6 +223,10 @@ private:
     
     // Between begin and end? For ASSERTs only.
     bool mInEvent;
+
+    // Lockstep simulation callback, or NULL when using a separate thread
+    void (*mRunner)(void *);
+    void *mRunnerParam;
 };
 
 
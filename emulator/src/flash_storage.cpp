@@ -38,6 +38,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include "macros.h"
 #include "flash_device.h"
 #include "flash_storage.h"
@@ -52,7 +53,7 @@ extern const uint8_t launcher[];
 
 
 FlashStorage::FlashStorage()
-    : data(NULL), isInitialized(false) {}
+    : data(NULL), isInitialized(false), isOverlay(false) {}
     
 FlashStorage::~FlashStorage()
 {
@@ -63,19 +64,28 @@ FlashStorage::~FlashStorage()
     }
 }
 
-bool FlashStorage::init(const char *filename)
+bool FlashStorage::init(const char *filename, const char *overlayFilename)
 {
     ASSERT(isInitialized == false);
+    ASSERT(filename || !overlayFilename);
     isFileBacked = filename != NULL;
+    isOverlay = overlayFilename != NULL;
 
     if (isFileBacked) {
-        // Disk-backed flash memory
-        if (!mapFile(filename))
+        // Disk-backed flash memory, optionally copy-on-write
+        if (!mapFile(filename, isOverlay))
             return false;
         if (!checkData()) {
             unmapFile();
             return false;
         }
+        if (isOverlay) {
+            this->overlayFilename = overlayFilename;
+            if (!loadOverlay()) {
+                unmapFile();
+                return false;
+            }
+        }
     } else {
         // Anonymous non-persistent flash memory
         data = new FileRecord();
@@ -90,6 +100,9 @@ void FlashStorage::exit()
 {
     ASSERT(isInitialized == true);
 
+    if (isOverlay)
+        saveOverlay();
+
     if (isFileBacked)
         unmapFile();
     else
@@ -236,12 +249,19 @@ bool FlashStorage::checkData()
     return true;
 }
 
-bool FlashStorage::mapFile(const char *filename)
+bool FlashStorage::mapFile(const char *filename, bool copyOnWrite)
 {
+    /*
+     * In copy-on-write mode, the base file is only ever opened for reading.
+     * It must already exist at full size, since we can't initialize it.
+     */
+
 #ifdef _WIN32
 
-    HANDLE fh = CreateFile(filename, GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+    HANDLE fh = CreateFile(filename,
+        copyOnWrite ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE),
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        copyOnWrite ? OPEN_EXISTING : OPEN_ALWAYS,
         FILE_ATTRIBUTE_NORMAL, NULL);
     if (fh == INVALID_HANDLE_VALUE) {
         LOG(("FLASH: Can't open backing file '%s' (%08x)\n",
@@ -252,7 +272,15 @@ bool FlashStorage::mapFile(const char *filename)
     fileHandle = (uintptr_t) fh;
     bool newFile = GetFileSize(fh, NULL) == (DWORD)0;
 
-    HANDLE mh = CreateFileMapping(fh, NULL, PAGE_READWRITE, 0, sizeof *data, NULL);
+    if (copyOnWrite && GetFileSize(fh, NULL) < (DWORD)sizeof *data) {
+        CloseHandle(fh);
+        LOG(("FLASH: Base image '%s' is incomplete, can't use it with an overlay\n",
+            filename));
+        return false;
+    }
+
+    HANDLE mh = CreateFileMapping(fh, NULL,
+        copyOnWrite ? PAGE_WRITECOPY : PAGE_READWRITE, 0, sizeof *data, NULL);
     if (mh == NULL) {
         CloseHandle(fh);
         LOG(("FLASH: Can't create mapping for file '%s' (%08x)\n",
@@ -261,7 +289,9 @@ bool FlashStorage::mapFile(const char *filename)
     }
     mappingHandle = (uintptr_t) mh;
 
-    LPVOID mapping = MapViewOfFile(mh, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof *data);
+    LPVOID mapping = MapViewOfFile(mh,
+        copyOnWrite ? FILE_MAP_COPY : (FILE_MAP_READ | FILE_MAP_WRITE),
+        0, 0, sizeof *data);
     if (mapping == NULL) {
         CloseHandle(mh);
         CloseHandle(fh);
@@ -272,7 +302,7 @@ bool FlashStorage::mapFile(const char *filename)
 
 #else
 
-    int fh = open(filename, O_RDWR | O_CREAT, 0777);
+    int fh = copyOnWrite ? open(filename, O_RDONLY) : open(filename, O_RDWR | O_CREAT, 0777);
     struct stat st;
 
     if (fh < 0 || fstat(fh, &st)) {
@@ -285,6 +315,12 @@ bool FlashStorage::mapFile(const char *filename)
     fileHandle = fh;
 
     bool newFile = (unsigned)st.st_size == (unsigned)0;
+    if (copyOnWrite && (unsigned)st.st_size < (unsigned)sizeof *data) {
+        close(fileHandle);
+        LOG(("FLASH: Base image '%s' is incomplete, can't use it with an overlay\n",
+            filename));
+        return false;
+    }
     if ((unsigned)st.st_size < (unsigned)sizeof *data && ftruncate(fileHandle, sizeof *data)) {
         close(fileHandle);
         LOG(("FLASH: Can't resize backing file '%s' (%s)\n",
@@ -292,7 +328,8 @@ bool FlashStorage::mapFile(const char *filename)
         return false;
     }
 
-    void *mapping = mmap(NULL, sizeof *data, PROT_READ | PROT_WRITE, MAP_SHARED, fileHandle, 0);
+    void *mapping = mmap(NULL, sizeof *data, PROT_READ | PROT_WRITE,
+        copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fileHandle, 0);
     if (mapping == MAP_FAILED) {
         close(fileHandle);
         LOG(("FLASH: Can't memory-map backing file '%s' (%s)\n",
@@ -313,16 +350,178 @@ void FlashStorage::unmapFile()
 {
 #ifdef _WIN32
 
-    FlushViewOfFile(data, sizeof *data);
+    if (!isOverlay)
+        FlushViewOfFile(data, sizeof *data);
     UnmapViewOfFile(data);
     CloseHandle((HANDLE) mappingHandle);
     CloseHandle((HANDLE) fileHandle);
 
 #else
 
-    fsync(fileHandle);
+    if (!isOverlay)
+        fsync(fileHandle);
     munmap(data, sizeof *data);
     close(fileHandle);
 
 #endif
 }
+
+const FlashStorage::FileRecord *FlashStorage::mapBase()
+{
+    /*
+     * A second, read-only view of the unmodified base image. Pages in our
+     * private mapping that differ from this view are the overlay's deltas.
+     */
+
+    if (!isOverlay)
+        return NULL;
+
+#ifdef _WIN32
+
+    HANDLE mh = CreateFileMapping((HANDLE) fileHandle, NULL, PAGE_READONLY, 0, sizeof *data, NULL);
+    if (mh == NULL)
+        return NULL;
+
+    LPVOID mapping = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, sizeof *data);
+    CloseHandle(mh);
+    return (const FileRecord*) mapping;
+
+#else
+
+    void *mapping = mmap(NULL, sizeof *data, PROT_READ, MAP_SHARED, fileHandle, 0);
+    return mapping == MAP_FAILED ? NULL : (const FileRecord*) mapping;
+
+#endif
+}
+
+void FlashStorage::unmapBase(const FileRecord *base)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+#else
+    munmap((void*) base, sizeof *data);
+#endif
+}
+
+bool FlashStorage::loadOverlay()
+{
+    FILE *f = fopen(overlayFilename.c_str(), "rb");
+    if (!f) {
+        // No overlay yet. Start out identical to the base image.
+        return true;
+    }
+
+    OverlayHeader hdr;
+    if (fread(&hdr, sizeof hdr, 1, f) != 1 ||
+        hdr.magic != OverlayHeader::MAGIC ||
+        hdr.version != OverlayHeader::CURRENT_VERSION ||
+        hdr.pageSize != OverlayHeader::PAGE_SIZE) {
+        LOG(("FLASH: Overlay file '%s' has an unrecognized format\n",
+            overlayFilename.c_str()));
+        fclose(f);
+        return false;
+    }
+
+    if (hdr.baseFileSize != sizeof *data ||
+        hdr.baseUniqueID != data->header.uniqueID) {
+        LOG(("FLASH: Overlay file '%s' belongs to a different base image\n",
+            overlayFilename.c_str()));
+        fclose(f);
+        return false;
+    }
+
+    const uint32_t numPages = (sizeof *data + hdr.pageSize - 1) / hdr.pageSize;
+    uint8_t *bytes = reinterpret_cast<uint8_t*>(data);
+
+    for (unsigned i = 0; i < hdr.numPages; ++i) {
+        uint32_t index;
+        if (fread(&index, sizeof index, 1, f) != 1 || index >= numPages)
+            goto corrupt;
+
+        uint32_t offset = index * hdr.pageSize;
+        uint32_t length = std::min<uint32_t>(hdr.pageSize, sizeof *data - offset);
+        if (fread(bytes + offset, length, 1, f) != 1)
+            goto corrupt;
+    }
+
+    fclose(f);
+    LOG(("FLASH: Applied %d modified pages from overlay '%s'\n",
+        hdr.numPages, overlayFilename.c_str()));
+    return true;
+
+corrupt:
+    LOG(("FLASH: Overlay file '%s' is truncated or corrupted\n",
+        overlayFilename.c_str()));
+    fclose(f);
+    return false;
+}
+
+bool FlashStorage::saveOverlay()
+{
+    const FileRecord *base = mapBase();
+    if (!base) {
+        LOG(("FLASH: Can't re-map base image to save overlay\n"));
+        return false;
+    }
+
+    /*
+     * Write to a temporary file and rename it into place, so a crash
+     * never leaves a half-written overlay behind.
+     */
+
+    std::string tempName = overlayFilename + ".tmp";
+    FILE *f = fopen(tempName.c_str(), "wb");
+    if (!f) {
+        LOG(("FLASH: Can't write overlay file '%s'\n", tempName.c_str()));
+        unmapBase(base);
+        return false;
+    }
+
+    OverlayHeader hdr;
+    memset(&hdr, 0, sizeof hdr);
+    hdr.magic = OverlayHeader::MAGIC;
+    hdr.version = OverlayHeader::CURRENT_VERSION;
+    hdr.pageSize = OverlayHeader::PAGE_SIZE;
+    hdr.baseFileSize = sizeof *data;
+    hdr.baseUniqueID = base->header.uniqueID;
+    fwrite(&hdr, sizeof hdr, 1, f);
+
+    const uint8_t *baseBytes = reinterpret_cast<const uint8_t*>(base);
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data);
+    const uint32_t numPages = (sizeof *data + hdr.pageSize - 1) / hdr.pageSize;
+
+    for (uint32_t index = 0; index < numPages; ++index) {
+        uint32_t offset = index * hdr.pageSize;
+        uint32_t length = std::min<uint32_t>(hdr.pageSize, sizeof *data - offset);
+
+        if (memcmp(bytes + offset, baseBytes + offset, length)) {
+            fwrite(&index, sizeof index, 1, f);
+            fwrite(bytes + offset, length, 1, f);
+            hdr.numPages++;
+        }
+    }
+
+    unmapBase(base);
+
+    // Now that we know the page count, finish the header
+    fseek(f, 0, SEEK_SET);
+    fwrite(&hdr, sizeof hdr, 1, f);
+    bool success = !ferror(f);
+    success &= fclose(f) == 0;
+
+    if (success) {
+#ifdef _WIN32
+        // rename() can't replace an existing file on Windows
+        remove(overlayFilename.c_str());
+#endif
+        success = rename(tempName.c_str(), overlayFilename.c_str()) == 0;
+    }
+
+    if (!success) {
+        LOG(("FLASH: Error saving overlay file '%s'\n", overlayFilename.c_str()));
+        remove(tempName.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -29,6 +29,11 @@
  *
  * All of this storage is defined in a fixed-layout structure, which
  * can be backed either by anonymous RAM or by a mapped file.
+ *
+ * In overlay mode, the file is a read-only base image mapped copy-on-write.
+ * Pages we modify are saved to a separate overlay journal on exit, and
+ * reapplied at startup. Many processes can share one base image this way.
+ * Use tools/flash-overlay.py to commit an overlay to its base, or discard it.
  */
 
 #ifndef _FLASH_STORAGE_H
@@ -36,6 +41,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string>
 #include <sifteo/abi.h>
 #include "cube_flash_model.h"
 #include "flash_device.h"
@@ -88,24 +94,52 @@ class FlashStorage {
         CubeRecord     cubes[_SYS_NUM_CUBE_SLOTS];
     };
 
+    struct OverlayHeader {
+        uint64_t    magic;
+        uint32_t    version;
+        uint32_t    pageSize;
+        uint32_t    baseFileSize;
+        uint32_t    baseUniqueID;
+        uint32_t    numPages;
+        uint32_t    reserved;
+
+        // Followed by numPages of (uint32_t pageIndex, uint8_t bytes[pageSize])
+
+        static const uint64_t MAGIC             = 0x564f4c4674666953LLU;
+        static const uint32_t CURRENT_VERSION   = 1;
+        static const uint32_t PAGE_SIZE         = 4096;
+    };
+
     FileRecord *data;
 
     FlashStorage();
     ~FlashStorage();
 
-    bool init(const char *filename=NULL);
+    bool init(const char *filename=NULL, const char *overlayFilename=NULL);
     bool installLauncher(const char *filename=NULL);
     void exit();
 
+    /*
+     * With an overlay, a read-only view of the unmodified base image.
+     * Returns NULL if we aren't running on top of a base image.
+     */
+    const FileRecord *mapBase();
+    void unmapBase(const FileRecord *base);
+
  private:
     bool isInitialized;
     bool isFileBacked;
+    bool isOverlay;
+    std::string overlayFilename;
     uintptr_t fileHandle;
     uintptr_t mappingHandle;
 
-    bool mapFile(const char *filename);
+    bool mapFile(const char *filename, bool copyOnWrite);
     void unmapFile();
 
+    bool loadOverlay();
+    bool saveOverlay();
+
     void initData();
     bool checkData();
 
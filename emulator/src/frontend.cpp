@@ -30,6 +30,7 @@
 #include "mc_neighbor.h"
 #include "mc_volume.h"
 #include <time.h>
+#include <sstream>
 #include "batterylevel.h"
 
 Frontend *Frontend::instance = NULL;
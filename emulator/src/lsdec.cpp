@@ -32,21 +32,30 @@
  */
 
 #include <string.h>
+#include <protocol.h>
 #include "macros.h"
 #include "lsdec.h"
 #include "cube_flash_model.h"
+#include "cube_ccp.h"
 
 
 LoadstreamDecoder::LoadstreamDecoder(uint8_t *buffer, uint32_t bufferSize)
-    : buffer(buffer), bufferSize(bufferSize)
+{
+    init(buffer, bufferSize);
+}
+
+void LoadstreamDecoder::init(uint8_t *buffer, uint32_t bufferSize)
 {
     ASSERT((bufferSize % Cube::FlashModel::SECTOR_SIZE) == 0);
+    setBuffer(buffer, bufferSize);
     reset();
 }
 
 void LoadstreamDecoder::reset()
 {
     memset(lut, 0, sizeof lut);
+    memset(query, 0, sizeof query);
+    queryPending = false;
     state = S_OPCODE;
     flashAddr = 0;
 }
@@ -127,8 +136,16 @@ void LoadstreamDecoder::handleByte(uint8_t byte)
                 state = S_ADDR_LOW;
                 return;
 
+            case OP_QUERY_CRC:
+                state = S_QUERY_ID;
+                return;
+
+            case OP_CHECK_QUERY:
+                state = S_CHECK_COUNT;
+                return;
+
             default:
-                ASSERT(0);
+                // Unrecognized, ignored by the firmware too
                 return;
             }
         }
@@ -141,9 +158,10 @@ void LoadstreamDecoder::handleByte(uint8_t byte)
     }
 
     case S_ADDR_HIGH: {
-        uint32_t lat1_part = (byte >> 1) << 7;
-        uint32_t lat2_part = (partial >> 1) << 14;
-        uint32_t a21_part = (partial & 1) << 21;
+        // First byte is lat1, second is lat2 with A21 in its LSB
+        uint32_t lat1_part = (partial >> 1) << 7;
+        uint32_t lat2_part = (byte >> 1) << 14;
+        uint32_t a21_part = (byte & 1) << 21;
         setAddress(lat1_part | lat2_part | a21_part);
         state = S_OPCODE;
         return;
@@ -316,5 +334,71 @@ void LoadstreamDecoder::handleByte(uint8_t byte)
             goto p16_next_mask;
         }
     }
+
+    case S_QUERY_ID: {
+        query[0] = byte | QUERY_ACK_BIT;
+        state = S_QUERY_COUNT;
+        return;
+    }
+
+    case S_QUERY_COUNT: {
+        queryCRC(byte ? byte : 256);
+        state = S_OPCODE;
+        return;
     }
+
+    case S_CHECK_COUNT: {
+        counter = byte;
+        partial = 0;
+        queryMismatch = 0;
+        state = S_CHECK_DATA;
+        return;
+    }
+
+    case S_CHECK_DATA: {
+        // Counter is 8-bit, so a count of zero compares 256 bytes
+        queryMismatch |= byte ^ query[partial++ % QUERY_RESPONSE_LEN];
+        if (--counter == 0)
+            state = queryMismatch ? S_HANG : S_OPCODE;
+        return;
+    }
+
+    case S_HANG:
+        return;
+    }
+}
+
+void LoadstreamDecoder::queryCRC(unsigned numBlocks)
+{
+    /*
+     * Same algorithm as flash_query_crc() in the firmware: each 16-tile
+     * block gets a CRC per tile, computed on a few bytes sampled using
+     * the CRC itself as feedback. Tiles are XOR'ed together across blocks.
+     */
+
+    uint32_t tile = (flashAddr >> 7) & 0x3FFF;
+    uint32_t a21 = flashAddr & (1 << 21);
+
+    memset(query + 1, 0, QUERY_RESPONSE_LEN - 1);
+
+    while (numBlocks--) {
+        uint8_t crc = 0xFF;
+        uint8_t sample = 0;
+
+        for (unsigned i = 1; i < QUERY_RESPONSE_LEN; i++) {
+            const uint8_t *data = buffer + (((tile << 7) | a21) % bufferSize);
+
+            for (unsigned round = 0; round < 4; round++) {
+                crc = data[sample >> 1] ^
+                    Cube::CCP::galoisFieldMultiply(crc, CRC_GENERATOR);
+                sample = crc;
+            }
+
+            query[i] ^= crc;
+            tile = (tile + 1) & 0x3FFF;
+        }
+    }
+
+    setAddress((tile << 7) | a21 | (flashAddr & 0x7F));
+    queryPending = true;
 }
@@ -39,15 +39,40 @@
 
 class LoadstreamDecoder {
 public:
+    // Size of a CRC query response: query ID, then one CRC byte per tile
+    static const unsigned QUERY_RESPONSE_LEN = 17;
+
+    LoadstreamDecoder() : buffer(0), bufferSize(0) {}
     LoadstreamDecoder(uint8_t *buffer, uint32_t bufferSize);
 
+    void init(uint8_t *buffer, uint32_t bufferSize);
     void reset();
+
+    /// Point at a new flash buffer without resetting decoder state
+    void setBuffer(uint8_t *buffer, uint32_t bufferSize) {
+        this->buffer = buffer;
+        this->bufferSize = bufferSize;
+    }
     void handleByte(uint8_t b);
     void setAddress(uint32_t addr);
 
+    /// After a failed CHECK_QUERY, the decoder refuses all further bytes
+    bool isHung() const {
+        return state == S_HANG;
+    }
+
+    /// Returns a new query response once, or NULL if there isn't one
+    const uint8_t *takeQueryResponse() {
+        if (!queryPending)
+            return 0;
+        queryPending = false;
+        return query;
+    }
+
 private:
     void write8(uint8_t value);
     void write16(uint16_t value);
+    void queryCRC(unsigned numBlocks);
     
     uint8_t *buffer;
     uint32_t bufferSize;
@@ -67,6 +92,10 @@ private:
 
     static const uint8_t OP_NOP         = 0xe0;
     static const uint8_t OP_ADDRESS     = 0xe1;
+    static const uint8_t OP_QUERY_CRC   = 0xe2;
+    static const uint8_t OP_CHECK_QUERY = 0xe3;
+
+    static const uint8_t CRC_GENERATOR  = 0x84;
 
     // State machine states
     enum States {
@@ -83,6 +112,11 @@ private:
         S_TILE_P16_MASK,
         S_TILE_P16_LOW,
         S_TILE_P16_HIGH,
+        S_QUERY_ID,
+        S_QUERY_COUNT,
+        S_CHECK_COUNT,
+        S_CHECK_DATA,
+        S_HANG,
     };
 
     // Codec state
@@ -95,6 +129,11 @@ private:
     uint8_t counter;
     uint8_t rle1;
     uint8_t rle2;
+
+    // Query state
+    uint8_t query[QUERY_RESPONSE_LEN];
+    uint8_t queryMismatch;
+    bool queryPending;
 };
 
 
@@ -40,6 +40,8 @@ Lunar<LuaSystem>::RegType LuaSystem::methods[] = {
     LUNAR_DECLARE_METHOD(LuaSystem, setOptions),
     LUNAR_DECLARE_METHOD(LuaSystem, setTraceMode),
     LUNAR_DECLARE_METHOD(LuaSystem, setAssetLoaderBypass),
+    LUNAR_DECLARE_METHOD(LuaSystem, saveSnapshot),
+    LUNAR_DECLARE_METHOD(LuaSystem, loadSnapshot),
     LUNAR_DECLARE_METHOD(LuaSystem, vclock),
     LUNAR_DECLARE_METHOD(LuaSystem, vsleep),
     LUNAR_DECLARE_METHOD(LuaSystem, sleep),
@@ -67,14 +69,30 @@ int LuaSystem::setOptions(lua_State *L)
     if (LuaScript::argMatch(L, "turbo"))
         sys->opt_turbo = lua_toboolean(L, -1);
 
+    if (LuaScript::argMatch(L, "lockstep"))
+        sys->opt_lockstep = lua_toboolean(L, -1);
+
+    if (LuaScript::argMatch(L, "seed"))
+        sys->opt_seed = lua_tointeger(L, -1);
+
+    if (LuaScript::argMatch(L, "cubeThreads"))
+        sys->opt_cubeThreads = lua_tointeger(L, -1);
+
+    if (LuaScript::argMatch(L, "cubeHLE"))
+        sys->opt_cubeHLE = lua_toboolean(L, -1);
+
     if (LuaScript::argMatch(L, "continueOnException"))
         sys->opt_continueOnException = lua_toboolean(L, -1);
 
     if (LuaScript::argMatch(L, "cube0Debug"))
         sys->opt_cube0Debug = lua_toboolean(L, -1);
 
+    if (LuaScript::argMatch(L, "cubeProfile"))
+        sys->opt_cubeProfile = lua_tostring(L, -1);
+
+    // Older name, from when only cube 0 was profiled
     if (LuaScript::argMatch(L, "cube0Profile"))
-        sys->opt_cube0Profile = lua_tostring(L, -1);
+        sys->opt_cubeProfile = lua_tostring(L, -1);
 
     if (LuaScript::argMatch(L, "paintTrace"))
         sys->opt_paintTrace = lua_toboolean(L, -1);
@@ -82,6 +100,9 @@ int LuaSystem::setOptions(lua_State *L)
     if (LuaScript::argMatch(L, "radioTrace"))
         sys->opt_radioTrace = lua_toboolean(L, -1);
 
+    if (LuaScript::argMatch(L, "svmJit"))
+        sys->opt_svmJit = lua_toboolean(L, -1);
+
     if (LuaScript::argMatch(L, "svmTrace"))
         sys->opt_svmTrace = lua_toboolean(L, -1);
 
@@ -91,6 +112,12 @@ int LuaSystem::setOptions(lua_State *L)
     if (LuaScript::argMatch(L, "svmStackMonitor"))
         sys->opt_svmStackMonitor = lua_toboolean(L, -1);
 
+    if (LuaScript::argMatch(L, "svmProfile"))
+        sys->opt_svmProfileFilename = lua_tostring(L, -1);
+
+    if (LuaScript::argMatch(L, "flashMisses"))
+        sys->opt_flashMissesFilename = lua_tostring(L, -1);
+
     if (LuaScript::argMatch(L, "noCubeReconnect"))
         sys->opt_noCubeReconnect = lua_toboolean(L, -1);
 
@@ -118,6 +145,28 @@ int LuaSystem::setAssetLoaderBypass(lua_State *L)
     return 0;
 }
 
+int LuaSystem::saveSnapshot(lua_State *L)
+{
+    const char *filename = luaL_checkstring(L, 1);
+
+    if (!sys->saveSnapshot(filename)) {
+        lua_pushfstring(L, "failed to save snapshot '%s'", filename);
+        lua_error(L);
+    }
+    return 0;
+}
+
+int LuaSystem::loadSnapshot(lua_State *L)
+{
+    const char *filename = luaL_checkstring(L, 1);
+
+    if (!sys->loadSnapshot(filename)) {
+        lua_pushfstring(L, "failed to load snapshot '%s'", filename);
+        lua_error(L);
+    }
+    return 0;
+}
+
 int LuaSystem::vclock(lua_State *L)
 {
     /*
@@ -136,9 +185,20 @@ int LuaSystem::sleep(lua_State *L)
 int LuaSystem::vsleep(lua_State *L)
 {
     /*
-     * Sleep, in virtual time
+     * Sleep, in virtual time.
+     *
+     * In lockstep mode, this is the only time the simulation runs. We
+     * wake up at the first sync event on or after the deadline, and the
+     * simulation holds there until we vsleep() again.
      */
 
+    if (sys->opt_lockstep && sys->isRunning()) {
+        uint64_t ticks = luaL_checknumber(L, 1) * VirtualTime::HZ;
+        sys->setLockstepHold(sys->time.clocks + ticks);
+        sys->waitLockstepHold();
+        return 0;
+    }
+
     double deadline = sys->time.elapsedSeconds() + luaL_checknumber(L, 1);
     double remaining;
     
@@ -162,6 +222,10 @@ int LuaSystem::init(lua_State *L)
  
 int LuaSystem::start(lua_State *L)
 {
+    // In lockstep mode, the script decides when time passes (see vsleep)
+    if (sys->opt_lockstep)
+        sys->setLockstepHold(sys->time.clocks);
+
     sys->start();
     return 0;
 }
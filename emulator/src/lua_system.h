@@ -46,6 +46,8 @@ private:
     int setOptions(lua_State *L);
     int setTraceMode(lua_State *L);
     int setAssetLoaderBypass(lua_State *L);
+    int saveSnapshot(lua_State *L);
+    int loadSnapshot(lua_State *L);
 
     int numCubes(lua_State *L);
 
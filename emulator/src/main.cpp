@@ -39,6 +39,7 @@
  
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
 #include "frontend.h"
@@ -57,7 +58,7 @@ static void usage()
      * names, so that the long names don't show up in our binary's strings.
      *
      *  -f FIRMWARE.hex   Specify firmware image for cubes
-     *  -p PROFILE.txt    Profile firmware execution (first cube only) to a text file
+     *  -p PROFILE.txt    Profile firmware execution to text files, one per cube
      *  -d                Launch firmware debugger (first cube only)
      *  -c                Continue executing on exception, rather than stopping the debugger.
      *  -R                Cube trace enabled at startup.
@@ -77,16 +78,26 @@ static void usage()
             "  -e SCRIPT.lua         Execute a Lua script instead of the default frontend\n"
             "  -l LAUNCHER.elf       Start the supplied binary as the system launcher\n"
             "\n"
+            "  --cube-hle            Emulate cube firmware at a high level, without the 8051\n"
+            "  --cube-threads NUM    Simulate cubes in parallel, on up to NUM threads\n"
+            "  --flash-misses FILE   Report flash cache misses by SVM function\n"
+            "  --flash-overlay FILE  Keep the -F image read-only, saving changes to FILE\n"
             "  --headless            Run without graphics or sound output\n"
+            "  --load-snapshot FILE  Restore machine state from a snapshot at startup\n"
             "  --lock-rotation       Lock rotation by default\n"
+            "  --lockstep            Deterministic headless simulation on a single thread\n"
             "  --mute                Mute the Base's volume control by default\n"
             "  --paint-trace         Trace the state of the repaint controller\n"
             "  --radio-trace         Trace all radio packet contents\n"
             "  --radio-noise FLOAT   Simulated radio noise, arbitrary units.\n"     
+            "  --save-snapshot FILE  Save a snapshot of machine state on exit\n"
+            "  --seed NUM            Random number seed, for --lockstep mode\n"
             "  --stdout FILENAME     Redirect output to FILENAME\n"
+            "  --svm-jit             Translate SVM code to native x86-64 code\n"
             "  --svm-trace           Trace SVM instruction execution\n"
             "  --svm-stack           Monitor SVM stack usage\n"
             "  --svm-flash-stats     Dump statistics about flash memory usage\n"
+            "  --svm-profile FILE    Sample SVM call stacks, saving them for flame graphs\n"
             "  --waveout FILE.wav    Log all audio output to LOG.wav\n"
             "  --white-bg            Force the UI to use a plain white background\n"
             "  --window WxH          Initial window size (default 800x600)\n"
@@ -254,6 +265,11 @@ int main(int argc, char **argv)
             continue;
         }
 
+        if (!strcmp(arg, "--svm-jit")) {
+            sys.opt_svmJit = true;
+            continue;
+        }
+
         if (!strcmp(arg, "--svm-trace")) {
             sys.opt_svmTrace = true;
             continue;
@@ -269,6 +285,18 @@ int main(int argc, char **argv)
             continue;
         }
 
+        if (!strcmp(arg, "--svm-profile") && argv[c+1]) {
+            sys.opt_svmProfileFilename = argv[c+1];
+            c++;
+            continue;
+        }
+
+        if (!strcmp(arg, "--flash-misses") && argv[c+1]) {
+            sys.opt_flashMissesFilename = argv[c+1];
+            c++;
+            continue;
+        }
+
         if (!strcmp(arg, "--radio-trace")) {
             sys.opt_radioTrace = true;
             continue;
@@ -284,6 +312,17 @@ int main(int argc, char **argv)
             continue;
         }
 
+        if (!strcmp(arg, "--lockstep")) {
+            sys.opt_lockstep = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "--seed") && argv[c+1]) {
+            sys.opt_seed = strtoul(argv[c+1], NULL, 0);
+            c++;
+            continue;
+        }
+
         if (!strcmp(arg, "--white-bg")) {
             sys.opt_whiteBackground = true;
             continue;
@@ -300,6 +339,22 @@ int main(int argc, char **argv)
             continue;
         }
 
+        if (!strcmp(arg, "--cube-hle")) {
+            sys.opt_cubeHLE = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "--cube-threads") && argv[c+1]) {
+            int threads = atoi(argv[c+1]);
+            if (threads < 1) {
+                message("Error: invalid number of cube threads \"%s\"", argv[c+1]);
+                return 1;
+            }
+            sys.opt_cubeThreads = threads;
+            c++;
+            continue;
+        }
+
         if (!strcmp(arg, "--window") && argv[c+1]) {
             int result = sscanf(argv[c+1], "%dx%d", &(sys.opt_windowWidth), &(sys.opt_windowHeight));
             if (result != 2 || sys.opt_windowWidth <= 0 || sys.opt_windowHeight <=0) {
@@ -324,6 +379,24 @@ int main(int argc, char **argv)
             continue;
         }
 
+        if (!strcmp(arg, "--flash-overlay") && argv[c+1]) {
+            sys.opt_flashOverlayFilename = argv[c+1];
+            c++;
+            continue;
+        }
+
+        if (!strcmp(arg, "--load-snapshot") && argv[c+1]) {
+            sys.opt_loadSnapshotFilename = argv[c+1];
+            c++;
+            continue;
+        }
+
+        if (!strcmp(arg, "--save-snapshot") && argv[c+1]) {
+            sys.opt_saveSnapshotFilename = argv[c+1];
+            c++;
+            continue;
+        }
+
         if (!strcmp(arg, "--waveout") && argv[c+1]) {
             sys.opt_waveoutFilename = argv[c+1];
             c++;
@@ -355,7 +428,7 @@ int main(int argc, char **argv)
         }
 
         if (!strcmp(arg, "-p") && argv[c+1]) {
-            sys.opt_cube0Profile = argv[c+1];
+            sys.opt_cubeProfile = argv[c+1];
             c++;
             continue;
         }
@@ -391,6 +464,11 @@ int main(int argc, char **argv)
         SystemMC::installGame(arg);
     }
 
+    if (!sys.opt_flashOverlayFilename.empty() && sys.opt_flashFilename.empty()) {
+        message("Error: --flash-overlay requires a base image, specified with -F");
+        return 1;
+    }
+
     return scriptFile ? runScript(sys, scriptFile) : run(sys);
 }
 
@@ -176,6 +176,19 @@ std::string ELFDebugInfo::formatAddress(uint32_t address) const
     return name;
 }
 
+std::string ELFDebugInfo::formatFunction(uint32_t address) const
+{
+    // Like formatAddress(), but without the offset. Good for grouping
+    // samples or statistics by function.
+
+    Elf::Symbol symbol;
+    std::string name;
+
+    findNearestSymbol(address, symbol, name);
+    demangle(name);
+    return name;
+}
+
 void ELFDebugInfo::demangle(std::string &name)
 {
     // This uses the demangler built into GCC's libstdc++.
@@ -25,6 +25,8 @@
  */
 
 #include "flash_blockcache.h"
+#include "flash_preerase.h"
+#include "mc_flash_missreport.h"
 #include "svmdebugpipe.h"
 #include "svmmemory.h"
 #include "system.h"
@@ -33,6 +35,8 @@
 #include <algorithm>
 
 FlashBlock::FlashStats FlashBlock::stats;
+FlashBlockAccess::Kind FlashBlockAccess::currentKind = FlashBlockAccess::OTHER;
+uint32_t FlashBlockAccess::currentObject;
 
 
 bool FlashBlock::isAddrValid(uintptr_t pa)
@@ -53,8 +57,9 @@ void FlashBlock::resetStats()
     memset(&stats.periodic, 0, sizeof stats.periodic);
 }
 
-void FlashBlock::countBlockMiss(uint32_t blockAddr)
+void FlashBlock::countBlockMiss(uint32_t blockAddr, unsigned cacheBlockID)
 {
+    FlashMissReport::recordMiss(blockAddr, cacheBlockID);
     stats.periodic.blockMiss++;
 
     unsigned blockNumber = blockAddr / BLOCK_SIZE;
@@ -98,6 +103,32 @@ void FlashBlock::dumpStats()
         stats.periodic.blockMiss / dt,
         effectiveMHZ / flashBusMHZ * 100.0));
 
+    /*
+     * Hit rate for this cache configuration, and how far the CLOCK hand
+     * had to sweep on average to find a block to recycle.
+     */
+
+    unsigned hits = stats.periodic.blockHitSame + stats.periodic.blockHitOther;
+    unsigned recycles = stats.periodic.recycles;
+
+    LOG(("FLASH: %u x %u byte cache, %6.2f%% hit rate, "
+        "%5.2f blocks swept per recycle\n",
+        NUM_CACHE_BLOCKS, BLOCK_SIZE,
+        stats.periodic.blockTotal ? hits * 100.0 / stats.periodic.blockTotal : 0.0,
+        recycles ? stats.periodic.recycleSteps / (double) recycles : 0.0));
+
+    LOG(("FLASH: %8.1f read-ahead/s, %8.1f waited/s\n",
+        stats.periodic.prefetchIssued / dt,
+        stats.periodic.prefetchWait / dt));
+
+    /*
+     * Pre-erase pool. These are running totals, not per-interval rates.
+     */
+
+    const FlashPreEraseScheduler::Stats &pe = FlashPreEraseScheduler::stats;
+    LOG(("FLASH: %u blocks pre-erased, %u in pool, %u pool hits, %u erase stalls\n",
+        pe.preErased, pe.poolDepth, pe.poolHits, pe.eraseStalls));
+
     /*
      * Log the N 'hottest' blocks; those with the most repeated misses.
      */
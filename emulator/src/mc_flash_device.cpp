@@ -27,6 +27,7 @@
 #include "system.h"
 #include "system_mc.h"
 #include "mc_timing.h"
+#include "mc_svmprofiler.h"
 #include "svmmemory.h"
 #include "flash_device.h"
 #include "flash_storage.h"
@@ -67,7 +68,8 @@ void FlashDevice::read(uint32_t address, uint8_t *buf, unsigned len)
 
     if (!gStealthIOCounter) {
         LuaFilesystem::onRawRead(address, buf, len);
-        SystemMC::elapseTicks(MCTiming::TICKS_PER_PAGE_MISS);
+        SvmProfiler::ActivityScope scope(SvmProfiler::A_FLASH_MISS);
+        SystemMC::elapseTicks(MCTiming::TICKS_PER_READ + len * MCTiming::TICKS_PER_READ_BYTE);
     }
 }
 
@@ -92,6 +94,7 @@ void FlashDevice::write(uint32_t address, const uint8_t *buf, unsigned len)
 
         if (!gStealthIOCounter) {
             LuaFilesystem::onRawWrite(address, buf, len);
+            SvmProfiler::ActivityScope scope(SvmProfiler::A_FLASH_WRITE);
             SystemMC::elapseTicks(MCTiming::TICKS_PER_PAGE_WRITE);
         }
 
@@ -121,6 +124,7 @@ void FlashDevice::eraseBlock(uint32_t address)
             LOG(("FLASH: Erasing block %08x\n", address));
 
             LuaFilesystem::onRawErase(address);
+            SvmProfiler::ActivityScope scope(SvmProfiler::A_FLASH_ERASE);
             SystemMC::elapseTicks(MCTiming::TICKS_PER_BLOCK_ERASE);
         }
 
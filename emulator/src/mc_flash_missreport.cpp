@@ -0,0 +1,264 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "mc_flash_missreport.h"
+#include "flash_blockcache.h"
+#include "svm.h"
+#include "svmcpu.h"
+#include "svmmemory.h"
+#include "svmruntime.h"
+#include "svmdebugpipe.h"
+#include "systime.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using namespace Svm;
+
+bool FlashMissReport::enabled;
+
+static const char *kindNames[] = {
+    "other",
+    "code",
+    "rodata",
+    "asset",
+    "lfs",
+    "prefetch",
+};
+
+namespace {
+
+/*
+ * Misses are counted by raw address until flush(), since looking up
+ * symbols for every miss would be slow.
+ */
+struct RawMiss {
+    uint32_t pcVA;
+    uint32_t kind;
+    uint32_t target;
+
+    bool operator< (const RawMiss &other) const {
+        if (pcVA != other.pcVA) return pcVA < other.pcVA;
+        if (kind != other.kind) return kind < other.kind;
+        return target < other.target;
+    }
+};
+
+struct KindCounts {
+    uint64_t counts[FlashBlockAccess::NUM_KINDS];
+
+    KindCounts() {
+        memset(counts, 0, sizeof counts);
+    }
+
+    uint64_t total() const {
+        uint64_t t = 0;
+        for (unsigned i = 0; i < arraysize(counts); ++i)
+            t += counts[i];
+        return t;
+    }
+};
+
+}  // end anonymous namespace
+
+typedef std::map<RawMiss, uint64_t> RawMisses;
+typedef std::map<std::string, KindCounts> FunctionMisses;
+typedef std::map<std::pair<unsigned, std::string>, uint64_t> TargetMisses;
+
+static std::string gFilename;
+static FILE *gTimeline;
+static SysTime::Ticks gStartTime;
+static RawMisses gRawMisses;
+static FunctionMisses gFunctionMisses;
+static TargetMisses gTargetMisses;
+static KindCounts gKindCounts;
+
+
+void FlashMissReport::init(const std::string &filename)
+{
+    STATIC_ASSERT(arraysize(kindNames) == FlashBlockAccess::NUM_KINDS);
+
+    gFilename = filename;
+    enabled = !filename.empty();
+    if (!enabled)
+        return;
+
+    /*
+     * The timeline goes next to the report, with a suffix before the
+     * extension: "misses.txt" -> "misses-timeline.txt"
+     */
+
+    std::string timeline = filename;
+    size_t dot = timeline.rfind('.');
+    if (dot == std::string::npos || timeline.find_first_of("/\\", dot) != std::string::npos)
+        dot = timeline.size();
+    timeline.insert(dot, "-timeline");
+
+    gTimeline = fopen(timeline.c_str(), "w");
+    if (gTimeline) {
+        fprintf(gTimeline, "# time_ns slot flash_addr kind pc_va target_va\n");
+    } else {
+        LOG(("FLASH: Error, couldn't write miss timeline '%s' (%s)\n",
+            timeline.c_str(), strerror(errno)));
+    }
+
+    gStartTime = SysTime::ticks();
+}
+
+void FlashMissReport::record(uint32_t blockAddr, unsigned cacheBlockID)
+{
+    RawMiss miss;
+    miss.pcVA = SvmRuntime::reconstructCodeAddr(SvmCpu::liveReg(REG_PC));
+    miss.kind = FlashBlockAccess::currentKind;
+
+    switch (miss.kind) {
+    case FlashBlockAccess::ASSET:
+        // Asset group header
+        miss.target = FlashBlockAccess::currentObject;
+        break;
+    case FlashBlockAccess::LFS:
+        miss.target = 0;
+        break;
+    default:
+        // Whatever is mapped at this block, if anything
+        miss.target = SvmMemory::flashToVirtAddr(blockAddr);
+        break;
+    }
+
+    gRawMisses[miss]++;
+    gKindCounts.counts[miss.kind]++;
+
+    if (gTimeline) {
+        fprintf(gTimeline, "%llu %2u %06x %-8s %08x %08x\n",
+            (unsigned long long) SysTime::ticks(), cacheBlockID, blockAddr,
+            kindNames[miss.kind], miss.pcVA, miss.target);
+    }
+}
+
+static std::string formatTarget(uint32_t va)
+{
+    return va ? SvmDebugPipe::formatFunction(va) : "(system)";
+}
+
+void FlashMissReport::flush()
+{
+    for (RawMisses::iterator I = gRawMisses.begin(), E = gRawMisses.end(); I != E; ++I) {
+        const RawMiss &miss = I->first;
+
+        gFunctionMisses[formatTarget(miss.pcVA)].counts[miss.kind] += I->second;
+
+        std::string target = miss.kind == FlashBlockAccess::LFS
+            ? "(filesystem)" : formatTarget(miss.target);
+        gTargetMisses[std::make_pair(miss.kind, target)] += I->second;
+    }
+
+    gRawMisses.clear();
+}
+
+typedef std::pair<std::string, KindCounts> FunctionEntry;
+typedef std::pair<std::pair<unsigned, std::string>, uint64_t> TargetEntry;
+
+static bool functionSort(const FunctionEntry &a, const FunctionEntry &b)
+{
+    return a.second.total() > b.second.total();
+}
+
+static bool targetSort(const TargetEntry &a, const TargetEntry &b)
+{
+    return a.second > b.second;
+}
+
+void FlashMissReport::exit()
+{
+    if (!enabled)
+        return;
+    enabled = false;
+
+    if (gTimeline) {
+        fclose(gTimeline);
+        gTimeline = 0;
+    }
+
+    flush();
+
+    FILE *f = fopen(gFilename.c_str(), "w");
+    if (!f) {
+        LOG(("FLASH: Error, couldn't write miss report '%s' (%s)\n",
+            gFilename.c_str(), strerror(errno)));
+        return;
+    }
+
+    uint64_t total = gKindCounts.total();
+    double seconds = (SysTime::ticks() - gStartTime) / (double) SysTime::sTicks(1);
+    double percent = total ? 100.0 / total : 0.0;
+
+    fprintf(f, "Flash cache misses: %llu in %.2f s of simulated time (%.1f/s)\n\n",
+        (unsigned long long) total, seconds, seconds > 0 ? total / seconds : 0.0);
+
+    for (unsigned i = 0; i < FlashBlockAccess::NUM_KINDS; ++i)
+        fprintf(f, "  %-8s %10llu %6.2f%%\n", kindNames[i],
+            (unsigned long long) gKindCounts.counts[i], gKindCounts.counts[i] * percent);
+
+    /*
+     * Misses by the SVM function that was running when they happened
+     */
+
+    std::vector<FunctionEntry> functions(gFunctionMisses.begin(), gFunctionMisses.end());
+    std::stable_sort(functions.begin(), functions.end(), functionSort);
+
+    fprintf(f, "\nMisses by SVM function:\n\n  %10s", "total");
+    for (unsigned i = 0; i < FlashBlockAccess::NUM_KINDS; ++i)
+        fprintf(f, " %8s", kindNames[i]);
+    fprintf(f, "  function\n");
+
+    for (unsigned i = 0; i < functions.size(); ++i) {
+        const KindCounts &kc = functions[i].second;
+        fprintf(f, "  %10llu", (unsigned long long) kc.total());
+        for (unsigned j = 0; j < FlashBlockAccess::NUM_KINDS; ++j)
+            fprintf(f, " %8llu", (unsigned long long) kc.counts[j]);
+        fprintf(f, "  %s\n", functions[i].first.c_str());
+    }
+
+    /*
+     * Misses by what was being read: a function, data symbol, or asset group
+     */
+
+    std::vector<TargetEntry> targets(gTargetMisses.begin(), gTargetMisses.end());
+    std::stable_sort(targets.begin(), targets.end(), targetSort);
+
+    fprintf(f, "\nMisses by target:\n\n  %10s %-8s  target\n", "total", "kind");
+    for (unsigned i = 0; i < targets.size(); ++i)
+        fprintf(f, "  %10llu %-8s  %s\n", (unsigned long long) targets[i].second,
+            kindNames[targets[i].first.first], targets[i].first.second.c_str());
+
+    fclose(f);
+
+    LOG(("FLASH: %llu cache misses, report saved to '%s'\n",
+        (unsigned long long) total, gFilename.c_str()));
+}
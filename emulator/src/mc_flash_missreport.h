@@ -0,0 +1,62 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Flash cache miss attribution, for --flash-misses.
+ *
+ * Every miss is tagged with the SVM PC that caused it and with its
+ * FlashBlockAccess kind. On exit we write a report summarizing misses by
+ * SVM function and by what was being read (code, data symbol, or asset
+ * group), and alongside it a timeline with one line per miss, for
+ * plotting how blocks move through the cache over time.
+ */
+
+#ifndef MC_FLASH_MISSREPORT_H
+#define MC_FLASH_MISSREPORT_H
+
+#include "macros.h"
+#include <string>
+
+
+class FlashMissReport {
+public:
+    static void init(const std::string &filename);
+    static void exit();
+
+    // Symbolize all misses so far, before the debug symbols change
+    static void flush();
+
+    static ALWAYS_INLINE void recordMiss(uint32_t blockAddr, unsigned cacheBlockID) {
+        if (UNLIKELY(enabled))
+            record(blockAddr, cacheBlockID);
+    }
+
+private:
+    static bool enabled;
+    static void record(uint32_t blockAddr, unsigned cacheBlockID);
+};
+
+#endif
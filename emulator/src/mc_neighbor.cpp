@@ -53,6 +53,22 @@ void MCNeighbor::updateNeighbor(bool touching, unsigned mcSide, unsigned cube, u
     deadline.set(0);
 }
 
+unsigned MCNeighbor::getContactID(unsigned cube, unsigned cubeSide)
+{
+    /*
+     * For high-level cube emulation: the ID byte we're currently
+     * transmitting toward this cube side, or zero if none.
+     */
+
+    unsigned sides = txSides & nbrSides;
+
+    for (unsigned i = 0; i < NUM_SIDES; ++i)
+        if ((sides & (1 << i)) && cubes[i].id == cube && cubes[i].side == cubeSide)
+            return txData >> 8;
+
+    return 0;
+}
+
 void NeighborTX::init()
 {
     stop();
@@ -59,6 +59,8 @@ public:
         return deadline.remaining();
     }
 
+    static unsigned getContactID(unsigned cube, unsigned cubeSide);
+
 private:
 
     friend class NeighborTX;
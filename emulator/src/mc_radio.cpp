@@ -261,8 +261,7 @@ void SystemMC::doRadioPacket()
 
         Cube::Hardware *cube = getCubeForAddress(buf.ptx.dest);
 
-        buf.ack = cube && cube->isRadioClockRunning()
-            && !dropped && cube->spi.radio.handlePacket(buf.packet, buf.reply);
+        buf.ack = cube && !dropped && cube->handleRadioPacket(buf.packet, buf.reply);
         buf.ackCube = cube ? cube->id() : -1;
     }
 
@@ -313,7 +312,7 @@ Cube::Hardware *SystemMC::getCubeForAddress(const RadioAddress *addr)
 
     for (unsigned i = 0; i < sys->opt_numCubes; i++) {
         Cube::Hardware &cube = sys->cubes[i];
-        if (cube.spi.radio.getPackedRXAddr() == packed)
+        if (cube.hasRadioAddress(packed))
             return &cube;
     }
 
@@ -32,14 +32,23 @@
 #include "system.h"
 #include "system_mc.h"
 #include "svmmemory.h"
+#include "flash_blockcache.h"
+#include "mc_svmjit.h"
 
 #include <string.h>
 
 namespace SvmCpu {
 
 static reg_t regs[NUM_REGS];
+static bool inException;
 UserRegs userRegs;
 
+reg_t liveReg(unsigned r)
+{
+    // Inside an exception, userRegs is authoritative. Otherwise it's stale.
+    return inException ? reg(r) : regs[r];
+}
+
 
 /***************************************************************************
  * Timing
@@ -72,49 +81,107 @@ static void calculateElapsedTicks()
  * Flags and Condition Codes
  ***************************************************************************/
 
+/*
+ * Flags are evaluated lazily. Nearly every ALU instruction sets flags,
+ * but most of those flags are overwritten before anything reads them.
+ * So instead of updating CPSR on every instruction, we remember where
+ * each flag would come from and only compute it on demand: for
+ * conditional branches, ADC/SBC, exception entry, and tracing.
+ *
+ * N and Z come from the last result, which is normally 32-bit. C and V come either from
+ * CPSR or from the operands of the last opADD(), and C may also be
+ * a shifter carry-out that we've already computed.
+ */
+
+enum FlagSource {
+    FLAGS_FROM_CPSR = 0,
+    FLAGS_FROM_RESULT,      // N, Z
+    FLAGS_FROM_ADD,         // C, V
+    FLAGS_FROM_VALUE,       // C
+};
+
+static struct LazyFlags {
+    uint8_t nz;
+    uint8_t c;
+    uint8_t v;
+    bool carry;             // C, for FLAGS_FROM_VALUE
+    int64_t result;         // N and Z, for FLAGS_FROM_RESULT
+    uint32_t addA;          // C and V, for FLAGS_FROM_ADD
+    uint32_t addB;
+    uint32_t addCarry;
+} lazyFlags;
+
 static inline bool getNeg() {
+    if (lazyFlags.nz == FLAGS_FROM_RESULT)
+        return lazyFlags.result < 0;
     return Svm::getNeg(regs[REG_CPSR]);
 }
-static inline void setNeg(bool f) {
-    if (f)
-        regs[REG_CPSR] |= (1 << 31);
-    else
-        regs[REG_CPSR] &= ~(1 << 31);
-}
 
 static inline bool getZero() {
+    if (lazyFlags.nz == FLAGS_FROM_RESULT)
+        return lazyFlags.result == 0;
     return Svm::getZero(regs[REG_CPSR]);
 }
-static inline void setZero(bool f) {
-    if (f)
-        regs[REG_CPSR] |= 1 << 30;
-    else
-        regs[REG_CPSR] &= ~(1 << 30);
-}
 
 static inline bool getCarry() {
-    return Svm::getCarry(regs[REG_CPSR]);
-}
-static inline void setCarry(bool f) {
-    if (f)
-        regs[REG_CPSR] |= 1 << 29;
-    else
-        regs[REG_CPSR] &= ~(1 << 29);
+    switch (lazyFlags.c) {
+    case FLAGS_FROM_ADD: {
+        uint64_t uSum32 = (uint64_t)lazyFlags.addA + lazyFlags.addB + lazyFlags.addCarry;
+        return (uint32_t)uSum32 != uSum32;
+    }
+    case FLAGS_FROM_VALUE:
+        return lazyFlags.carry;
+    default:
+        return Svm::getCarry(regs[REG_CPSR]);
+    }
 }
 
-static inline int getOverflow() {
+static inline bool getOverflow() {
+    if (lazyFlags.v == FLAGS_FROM_ADD) {
+        int64_t sSum32 = (int64_t)(int32_t)lazyFlags.addA +
+            (int32_t)lazyFlags.addB + lazyFlags.addCarry;
+        return (int32_t)sSum32 != sSum32;
+    }
     return Svm::getOverflow(regs[REG_CPSR]);
 }
-static inline void setOverflow(bool f) {
-    if (f)
-        regs[REG_CPSR] |= (1 << 28);
-    else
-        regs[REG_CPSR] &= ~(1 << 28);
+
+static void flushFlags()
+{
+    // Write back any lazily evaluated flags, so CPSR is up to date.
+
+    if (lazyFlags.nz == FLAGS_FROM_CPSR &&
+        lazyFlags.c == FLAGS_FROM_CPSR &&
+        lazyFlags.v == FLAGS_FROM_CPSR)
+        return;
+
+    reg_t cpsr = regs[REG_CPSR] & ~(reg_t)0xF0000000;
+    if (getNeg())       cpsr |= 1u << 31;
+    if (getZero())      cpsr |= 1u << 30;
+    if (getCarry())     cpsr |= 1u << 29;
+    if (getOverflow())  cpsr |= 1u << 28;
+
+    regs[REG_CPSR] = cpsr;
+    lazyFlags.nz = lazyFlags.c = lazyFlags.v = FLAGS_FROM_CPSR;
+}
+
+static void discardFlags()
+{
+    // CPSR was just overwritten; forget any pending flags.
+    lazyFlags.nz = lazyFlags.c = lazyFlags.v = FLAGS_FROM_CPSR;
+}
+
+static inline void setCarry(bool f) {
+    lazyFlags.carry = f;
+    lazyFlags.c = FLAGS_FROM_VALUE;
+}
+
+static inline void setNZ64(int64_t result) {
+    lazyFlags.result = result;
+    lazyFlags.nz = FLAGS_FROM_RESULT;
 }
 
 static inline void setNZ(int32_t result) {
-    setNeg(result < 0);
-    setZero(result == 0);
+    setNZ64(result);
 }
 
 static inline reg_t opLSL(reg_t a, reg_t b) {
@@ -143,11 +210,12 @@ static inline reg_t opASR(reg_t a, reg_t b) {
 
 static inline reg_t opADD(reg_t a, reg_t b, reg_t carry) {
     // Based on AddWithCarry() in the ARMv7 ARM, page A2-8
-    uint64_t uSum32 = (uint64_t)(uint32_t)a + (uint32_t)b + (uint32_t)carry;
-    int64_t sSum32 = (int64_t)(int32_t)a + (int32_t)b + (uint32_t)carry;
-    setNZ(sSum32);
-    setOverflow((int32_t)sSum32 != sSum32);
-    setCarry((uint32_t)uSum32 != uSum32);
+    // Flags are only computed on demand, by getCarry() and getOverflow().
+    lazyFlags.addA = a;
+    lazyFlags.addB = b;
+    lazyFlags.addCarry = carry;
+    lazyFlags.c = lazyFlags.v = FLAGS_FROM_ADD;
+    setNZ(a + b + carry);
 
     // Preserve full reg_t width in result, even though we use 32-bit value for flags
     return a + b + carry;
@@ -189,6 +257,8 @@ static void emulateEnterException(reg_t returnAddr)
     ctx->r12        = regs[12];
     ctx->lr         = regs[REG_LR];
     ctx->returnAddr = returnAddr;
+
+    flushFlags();
     ctx->xpsr       = regs[REG_CPSR];   // XXX; must also or in frameptralign
 
     ASSERT((ctx->returnAddr & 1) == 0 && "ReturnAddress from exception must be halfword aligned");
@@ -196,6 +266,7 @@ static void emulateEnterException(reg_t returnAddr)
     regs[REG_LR] = 0xfffffffd;  // indicate that we're coming from User mode, using User stack
 
     userRegs.sp = regs[REG_SP];
+    inException = true;
 }
 
 /*
@@ -203,6 +274,7 @@ static void emulateEnterException(reg_t returnAddr)
  */
 static void emulateExitException()
 {
+    inException = false;
     regs[REG_SP] = userRegs.sp;
 
     HwContext *ctx = reinterpret_cast<HwContext*>(regs[REG_SP]);
@@ -213,6 +285,7 @@ static void emulateExitException()
     regs[12]        = ctx->r12;
     regs[REG_LR]    = ctx->lr;
     regs[REG_CPSR]  = ctx->xpsr;
+    discardFlags();
 
     regs[REG_SP] += sizeof(HwContext);
 
@@ -249,7 +322,7 @@ static void restoreUserRegs()
     regs[11] = userRegs.irq.r11;
 }
 
-static void emulateSVC(uint16_t instr)
+static void emulateSVC(uint32_t instr)
 {
     reg_t nextInstruction = regs[REG_PC];    // already incremented in fetch()
     emulateEnterException(nextInstruction);
@@ -294,7 +367,7 @@ static void emulateFault(FaultCode code)
  ***************************************************************************/
 
 // left shift
-static void emulateLSLImm(uint16_t inst)
+static void emulateLSLImm(uint32_t inst)
 {
     unsigned imm5 = (inst >> 6) & 0x1f;
     unsigned Rm = (inst >> 3) & 0x7;
@@ -303,7 +376,7 @@ static void emulateLSLImm(uint16_t inst)
     regs[Rd] = opLSL(regs[Rm], imm5);
 }
 
-static void emulateLSRImm(uint16_t inst)
+static void emulateLSRImm(uint32_t inst)
 {
     unsigned imm5 = (inst >> 6) & 0x1f;
     unsigned Rm = (inst >> 3) & 0x7;
@@ -315,7 +388,7 @@ static void emulateLSRImm(uint16_t inst)
     regs[Rd] = opLSR(regs[Rm], imm5);
 }
 
-static void emulateASRImm(uint16_t instr)
+static void emulateASRImm(uint32_t instr)
 {
     unsigned imm5 = (instr >> 6) & 0x1f;
     unsigned Rm = (instr >> 3) & 0x7;
@@ -327,7 +400,7 @@ static void emulateASRImm(uint16_t instr)
     regs[Rd] = opASR(regs[Rm], imm5);
 }
 
-static void emulateADDReg(uint16_t instr)
+static void emulateADDReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 6) & 0x7;
     unsigned Rn = (instr >> 3) & 0x7;
@@ -336,7 +409,7 @@ static void emulateADDReg(uint16_t instr)
     regs[Rd] = opADD(regs[Rn], regs[Rm], 0);
 }
 
-static void emulateSUBReg(uint16_t instr)
+static void emulateSUBReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 6) & 0x7;
     unsigned Rn = (instr >> 3) & 0x7;
@@ -345,7 +418,7 @@ static void emulateSUBReg(uint16_t instr)
     regs[Rd] = opADD(regs[Rn], ~regs[Rm], 1);
 }
 
-static void emulateADD3Imm(uint16_t instr)
+static void emulateADD3Imm(uint32_t instr)
 {
     reg_t imm3 = (instr >> 6) & 0x7;
     unsigned Rn = (instr >> 3) & 0x7;
@@ -354,7 +427,7 @@ static void emulateADD3Imm(uint16_t instr)
     regs[Rd] = opADD(regs[Rn], imm3, 0);
 }
 
-static void emulateSUB3Imm(uint16_t instr)
+static void emulateSUB3Imm(uint32_t instr)
 {
     reg_t imm3 = (instr >> 6) & 0x7;
     unsigned Rn = (instr >> 3) & 0x7;
@@ -363,7 +436,7 @@ static void emulateSUB3Imm(uint16_t instr)
     regs[Rd] = opADD(regs[Rn], ~imm3, 1);
 }
 
-static void emulateMovImm(uint16_t instr)
+static void emulateMovImm(uint32_t instr)
 {
     unsigned Rd = (instr >> 8) & 0x7;
     unsigned imm8 = instr & 0xff;
@@ -371,7 +444,7 @@ static void emulateMovImm(uint16_t instr)
     regs[Rd] = imm8;
 }
 
-static void emulateCmpImm(uint16_t instr)
+static void emulateCmpImm(uint32_t instr)
 {
     unsigned Rn = (instr >> 8) & 0x7;
     reg_t imm8 = instr & 0xff;
@@ -379,7 +452,7 @@ static void emulateCmpImm(uint16_t instr)
     reg_t result = opADD(regs[Rn], ~imm8, 1);
 }
 
-static void emulateADD8Imm(uint16_t instr)
+static void emulateADD8Imm(uint32_t instr)
 {
     unsigned Rdn = (instr >> 8) & 0x7;
     reg_t imm8 = instr & 0xff;
@@ -387,7 +460,7 @@ static void emulateADD8Imm(uint16_t instr)
     regs[Rdn] = opADD(regs[Rdn], imm8, 0);
 }
 
-static void emulateSUB8Imm(uint16_t instr)
+static void emulateSUB8Imm(uint32_t instr)
 {
     unsigned Rdn = (instr >> 8) & 0x7;
     reg_t imm8 = instr & 0xff;
@@ -399,7 +472,7 @@ static void emulateSUB8Imm(uint16_t instr)
 // D A T A   P R O C E S S I N G
 ///////////////////////////////////
 
-static void emulateANDReg(uint16_t instr)
+static void emulateANDReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -407,7 +480,7 @@ static void emulateANDReg(uint16_t instr)
     regs[Rdn] = opAND(regs[Rdn], regs[Rm]);
 }
 
-static void emulateEORReg(uint16_t instr)
+static void emulateEORReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -415,7 +488,7 @@ static void emulateEORReg(uint16_t instr)
     regs[Rdn] = opEOR(regs[Rdn], regs[Rm]);
 }
 
-static void emulateLSLReg(uint16_t instr)
+static void emulateLSLReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -424,7 +497,7 @@ static void emulateLSLReg(uint16_t instr)
     regs[Rdn] = opLSL(regs[Rdn], shift);
 }
 
-static void emulateLSRReg(uint16_t instr)
+static void emulateLSRReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -433,7 +506,7 @@ static void emulateLSRReg(uint16_t instr)
     regs[Rdn] = opLSR(regs[Rdn], shift);
 }
 
-static void emulateASRReg(uint16_t instr)
+static void emulateASRReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -442,7 +515,7 @@ static void emulateASRReg(uint16_t instr)
     regs[Rdn] = opASR(regs[Rdn], shift);
 }
 
-static void emulateADCReg(uint16_t instr)
+static void emulateADCReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -450,7 +523,7 @@ static void emulateADCReg(uint16_t instr)
     regs[Rdn] = opADD(regs[Rdn], regs[Rm], getCarry());
 }
 
-static void emulateSBCReg(uint16_t instr)
+static void emulateSBCReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -458,7 +531,7 @@ static void emulateSBCReg(uint16_t instr)
     regs[Rdn] = opADD(regs[Rdn], ~regs[Rm], getCarry());
 }
 
-static void emulateRORReg(uint16_t instr)
+static void emulateRORReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -466,7 +539,7 @@ static void emulateRORReg(uint16_t instr)
     regs[Rdn] = Intrinsic::ROR(regs[Rdn], regs[Rm]);
 }
 
-static void emulateTSTReg(uint16_t instr)
+static void emulateTSTReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -474,7 +547,7 @@ static void emulateTSTReg(uint16_t instr)
     opAND(regs[Rdn], regs[Rm]);
 }
 
-static void emulateRSBImm(uint16_t instr)
+static void emulateRSBImm(uint32_t instr)
 {
     unsigned Rn = (instr >> 3) & 0x7;
     unsigned Rd = instr & 0x7;
@@ -482,7 +555,7 @@ static void emulateRSBImm(uint16_t instr)
     regs[Rd] = opADD(~regs[Rn], 0, 1);
 }
 
-static void emulateCMPReg(uint16_t instr)
+static void emulateCMPReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -490,7 +563,7 @@ static void emulateCMPReg(uint16_t instr)
     opADD(regs[Rdn], ~regs[Rm], 1);
 }
 
-static void emulateCMNReg(uint16_t instr)
+static void emulateCMNReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -498,7 +571,7 @@ static void emulateCMNReg(uint16_t instr)
     opADD(regs[Rdn], regs[Rm], 0);
 }
 
-static void emulateORRReg(uint16_t instr)
+static void emulateORRReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -508,7 +581,7 @@ static void emulateORRReg(uint16_t instr)
     setNZ(result);
 }
 
-static void emulateMUL(uint16_t instr)
+static void emulateMUL(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -517,11 +590,10 @@ static void emulateMUL(uint16_t instr)
     regs[Rdn] = (uint32_t) result;
 
     // Flag calculations always use the full 64-bit result
-    setNeg((int64_t)result < 0);
-    setZero(result == 0);
+    setNZ64(result);
 }
 
-static void emulateBICReg(uint16_t instr)
+static void emulateBICReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -529,7 +601,7 @@ static void emulateBICReg(uint16_t instr)
     regs[Rdn] = (uint32_t) (regs[Rdn] & ~(regs[Rm]));
 }
 
-static void emulateMVNReg(uint16_t instr)
+static void emulateMVNReg(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -541,7 +613,7 @@ static void emulateMVNReg(uint16_t instr)
 // M I S C   I N S T R U C T I O N S
 /////////////////////////////////////
 
-static void emulateSXTH(uint16_t instr)
+static void emulateSXTH(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -549,7 +621,7 @@ static void emulateSXTH(uint16_t instr)
     regs[Rdn] = (uint32_t) signExtend(regs[Rm], 16);
 }
 
-static void emulateSXTB(uint16_t instr)
+static void emulateSXTB(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -557,7 +629,7 @@ static void emulateSXTB(uint16_t instr)
     regs[Rdn] = (uint32_t) signExtend(regs[Rm], 8);
 }
 
-static void emulateUXTH(uint16_t instr)
+static void emulateUXTH(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -565,7 +637,7 @@ static void emulateUXTH(uint16_t instr)
     regs[Rdn] = regs[Rm] & 0xFFFF;
 }
 
-static void emulateUXTB(uint16_t instr)
+static void emulateUXTB(uint32_t instr)
 {
     unsigned Rm = (instr >> 3) & 0x7;
     unsigned Rdn = instr & 0x7;
@@ -573,7 +645,7 @@ static void emulateUXTB(uint16_t instr)
     regs[Rdn] = regs[Rm] & 0xFF;
 }
 
-static void emulateMOV(uint16_t instr)
+static void emulateMOV(uint32_t instr)
 {
     // Thumb T5 encoding, does not affect flags.
     // This subset does not support high register access.
@@ -589,7 +661,7 @@ static void emulateMOV(uint16_t instr)
 // B R A N C H I N G   I N S T R U C T I O N S
 ///////////////////////////////////////////////
 
-static void emulateB(uint16_t instr)
+static void emulateB(uint32_t instr)
 {
     reg_t oldPC = regs[REG_PC];
     reg_t newPC = branchTargetB(instr, oldPC);
@@ -602,9 +674,10 @@ static void emulateB(uint16_t instr)
 }
 
 
-static void emulateCondB(uint16_t instr)
+static void emulateCondB(uint32_t instr)
 {
     reg_t oldPC = regs[REG_PC];
+    flushFlags();
     reg_t newPC = branchTargetCondB(instr, oldPC, regs[REG_CPSR]);
 
     if (newPC != oldPC) {
@@ -614,7 +687,7 @@ static void emulateCondB(uint16_t instr)
     }
 }
 
-static void emulateCBZ_CBNZ(uint16_t instr)
+static void emulateCBZ_CBNZ(uint32_t instr)
 {
     unsigned Rn = instr & 0x7;
     reg_t oldPC = regs[REG_PC];
@@ -632,7 +705,7 @@ static void emulateCBZ_CBNZ(uint16_t instr)
 // M E M O R Y  I N S T R U C T I O N S
 /////////////////////////////////////////
 
-static void emulateSTRSPImm(uint16_t instr)
+static void emulateSTRSPImm(uint32_t instr)
 {
     // encoding T2 only
     unsigned Rt = (instr >> 8) & 0x7;
@@ -649,7 +722,7 @@ static void emulateSTRSPImm(uint16_t instr)
     svmCyclesElapsed += MCTiming::CPU_LOAD_STORE;
 }
 
-static void emulateLDRSPImm(uint16_t instr)
+static void emulateLDRSPImm(uint32_t instr)
 {
     // encoding T2 only
     unsigned Rt = (instr >> 8) & 0x7;
@@ -666,7 +739,7 @@ static void emulateLDRSPImm(uint16_t instr)
     svmCyclesElapsed += MCTiming::CPU_LOAD_STORE;
 }
 
-static void emulateADDSpImm(uint16_t instr)
+static void emulateADDSpImm(uint32_t instr)
 {
     // encoding T1 only
     unsigned Rd = (instr >> 8) & 0x7;
@@ -698,7 +771,7 @@ static void emulateADDSpImm(uint16_t instr)
     regs[Rd] = SvmMemory::squashPhysicalAddr(regs[REG_SP]) + (imm8 << 2);
 }
 
-static void emulateLDRLitPool(uint16_t instr)
+static void emulateLDRLitPool(uint32_t instr)
 {
     unsigned Rt = (instr >> 8) & 0x7;
     unsigned imm8 = instr & 0xFF;
@@ -941,7 +1014,26 @@ static uint16_t fetch()
     return *pc;
 }
 
-static void execute16(uint16_t instr)
+static void emulateNop(uint32_t instr)
+{
+    // nothing to do
+}
+
+static void emulateInvalid16(uint32_t instr)
+{
+    // should never get here since we should only be executing validated instructions
+    LOG(("SVMCPU: invalid 16bit instruction: 0x%x\n", instr));
+    return emulateFault(F_CPU_SIM);
+}
+
+static void emulateInvalid32(uint32_t instr)
+{
+    // should never get here since we should only be executing validated instructions
+    LOG(("SVMCPU: invalid 32bit instruction: 0x%x\n", instr));
+    return emulateFault(F_CPU_SIM);
+}
+
+static InstrHandler decode16(uint16_t instr)
 {
     if ((instr & AluMask) == AluTest) {
         // lsl, lsr, asr, add, sub, mov, cmp
@@ -949,158 +1041,326 @@ static void execute16(uint16_t instr)
         uint8_t prefix = (instr >> 11) & 0x7;
         switch (prefix) {
         case 0: // 0b000 - LSL
-            emulateLSLImm(instr);
-            return;
+            return emulateLSLImm;
         case 1: // 0b001 - LSR
-            emulateLSRImm(instr);
-            return;
+            return emulateLSRImm;
         case 2: // 0b010 - ASR
-            emulateASRImm(instr);
-            return;
+            return emulateASRImm;
         case 3: { // 0b011 - ADD/SUB reg/imm
             uint8_t subop = (instr >> 9) & 0x3;
             switch (subop) {
             case 0:
-                emulateADDReg(instr);
-                return;
+                return emulateADDReg;
             case 1:
-                emulateSUBReg(instr);
-                return;
+                return emulateSUBReg;
             case 2:
-                emulateADD3Imm(instr);
-                return;
+                return emulateADD3Imm;
             case 3:
-                emulateADD8Imm(instr);
-                return;
+                return emulateADD8Imm;
             }
         }
         case 4: // 0b100 - MOV
-            emulateMovImm(instr);
-            return;
+            return emulateMovImm;
         case 5: // 0b101
-            emulateCmpImm(instr);
-            return;
+            return emulateCmpImm;
         case 6: // 0b110 - ADD 8bit
-            emulateADD8Imm(instr);
-            return;
+            return emulateADD8Imm;
         case 7: // 0b111 - SUB 8bit
-            emulateSUB8Imm(instr);
-            return;
+            return emulateSUB8Imm;
         }
         ASSERT(0 && "unhandled ALU instruction!");
     }
     if ((instr & DataProcMask) == DataProcTest) {
         uint8_t opcode = (instr >> 6) & 0xf;
         switch (opcode) {
-        case 0:  emulateANDReg(instr); return;
-        case 1:  emulateEORReg(instr); return;
-        case 2:  emulateLSLReg(instr); return;
-        case 3:  emulateLSRReg(instr); return;
-        case 4:  emulateASRReg(instr); return;
-        case 5:  emulateADCReg(instr); return;
-        case 6:  emulateSBCReg(instr); return;
-        case 7:  emulateRORReg(instr); return;
-        case 8:  emulateTSTReg(instr); return;
-        case 9:  emulateRSBImm(instr); return;
-        case 10: emulateCMPReg(instr); return;
-        case 11: emulateCMNReg(instr); return;
-        case 12: emulateORRReg(instr); return;
-        case 13: emulateMUL(instr);    return;
-        case 14: emulateBICReg(instr); return;
-        case 15: emulateMVNReg(instr); return;
+        case 0:  return emulateANDReg;
+        case 1:  return emulateEORReg;
+        case 2:  return emulateLSLReg;
+        case 3:  return emulateLSRReg;
+        case 4:  return emulateASRReg;
+        case 5:  return emulateADCReg;
+        case 6:  return emulateSBCReg;
+        case 7:  return emulateRORReg;
+        case 8:  return emulateTSTReg;
+        case 9:  return emulateRSBImm;
+        case 10: return emulateCMPReg;
+        case 11: return emulateCMNReg;
+        case 12: return emulateORRReg;
+        case 13: return emulateMUL;
+        case 14: return emulateBICReg;
+        case 15: return emulateMVNReg;
         }
     }
     if ((instr & MiscMask) == MiscTest) {
         uint8_t opcode = (instr >> 5) & 0x7f;
         if ((opcode & 0x78) == 0x2) {   // bits [6:3] of opcode identify this group
             switch (opcode & 0x6) {     // bits [2:1] of the opcode identify the instr
-            case 0: emulateSXTH(instr); return;
-            case 1: emulateSXTB(instr); return;
-            case 2: emulateUXTH(instr); return;
-            case 3: emulateUXTB(instr); return;
+            case 0: return emulateSXTH;
+            case 1: return emulateSXTB;
+            case 2: return emulateUXTH;
+            case 3: return emulateUXTB;
             }
         }
     }
     if ((instr & MovMask) == MovTest) {
-        emulateMOV(instr);
-        return;
+        return emulateMOV;
     }    
     if ((instr & SvcMask) == SvcTest) {
-        emulateSVC(instr);
-        return;
+        return emulateSVC;
     }
     if ((instr & PcRelLdrMask) == PcRelLdrTest) {
-        emulateLDRLitPool(instr);
-        return;
+        return emulateLDRLitPool;
     }
     if ((instr & SpRelLdrStrMask) == SpRelLdrStrTest) {
         uint16_t isLoad = instr & (1 << 11);
         if (isLoad)
-            emulateLDRSPImm(instr);
+            return emulateLDRSPImm;
         else
-            emulateSTRSPImm(instr);
-        return;
+            return emulateSTRSPImm;
     }
     if ((instr & SpRelAddMask) == SpRelAddTest) {
-        emulateADDSpImm(instr);
-        return;
+        return emulateADDSpImm;
     }
     if ((instr & UncondBranchMask) == UncondBranchTest) {
-        emulateB(instr);
-        return;
+        return emulateB;
     }
     if ((instr & CompareBranchMask) == CompareBranchTest) {
-        emulateCBZ_CBNZ(instr);
-        return;
+        return emulateCBZ_CBNZ;
     }
     if ((instr & CondBranchMask) == CondBranchTest) {
-        emulateCondB(instr);
-        return;
+        return emulateCondB;
     }
     if (instr == Nop) {
-        // nothing to do
-        return;
+        return emulateNop;
     }
 
-    // should never get here since we should only be executing validated instructions
-    LOG(("SVMCPU: invalid 16bit instruction: 0x%x\n", instr));
-    return emulateFault(F_CPU_SIM);
+    return emulateInvalid16;
 }
 
-static void execute32(uint32_t instr)
+static InstrHandler decode32(uint32_t instr)
 {
     if ((instr & StrMask) == StrTest) {
-        emulateSTR(instr);
-        return;
+        return emulateSTR;
     }
     if ((instr & StrBhMask) == StrBhTest) {
-        emulateSTRBH(instr);
-        return;
+        return emulateSTRBH;
     }
     if ((instr & LdrBhMask) == LdrBhTest) {
-        emulateLDRBH(instr);
-        return;
+        return emulateLDRBH;
     }
     if ((instr & LdrMask) == LdrTest) {
-        emulateLDR(instr);
-        return;
+        return emulateLDR;
     }
     if ((instr & MovWtMask) == MovWtTest) {
-        emulateMOVWT(instr);
-        return;
+        return emulateMOVWT;
     }
     if ((instr & DivMask) == DivTest) {
-        emulateDIV(instr);
-        return;
+        return emulateDIV;
     }
     if ((instr & ClzMask) == ClzTest) {
-        emulateCLZ(instr);
-        return;
+        return emulateCLZ;
     }
 
-    // should never get here since we should only be executing validated instructions
-    LOG(("SVMCPU: invalid 32bit instruction: 0x%x\n", instr));
-    return emulateFault(F_CPU_SIM);
+    return emulateInvalid32;
+}
+
+static void execute16(uint16_t instr)
+{
+    decode16(instr)(instr);
+}
+
+static void execute32(uint32_t instr)
+{
+    decode32(instr)(instr);
+}
+
+
+/***************************************************************************
+ * Decoded Block Cache
+ ***************************************************************************/
+
+/*
+ * Running every instruction through fetch() and the decode16/decode32
+ * mask tests is the bulk of our interpreter overhead. Code always runs
+ * out of the FlashBlock cache, so we keep a parallel array of decoded
+ * instructions for each cache slot, with one entry per halfword.
+ *
+ * A slot's decoded instructions are discarded by FlashBlock at the same
+ * points where it resets its lazy code validator: whenever the slot is
+ * loaded with a different flash block, reloaded, or written. We decode
+ * lazily, the first time we execute from a slot after that.
+ *
+ * Instructions at the current PC are only run from this cache if they
+ * are in cache memory and we're not tracing. Everything else falls back
+ * on fetch() and execute16/32(), which also handle fetch faults.
+ *
+ * With --svm-jit, decoded blocks are further translated to host code by
+ * SvmJit. The translation is discarded along with the decoded block.
+ */
+
+struct DecodedBlock {
+    uint32_t generation;        // Incremented on every invalidation
+    bool valid;
+    DecodedInstr instrs[FlashBlock::BLOCK_SIZE / sizeof(uint16_t)];
+};
+
+static DecodedBlock decodedBlocks[FlashBlock::NUM_CACHE_BLOCKS];
+
+void invalidateDecodedBlock(unsigned cacheBlockID)
+{
+    ASSERT(cacheBlockID < arraysize(decodedBlocks));
+    DecodedBlock &block = decodedBlocks[cacheBlockID];
+    block.valid = false;
+    block.generation++;
+    SvmJit::invalidate(cacheBlockID);
+}
+
+static uint8_t jitOp(InstrHandler handler, uint32_t instr)
+{
+    /*
+     * Tell the JIT how to translate this instruction. Only handlers
+     * listed here are known never to branch, fault, or call into
+     * SvmRuntime; anything else gets control flow checks after it.
+     */
+
+    if (handler == emulateNop)
+        return SvmJit::OP_NOP;
+    if (handler == emulateMOV)
+        return SvmJit::OP_MOV;
+
+    if (handler == emulateMOVWT || handler == emulateDIV) {
+        unsigned Rd = (instr >> 8) & 0xF;
+        if (Rd >= REG_SP)
+            return SvmJit::OP_CALL_EXIT;
+        return handler == emulateMOVWT ? SvmJit::OP_MOVWT : SvmJit::OP_CALL;
+    }
+
+    static const InstrHandler straightLine[] = {
+        emulateLSLImm, emulateLSRImm, emulateASRImm, emulateADDReg,
+        emulateSUBReg, emulateADD3Imm, emulateSUB3Imm, emulateMovImm,
+        emulateCmpImm, emulateADD8Imm, emulateSUB8Imm, emulateANDReg,
+        emulateEORReg, emulateLSLReg, emulateLSRReg, emulateASRReg,
+        emulateADCReg, emulateSBCReg, emulateRORReg, emulateTSTReg,
+        emulateRSBImm, emulateCMPReg, emulateCMNReg, emulateORRReg,
+        emulateMUL, emulateBICReg, emulateMVNReg, emulateSXTH,
+        emulateSXTB, emulateUXTH, emulateUXTB, emulateADDSpImm,
+    };
+
+    for (unsigned i = 0; i < arraysize(straightLine); ++i)
+        if (handler == straightLine[i])
+            return SvmJit::OP_CALL;
+
+    return SvmJit::OP_CALL_EXIT;
+}
+
+static void decodeBlock(DecodedBlock &block, const uint16_t *code)
+{
+    const unsigned count = arraysize(block.instrs);
+
+    for (unsigned i = 0; i < count; ++i) {
+        DecodedInstr &d = block.instrs[i];
+        uint16_t instr = code[i];
+
+        if (instructionSize(instr) == InstrBits16) {
+            d.handler = decode16(instr);
+            d.instr = instr;
+            d.size = sizeof(uint16_t);
+            d.cycles = MCTiming::CPU_FETCH;
+        } else if (i + 1 < count) {
+            d.instr = instr << 16 | code[i + 1];
+            d.handler = decode32(d.instr);
+            d.size = sizeof(uint32_t);
+            d.cycles = MCTiming::CPU_FETCH * 2;
+        } else {
+            // Split across blocks; never valid, leave it to fetch()
+            d.handler = 0;
+            continue;
+        }
+
+        d.op = jitOp(d.handler, d.instr);
+    }
+
+    block.valid = true;
+}
+
+static bool runTranslatedBlock(unsigned cacheBlockID, DecodedBlock &block,
+    uintptr_t code, unsigned blockOffset)
+{
+    /*
+     * Run host code for this block, translating it first if necessary.
+     * We only translate bundles SvmValidator has already accepted, and
+     * a block isn't translated until something has branched into it.
+     */
+
+    if (!SvmJit::isTranslated(cacheBlockID)) {
+        unsigned validBytes = FlashBlock::getValidCodeBytes(cacheBlockID);
+        if (!validBytes)
+            return false;
+        SvmJit::translate(cacheBlockID, code, block.instrs, validBytes, &block.generation);
+    }
+
+    return SvmJit::run(cacheBlockID, blockOffset);
+}
+
+static bool runDecodedBlock()
+{
+    /*
+     * Run straight-line code from the decoded block cache, starting
+     * at the current PC. We stop after any instruction that changes
+     * control flow, or if the block is invalidated underneath us (by
+     * an SVC, for example), or at the end of the block.
+     *
+     * Returns false without executing anything if the current PC must
+     * be handled by fetch() instead.
+     */
+
+    uintptr_t offset = FlashBlock::getCacheOffset(regs[REG_PC]);
+    if (offset >= FlashBlock::CACHE_MEM_SIZE || (offset & 1))
+        return false;
+    if (SystemMC::getSystem()->opt_svmTrace)
+        return false;
+
+    unsigned blockOffset = offset & FlashBlock::BLOCK_MASK;
+    unsigned cacheBlockID = offset >> FlashBlock::BLOCK_SIZE_LOG2;
+    uintptr_t code = regs[REG_PC] - blockOffset;
+    DecodedBlock &block = decodedBlocks[cacheBlockID];
+    if (!block.valid)
+        decodeBlock(block, reinterpret_cast<uint16_t*>(code));
+
+    const DecodedInstr *d = &block.instrs[blockOffset / sizeof(uint16_t)];
+    const DecodedInstr *end = &block.instrs[arraysize(block.instrs)];
+    const uint32_t generation = block.generation;
+
+    if (!d->handler)
+        return false;
+
+    // Same double-check as fetch(), but once per entry into the block
+    DEBUG_ONLY({
+        SvmMemory::VirtAddr bundleVA = SvmRuntime::reconstructCodeAddr(regs[REG_PC]);
+        SvmMemory::PhysAddr pa;
+        FlashBlockRef ref;
+        bundleVA &= ~(Svm::BUNDLE_SIZE - 1);
+        ASSERT(SvmMemory::mapROCode(ref, bundleVA, pa));
+    });
+
+    if (SystemMC::getSystem()->opt_svmJit &&
+        runTranslatedBlock(cacheBlockID, block, code, blockOffset))
+        return true;
+
+    do {
+        reg_t nextPC = regs[REG_PC] + d->size;
+        regs[REG_PC] = nextPC;
+        svmCyclesElapsed += d->cycles;
+
+        d->handler(d->instr);
+
+        if (regs[REG_PC] != nextPC || block.generation != generation)
+            break;
+
+        d += d->size / sizeof(uint16_t);
+    } while (d < end && d->handler);
+
+    return true;
 }
 
 
@@ -1113,7 +1373,16 @@ void run(reg_t sp, reg_t pc)
     regs[REG_SP] = sp;
     regs[REG_PC] = pc;
 
+    System *sys = SystemMC::getSystem();
+    if (sys->opt_svmJit && !SvmJit::init(regs, &svmCyclesElapsed)) {
+        LOG(("SVM: JIT not available on this host, using the interpreter\n"));
+        sys->opt_svmJit = false;
+    }
+
     for (;;) {
+        if (runDecodedBlock())
+            continue;
+
         uint16_t instr = fetch();
         if (instructionSize(instr) == InstrBits16) {
             execute16(instr);
@@ -34,6 +34,8 @@
 #include "mc_elfdebuginfo.h"
 #include "mc_gdbserver.h"
 #include "mc_logdecoder.h"
+#include "mc_svmprofiler.h"
+#include "mc_flash_missreport.h"
 #include "lua_runtime.h"
 #include "tinythread.h"
 #include "tasks.h"
@@ -153,6 +155,11 @@ std::string SvmDebugPipe::formatAddress(void *address)
     return gELFDebugInfo.formatAddress(SvmMemory::physToVirtRAM((uint8_t*)address));
 }
 
+std::string SvmDebugPipe::formatFunction(uint32_t address)
+{
+    return gELFDebugInfo.formatFunction(address);
+}
+
 bool SvmDebugPipe::debuggerMsgAccept(SvmDebugPipe::DebuggerMsg &msg)
 {
     /*
@@ -238,6 +245,10 @@ static uint32_t debuggerMsgCallback(const uint32_t *cmd,
 
 void SvmDebugPipe::setSymbolSource(const Elf::Program &program)
 {
+    // Samples taken so far belong to the old program's symbols
+    SvmProfiler::flush();
+    FlashMissReport::flush();
+
     gELFDebugInfo.init(program);
     GDBServer::setDebugInfo(&gELFDebugInfo);
     GDBServer::setMessageCallback(debuggerMsgCallback);
@@ -0,0 +1,368 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "mc_svmjit.h"
+#include "flash_blockcache.h"
+#include "macros.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#   define SVMJIT_X86_64
+#   include <sys/mman.h>
+#endif
+
+#include <string.h>
+
+namespace SvmJit {
+
+#ifdef SVMJIT_X86_64
+
+using SvmCpu::DecodedInstr;
+
+static const unsigned HALFWORDS_PER_BLOCK = FlashBlock::BLOCK_SIZE / sizeof(uint16_t);
+
+// Fixed code area per cache slot. Worst case is about 9 kB.
+static const unsigned SLOT_CODE_SIZE = 16 * 1024;
+static const unsigned CODE_BUFFER_SIZE = SLOT_CODE_SIZE * FlashBlock::NUM_CACHE_BLOCKS;
+
+static uint8_t *codeBuffer;
+static Svm::reg_t *cpuRegs;
+static unsigned *cpuCycles;
+
+static bool translated[FlashBlock::NUM_CACHE_BLOCKS];
+
+// Entry point for each halfword, as an offset into the slot's code. Zero if none.
+static uint16_t entries[FlashBlock::NUM_CACHE_BLOCKS][HALFWORDS_PER_BLOCK];
+
+// Translated blocks are entered via their prologue, which jumps to 'entry'.
+typedef void (*BlockFn)(const uint8_t *entry);
+
+
+/*
+ * Just enough of an x86-64 assembler for our translated code. We use the
+ * System V calling convention, and keep state in callee-saved registers
+ * so it survives calls to instruction handlers:
+ *
+ *   r12 = &svmCyclesElapsed
+ *   r13 = &generation for this slot
+ *   r14 = regs[]
+ */
+class Emitter {
+public:
+    Emitter(uint8_t *base, unsigned size)
+        : base(base), ptr(base), limit(base + size) {}
+
+    uint8_t *here() const {
+        return ptr;
+    }
+
+    unsigned offset() const {
+        return ptr - base;
+    }
+
+    void prologue(const uint32_t *generation) {
+        u8(0x41); u8(0x54);                     // push r12
+        u8(0x41); u8(0x55);                     // push r13
+        u8(0x41); u8(0x56);                     // push r14
+        u8(0x49); u8(0xBC); u64(uintptr_t(cpuCycles));      // mov r12, imm64
+        u8(0x49); u8(0xBD); u64(uintptr_t(generation));     // mov r13, imm64
+        u8(0x49); u8(0xBE); u64(uintptr_t(cpuRegs));        // mov r14, imm64
+        u8(0xFF); u8(0xE7);                     // jmp rdi
+    }
+
+    void epilogue() {
+        u8(0x41); u8(0x5E);                     // pop r14
+        u8(0x41); u8(0x5D);                     // pop r13
+        u8(0x41); u8(0x5C);                     // pop r12
+        u8(0xC3);                               // ret
+    }
+
+    void addReg(unsigned r, uint8_t imm) {
+        u8(0x49); u8(0x83); u8(0x46); u8(disp(r)); u8(imm);  // add qword [r14+d], imm8
+    }
+
+    void addCycles(uint8_t imm) {
+        u8(0x41); u8(0x83); u8(0x04); u8(0x24); u8(imm);     // add dword [r12], imm8
+    }
+
+    void call(SvmCpu::InstrHandler handler, uint32_t instr) {
+        u8(0xBF); u32(instr);                   // mov edi, imm32
+        u8(0x48); u8(0xB8); u64(uintptr_t(handler));        // mov rax, imm64
+        u8(0xFF); u8(0xD0);                     // call rax
+    }
+
+    void exitIfPCNot(Svm::reg_t pc, uint8_t *target) {
+        u8(0x48); u8(0xB8); u64(pc);            // mov rax, imm64
+        u8(0x49); u8(0x39); u8(0x46); u8(disp(Svm::REG_PC));  // cmp [r14+d], rax
+        jne(target);
+    }
+
+    void exitIfGenerationNot(uint32_t generation, uint8_t *target) {
+        u8(0x41); u8(0x81); u8(0x7D); u8(0x00); u32(generation);  // cmp dword [r13], imm32
+        jne(target);
+    }
+
+    void movReg(unsigned rd, unsigned rs) {
+        u8(0x49); u8(0x8B); u8(0x46); u8(disp(rs));  // mov rax, [r14+d]
+        u8(0x49); u8(0x89); u8(0x46); u8(disp(rd));  // mov [r14+d], rax
+    }
+
+    void movRegImm(unsigned rd, uint32_t imm) {
+        ASSERT(imm < 0x80000000);
+        u8(0x49); u8(0xC7); u8(0x46); u8(disp(rd)); u32(imm);  // mov qword [r14+d], imm32
+    }
+
+    void movRegTop(unsigned rd, uint32_t imm16) {
+        u8(0x41); u8(0x8B); u8(0x46); u8(disp(rd));  // mov eax, [r14+d]
+        u8(0x25); u32(0xFFFF);                       // and eax, imm32
+        u8(0x0D); u32(imm16 << 16);                  // or eax, imm32
+        u8(0x49); u8(0x89); u8(0x46); u8(disp(rd));  // mov [r14+d], rax
+    }
+
+    void jmp(uint8_t *target) {
+        u8(0xE9);
+        rel32(target);
+    }
+
+    uint8_t *jmpForward() {
+        // Returns the rel32 field, to be patched by bind()
+        u8(0xE9);
+        uint8_t *field = ptr;
+        u32(0);
+        return field;
+    }
+
+    void bind(uint8_t *field) {
+        int32_t rel = ptr - (field + 4);
+        memcpy(field, &rel, sizeof rel);
+    }
+
+private:
+    uint8_t *base;
+    uint8_t *ptr;
+    uint8_t *limit;
+
+    static uint8_t disp(unsigned r) {
+        ASSERT(r < Svm::NUM_REGS);
+        return r * sizeof(Svm::reg_t);
+    }
+
+    void u8(uint8_t b) {
+        ASSERT(ptr < limit);
+        *(ptr++) = b;
+    }
+
+    void u32(uint32_t w) {
+        for (unsigned i = 0; i < 4; ++i)
+            u8(w >> (i * 8));
+    }
+
+    void u64(uint64_t w) {
+        u32(w);
+        u32(w >> 32);
+    }
+
+    void rel32(uint8_t *target) {
+        int32_t rel = target - (ptr + 4);
+        u32(rel);
+    }
+
+    void jne(uint8_t *target) {
+        u8(0x0F); u8(0x85);
+        rel32(target);
+    }
+};
+
+
+static void translateInstr(Emitter &e, const DecodedInstr &d, Svm::reg_t nextPC,
+    uint32_t generation, uint8_t *exit)
+{
+    // Same bookkeeping the interpreter does before every handler
+    e.addReg(Svm::REG_PC, d.size);
+    e.addCycles(d.cycles);
+
+    switch (d.op) {
+
+    case OP_NOP:
+        break;
+
+    case OP_MOV:
+        e.movReg(d.instr & 0x7, (d.instr >> 3) & 0x7);
+        break;
+
+    case OP_MOVWT: {
+        const unsigned TopBit = 1 << 23;
+        unsigned Rd = (d.instr >> 8) & 0xF;
+        unsigned imm16 =
+            (d.instr & 0x000000FF) |
+            (d.instr & 0x00007000) >> 4 |
+            (d.instr & 0x04000000) >> 15 |
+            (d.instr & 0x000F0000) >> 4;
+
+        if (TopBit & d.instr)
+            e.movRegTop(Rd, imm16);
+        else
+            e.movRegImm(Rd, imm16);
+        break;
+    }
+
+    case OP_CALL:
+        e.call(d.handler, d.instr);
+        break;
+
+    default:
+        // Leave if the handler branched, or if it reloaded this slot
+        e.call(d.handler, d.instr);
+        e.exitIfPCNot(nextPC, exit);
+        e.exitIfGenerationNot(generation, exit);
+        break;
+    }
+}
+
+bool init(Svm::reg_t *regs, unsigned *cycleCounter)
+{
+    cpuRegs = regs;
+    cpuCycles = cycleCounter;
+
+    if (!codeBuffer) {
+        void *mem = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (mem == MAP_FAILED)
+            return false;
+        codeBuffer = static_cast<uint8_t*>(mem);
+    }
+
+    return true;
+}
+
+void translate(unsigned cacheBlockID, uintptr_t code, const DecodedInstr *instrs,
+    unsigned validBytes, const uint32_t *generation)
+{
+    ASSERT(codeBuffer);
+    ASSERT(cacheBlockID < FlashBlock::NUM_CACHE_BLOCKS);
+
+    const unsigned count = MIN(validBytes / sizeof(uint16_t), HALFWORDS_PER_BLOCK);
+    uint16_t *entry = entries[cacheBlockID];
+    Emitter e(codeBuffer + cacheBlockID * SLOT_CODE_SIZE, SLOT_CODE_SIZE);
+
+    e.prologue(generation);
+    uint8_t *exit = e.here();
+    e.epilogue();
+
+    // Pending forward jump into each halfword, from the 32-bit instruction before it
+    uint8_t *fixups[HALFWORDS_PER_BLOCK + 1];
+    memset(fixups, 0, sizeof fixups);
+    memset(entry, 0, sizeof entries[0]);
+
+    /*
+     * One label per halfword, in order. 16-bit instructions fall through
+     * to the next label; 32-bit instructions jump over the halfword in
+     * between. Anything we can't run, including the end of the validated
+     * code, returns to the interpreter.
+     */
+    for (unsigned i = 0; i <= count; ++i) {
+        if (fixups[i])
+            e.bind(fixups[i]);
+
+        if (i == count || !instrs[i].handler) {
+            e.jmp(exit);
+            continue;
+        }
+
+        const DecodedInstr &d = instrs[i];
+        unsigned next = i + d.size / sizeof(uint16_t);
+
+        entry[i] = e.offset();
+        translateInstr(e, d, code + next * sizeof(uint16_t), *generation, exit);
+
+        if (next > count)
+            e.jmp(exit);
+        else if (next != i + 1)
+            fixups[next] = e.jmpForward();
+    }
+
+    translated[cacheBlockID] = true;
+}
+
+void invalidate(unsigned cacheBlockID)
+{
+    ASSERT(cacheBlockID < FlashBlock::NUM_CACHE_BLOCKS);
+    translated[cacheBlockID] = false;
+}
+
+bool isTranslated(unsigned cacheBlockID)
+{
+    ASSERT(cacheBlockID < FlashBlock::NUM_CACHE_BLOCKS);
+    return translated[cacheBlockID];
+}
+
+bool run(unsigned cacheBlockID, unsigned offset)
+{
+    ASSERT(cacheBlockID < FlashBlock::NUM_CACHE_BLOCKS);
+    ASSERT(offset < FlashBlock::BLOCK_SIZE);
+
+    if (!translated[cacheBlockID])
+        return false;
+
+    unsigned entry = entries[cacheBlockID][offset / sizeof(uint16_t)];
+    if (!entry)
+        return false;
+
+    uint8_t *slot = codeBuffer + cacheBlockID * SLOT_CODE_SIZE;
+    reinterpret_cast<BlockFn>(slot)(slot + entry);
+    return true;
+}
+
+#else  // !SVMJIT_X86_64
+
+bool init(Svm::reg_t *regs, unsigned *cycleCounter)
+{
+    return false;
+}
+
+void translate(unsigned cacheBlockID, uintptr_t code, const SvmCpu::DecodedInstr *instrs,
+    unsigned validBytes, const uint32_t *generation)
+{
+    ASSERT(0 && "No JIT on this host");
+}
+
+void invalidate(unsigned cacheBlockID)
+{
+    // Nothing to do
+}
+
+bool isTranslated(unsigned cacheBlockID)
+{
+    return false;
+}
+
+bool run(unsigned cacheBlockID, unsigned offset)
+{
+    return false;
+}
+
+#endif  // SVMJIT_X86_64
+
+}  // namespace SvmJit
@@ -0,0 +1,101 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef MC_SVMJIT_H
+#define MC_SVMJIT_H
+
+#include "svm.h"
+
+namespace SvmCpu {
+
+typedef void (*InstrHandler)(uint32_t instr);
+
+/*
+ * One pre-decoded instruction, as stored in the decoded block cache.
+ * The interpreter only looks at the handler, instr, size, and cycles.
+ * The JIT also uses 'op', which says how the instruction can be
+ * translated.
+ */
+struct DecodedInstr {
+    InstrHandler handler;       // NULL if this can't be run from the cache
+    uint32_t instr;
+    uint8_t size;               // In bytes, 2 or 4
+    uint8_t cycles;             // Fetch cycles, as fetch() counts them
+    uint8_t op;                 // SvmJit::Op
+};
+
+}  // namespace SvmCpu
+
+
+/*
+ * Translates decoded SVM code blocks into x86-64 host code.
+ *
+ * Translation is per FlashBlock cache slot, using that slot's decoded
+ * instructions, and only covers the leading run of bundles that
+ * SvmValidator has already accepted. Most instructions become a direct
+ * call to the interpreter's handler, so SVC, branch, and fault handling
+ * still happen in SvmCpu and SvmRuntime, and cycle counts match the
+ * interpreter exactly. The overhead we remove is the per-instruction
+ * dispatch loop; a few trivial instructions are emitted inline.
+ */
+
+namespace SvmJit {
+
+enum Op {
+    OP_CALL,        // Call the handler; can't change control flow
+    OP_CALL_EXIT,   // Call the handler; may branch, fault, or call SvmRuntime
+    OP_NOP,         // Inline: no effect
+    OP_MOV,         // Inline: MOV Rd, Rs (low registers, no flags)
+    OP_MOVWT,       // Inline: MOVW / MOVT, Rd in r0-r12
+};
+
+// Set up JIT state. Returns false if there's no JIT for this host.
+// 'regs' and 'cycleCounter' are SvmCpu's register file and cycle count.
+bool init(Svm::reg_t *regs, unsigned *cycleCounter);
+
+/*
+ * Translate one cache slot. 'code' is the slot's address in cache memory,
+ * 'instrs' has one entry per halfword, and only the first 'validBytes'
+ * bytes are translated. Translated code stops if '*generation' no longer
+ * matches its current value.
+ */
+void translate(unsigned cacheBlockID, uintptr_t code, const SvmCpu::DecodedInstr *instrs,
+    unsigned validBytes, const uint32_t *generation);
+
+// Forget a slot's translation.
+void invalidate(unsigned cacheBlockID);
+bool isTranslated(unsigned cacheBlockID);
+
+/*
+ * Run translated code for a slot, starting at the given byte offset.
+ * Returns false without running anything if that slot or offset has no
+ * translation.
+ */
+bool run(unsigned cacheBlockID, unsigned offset);
+
+}  // namespace SvmJit
+
+#endif // MC_SVMJIT_H
@@ -0,0 +1,185 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "mc_svmprofiler.h"
+#include "svm.h"
+#include "svmcpu.h"
+#include "svmmemory.h"
+#include "svmruntime.h"
+#include "svmdebugpipe.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using namespace Svm;
+
+uint64_t SvmProfiler::deadline = uint64_t(-1);
+unsigned SvmProfiler::syscall = SvmProfiler::NO_SYSCALL;
+SvmProfiler::Activity SvmProfiler::activity = SvmProfiler::A_NONE;
+
+/*
+ * Raw samples are keyed by their virtual addresses, outermost frame first,
+ * followed by the syscall number and Activity. Symbolizing is comparatively
+ * slow, so we only do it once per unique stack, in flush().
+ */
+typedef std::vector<uint32_t> RawStack;
+typedef std::map<RawStack, uint64_t> RawSamples;
+typedef std::map<std::string, uint64_t> CollapsedSamples;
+
+static std::string gFilename;
+static RawSamples gRawSamples;
+static CollapsedSamples gCollapsedSamples;
+static uint64_t gActivityCounts[SvmProfiler::NUM_ACTIVITIES];
+static uint64_t gSyscallCount;
+
+
+void SvmProfiler::init(const std::string &filename)
+{
+    gFilename = filename;
+    gRawSamples.clear();
+    gCollapsedSamples.clear();
+    memset(gActivityCounts, 0, sizeof gActivityCounts);
+    gSyscallCount = 0;
+
+    deadline = filename.empty() ? uint64_t(-1) : TICKS_PER_SAMPLE;
+}
+
+void SvmProfiler::sample(uint64_t ticks)
+{
+    /*
+     * Count every sample period that ended since the last call. Long
+     * operations like a flash erase elapse many periods at once, and
+     * they should be weighted accordingly.
+     */
+
+    uint64_t count = (ticks - deadline) / TICKS_PER_SAMPLE + 1;
+    deadline += count * TICKS_PER_SAMPLE;
+
+    RawStack stack;
+
+    // PC is zero if no SVM code is running yet
+    uint32_t pcVA = SvmRuntime::reconstructCodeAddr(SvmCpu::liveReg(REG_PC));
+    if (pcVA) {
+        stack.push_back(pcVA);
+
+        SvmMemory::VirtAddr fpVA = SvmCpu::liveReg(REG_FP);
+        SvmMemory::PhysAddr fpPA;
+        while (stack.size() < MAX_STACK_DEPTH &&
+               SvmMemory::mapRAM(fpVA, sizeof(CallFrame), fpPA)) {
+            CallFrame *frame = reinterpret_cast<CallFrame*>(fpPA);
+            stack.push_back(frame->pc);
+            fpVA = frame->fp;
+        }
+
+        std::reverse(stack.begin(), stack.end());
+    }
+
+    stack.push_back(syscall);
+    stack.push_back(activity);
+
+    gRawSamples[stack] += count;
+    gActivityCounts[activity] += count;
+    if (syscall != NO_SYSCALL)
+        gSyscallCount += count;
+}
+
+void SvmProfiler::flush()
+{
+    static const char *activityNames[] = {
+        NULL,
+        "[flash miss]",
+        "[flash write]",
+        "[flash erase]",
+        "[idle]",
+    };
+    STATIC_ASSERT(arraysize(activityNames) == NUM_ACTIVITIES);
+
+    for (RawSamples::iterator I = gRawSamples.begin(), E = gRawSamples.end(); I != E; ++I) {
+        const RawStack &stack = I->first;
+        unsigned numFrames = stack.size() - 2;
+        unsigned sampleSyscall = stack[numFrames];
+        unsigned sampleActivity = stack[numFrames + 1];
+        std::string line;
+
+        if (numFrames == 0)
+            line = "[firmware]";
+
+        for (unsigned i = 0; i < numFrames; ++i) {
+            if (i)
+                line += ';';
+            line += SvmDebugPipe::formatFunction(stack[i]);
+        }
+
+        if (sampleSyscall != NO_SYSCALL) {
+            line += ';';
+            line += SvmRuntime::syscallName(sampleSyscall);
+        }
+
+        if (activityNames[sampleActivity]) {
+            line += ';';
+            line += activityNames[sampleActivity];
+        }
+
+        gCollapsedSamples[line] += I->second;
+    }
+
+    gRawSamples.clear();
+}
+
+void SvmProfiler::exit()
+{
+    if (gFilename.empty())
+        return;
+
+    deadline = uint64_t(-1);
+    flush();
+
+    FILE *f = fopen(gFilename.c_str(), "w");
+    if (!f) {
+        LOG(("SVM: Error, couldn't write profile '%s' (%s)\n",
+            gFilename.c_str(), strerror(errno)));
+        return;
+    }
+
+    uint64_t total = 0;
+    for (CollapsedSamples::iterator I = gCollapsedSamples.begin(), E = gCollapsedSamples.end(); I != E; ++I) {
+        fprintf(f, "%s %llu\n", I->first.c_str(), (unsigned long long) I->second);
+        total += I->second;
+    }
+    fclose(f);
+
+    double percent = total ? 100.0 / total : 0.0;
+    LOG(("SVM: Profiled %llu samples, %.1f%% syscalls, %.1f%% flash, %.1f%% idle. Saved to '%s'\n",
+        (unsigned long long) total,
+        gSyscallCount * percent,
+        (gActivityCounts[A_FLASH_MISS] + gActivityCounts[A_FLASH_WRITE] +
+            gActivityCounts[A_FLASH_ERASE]) * percent,
+        gActivityCounts[A_IDLE] * percent,
+        gFilename.c_str()));
+}
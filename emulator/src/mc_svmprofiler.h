@@ -0,0 +1,102 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Sampling profiler for SVM code. At a fixed rate in simulated time, we
+ * record the SVM call stack along with whatever the system is doing on its
+ * behalf: a syscall, a flash access, or idling while waiting for an
+ * interrupt. Samples are written in the "collapsed stack" format used by
+ * flame graph tools, one line per unique stack:
+ *
+ *   main;Game::run;Game::draw;_SYS_paint;[idle] 1234
+ *
+ * Because sampling is driven by virtual time, a profile describes the
+ * speed of the simulated hardware, independent of how fast the host is.
+ */
+
+#ifndef MC_SVMPROFILER_H
+#define MC_SVMPROFILER_H
+
+#include "macros.h"
+#include "mc_timing.h"
+#include <string>
+
+
+class SvmProfiler {
+public:
+    static const unsigned SAMPLE_HZ = 10000;
+    static const unsigned TICKS_PER_SAMPLE = MCTiming::TICK_HZ / SAMPLE_HZ;
+    static const unsigned MAX_STACK_DEPTH = 64;
+
+    // What the system is doing, at the leaf of each sampled stack
+    enum Activity {
+        A_NONE = 0,
+        A_FLASH_MISS,
+        A_FLASH_WRITE,
+        A_FLASH_ERASE,
+        A_IDLE,
+        NUM_ACTIVITIES
+    };
+
+    static const unsigned NO_SYSCALL = unsigned(-1);
+
+    static void init(const std::string &filename);
+    static void exit();
+
+    // Symbolize all samples taken so far, before the debug symbols change
+    static void flush();
+
+    // Called with the current time every time MC ticks elapse
+    static ALWAYS_INLINE void elapseTicks(uint64_t ticks) {
+        if (UNLIKELY(ticks >= deadline))
+            sample(ticks);
+    }
+
+    class SyscallScope {
+    public:
+        SyscallScope(unsigned num) : saved(syscall) { syscall = num; }
+        ~SyscallScope() { syscall = saved; }
+    private:
+        unsigned saved;
+    };
+
+    class ActivityScope {
+    public:
+        ActivityScope(Activity a) : saved(activity) { activity = a; }
+        ~ActivityScope() { activity = saved; }
+    private:
+        Activity saved;
+    };
+
+private:
+    static uint64_t deadline;
+    static unsigned syscall;
+    static Activity activity;
+
+    static void sample(uint64_t ticks);
+};
+
+#endif
@@ -26,6 +26,7 @@
 #include "sysinfo.h"
 #include <stdlib.h>
 #include "ostime.h"
+#include "system.h"
 
 namespace SysInfo {
 
@@ -35,11 +36,14 @@ namespace SysInfo {
     {
         uint32_t *p = reinterpret_cast<uint32_t*>(&uidBytes[0]);
 
+        // In lockstep mode, runs must be repeatable. Only use our seeded rand().
+        bool lockstep = SystemMC::getSystem()->opt_lockstep;
+
         for (unsigned i = 0; i < UniqueIdNumBytes / sizeof(uint32_t); ++i) {
 
             // ultra cheeseball. will (obviously) not be constant between
             // runs of the simulator
-            *p = rand() ^ rand() ^ uint32_t(OSTime::clock() * 1e6);
+            *p = rand() ^ rand() ^ (lockstep ? 0 : uint32_t(OSTime::clock() * 1e6));
             p++;
         }
     }
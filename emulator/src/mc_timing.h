@@ -50,10 +50,12 @@ struct MCTiming {
     // time to elapse. (For example, audio output with --headless)
     static const unsigned TICKS_PER_TASKS_WORK = 10;
 
-    // XXX: Arbitrary unverified time for flash cache miss, in ticks
-    // (Based on theoretical 18 MHz / 1.8 MBps bus speed and 256-byte pages,
+    // XXX: Arbitrary unverified time for flash reads, in ticks
+    // (Based on theoretical 18 MHz / 1.8 MBps bus speed, plus a fixed cost
+    // for each read command. A 256-byte cache miss comes to 3000 ticks,
     // including some generous padding)
-    static const unsigned TICKS_PER_PAGE_MISS = 3000;
+    static const unsigned TICKS_PER_READ = 696;
+    static const unsigned TICKS_PER_READ_BYTE = 9;
 
     // Typical write timing for our flash chip
     static const unsigned TICKS_PER_PAGE_WRITE = 51200;     // min 1.4ms, max 5ms. go with ~3.2ms in the middle
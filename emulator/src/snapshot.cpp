@@ -0,0 +1,205 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include "snapshot.h"
+
+
+bool SnapshotWriter::open(const char *filename)
+{
+    file = fopen(filename, "wb");
+    if (!file)
+        return false;
+
+    uint64_t magic = Snapshot::MAGIC;
+    uint32_t version = Snapshot::VERSION;
+
+    count = 0;
+    error = false;
+
+    put(magic);
+    put(version);
+    return !error;
+}
+
+bool SnapshotWriter::close()
+{
+    if (file) {
+        error |= fclose(file) != 0;
+        file = NULL;
+    }
+    return !error;
+}
+
+void SnapshotWriter::beginSection(uint32_t tag)
+{
+    uint32_t length = 0;
+
+    put(tag);
+    if (file)
+        sectionStart = ftell(file);
+    put(length);
+}
+
+void SnapshotWriter::endSection()
+{
+    /*
+     * Go back and patch the length we skipped in beginSection().
+     */
+
+    if (!file)
+        return;
+
+    long end = ftell(file);
+    uint32_t length = end - sectionStart - sizeof length;
+
+    error |= fseek(file, sectionStart, SEEK_SET) != 0;
+    error |= fwrite(&length, sizeof length, 1, file) != 1;
+    error |= fseek(file, end, SEEK_SET) != 0;
+}
+
+void SnapshotWriter::put(const void *data, size_t len)
+{
+    count += len;
+    if (file && len)
+        error |= fwrite(data, len, 1, file) != 1;
+}
+
+void SnapshotWriter::putSparse(const uint8_t *data, size_t len, const uint8_t *base)
+{
+    /*
+     * List of (chunk index, chunk data) pairs for every chunk that
+     * differs from the base image, or without a base, every chunk that
+     * isn't fully erased. Terminated by an index of 0xFFFFFFFF.
+     */
+
+    for (uint32_t i = 0; i < len / Snapshot::SPARSE_CHUNK; i++) {
+        const uint8_t *chunk = data + i * Snapshot::SPARSE_CHUNK;
+        bool skip;
+
+        if (base) {
+            skip = !memcmp(chunk, base + i * Snapshot::SPARSE_CHUNK, Snapshot::SPARSE_CHUNK);
+        } else {
+            skip = true;
+            for (unsigned j = 0; j < Snapshot::SPARSE_CHUNK; j++)
+                if (chunk[j] != 0xFF) {
+                    skip = false;
+                    break;
+                }
+        }
+
+        if (!skip) {
+            put(i);
+            put(chunk, Snapshot::SPARSE_CHUNK);
+        }
+    }
+
+    put(uint32_t(-1));
+}
+
+bool SnapshotReader::open(const char *filename)
+{
+    file = fopen(filename, "rb");
+    if (!file)
+        return false;
+
+    uint64_t magic = 0;
+    uint32_t version = 0;
+
+    error = false;
+    sectionEnd = sizeof magic + sizeof version;
+    get(magic);
+    get(version);
+
+    if (error || magic != Snapshot::MAGIC || version != Snapshot::VERSION) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SnapshotReader::close()
+{
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+bool SnapshotReader::nextSection(uint32_t &tag, uint32_t &length)
+{
+    if (error || fseek(file, sectionEnd, SEEK_SET))
+        return false;
+
+    if (fread(&tag, sizeof tag, 1, file) != 1 ||
+        fread(&length, sizeof length, 1, file) != 1)
+        return false;
+
+    sectionEnd = ftell(file) + (long)length;
+    return true;
+}
+
+void SnapshotReader::get(void *data, size_t len)
+{
+    if (error || ftell(file) + (long)len > sectionEnd ||
+        (len && fread(data, len, 1, file) != 1)) {
+        error = true;
+        memset(data, 0, len);
+    }
+}
+
+void SnapshotReader::getSparse(uint8_t *data, size_t len, const uint8_t *base)
+{
+    /*
+     * Unlisted chunks come from the base image. Only copy the ones that
+     * actually changed, since writing to our copy-on-write mapping makes
+     * a private copy of every page we touch.
+     */
+
+    if (!base) {
+        memset(data, 0xFF, len);
+    } else {
+        for (size_t offset = 0; offset < len; offset += Snapshot::SPARSE_CHUNK) {
+            size_t chunkLen = std::min<size_t>(Snapshot::SPARSE_CHUNK, len - offset);
+            if (memcmp(data + offset, base + offset, chunkLen))
+                memcpy(data + offset, base + offset, chunkLen);
+        }
+    }
+
+    for (;;) {
+        uint32_t i;
+        get(i);
+        if (error || i == uint32_t(-1))
+            break;
+
+        if (i >= len / Snapshot::SPARSE_CHUNK) {
+            error = true;
+            break;
+        }
+
+        get(data + i * Snapshot::SPARSE_CHUNK, Snapshot::SPARSE_CHUNK);
+    }
+}
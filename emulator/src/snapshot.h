@@ -0,0 +1,128 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Snapshot files: a checkpoint of simulated machine state.
+ *
+ * A snapshot is a magic number and version, followed by a list of tagged
+ * sections. Each section is a four-character tag, a 32-bit payload length,
+ * and the payload itself. Payloads are raw host-endian structures, so
+ * snapshots are only portable between identical Siftulator builds. We
+ * guard against mismatches by checking section lengths on restore.
+ *
+ * Flash memory is stored sparsely. Normally we skip any chunk that's fully
+ * erased. When running on top of a base image (--flash-overlay), we skip
+ * chunks that match the base instead, so a snapshot is just our copy-on-write
+ * deltas. Such a snapshot can only be restored on top of the same base.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+
+class Snapshot {
+ public:
+    static const uint64_t MAGIC     = 0x70616e5374666953LLU;   // "SiftSnap"
+    static const uint32_t VERSION   = 2;
+
+    // Granularity for sparse flash storage
+    static const unsigned SPARSE_CHUNK = 4096;
+
+    static uint32_t tag(char a, char b, char c, char d) {
+        return a | (b << 8) | (c << 16) | (d << 24);
+    }
+};
+
+
+class SnapshotWriter {
+ public:
+    SnapshotWriter()
+        : file(NULL), sectionStart(0), count(0), error(false) {}
+
+    bool open(const char *filename);
+    bool close();
+
+    void beginSection(uint32_t tag);
+    void endSection();
+
+    void put(const void *data, size_t len);
+
+    template <typename T> void put(const T &value) {
+        put(&value, sizeof value);
+    }
+
+    /// Write only the chunks that differ from 'base', or from erased flash.
+    void putSparse(const uint8_t *data, size_t len, const uint8_t *base=NULL);
+
+    /// Total bytes written so far. Works without a file, to measure state size.
+    uint32_t size() const {
+        return count;
+    }
+
+ private:
+    FILE *file;
+    long sectionStart;
+    uint32_t count;
+    bool error;
+};
+
+
+class SnapshotReader {
+ public:
+    SnapshotReader()
+        : file(NULL), sectionEnd(0), error(false) {}
+
+    bool open(const char *filename);
+    void close();
+
+    /// Advance to the next section. Returns false at end of file.
+    bool nextSection(uint32_t &tag, uint32_t &length);
+
+    void get(void *data, size_t len);
+
+    template <typename T> void get(T &value) {
+        get(&value, sizeof value);
+    }
+
+    /// Read chunks written by putSparse(), with the same 'base'.
+    void getSparse(uint8_t *data, size_t len, const uint8_t *base=NULL);
+
+    /// Did any read run short, or past the end of its section?
+    bool failed() const {
+        return error;
+    }
+
+ private:
+    FILE *file;
+    long sectionEnd;
+    bool error;
+};
+
+#endif
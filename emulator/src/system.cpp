@@ -26,9 +26,11 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <algorithm>
 #include "system.h"
 #include "cube_debug.h"
 #include "mc_gdbserver.h"
+#include "snapshot.h"
 
 
 System::System()
@@ -39,11 +41,16 @@ System::System()
         opt_windowHeight(600),
         opt_continueOnException(false),
         opt_turbo(false),
+        opt_lockstep(false),
+        opt_seed(0),
+        opt_cubeThreads(1),
+        opt_cubeHLE(false),
         opt_lockRotationByDefault(false),
         opt_noCubeReconnect(false),
         opt_flushLogs(false),
         opt_paintTrace(false),
         opt_svmTrace(false),
+        opt_svmJit(false),
         opt_svmFlashStats(false),
         opt_gdbServerPort(0),
         opt_cube0Debug(false),
@@ -59,7 +66,26 @@ bool System::init()
     if (mIsInitialized)
         return true;
 
-    if (!flash.init(opt_flashFilename.empty() ? NULL : opt_flashFilename.c_str()))
+    if (opt_lockstep) {
+        /*
+         * Deterministic lockstep mode. Everything runs on the MC thread,
+         * as fast as possible, with no graphics or audio output to pace us.
+         * All randomness comes from opt_seed. The interactive debugger is
+         * inherently driven by host timing, so it can't be used here.
+         */
+
+        if (opt_cube0Debug) {
+            LOG(("SYSTEM: The cube debugger is not available in lockstep mode\n"));
+            return false;
+        }
+
+        opt_headless = true;
+        opt_turbo = true;
+        srand(opt_seed);
+    }
+
+    if (!flash.init(opt_flashFilename.empty() ? NULL : opt_flashFilename.c_str(),
+                    opt_flashOverlayFilename.empty() ? NULL : opt_flashOverlayFilename.c_str()))
         return false;
 
     if (!sc.init(this))
@@ -71,6 +97,11 @@ bool System::init()
     time.init();
 
     mIsInitialized = true;
+
+    if (!opt_loadSnapshotFilename.empty() &&
+        !loadSnapshot(opt_loadSnapshotFilename.c_str()))
+        return false;
+
     return true;
 }
 
@@ -133,14 +164,226 @@ void System::exit()
         if (opt_gdbServerPort)
             GDBServer::stop();
 
+        // Let the MC thread run again, if a script left it held
+        if (opt_lockstep)
+            sc.setLockstepHold(~(uint64_t)0);
+
         smc.stop();
         sc.stop();
 
         mIsStarted = false;
     }
 
+    // Everything is stopped, but flash is still mapped
+    if (!opt_saveSnapshotFilename.empty())
+        writeSnapshot(opt_saveSnapshotFilename.c_str());
+
     smc.exit();
     sc.exit();
     flash.exit();
     tracer.close();
 }
+
+bool System::saveSnapshot(const char *filename)
+{
+    if (!mIsInitialized)
+        return false;
+
+    if (!mIsStarted)
+        return writeSnapshot(filename);
+
+    /*
+     * The master firmware runs natively on the MC thread, so the only
+     * time it's at a known-consistent point is when that thread calls us.
+     * Hold the cubes at a deadline sync while we copy their state.
+     */
+
+    if (!SystemMC::isMCThread()) {
+        LOG(("SNAPSHOT: Can only save a running system from the MC thread\n"));
+        return false;
+    }
+
+    SystemMC::pauseCubes();
+    bool success = writeSnapshot(filename);
+    SystemMC::resumeCubes();
+
+    return success;
+}
+
+bool System::writeSnapshot(const char *filename)
+{
+    SnapshotWriter snap;
+
+    if (!snap.open(filename)) {
+        LOG(("SNAPSHOT: Can't create '%s'\n", filename));
+        return false;
+    }
+
+    snap.beginSection(Snapshot::tag('S','Y','S',' '));
+    snap.put(uint32_t(opt_numCubes));
+    snap.put(uint8_t(opt_cubeHLE));
+    snap.put(uint8_t(opt_cubeFirmware.empty()));
+    snap.put(time.clocks);
+    snap.endSection();
+
+    // With a base image, flash is stored as deltas against it
+    const FlashStorage::FileRecord *base = flash.mapBase();
+    if (base) {
+        snap.beginSection(Snapshot::tag('B','A','S','E'));
+        snap.put(base->header.uniqueID);
+        snap.put(base->header.fileSize);
+        snap.endSection();
+    }
+
+    FlashStorage::MasterRecord &master = flash.data->master;
+    snap.beginSection(Snapshot::tag('M','F','L','S'));
+    snap.putSparse(master.bytes, sizeof master.bytes,
+        base ? base->master.bytes : NULL);
+    snap.put(master.eraseCounts);
+    snap.endSection();
+
+    for (uint32_t id = 0; id < MAX_CUBES; id++) {
+        FlashStorage::CubeRecord &rec = flash.data->cubes[id];
+        snap.beginSection(Snapshot::tag('C','F','L','S'));
+        snap.put(id);
+        snap.put(rec.nvm);
+        snap.putSparse(rec.ext, sizeof rec.ext,
+            base ? base->cubes[id].ext : NULL);
+        snap.put(rec.eraseCounts);
+        snap.endSection();
+    }
+
+    if (base)
+        flash.unmapBase(base);
+
+    for (uint32_t id = 0; id < opt_numCubes; id++) {
+        SnapshotWriter sizer;
+        cubes[id].saveState(sizer);
+
+        snap.beginSection(Snapshot::tag('C','U','B','E'));
+        snap.put(id);
+        snap.put(sizer.size());
+        cubes[id].saveState(snap);
+        snap.endSection();
+    }
+
+    if (!snap.close()) {
+        LOG(("SNAPSHOT: Error writing '%s'\n", filename));
+        return false;
+    }
+
+    return true;
+}
+
+bool System::loadSnapshot(const char *filename)
+{
+    /*
+     * Restores flash memory, the clock, and the complete state of each
+     * cube. The master firmware itself can't be restored, since it runs
+     * natively. It boots fresh from the restored flash when we start(),
+     * which still skips the expensive parts: installing games, and loading
+     * assets onto cubes.
+     */
+
+    if (!mIsInitialized || mIsStarted) {
+        LOG(("SNAPSHOT: Can only restore between init() and start()\n"));
+        return false;
+    }
+
+    SnapshotReader snap;
+    if (!snap.open(filename)) {
+        LOG(("SNAPSHOT: Can't read '%s', or it isn't a snapshot\n", filename));
+        return false;
+    }
+
+    /*
+     * Snapshots taken on top of a base image only store flash that
+     * differs from it. Keep it mapped while we restore, in case we need it.
+     */
+    const FlashStorage::FileRecord *base = flash.mapBase();
+    const FlashStorage::FileRecord *deltaBase = NULL;
+    bool success = false;
+
+    uint32_t tag, length;
+    while (snap.nextSection(tag, length)) {
+
+        if (tag == Snapshot::tag('S','Y','S',' ')) {
+            uint32_t numCubes;
+            uint8_t hle, sbt;
+
+            snap.get(numCubes);
+            snap.get(hle);
+            snap.get(sbt);
+            snap.get(time.clocks);
+
+            if (hle != opt_cubeHLE || sbt != opt_cubeFirmware.empty()) {
+                LOG(("SNAPSHOT: '%s' was saved with a different cube emulation mode\n", filename));
+                goto done;
+            }
+
+            setNumCubes(std::min<uint32_t>(numCubes, MAX_CUBES));
+
+        } else if (tag == Snapshot::tag('B','A','S','E')) {
+            uint32_t uniqueID, fileSize;
+            snap.get(uniqueID);
+            snap.get(fileSize);
+
+            if (!base || base->header.uniqueID != uniqueID ||
+                base->header.fileSize != fileSize) {
+                LOG(("SNAPSHOT: '%s' must be restored on top of the flash "
+                    "image it was saved with (-F, --flash-overlay)\n", filename));
+                goto done;
+            }
+            deltaBase = base;
+
+        } else if (tag == Snapshot::tag('M','F','L','S')) {
+            FlashStorage::MasterRecord &master = flash.data->master;
+            snap.getSparse(master.bytes, sizeof master.bytes,
+                deltaBase ? deltaBase->master.bytes : NULL);
+            snap.get(master.eraseCounts);
+
+        } else if (tag == Snapshot::tag('C','F','L','S')) {
+            uint32_t id;
+            snap.get(id);
+            if (id >= MAX_CUBES) {
+                LOG(("SNAPSHOT: '%s' has flash for an invalid cube\n", filename));
+                goto done;
+            }
+
+            FlashStorage::CubeRecord &rec = flash.data->cubes[id];
+            snap.get(rec.nvm);
+            snap.getSparse(rec.ext, sizeof rec.ext,
+                deltaBase ? deltaBase->cubes[id].ext : NULL);
+            snap.get(rec.eraseCounts);
+
+        } else if (tag == Snapshot::tag('C','U','B','E')) {
+            uint32_t id, size;
+            snap.get(id);
+            snap.get(size);
+
+            SnapshotWriter sizer;
+            if (id < opt_numCubes)
+                cubes[id].saveState(sizer);
+
+            if (id >= opt_numCubes || size != sizer.size()) {
+                LOG(("SNAPSHOT: Cube state in '%s' doesn't match this build\n", filename));
+                goto done;
+            }
+
+            cubes[id].loadState(snap);
+        }
+
+        if (snap.failed())
+            break;
+    }
+
+    if (snap.failed())
+        LOG(("SNAPSHOT: '%s' is truncated or corrupt\n", filename));
+    else
+        success = true;
+
+done:
+    if (base)
+        flash.unmapBase(base);
+    return success;
+}
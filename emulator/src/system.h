@@ -61,8 +61,11 @@ class System {
     unsigned opt_numCubes;
     std::string opt_cubeFirmware;
     std::string opt_flashFilename;
+    std::string opt_flashOverlayFilename;
     std::string opt_launcherFilename;
     std::string opt_waveoutFilename;
+    std::string opt_loadSnapshotFilename;
+    std::string opt_saveSnapshotFilename;
 
     // UI options
     bool opt_whiteBackground;
@@ -72,6 +75,10 @@ class System {
     // Global debug options
     bool opt_continueOnException;
     bool opt_turbo;
+    bool opt_lockstep;
+    unsigned opt_seed;
+    unsigned opt_cubeThreads;
+    bool opt_cubeHLE;
     bool opt_lockRotationByDefault;
     bool opt_radioTrace;
     bool opt_traceEnabledAtStartup;
@@ -83,13 +90,18 @@ class System {
 
     // SVM options
     bool opt_svmTrace;
+    bool opt_svmJit;
     bool opt_svmFlashStats;
     bool opt_svmStackMonitor;
+    std::string opt_svmProfileFilename;
+    std::string opt_flashMissesFilename;
     unsigned opt_gdbServerPort;
 
     // Debug options, applicable to cube 0 only
     bool opt_cube0Debug;
-    std::string opt_cube0Profile;
+
+    // Firmware profiler output, for all cubes
+    std::string opt_cubeProfile;
 
     // Other options
     bool opt_mute;
@@ -102,6 +114,14 @@ class System {
     void resetCube(unsigned id);
     void fullResetCube(unsigned id);
 
+    /*
+     * Machine state snapshots. Saving works before start(), or while
+     * running from the MC thread (e.g. a script invoked by a game).
+     * Restoring must happen between init() and start().
+     */
+    bool saveSnapshot(const char *filename);
+    bool loadSnapshot(const char *filename);
+
     bool isRunning() {
         return mIsStarted;
     }
@@ -116,6 +136,15 @@ class System {
         sc.stop();
     }
 
+    // Lockstep mode only. See SystemCubes::setLockstepHold().
+    void setLockstepHold(uint64_t clock) {
+        sc.setLockstepHold(clock);
+    }
+
+    void waitLockstepHold() {
+        sc.waitLockstepHold();
+    }
+
  private:
     System();
     
@@ -125,6 +154,8 @@ class System {
     SystemCubes sc;
     SystemMC smc;
 
+    bool writeSnapshot(const char *filename);
+
 public:
 
     inline static System& getInstance() {
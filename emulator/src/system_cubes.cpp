@@ -25,6 +25,7 @@
  */
 
 #include <stdio.h>
+#include <algorithm>
 #include "system.h"
 #include "ostime.h"
 #include "system_cubes.h"
@@ -36,10 +37,14 @@ bool SystemCubes::init(System *sys)
     this->sys = sys;
     deadlineSync.init(&sys->time, &mThreadRunning);
 
+    mHoldClock = ~(uint64_t)0;
+    mHolding = false;
+    memset(mProfileData, 0, sizeof mProfileData);
+
     MCNeighbor::cubeInit(&sys->time);
 
-    if (sys->opt_cubeFirmware.empty() && (!sys->opt_cube0Profile.empty() || 
-                                           sys->opt_cube0Debug)) {
+    bool sbtProfile = !sys->opt_cubeProfile.empty() && !Cube::CPU::sbt_rom_profiled;
+    if (sys->opt_cubeFirmware.empty() && (sbtProfile || sys->opt_cube0Debug)) {
         /*
          * We want to disable our debugging features when using the
          * built-in binary translated firmware. The debugger won't really
@@ -47,6 +52,9 @@ bool SystemCubes::init(System *sys)
          * disable it in order to make it harder to reverse engineer our
          * firmware. Of course, any dedicated reverse engineer could just
          * disable this test easily :)
+         *
+         * The exception is a developer build whose SBT firmware was
+         * translated with profiling counters (SBT_PROFILE=1).
          */
         fprintf(stderr, "Debug features only available if a firmware image is provided.\n");
         return false;
@@ -122,16 +130,22 @@ bool SystemCubes::initCube(unsigned id)
 
     sys->cubes[id].cpu.id = id;
     
-    if (id == 0 && !sys->opt_cube0Profile.empty()) {
-        Cube::CPU::profile_data *pd;
-        size_t s = CODE_SIZE * sizeof pd[0];
-        pd = (Cube::CPU::profile_data *) malloc(s);
-        memset(pd, 0, s);
-        sys->cubes[0].cpu.mProfileData = pd;
+    if (!sys->opt_cubeProfile.empty()) {
+        // Keep accumulating into the same buffer if this cube is re-added
+        Cube::CPU::profile_data *&pd = mProfileData[id];
+        if (!pd) {
+            size_t s = CODE_SIZE * sizeof pd[0];
+            pd = (Cube::CPU::profile_data *) malloc(s);
+            memset(pd, 0, s);
+        }
+        sys->cubes[id].cpu.mProfileData = pd;
     }
 
     sys->cubes[id].neighbors.attachCubes(sys->cubes);
 
+    if (sys->opt_cubeHLE)
+        sys->cubes[id].hle.init(&sys->cubes[id]);
+
     return true;
 }
 
@@ -142,9 +156,22 @@ void SystemCubes::start()
         Cube::Debug::stopOnException = !sys->opt_continueOnException;
     }
 
+    mNumWorkers = std::max(1U, std::min(sys->opt_cubeThreads, MAX_WORKERS));
+    if (sys->opt_lockstep)
+        mNumWorkers = 1;
+    if (mNumWorkers > 1)
+        startWorkers();
+
     mThreadRunning = true;
     __asm__ __volatile__ ("" : : : "memory");
-    mThread = new tthread::thread(threadFn, this);
+
+    if (sys->opt_lockstep) {
+        // No cube thread; the MC thread runs us from inside deadlineSync.
+        mThread = 0;
+        deadlineSync.setLockstep(lockstepFn, this);
+    } else {
+        mThread = new tthread::thread(threadFn, this);
+    }
 }
 
 void SystemCubes::stop()
@@ -155,9 +182,19 @@ void SystemCubes::stop()
     mThreadRunning = false;
     __asm__ __volatile__ ("" : : : "memory");
     deadlineSync.wake();
-    mThread->join();
-    delete mThread;
-    mThread = 0;
+
+    mHoldLock.lock();
+    mHoldCond.notify_all();
+    mHoldLock.unlock();
+
+    if (mThread) {
+        mThread->join();
+        delete mThread;
+        mThread = 0;
+    }
+
+    if (mNumWorkers > 1)
+        stopWorkers();
 
     if (sys->opt_cube0Debug)
         Cube::Debug::exit();
@@ -166,8 +203,36 @@ void SystemCubes::stop()
 void SystemCubes::exit()
 {
     stop();
-    if (!sys->opt_cube0Profile.empty())
-        Cube::Debug::writeProfile(&sys->cubes[0].cpu, sys->opt_cube0Profile.c_str());
+    if (!sys->opt_cubeProfile.empty())
+        writeProfiles();
+}
+
+void SystemCubes::writeProfiles()
+{
+    /*
+     * Cube 0 writes to the requested file name. Other cubes insert their
+     * ID before the extension, e.g. "profile.txt" -> "profile-cube01.txt".
+     */
+
+    const std::string &name = sys->opt_cubeProfile;
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos || name.find_first_of("/\\", dot) != std::string::npos)
+        dot = name.size();
+
+    for (unsigned id = 0; id < arraysize(mProfileData); id++) {
+        if (!mProfileData[id])
+            continue;
+
+        std::string filename = name;
+        if (id) {
+            char suffix[16];
+            snprintf(suffix, sizeof suffix, "-cube%02d", id);
+            filename.insert(dot, suffix);
+        }
+
+        sys->cubes[id].cpu.mProfileData = mProfileData[id];
+        Cube::Debug::writeProfile(&sys->cubes[id].cpu, filename.c_str());
+    }
 }
 
 void SystemCubes::threadFn(void *param)
@@ -193,25 +258,7 @@ void SystemCubes::threadFn(void *param)
     srand(OSTime::clock() * 1e6);
 
     while (self->mThreadRunning) {
-        /*
-         * Pick one of several specific tick batch loops. This keeps the loop tight by
-         * eliminating unused features when possible.
-         *
-         * All batch loops are marked NEVER_INLINE, so that they will show up separately
-         * in profilers.
-         */
-
-        self->mBigCubeLock.lock();
-        if (sys->opt_numCubes == 0) {
-            self->tickLoopEmpty();
-        } else if (sys->opt_cube0Debug) {
-            self->tickLoopDebug();
-        } else if (!sys->cubes[0].cpu.sbt || sys->cubes[0].cpu.mProfileData || Tracer::isEnabled()) {
-            self->tickLoopGeneral();
-        } else {
-            self->tickLoopFastSBT();
-        }
-        self->mBigCubeLock.unlock();
+        self->tickBatch();
 
         /*
          * Use TimeGovernor to keep us running no faster than real-time.
@@ -225,6 +272,73 @@ void SystemCubes::threadFn(void *param)
     }
 }
 
+void SystemCubes::lockstepFn(void *param)
+{
+    /*
+     * Lockstep replacement for threadFn(). Called on the MC thread by
+     * deadlineSync.beginEvent(), to run all cubes up to the new deadline.
+     * Every event happens in the same order on every run, regardless of
+     * host scheduling. There's no TimeGovernor; we always run in turbo.
+     */
+
+    SystemCubes *self = (SystemCubes *) param;
+
+    // Has a script asked us to hold here?
+    self->mHoldLock.lock();
+    while (self->mThreadRunning && self->sys->time.clocks >= self->mHoldClock) {
+        self->mHolding = true;
+        self->mHoldCond.notify_all();
+        self->mHoldCond.wait(self->mHoldLock);
+    }
+    self->mHolding = false;
+    self->mHoldLock.unlock();
+
+    while (self->mThreadRunning && self->deadlineSync.remaining())
+        self->tickBatch();
+}
+
+void SystemCubes::setLockstepHold(uint64_t clock)
+{
+    tthread::lock_guard<tthread::mutex> guard(mHoldLock);
+    mHoldClock = clock;
+    mHoldCond.notify_all();
+}
+
+void SystemCubes::waitLockstepHold()
+{
+    tthread::lock_guard<tthread::mutex> guard(mHoldLock);
+    while (mThreadRunning && !(mHolding && sys->time.clocks >= mHoldClock))
+        mHoldCond.wait(mHoldLock);
+}
+
+void SystemCubes::tickBatch()
+{
+    /*
+     * Pick one of several specific tick batch loops. This keeps the loop tight by
+     * eliminating unused features when possible.
+     *
+     * All batch loops are marked NEVER_INLINE, so that they will show up separately
+     * in profilers.
+     */
+
+    mBigCubeLock.lock();
+    if (sys->opt_numCubes == 0) {
+        tickLoopEmpty();
+    } else if (sys->opt_cubeHLE) {
+        tickLoopHLE();
+    } else if (sys->opt_cube0Debug) {
+        tickLoopDebug();
+    } else if (!sys->cubes[0].cpu.sbt || Tracer::isEnabled() ||
+               (sys->cubes[0].cpu.mProfileData && !Cube::CPU::sbt_rom_profiled)) {
+        tickLoopGeneral();
+    } else if (mNumWorkers > 1 && sys->opt_numCubes > 1) {
+        tickLoopParallelSBT();
+    } else {
+        tickLoopFastSBT();
+    }
+    mBigCubeLock.unlock();
+}
+
 ALWAYS_INLINE void SystemCubes::tick(unsigned count)
 {
     sys->time.tick(count);
@@ -275,6 +389,10 @@ NEVER_INLINE void SystemCubes::tickLoopGeneral()
     System *sys = this->sys;
     unsigned batch = sys->time.timestepTicks();
     unsigned nCubes = sys->opt_numCubes;
+
+    // Without a thread to block in deadlineSync, we must stop right at the deadline
+    if (deadlineSync.isLockstep())
+        batch = (unsigned) std::min<uint64_t>(batch, deadlineSync.remaining());
     
     while (batch--) {
         for (unsigned i = 0; i < nCubes; i++)
@@ -289,13 +407,22 @@ NEVER_INLINE void SystemCubes::tickLoopFastSBT()
     /*
      * Fastest path: No debugging, no tracing, SBT only,
      * and advance by more than one tick when we can.
+     *
+     * Cubes that are asleep move out of the per-step loop and into
+     * mSleepQueue, until their next timer event. The clock jumps straight
+     * to the earliest event across all cubes, so a set of mostly-sleeping
+     * cubes costs very little. Sleeping cubes notice wake-on-pin (touch)
+     * only when they're ticked, which is at least once per batch.
      */
 
     System *sys = this->sys;
     unsigned batch = sys->time.timestepTicks();
     unsigned nCubes = sys->opt_numCubes;
+    uint32_t awake = nCubes < 32 ? (1 << nCubes) - 1 : 0xFFFFFFFF;
     unsigned stepSize = 1;
 
+    mSleepQueue.clear();
+
     /*
      * Run until our batch is empty, or someone tells us to stop.
      *
@@ -305,23 +432,88 @@ NEVER_INLINE void SystemCubes::tickLoopFastSBT()
      */
 
     while (batch && stepSize) {
+        uint64_t stepEnd = sys->time.clocks + stepSize;
+        uint32_t cubes = awake;
         unsigned nextStep;
 
         batch -= stepSize;
         nextStep = batch;
 
-        for (unsigned i = 0; i < nCubes; i++) {
+        while (cubes) {
+            unsigned i = __builtin_ffs(cubes) - 1;
             Cube::Hardware &cube = sys->cubes[i];
-            nextStep = std::min(nextStep, sys->cubes[i].tickFastSBT(stepSize));
+            unsigned cubeStep = cube.tickFastSBT(stepSize);
+            cubes &= cubes - 1;
+
+            if (UNLIKELY(cube.cpu.powerDown)) {
+                awake &= ~(1 << i);
+                mSleepQueue.push(i, stepEnd, stepEnd + cubeStep);
+            } else {
+                nextStep = std::min(nextStep, cubeStep);
+            }
+        }
+
+        // Catch up any sleeping cubes whose next event is due
+        while (mSleepQueue.nextWake() <= stepEnd) {
+            CubeSleepQueue::Entry e = mSleepQueue.pop();
+            Cube::Hardware &cube = sys->cubes[e.id];
+            unsigned cubeStep = cube.tickFastSBT(stepEnd - e.since);
+
+            if (cube.cpu.powerDown) {
+                mSleepQueue.push(e.id, stepEnd, stepEnd + cubeStep);
+            } else {
+                awake |= 1 << e.id;
+                nextStep = std::min(nextStep, cubeStep);
+            }
         }
 
         tick(stepSize);
 
         stepSize = std::min(nextStep, (unsigned)deadlineSync.remaining());
         stepSize = std::min(stepSize, (unsigned)MCNeighbor::cubeDeadlineRemaining());
+        stepSize = (unsigned) std::min<uint64_t>(stepSize, mSleepQueue.nextWake() - stepEnd);
+    }
+
+    // Everyone must be caught up before we let go of mBigCubeLock
+    while (!mSleepQueue.empty()) {
+        CubeSleepQueue::Entry e = mSleepQueue.pop();
+        uint64_t now = sys->time.clocks;
+        if (now > e.since)
+            sys->cubes[e.id].tickFastSBT(now - e.since);
     }
 }
 
+NEVER_INLINE void SystemCubes::tickLoopParallelSBT()
+{
+    /*
+     * Like tickLoopFastSBT(), but cubes are divided into groups which
+     * run concurrently on our worker threads. Each step of this loop is
+     * an 'epoch' during which the groups run independently, ending at
+     * the same deadlines that tickLoopFastSBT() would stop at.
+     */
+
+    System *sys = this->sys;
+    unsigned batch = sys->time.timestepTicks();
+    unsigned stepSize = 1;
+
+    assignCubeGroups();
+
+    while (batch && stepSize) {
+        unsigned nextStep;
+
+        batch -= stepSize;
+        nextStep = batch;
+
+        runCubeGroups(stepSize);
+        tick(stepSize);
+
+        stepSize = std::min(nextStep, (unsigned)deadlineSync.remaining());
+        stepSize = std::min(stepSize, (unsigned)MCNeighbor::cubeDeadlineRemaining());
+    }
+
+    releaseCubeGroups();
+}
+
 NEVER_INLINE void SystemCubes::tickLoopEmpty()
 {
     /*
@@ -343,3 +535,288 @@ NEVER_INLINE void SystemCubes::tickLoopEmpty()
         stepSize = std::min(stepSize, (unsigned)MCNeighbor::cubeDeadlineRemaining());
     }
 }
+
+NEVER_INLINE void SystemCubes::tickLoopHLE()
+{
+    /*
+     * High-level cube emulation. There's no 8051 to run, so we only
+     * wake up for each cube's next scheduled event, and otherwise
+     * advance the clock as far as deadlineSync allows.
+     */
+
+    System *sys = this->sys;
+    unsigned batch = sys->time.timestepTicks();
+    unsigned nCubes = sys->opt_numCubes;
+    unsigned stepSize = 1;
+
+    while (batch && stepSize) {
+        unsigned nextStep;
+
+        batch -= stepSize;
+        nextStep = batch;
+
+        for (unsigned i = 0; i < nCubes; i++)
+            nextStep = (unsigned) std::min<uint64_t>(nextStep, sys->cubes[i].hle.tick());
+
+        tick(stepSize);
+
+        stepSize = std::min(nextStep, (unsigned)deadlineSync.remaining());
+        stepSize = std::min(stepSize, (unsigned)MCNeighbor::cubeDeadlineRemaining());
+    }
+}
+
+void SystemCubes::startWorkers()
+{
+    mWorkersRunning = true;
+    mWorkersPending = 0;
+    mEpochCount = 0;
+
+    for (unsigned i = 0; i < mNumWorkers; i++) {
+        Worker &w = mWorkers[i];
+        w.self = this;
+        w.cubes = 0;
+        w.clock = sys->time;
+        w.thread = i ? new tthread::thread(workerFn, &w) : 0;
+    }
+}
+
+void SystemCubes::stopWorkers()
+{
+    /*
+     * Only called after the main cube thread has exited, so no
+     * epoch can be in progress.
+     */
+
+    mWorkerLock.lock();
+    mWorkersRunning = false;
+    mWorkerCond.notify_all();
+    mWorkerLock.unlock();
+
+    for (unsigned i = 1; i < mNumWorkers; i++) {
+        mWorkers[i].thread->join();
+        delete mWorkers[i].thread;
+        mWorkers[i].thread = 0;
+    }
+}
+
+void SystemCubes::assignCubeGroups()
+{
+    /*
+     * Divide cubes among our workers. Cubes which are in neighbor
+     * range of each other must share a group, so that their pulses
+     * are delivered on the same clock tick as in the single-threaded
+     * loop. Each connected set of cubes goes to the least-loaded group.
+     *
+     * This depends only on cube order and neighbor contacts, never on
+     * thread timing. Contacts that change during a batch are caught by
+     * the deferred pulse queue in Neighbors.
+     */
+
+    System *sys = this->sys;
+    unsigned nCubes = sys->opt_numCubes;
+    uint32_t allCubes = nCubes < 32 ? (1 << nCubes) - 1 : 0xFFFFFFFF;
+    uint32_t adjacent[System::MAX_CUBES];
+    unsigned groupSize[MAX_WORKERS];
+    uint32_t assigned = 0;
+
+    for (unsigned i = 0; i < nCubes; i++)
+        adjacent[i] = 0;
+
+    for (unsigned i = 0; i < nCubes; i++) {
+        uint32_t contacts = sys->cubes[i].neighbors.getContactMask() & allCubes;
+        adjacent[i] |= contacts;
+        while (contacts) {
+            unsigned j = __builtin_ffs(contacts) - 1;
+            adjacent[j] |= 1 << i;
+            contacts &= contacts - 1;
+        }
+    }
+
+    for (unsigned w = 0; w < mNumWorkers; w++) {
+        mWorkers[w].cubes = 0;
+        groupSize[w] = 0;
+    }
+
+    for (unsigned i = 0; i < nCubes; i++) {
+        if (assigned & (1 << i))
+            continue;
+
+        // Flood-fill to find everything connected to cube 'i'
+        uint32_t component = 1 << i;
+        uint32_t frontier = component;
+        while (frontier) {
+            unsigned j = __builtin_ffs(frontier) - 1;
+            uint32_t next = adjacent[j] & ~component;
+            component |= next;
+            frontier = (frontier & ~(1 << j)) | next;
+        }
+        assigned |= component;
+
+        unsigned best = 0;
+        for (unsigned w = 1; w < mNumWorkers; w++)
+            if (groupSize[w] < groupSize[best])
+                best = w;
+
+        mWorkers[best].cubes |= component;
+        groupSize[best] += __builtin_popcount(component);
+    }
+
+    for (unsigned w = 0; w < mNumWorkers; w++) {
+        Worker &worker = mWorkers[w];
+        uint32_t cubes = worker.cubes;
+
+        worker.clock = sys->time;
+
+        while (cubes) {
+            unsigned i = __builtin_ffs(cubes) - 1;
+            sys->cubes[i].setClock(&worker.clock);
+            sys->cubes[i].neighbors.setLocalCubes(worker.cubes);
+            cubes &= cubes - 1;
+        }
+    }
+}
+
+void SystemCubes::releaseCubeGroups()
+{
+    // Return all cubes to the shared clock, for the single-threaded loops
+    System *sys = this->sys;
+
+    for (unsigned i = 0; i < sys->opt_numCubes; i++) {
+        sys->cubes[i].setClock(&sys->time);
+        sys->cubes[i].neighbors.setLocalCubes(0xFFFFFFFF);
+    }
+}
+
+void SystemCubes::runCubeGroups(unsigned epoch)
+{
+    /*
+     * Run every cube group for exactly 'epoch' ticks, and wait for
+     * them all to finish. Group 0 runs on the calling thread.
+     */
+
+    System *sys = this->sys;
+
+    mWorkerLock.lock();
+    mEpochTicks = epoch;
+    mWorkersPending = 0;
+    for (unsigned w = 1; w < mNumWorkers; w++)
+        if (mWorkers[w].cubes) {
+            mWorkers[w].clock.clocks = sys->time.clocks;
+            mWorkersPending++;
+        }
+    mEpochCount++;
+    mWorkerCond.notify_all();
+    mWorkerLock.unlock();
+
+    mWorkers[0].clock.clocks = sys->time.clocks;
+    tickCubeGroup(mWorkers[0], epoch);
+
+    mWorkerLock.lock();
+    while (mWorkersPending)
+        mWorkerDoneCond.wait(mWorkerLock);
+    mWorkerLock.unlock();
+
+    // Pulses that crossed between groups, in a fixed order
+    for (unsigned i = 0; i < sys->opt_numCubes; i++)
+        sys->cubes[i].neighbors.deliverDeferredPulses(sys->cubes[i].cpu);
+}
+
+void SystemCubes::tickCubeGroup(Worker &w, unsigned batch)
+{
+    /*
+     * The tickLoopFastSBT() algorithm, applied to a single group of
+     * cubes on the group's private clock. Always runs exactly 'batch' ticks.
+     * Sleeping cubes are parked in the group's own queue, and everyone
+     * is caught up again before the epoch ends.
+     */
+
+    System *sys = this->sys;
+    CubeSleepQueue &sleepQueue = w.sleepQueue;
+    uint32_t awake = w.cubes;
+    unsigned stepSize = 1;
+
+    sleepQueue.clear();
+
+    while (batch) {
+        uint64_t stepEnd = w.clock.clocks + stepSize;
+        uint32_t cubes = awake;
+        unsigned nextStep;
+
+        batch -= stepSize;
+        nextStep = batch;
+
+        while (cubes) {
+            unsigned i = __builtin_ffs(cubes) - 1;
+            Cube::Hardware &cube = sys->cubes[i];
+            unsigned cubeStep = cube.tickFastSBT(stepSize);
+            cubes &= cubes - 1;
+
+            if (UNLIKELY(cube.cpu.powerDown)) {
+                awake &= ~(1 << i);
+                sleepQueue.push(i, stepEnd, stepEnd + cubeStep);
+            } else {
+                nextStep = std::min(nextStep, cubeStep);
+            }
+        }
+
+        while (sleepQueue.nextWake() <= stepEnd) {
+            CubeSleepQueue::Entry e = sleepQueue.pop();
+            Cube::Hardware &cube = sys->cubes[e.id];
+            unsigned cubeStep = cube.tickFastSBT(stepEnd - e.since);
+
+            if (cube.cpu.powerDown) {
+                sleepQueue.push(e.id, stepEnd, stepEnd + cubeStep);
+            } else {
+                awake |= 1 << e.id;
+                nextStep = std::min(nextStep, cubeStep);
+            }
+        }
+
+        w.clock.tick(stepSize);
+        stepSize = (unsigned) std::min<uint64_t>(nextStep, sleepQueue.nextWake() - stepEnd);
+        stepSize = std::max(stepSize, 1U);
+    }
+
+    while (!sleepQueue.empty()) {
+        CubeSleepQueue::Entry e = sleepQueue.pop();
+        uint64_t now = w.clock.clocks;
+        if (now > e.since)
+            sys->cubes[e.id].tickFastSBT(now - e.since);
+    }
+}
+
+void SystemCubes::workerFn(void *param)
+{
+    /*
+     * Worker threads for tickLoopParallelSBT(). Each epoch we wake up,
+     * run our cube group, and report back.
+     */
+
+    Worker *w = (Worker *) param;
+    SystemCubes *self = w->self;
+    uint32_t lastEpoch = 0;
+
+    for (;;) {
+        unsigned epoch;
+
+        self->mWorkerLock.lock();
+        while (self->mWorkersRunning && self->mEpochCount == lastEpoch)
+            self->mWorkerCond.wait(self->mWorkerLock);
+        bool running = self->mWorkersRunning;
+        lastEpoch = self->mEpochCount;
+        epoch = self->mEpochTicks;
+        self->mWorkerLock.unlock();
+
+        if (!running)
+            return;
+        if (!w->cubes)
+            continue;
+
+        self->tickCubeGroup(*w, epoch);
+
+        self->mWorkerLock.lock();
+        if (!--self->mWorkersPending)
+            self->mWorkerDoneCond.notify_all();
+        self->mWorkerLock.unlock();
+    }
+}
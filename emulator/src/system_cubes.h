@@ -27,12 +27,74 @@
 #ifndef _SYSTEM_CUBES_H
 #define _SYSTEM_CUBES_H
 
+#include <algorithm>
+#include <sifteo/abi.h>
 #include "tinythread.h"
 #include "macros.h"
+#include "vtime.h"
 #include "deadlinesynchronizer.h"
 
 class System;
 
+namespace Cube {
+    namespace CPU {
+        struct profile_data;
+    }
+}
+
+
+/*
+ * Priority queue of sleeping cubes, for tickLoopFastSBT() and for each
+ * cube group in tickLoopParallelSBT(). A cube whose CPU is powered down
+ * can't observe anything until its next timer event, so instead of
+ * ticking it on every step we park it here until that event, keyed by
+ * absolute clock tick.
+ */
+
+class CubeSleepQueue {
+ public:
+    struct Entry {
+        uint64_t wake;      // Clock tick of the cube's next event
+        uint64_t since;     // Clock tick the cube has been simulated up to
+        unsigned id;
+    };
+
+    void clear() {
+        count = 0;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    uint64_t nextWake() const {
+        return count ? heap[0].wake : ~(uint64_t)0;
+    }
+
+    void push(unsigned id, uint64_t since, uint64_t wake) {
+        ASSERT(count < arraysize(heap));
+        Entry &e = heap[count++];
+        e.id = id;
+        e.since = since;
+        e.wake = wake;
+        std::push_heap(heap, heap + count, later);
+    }
+
+    Entry pop() {
+        ASSERT(count);
+        std::pop_heap(heap, heap + count, later);
+        return heap[--count];
+    }
+
+ private:
+    static bool later(const Entry &a, const Entry &b) {
+        return a.wake > b.wake;
+    }
+
+    Entry heap[_SYS_NUM_CUBE_SLOTS];
+    unsigned count;
+};
+
 
 class SystemCubes {
  public:
@@ -50,23 +112,84 @@ class SystemCubes {
     /// Reset flash memory and HWID too
     void fullResetCube(unsigned id);
 
+    /*
+     * Lockstep mode: let the simulation run up to the first sync event at
+     * or after 'clock', and hold it there. Scripts use this to interact with
+     * the simulation at exactly reproducible points in virtual time.
+     * waitLockstepHold() blocks until the hold is reached, or we stop.
+     */
+    void setLockstepHold(uint64_t clock);
+    void waitLockstepHold();
+
     // Allow other threads to synchronize with cube execution
     DeadlineSynchronizer deadlineSync;
 
  private: 
+    static const unsigned MAX_WORKERS = _SYS_NUM_CUBE_SLOTS;
+
+    /*
+     * In parallel mode, cubes are split into groups, and each group
+     * runs on its own worker thread with a private copy of the
+     * VirtualTime. All groups meet at a barrier whenever the cube
+     * simulation as a whole needs to stop: at our batch boundaries,
+     * deadlineSync deadlines, and MCNeighbor deadlines.
+     *
+     * Group 0 always runs on our main cube thread.
+     */
+    struct Worker {
+        SystemCubes *self;
+        tthread::thread *thread;
+        VirtualTime clock;
+        uint32_t cubes;
+        CubeSleepQueue sleepQueue;
+    };
+
     static void threadFn(void *param);
+    static void lockstepFn(void *param);
+    static void workerFn(void *param);
     bool initCube(unsigned id);
 
+    void startWorkers();
+    void stopWorkers();
+    void assignCubeGroups();
+    void releaseCubeGroups();
+    void runCubeGroups(unsigned epoch);
+    void tickCubeGroup(Worker &w, unsigned batch);
+
+    void writeProfiles();
+    void tickBatch();
     ALWAYS_INLINE void tick(unsigned count=1);
     NEVER_INLINE void tickLoopDebug();
     NEVER_INLINE void tickLoopGeneral();
     NEVER_INLINE void tickLoopFastSBT();
+    NEVER_INLINE void tickLoopParallelSBT();
     NEVER_INLINE void tickLoopEmpty();
+    NEVER_INLINE void tickLoopHLE();
 
     System *sys;
     tthread::thread *mThread;
     tthread::mutex mBigCubeLock;
     bool mThreadRunning;
+
+    Worker mWorkers[MAX_WORKERS];
+    unsigned mNumWorkers;
+    tthread::mutex mWorkerLock;
+    tthread::condition_variable mWorkerCond;
+    tthread::condition_variable mWorkerDoneCond;
+    bool mWorkersRunning;
+    unsigned mWorkersPending;
+    unsigned mEpochTicks;
+    uint32_t mEpochCount;
+
+    CubeSleepQueue mSleepQueue;
+
+    // Profiler buffers, owned by us rather than by each cube's CPU
+    Cube::CPU::profile_data *mProfileData[_SYS_NUM_CUBE_SLOTS];
+
+    tthread::mutex mHoldLock;
+    tthread::condition_variable mHoldCond;
+    uint64_t mHoldClock;
+    bool mHolding;
 };
 
 #endif
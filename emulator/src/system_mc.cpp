@@ -49,6 +49,8 @@
 #include "protocol.h"
 #include "tasks.h"
 #include "mc_timing.h"
+#include "mc_svmprofiler.h"
+#include "mc_flash_missreport.h"
 #include "lodepng.h"
 #include "sysinfo.h"
 #include "crc.h"
@@ -77,6 +79,8 @@ bool SystemMC::init(System *sys)
     FlashStack::init();
     SysInfo::init();
     Crc32::init();
+    SvmProfiler::init(sys->opt_svmProfileFilename);
+    FlashMissReport::init(sys->opt_flashMissesFilename);
 
     if (instance->sys->opt_headless) {
         Tasks::trigger(Tasks::AudioPull);
@@ -111,6 +115,8 @@ void SystemMC::exit()
         AudioOutDevice::stop();
 
     waveOut.close();
+    SvmProfiler::exit();
+    FlashMissReport::exit();
 }
 
 void SystemMC::autoInstall()
@@ -244,11 +250,31 @@ void Tasks::waitForInterrupt()
     // Note that we must actually call elapseTicks() here, since it's
     // important to run all async events (including exit) from halt().
 
+    SvmProfiler::ActivityScope scope(SvmProfiler::A_IDLE);
     SystemMC *self = SystemMC::instance;
     self->ticks = self->radioPacketDeadline;
     self->elapseTicks(0);
 }
 
+bool SystemMC::isMCThread()
+{
+    return instance && instance->mThread &&
+        instance->mThread->get_id() == tthread::this_thread::get_id();
+}
+
+void SystemMC::pauseCubes()
+{
+    // Same deadline we gave the cubes at the end of the last event
+    SystemMC *self = instance;
+    self->sys->getCubeSync().beginEvent(self->radioPacketDeadline, self->mThreadRunning);
+}
+
+void SystemMC::resumeCubes()
+{
+    SystemMC *self = instance;
+    self->sys->getCubeSync().endEvent(self->radioPacketDeadline);
+}
+
 Cube::Hardware *SystemMC::getCubeForSlot(CubeSlot *slot)
 {
     return instance->getCubeForAddress(slot->getRadioAddress());
@@ -290,6 +316,9 @@ void SystemMC::elapseTicks(unsigned n)
     if (!self->mThreadRunning)
         longjmp(self->mThreadExitJmp, 1);
 
+    // Virtual-time SVM profiler
+    SvmProfiler::elapseTicks(self->ticks);
+
     // Asynchronous radio packets
     while (self->ticks >= self->radioPacketDeadline)
         self->doRadioPacket();
@@ -54,6 +54,17 @@ class SystemMC {
     static Cube::Hardware *getCubeForSlot(CubeSlot *slot);
     static void checkQuiescentVRAM(CubeSlot *slot);
 
+    /// Is the caller running on the MC simulation thread?
+    static bool isMCThread();
+
+    /**
+     * Hold the cube thread at a deadline sync, so that cube state can be
+     * safely inspected. Must only be called from the MC thread, and must
+     * be paired with resumeCubes().
+     */
+    static void pauseCubes();
+    static void resumeCubes();
+
     /// Queue a game for asynchronous installation. Can be called at any time.
     static bool installGame(const char *name);
 
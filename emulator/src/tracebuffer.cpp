@@ -0,0 +1,191 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include "tracebuffer.h"
+#include "ostime.h"
+
+const char TraceBuffer::MAGIC[8] = { 'T', 'C', 'T', 'R', 'A', 'C', 'E', '1' };
+
+
+bool TraceBuffer::open(const char *filename)
+{
+    if (file)
+        return true;
+
+    file = fopen(filename, "wb");
+    if (!file)
+        return false;
+
+    if (!ring)
+        ring = (uint8_t*) malloc(RING_SIZE);
+
+    if (!ring || fwrite(MAGIC, sizeof MAGIC, 1, file) != 1) {
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+
+    head = tail = 0;
+    lastClock = 0;
+
+    running = true;
+    __asm__ __volatile__ ("" : : : "memory");
+    thread = new tthread::thread(threadFn, this);
+
+    return true;
+}
+
+void TraceBuffer::close()
+{
+    if (!file)
+        return;
+
+    // The writer thread drains whatever is left in the ring before exiting
+    running = false;
+    __asm__ __volatile__ ("" : : : "memory");
+    thread->join();
+    delete thread;
+    thread = NULL;
+
+    fclose(file);
+    file = NULL;
+
+    free(ring);
+    ring = NULL;
+}
+
+void TraceBuffer::flush()
+{
+    if (!file)
+        return;
+
+    while (head != tail)
+        tthread::this_thread::yield();
+
+    fflush(file);
+}
+
+void TraceBuffer::putBytes(const void *data, unsigned len)
+{
+    if (truncated)
+        return;
+
+    // Shorten to fit, leaving room for the length prefix
+    unsigned avail = recordLen + 10 < RECORD_SIZE ? RECORD_SIZE - recordLen - 10 : 0;
+    bool shortened = len > avail;
+    if (shortened)
+        len = avail;
+
+    putVarint(len);
+    memcpy(record + recordLen, data, len);
+    recordLen += len;
+
+    if (shortened)
+        truncated = true;
+}
+
+void TraceBuffer::writeTruncated()
+{
+    /*
+     * Wrap an incomplete record so the reader knows exactly how long it
+     * is, instead of misreading whatever follows it in the stream.
+     */
+
+    uint8_t header[11];
+    unsigned headerLen = 0;
+    uint32_t len = recordLen;
+
+    header[headerLen++] = T_TRUNCATED;
+    while (len >= 0x80) {
+        header[headerLen++] = 0x80 | (uint8_t)len;
+        len >>= 7;
+    }
+    header[headerLen++] = (uint8_t)len;
+
+    write(header, headerLen);
+    write(record, recordLen);
+}
+
+void TraceBuffer::write(const uint8_t *data, unsigned len)
+{
+    /*
+     * Producer side of the ring. If the writer thread falls behind, we
+     * wait for it rather than dropping records. That only costs real
+     * time; the emulated clock doesn't see the stall.
+     */
+
+    if (UNLIKELY(!file))
+        return;
+
+    while (len) {
+        uint32_t t = tail;
+        uint32_t space = RING_SIZE - (t - head);
+
+        if (!space) {
+            tthread::this_thread::yield();
+            continue;
+        }
+
+        uint32_t offset = t & (RING_SIZE - 1);
+        uint32_t chunk = MIN(len, MIN(space, RING_SIZE - offset));
+
+        memcpy(ring + offset, data, chunk);
+        __sync_synchronize();
+        tail = t + chunk;
+
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void TraceBuffer::threadFn(void *param)
+{
+    TraceBuffer *self = (TraceBuffer*) param;
+
+    for (;;) {
+        // Sample 'running' first, so we never exit with data still queued
+        bool stopping = !self->running;
+        __sync_synchronize();
+        uint32_t t = self->tail;
+        uint32_t h = self->head;
+        __sync_synchronize();
+
+        if (h == t) {
+            if (stopping)
+                break;
+            OSTime::sleep(0.001);
+            continue;
+        }
+
+        uint32_t offset = h & (RING_SIZE - 1);
+        uint32_t chunk = MIN(t - h, RING_SIZE - offset);
+
+        fwrite(self->ring + offset, chunk, 1, self->file);
+        __sync_synchronize();
+        self->head = h + chunk;
+    }
+}
@@ -0,0 +1,184 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo Thundercracker simulator
+ * Micah Elizabeth Scott <micah@misc.name>
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Binary trace recorder.
+ *
+ * Trace records are encoded on the emulation thread into a compact binary
+ * stream, pushed into a single-producer/single-consumer ring buffer, and
+ * written to disk by a background thread. Nothing here formats text; the
+ * offline tools/trace-convert.py script turns a recorded trace back into
+ * VCD and text logs.
+ *
+ * The file starts with an 8-byte magic string, followed by a stream of
+ * records. Each record is a one-byte tag followed by fields encoded as
+ * LEB128 varints, or as length-prefixed byte strings:
+ *
+ *   T_TIMESCALE   hz
+ *   T_SCOPE       name
+ *   T_UPSCOPE
+ *   T_VAR         id, numBits, name
+ *   T_TIME        zigzag(clock - previous clock)
+ *   T_VALUE       id, value
+ *   T_FORMAT      formatID, format string
+ *   T_LOG         cube, formatID, args...    (ints zigzag, strings inline)
+ *   T_HEX         cube, message, data
+ *   T_TRUNCATED   length, record
+ *
+ * Format strings are defined once, the first time they're used, and
+ * referenced by ID afterwards. Log arguments are stored in the order
+ * they appear in the format string.
+ *
+ * A record that didn't fit in RECORD_SIZE is written anyway, with its
+ * trailing fields missing or its strings shortened, but it's wrapped in
+ * a length-prefixed T_TRUNCATED record so the reader can tell where it
+ * ends and flag it in the output.
+ */
+
+#ifndef _TRACEBUFFER_H
+#define _TRACEBUFFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "macros.h"
+#include "tinythread.h"
+
+
+class TraceBuffer {
+public:
+    enum Tag {
+        T_TIMESCALE     = 0x01,
+        T_SCOPE         = 0x02,
+        T_UPSCOPE       = 0x03,
+        T_VAR           = 0x04,
+        T_TIME          = 0x10,
+        T_VALUE         = 0x11,
+        T_FORMAT        = 0x20,
+        T_LOG           = 0x21,
+        T_HEX           = 0x22,
+        T_TRUNCATED     = 0x30,
+    };
+
+    static const char MAGIC[8];
+
+    // Ring size, in bytes. Must be a power of two.
+    static const unsigned RING_SIZE = 1 << 22;
+
+    // Largest single record; see T_TRUNCATED for what happens to the rest.
+    static const unsigned RECORD_SIZE = 4096;
+
+    TraceBuffer()
+        : file(NULL), thread(NULL), running(false),
+          head(0), tail(0), ring(NULL), recordLen(0), truncated(false),
+          lastClock(0) {}
+
+    bool open(const char *filename);
+    void close();
+    void flush();
+
+    bool isOpen() const {
+        return file != NULL;
+    }
+
+    /*
+     * Record building. A record is assembled in a private staging area,
+     * and only becomes visible to the writer thread on endRecord().
+     */
+
+    ALWAYS_INLINE void beginRecord(Tag tag) {
+        recordLen = 0;
+        truncated = false;
+        record[recordLen++] = tag;
+    }
+
+    ALWAYS_INLINE void putVarint(uint64_t value) {
+        if (UNLIKELY(truncated || recordLen + 10 > RECORD_SIZE)) {
+            // Once a field is dropped, drop everything after it too
+            truncated = true;
+            return;
+        }
+        while (value >= 0x80) {
+            record[recordLen++] = 0x80 | (uint8_t)value;
+            value >>= 7;
+        }
+        record[recordLen++] = (uint8_t)value;
+    }
+
+    ALWAYS_INLINE void putSigned(int64_t value) {
+        putVarint((uint64_t(value) << 1) ^ uint64_t(value >> 63));
+    }
+
+    void putBytes(const void *data, unsigned len);
+
+    void putString(const char *str) {
+        putBytes(str, str ? strlen(str) : 0);
+    }
+
+    void endRecord() {
+        if (UNLIKELY(truncated))
+            writeTruncated();
+        else
+            write(record, recordLen);
+    }
+
+    /*
+     * Emit a T_TIME record if 'clock' differs from the last timestamp
+     * in the stream. All subsequent records share this timestamp.
+     */
+    ALWAYS_INLINE void timestamp(uint64_t clock) {
+        if (clock != lastClock) {
+            beginRecord(T_TIME);
+            putSigned(int64_t(clock - lastClock));
+            endRecord();
+            lastClock = clock;
+        }
+    }
+
+private:
+    FILE *file;
+    tthread::thread *thread;
+    volatile bool running;
+
+    /*
+     * Ring indices are free-running; only the producer writes 'tail',
+     * and only the writer thread writes 'head'.
+     */
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint8_t *ring;
+
+    unsigned recordLen;
+    bool truncated;
+    uint8_t record[RECORD_SIZE];
+    uint64_t lastClock;
+
+    void write(const uint8_t *data, unsigned len);
+    void writeTruncated();
+    static void threadFn(void *param);
+};
+
+#endif
@@ -27,6 +27,9 @@
 #include "macros.h"
 #include "tracer.h"
 #include "vtime.h"
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 
 bool Tracer::enabled;
 Tracer *Tracer::instance;
@@ -36,68 +39,167 @@ void Tracer::setEnabled(bool b)
 {
     if (b) {
         instance = this;
-        
-        if (!textTraceFile) {
-            textTraceFile = fopen("trace.txt", "w");
-        }
 
-        if (!vcdTraceFile) {
-            vcdTraceFile = fopen("trace.vcd", "w");
-            if (vcdTraceFile)
-                vcd.writeHeader(vcdTraceFile);
-        }
-            
-        enabled = textTraceFile && vcdTraceFile;
+        if (!buffer.isOpen() && buffer.open("trace.bin"))
+            vcd.writeHeader(buffer);
+
+        enabled = buffer.isOpen();
         if (!enabled)
             fprintf(stderr, "Tracer: Error opening output file(s)!\n");
 
     } else {
         enabled = false;
 
-        fflush(textTraceFile);
-        fflush(vcdTraceFile);
+        buffer.flush();
     }
 }
 
 void Tracer::close()
 {
     setEnabled(false);
-    
-    if (textTraceFile) {
-        fclose(textTraceFile);
-        textTraceFile = NULL;
-    }
 
-    if (vcdTraceFile) {
-        fclose(vcdTraceFile);
-        vcdTraceFile = NULL;
-    }
+    buffer.close();
+    formatIDs.clear();
 }
 
-void Tracer::logWork(const Cube::CPU::em8051 *cpu)
+unsigned Tracer::formatID(const char *fmt)
 {
-    fprintf(textTraceFile, "[%02d t=%"PRIu64"] ", cpu->id, getLocalClock(*cpu->vtime));
+    /*
+     * Format strings are identified by address, so they must be literals.
+     * The first time we see one, write out its definition.
+     */
+
+    std::map<const char*, unsigned>::iterator i = formatIDs.find(fmt);
+    if (i != formatIDs.end())
+        return i->second;
+
+    unsigned id = formatIDs.size();
+    formatIDs[fmt] = id;
+
+    buffer.beginRecord(TraceBuffer::T_FORMAT);
+    buffer.putVarint(id);
+    buffer.putString(fmt);
+    buffer.endRecord();
+
+    return id;
 }
 
-void Tracer::logWork(const Cube::CPU::em8051 *cpu, const char *fmt, va_list ap)
+unsigned Tracer::intArgBits(char size, unsigned longs)
 {
-    logWork(cpu);
-    vfprintf(textTraceFile, fmt, ap);
-    fprintf(textTraceFile, "\n");
+    /*
+     * Width, in bits, of an integer argument with the given length
+     * modifier. Arguments narrower than int were promoted by the caller.
+     */
+
+    switch (size) {
+    case 'j':   return 8 * sizeof(intmax_t);
+    case 'z':   return 8 * sizeof(size_t);
+    case 't':   return 8 * sizeof(ptrdiff_t);
+    case 'q':   return 8 * sizeof(long long);
+    case 'l':   return 8 * (longs >= 2 ? sizeof(long long) : sizeof(long));
+    default:    return 8 * sizeof(int);
+    }
 }
 
-void Tracer::logHexWork(const Cube::CPU::em8051 *cpu, const char *msg, size_t len, void *data)
+void Tracer::logWork(const Cube::CPU::em8051 *cpu, const char *fmt, va_list ap)
 {
-    logWork(cpu);
+    buffer.timestamp(getLocalClock(*cpu->vtime));
+    unsigned id = formatID(fmt);
+
+    buffer.beginRecord(TraceBuffer::T_LOG);
+    buffer.putVarint(cpu->id);
+    buffer.putVarint(id);
+
+    /*
+     * Store the raw arguments instead of formatting them. We only need to
+     * understand enough of the format string to know each argument's type;
+     * trace-convert.py parses it the same way. A '*' width or precision is
+     * stored as its own int argument, floating point values are stored as
+     * their IEEE-754 bit pattern. Anything we don't recognize (%n, for
+     * example) ends the argument list, and the converter marks the spot.
+     */
+
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%')
+            continue;
+
+        p++;
+        while (*p && strchr("-+ #0123456789.*", *p)) {
+            if (*p == '*')
+                buffer.putSigned(va_arg(ap, int));
+            p++;
+        }
+
+        char size = 0;
+        unsigned longs = 0;
+        while (*p && strchr("hlLqjzt", *p)) {
+            size = *p;
+            longs += *p == 'l';
+            p++;
+        }
+
+        switch (*p) {
+
+        case '%':
+            continue;
+
+        case 's':
+            buffer.putString(va_arg(ap, const char*));
+            continue;
+
+        case 'p':
+            buffer.putVarint(uintptr_t(va_arg(ap, void*)));
+            continue;
+
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            double d = size == 'L' ? double(va_arg(ap, long double)) : va_arg(ap, double);
+            uint64_t bits;
+            STATIC_ASSERT(sizeof bits == sizeof d);
+            memcpy(&bits, &d, sizeof bits);
+            buffer.putVarint(bits);
+            continue;
+        }
 
-    fprintf(textTraceFile, "%s [%u]", msg, (unsigned)len);
+        case 'c':
+        case 'd':
+        case 'i': {
+            unsigned width = intArgBits(size, longs);
+            uint64_t value = width == 64 ? va_arg(ap, uint64_t) : va_arg(ap, uint32_t);
+            buffer.putSigned(int64_t(value << (64 - width)) >> (64 - width));
+            continue;
+        }
+
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            if (intArgBits(size, longs) == 64)
+                buffer.putVarint(va_arg(ap, uint64_t));
+            else
+                buffer.putVarint(va_arg(ap, uint32_t));
+            continue;
+        }
 
-    uint8_t *bytes = (uint8_t*) data;
-    while (len) {
-        fprintf(textTraceFile, " %02x", *bytes);
-        len--;
-        bytes++;
+        break;
     }
-    
-    fprintf(textTraceFile, "\n");
+
+    buffer.endRecord();
+}
+
+void Tracer::logHexWork(const Cube::CPU::em8051 *cpu, const char *msg, size_t len, void *data)
+{
+    buffer.timestamp(getLocalClock(*cpu->vtime));
+
+    buffer.beginRecord(TraceBuffer::T_HEX);
+    buffer.putVarint(cpu->id);
+    buffer.putString(msg);
+    buffer.putBytes(data, len);
+    buffer.endRecord();
 }
@@ -27,6 +27,10 @@
 /*
  * Trace logging support, for development use only.
  * Requires a firmware image. (Intentionally disabled with SBT)
+ *
+ * Log messages and VCD signal changes are both recorded to a single binary
+ * trace.bin file via a TraceBuffer. Use tools/trace-convert.py to turn that
+ * into the usual trace.txt and trace.vcd.
  */
 
 #ifndef _TRACER_H
@@ -34,15 +38,17 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <map>
 #include "macros.h"
 #include "vcdwriter.h"
+#include "tracebuffer.h"
 #include "cube_cpu.h"
 
 
 class Tracer {
  public:
     Tracer()
-        : epochIsSet(false), textTraceFile(NULL), vcdTraceFile(NULL) {}
+        : epochIsSet(false) {}
 
     VCDWriter vcd;
      
@@ -51,7 +57,7 @@ class Tracer {
 
     ALWAYS_INLINE void tick(const VirtualTime &vtime) {
         if (isEnabled())
-            vcd.writeTick(vcdTraceFile, getLocalClock(vtime));
+            vcd.writeTick(buffer, getLocalClock(vtime));
     }
 
     ALWAYS_INLINE static bool isEnabled() {
@@ -166,9 +172,9 @@ class Tracer {
     bool epochIsSet;
     uint64_t epoch;
 
-    FILE *textTraceFile;
-    FILE *vcdTraceFile;
-    
+    TraceBuffer buffer;
+    std::map<const char*, unsigned> formatIDs;
+
     uint64_t getLocalClock(const VirtualTime &vtime)
     {
         /*
@@ -184,7 +190,8 @@ class Tracer {
         }
     }
     
-    void logWork(const Cube::CPU::em8051 *cpu);
+    unsigned formatID(const char *fmt);
+    static unsigned intArgBits(char size, unsigned longs);
     void logWork(const Cube::CPU::em8051 *cpu, const char *fmt, va_list ap);
     void logHexWork(const Cube::CPU::em8051 *cpu, const char *msg, size_t len, void *data);
 };
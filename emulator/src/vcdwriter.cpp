@@ -30,12 +30,12 @@
 
 void VCDWriter::enterScope(const std::string scope)
 {
-    defs << "$scope module " << scope << " $end\n";
+    defs.push_back(Definition(TraceBuffer::T_SCOPE, scope));
 }
 
 void VCDWriter::leaveScope()
 {
-    defs << "$upscope $end\n";
+    defs.push_back(Definition(TraceBuffer::T_UPSCOPE, ""));
 }
 
 void VCDWriter::setNamePrefix(const std::string prefix)
@@ -45,62 +45,50 @@ void VCDWriter::setNamePrefix(const std::string prefix)
 
 void VCDWriter::define(const std::string name, void *var, unsigned numBits, unsigned firstBit)
 {
-    std::string identifier = createIdentifier(sources.size());
-    identifiers.push_back(identifier);
-    
+    // Signal IDs are implied by definition order
     SignalSource s(var, numBits, firstBit);
     sources.push_back(s);
 
-    defs << "$var reg " << numBits << " " << identifier << " " << namePrefix << name;
-    if (numBits > 1)
-        defs << "[" << (numBits - 1) << ":0]";
-    defs << " $end\n";
+    defs.push_back(Definition(TraceBuffer::T_VAR, namePrefix + name, numBits));
 }
 
-void VCDWriter::writeHeader(FILE *f)
+void VCDWriter::writeHeader(TraceBuffer &buf)
 {
-    fprintf(f, "$timescale\n  %"PRIu64" fs\n$end\n%s$enddefinitions $end\n",
-        ((uint64_t)1e15) / VirtualTime::HZ, defs.str().c_str());
+    buf.beginRecord(TraceBuffer::T_TIMESCALE);
+    buf.putVarint(VirtualTime::HZ);
+    buf.endRecord();
+
+    unsigned id = 0;
+    for (std::vector<Definition>::iterator i = defs.begin(); i != defs.end(); ++i) {
+        buf.beginRecord(i->tag);
+        if (i->tag == TraceBuffer::T_VAR) {
+            buf.putVarint(id++);
+            buf.putVarint(i->numBits);
+        }
+        if (i->tag != TraceBuffer::T_UPSCOPE)
+            buf.putString(i->name.c_str());
+        buf.endRecord();
+    }
+
+    // Force every signal to be recorded on the first tick
+    for (std::vector<SignalSource>::iterator i = sources.begin(); i != sources.end(); ++i)
+        i->value = -1;
 }
 
-void VCDWriter::writeTick(FILE *f, uint64_t clock)
+void VCDWriter::writeTick(TraceBuffer &buf, uint64_t clock)
 {
     for (unsigned id = 0; id < sources.size(); id++) {
         SignalSource &source = sources[id];
         uint64_t newValue = source.sample();
-        
+
         if (newValue != source.value) {
-            if (clock != currentTick) {
-                fprintf(f, "#%"PRIu64"\n", clock);
-                currentTick = clock;
-            }
-            
-            if (source.numBits > 1)
-                fprintf(f, "b");
-            for (int bit = source.numBits - 1; bit >= 0; bit--)
-                fprintf(f, "%u", (unsigned)((newValue >> bit) & 1));
-            fprintf(f, " %s\n", identifiers[id].c_str());            
+            buf.timestamp(clock);
+            buf.beginRecord(TraceBuffer::T_VALUE);
+            buf.putVarint(id);
+            buf.putVarint(newValue);
+            buf.endRecord();
 
             source.value = newValue;
         }
     }
 }
-
-std::string VCDWriter::createIdentifier(unsigned id)
-{
-    /*
-     * Create a signal ID string based on the numerical ID 'i'.
-     */
-
-    const char firstSymbol = '!';
-    const char lastSymbol = '}';
-    const unsigned base = lastSymbol - firstSymbol + 1;
-    std::string s;
-
-    do {
-        s += (char)(firstSymbol + (id % base));
-        id /= base;
-    } while (id);
-
-    return s;
-}
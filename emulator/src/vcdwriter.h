@@ -25,37 +25,37 @@
  */
 
 /*
- * Object for writing Verilog Value Change Dump (VCD) files, a common interchange
- * format for digital logic simulation traces.
+ * Object for recording Verilog Value Change Dump (VCD) signals, a common
+ * interchange format for digital logic simulation traces.
  *
  * For simplicity, we define signals in terms of existing memory variables.
- * Every defined signal is polled once per clock tick. (We never said this would be fast...)
+ * Every defined signal is polled once per clock tick, and changes are recorded
+ * as binary T_VALUE records in a TraceBuffer. The actual VCD text is produced
+ * offline, by tools/trace-convert.py.
  */
 
 #ifndef _VCDWRITER_H
 #define _VCDWRITER_H
 
 #include <string>
-#include <sstream>
 #include <vector>
-#include <stdio.h>
 
 #include "macros.h"
 #include "vtime.h"
+#include "tracebuffer.h"
 
 
 class VCDWriter {
 public:
-    VCDWriter()
-        : currentTick(-1) {}
+    VCDWriter() {}
 
     void enterScope(const std::string scope);
     void leaveScope();
     void setNamePrefix(const std::string prefix);
     void define(const std::string name, void *var, unsigned numBits=1, unsigned firstBit=0);
 
-    void writeHeader(FILE *f);
-    void writeTick(FILE *f, uint64_t clock);
+    void writeHeader(TraceBuffer &buf);
+    void writeTick(TraceBuffer &buf, uint64_t clock);
 
 private:
     struct SignalSource {
@@ -86,13 +86,18 @@ private:
         uint8_t firstBit;
     };
 
+    struct Definition {
+        Definition(TraceBuffer::Tag tag, const std::string &name, unsigned numBits=0)
+            : tag(tag), numBits(numBits), name(name) {}
+
+        TraceBuffer::Tag tag;
+        unsigned numBits;
+        std::string name;
+    };
+
     std::vector<SignalSource> sources;
-    std::vector<std::string> identifiers;
+    std::vector<Definition> defs;
     std::string namePrefix;
-    std::stringstream defs;
-    uint64_t currentTick;
-    
-    std::string createIdentifier(unsigned id);
 };
 
 #endif
@@ -243,6 +243,11 @@ class TickDeadline {
         resetTo(latest);
     }
 
+    void setClock(const VirtualTime *_vtime) {
+        // Switch to a different (but equivalent) clock, keeping our deadline
+        vtime = _vtime;
+    }
+
     void reset() {
         ticks = 0xFFFFFFFFFFFFFFFFULL;
     }
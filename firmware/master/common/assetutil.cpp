@@ -288,6 +288,7 @@ unsigned AssetFIFO::fetchFromGroup(_SYSAssetLoaderCube &sys, AssetGroupInfo &gro
      * Most uses of 'head' and 'count' should totally optimize out.
      */
     AssetFIFO fifo(sys);
+    FlashBlockAccess access(FlashBlockAccess::ASSET, group.headerVA);
 
     unsigned dataSize = group.dataSize;
     if (offset >= dataSize)
@@ -347,6 +348,7 @@ void AssetGroupInfo::copyCRC(uint8_t *buffer) const
      */
 
     SvmMemory::VirtAddr va = headerVA + offsetof(_SYSAssetGroupHeader, crc);
+    FlashBlockAccess access(FlashBlockAccess::ASSET, headerVA);
 
     if (remapToVolume) {
         // Low-level volume mapping
@@ -28,19 +28,42 @@
 #include "flash_lfs.h"
 #include "svmdebugger.h"
 #include "faultlogger.h"
+#include "svmcpu.h"
+#include "tasks.h"
 #include <string.h>
 
 uint8_t FlashBlock::mem[NUM_CACHE_BLOCKS][BLOCK_SIZE] BLOCK_ALIGN;
 FlashBlock FlashBlock::instances[NUM_CACHE_BLOCKS];
 uint8_t FlashBlock::validCodeBundles[NUM_CACHE_BLOCKS];
-unsigned FlashBlock::latestStamp;
+uint8_t FlashBlock::hashHeads[NUM_HASH_BUCKETS];
+unsigned FlashBlock::clockHand;
+uint32_t FlashBlock::streamNext[NUM_PREFETCH_STREAMS];
+uint8_t FlashBlock::streamLength[NUM_PREFETCH_STREAMS];
+unsigned FlashBlock::streamVictim;
+uint8_t FlashBlock::prefetchQueue[PREFETCH_QUEUE_SIZE];
+unsigned FlashBlock::prefetchHead;
+unsigned FlashBlock::prefetchCount;
 
 
 void FlashBlock::init()
 {
+    STATIC_ASSERT(NUM_CACHE_BLOCKS < NO_BLOCK);
+    STATIC_ASSERT(sizeof(FlashBlock) == 8);
+
+    // Hash index starts out empty
+    memset(hashHeads, NO_BLOCK, sizeof hashHeads);
+    clockHand = 0;
+
+    // No read-ahead in progress
+    memset(streamNext, 0xFF, sizeof streamNext);
+    memset(streamLength, 0, sizeof streamLength);
+    prefetchCount = 0;
+
     // All blocks start out with no valid data
     for (unsigned i = 0; i < NUM_CACHE_BLOCKS; ++i) {
         instances[i].address = INVALID_ADDRESS;
+        instances[i].state = 0;
+        instances[i].hashNext = NO_BLOCK;
 
         // We explicitly store the ID of each block,
         // so that id() and getData() can be as fast as possible.
@@ -50,24 +73,45 @@ void FlashBlock::init()
     FLASHLAYER_STATS_ONLY(resetStats());
 }
 
+bool FlashBlock::isCached(uint32_t blockAddr)
+{
+    /*
+     * Is this block's data already in the cache? Blocks still waiting
+     * on a prefetch don't count. This doesn't count as an access, so it
+     * has no effect on which blocks we recycle.
+     */
+
+    FlashBlock *block = lookupBlock(blockAddr);
+    return block && !(block->state & S_IN_FLIGHT);
+}
+
 void FlashBlock::get(FlashBlockRef &ref, uint32_t blockAddr, unsigned flags)
 {
     ASSERT((blockAddr & BLOCK_MASK) == 0);
 
-    if (ref.isHeld() && ref->address == blockAddr) {
+    bool sameBlock = ref.isHeld() && ref->address == blockAddr;
+
+    if (sameBlock) {
         // Cache layer 1: Repeated access to the same block. Keep existing ref.
         FLASHLAYER_STATS_ONLY(stats.periodic.blockHitSame++);
 
     } else if (FlashBlock *cached = lookupBlock(blockAddr)) {
         // Cache layer 2: Block exists elsewhere in the cache
         FLASHLAYER_STATS_ONLY(stats.periodic.blockHitOther++);
+
+        if (UNLIKELY(cached->state & S_IN_FLIGHT)) {
+            // Read-ahead hasn't finished yet. Wait for it.
+            FLASHLAYER_STATS_ONLY(stats.periodic.prefetchWait++);
+            cached->load(blockAddr);
+        }
+
         ref.set(cached);
 
     } else {
         // Cache miss. Find a free block and reload it. Reset the lazy
         // code validator.
 
-        FlashBlock *recycled = recycleBlock(blockAddr);
+        FlashBlock *recycled = recycleBlock();
         ASSERT(recycled->refCount == 0);
         ASSERT(recycled >= &instances[0] && recycled < &instances[NUM_CACHE_BLOCKS]);
 
@@ -75,8 +119,12 @@ void FlashBlock::get(FlashBlockRef &ref, uint32_t blockAddr, unsigned flags)
         ref.set(recycled);
     }
     
-    // Update this block's access stamp (See recycleBlock)
-    ref->stamp = ++latestStamp;
+    // Give this block a second chance before it's recycled (See recycleBlock)
+    ref->state |= S_ACCESSED;
+
+    // Keep sequential reads ahead of us. Ignore repeated hits on one block.
+    if (!flags && !sameBlock)
+        readAhead(blockAddr);
 
     FLASHLAYER_STATS_ONLY(stats.periodic.blockTotal++);
     FLASHLAYER_STATS_ONLY(dumpStats());
@@ -99,13 +147,13 @@ void FlashBlock::anonymous(FlashBlockRef &ref)
      * the write address is not known ahead-of-time.
      */
 
-    FlashBlock *recycled = recycleBlock(INVALID_ADDRESS);
+    FlashBlock *recycled = recycleBlock();
     ASSERT(recycled->refCount == 0);
     ASSERT(recycled >= &instances[0] && recycled < &instances[NUM_CACHE_BLOCKS]);
 
     // This ensures nobody else will ref the same block.
-    recycled->address = INVALID_ADDRESS;
-    recycled->validCodeBundles[recycled->id()] = 0;
+    recycled->setAddress(INVALID_ADDRESS);
+    recycled->invalidateCode();
 
     ref.set(recycled);
     ASSERT(recycled->refCount == 1);
@@ -124,75 +172,106 @@ void FlashBlock::anonymous(FlashBlockRef &ref, uint8_t fillByte)
 ALWAYS_INLINE FlashBlock *FlashBlock::lookupBlock(uint32_t blockAddr)
 {
     /*
-     * This is a compromise between a fully associative and a set-associative
-     * cache. We can't usefully be set-associative with a small N, because
-     * our N would need to be at least as large as the worst-case number of
-     * referenced blocks.
-     *
-     * So instead, we'll still be a fully associative cache, but we use
-     * the address as a hint for which cache bucket to start in. We strongly
-     * prefer to place blocks in this cached address, but we don't require
-     * it (in case the preferred location is referenced or very recently
-     * accessed).
+     * The cache is fully associative, since any block may be pinned by a
+     * FlashBlockRef for an arbitrary length of time. A small fixed set
+     * size would run out of unreferenced blocks. Instead, every block with
+     * a flash address is linked into a hash bucket for that address, so
+     * lookups only examine blocks that hash to the same bucket.
      */
 
     ASSERT((blockAddr & BLOCK_MASK) == 0);
-    FlashBlock *ptr = &instances[(blockAddr >> BLOCK_SIZE_LOG2) % NUM_CACHE_BLOCKS];
-    unsigned count = NUM_CACHE_BLOCKS;
+    unsigned id = hashHeads[hashBucket(blockAddr)];
 
-    do {
+    while (id != NO_BLOCK) {
+        ASSERT(id < NUM_CACHE_BLOCKS);
+        FlashBlock *ptr = &instances[id];
         if (ptr->address == blockAddr)
             return ptr;
-        if (++ptr == &instances[NUM_CACHE_BLOCKS])
-            ptr = &instances[0];
-    } while (--count);
+        id = ptr->hashNext;
+    }
 
     return 0;
 }
 
-FlashBlock *FlashBlock::recycleBlock(uint32_t blockAddr)
+FlashBlock *FlashBlock::recycleBlock(bool mustSucceed)
 {
     /*
      * Look for a block we can recycle, in order to service a cache miss.
-     * To maintain the hash property of our cache, we strongly prefer to
-     * recycle the block which is directly mapped to the requested address.
      *
-     * We opt to skip to the next block if the preferred block is referenced,
-     * or if it was used recently. (Its stamp is recent).
+     * This is the CLOCK approximation of LRU: The hand sweeps around the
+     * cache, skipping referenced blocks and giving each recently accessed
+     * block a second chance by clearing its S_ACCESSED flag. Two full
+     * sweeps clear every flag, so if we get that far without finding a
+     * block, every block must be referenced.
+     *
+     * Blocks with a read-ahead in flight may be recycled like any other;
+     * setAddress() cancels the read.
      */
 
-    // First pass: Look for something both unreferenced and stale
-    {
-        FlashBlock *ptr = &instances[(blockAddr >> BLOCK_SIZE_LOG2) % NUM_CACHE_BLOCKS];
-        unsigned count = NUM_CACHE_BLOCKS;
-        const unsigned ageThreshold = NUM_CACHE_BLOCKS * 2;
-        unsigned localLatestStamp = latestStamp;
-
-        do {
-            if (ptr->refCount == 0 && (ptr->address == INVALID_ADDRESS
-                    || ptr->getAge(localLatestStamp) >= ageThreshold))
-                return ptr;
-            if (++ptr == &instances[NUM_CACHE_BLOCKS])
-                ptr = &instances[0];
-        } while (--count);
-    }
+    unsigned hand = clockHand;
+    unsigned count = NUM_CACHE_BLOCKS * 2;
 
-    // Second pass: Give up on finding a stale block, just look for anything unreferenced
-    {
-        FlashBlock *ptr = &instances[(blockAddr >> BLOCK_SIZE_LOG2) % NUM_CACHE_BLOCKS];
-        unsigned count = NUM_CACHE_BLOCKS;
-
-        do {
-            if (ptr->refCount == 0)
-                return ptr;
-            if (++ptr == &instances[NUM_CACHE_BLOCKS])
-                ptr = &instances[0];
-        } while (--count);
-    }
+    do {
+        FlashBlock *ptr = &instances[hand];
+        if (++hand == NUM_CACHE_BLOCKS)
+            hand = 0;
+
+        FLASHLAYER_STATS_ONLY(stats.periodic.recycleSteps++);
+
+        if (ptr->refCount)
+            continue;
+
+        if ((ptr->state & S_ACCESSED) && ptr->address != INVALID_ADDRESS) {
+            ptr->state &= ~S_ACCESSED;
+            continue;
+        }
+
+        FLASHLAYER_STATS_ONLY(stats.periodic.recycles++);
+        clockHand = hand;
+        return ptr;
+
+    } while (--count);
+
+    if (!mustSucceed)
+        return 0;
 
     FaultLogger::internalError(FaultLogger::F_OUT_OF_CACHE_BLOCKS);
 }
 
+void FlashBlock::setAddress(uint32_t blockAddr)
+{
+    /*
+     * Change the flash address this block caches, keeping the hash index
+     * up to date. Blocks with no address aren't indexed.
+     */
+
+    if (address == blockAddr)
+        return;
+
+    // Any read-ahead was for the old address
+    state &= ~S_IN_FLIGHT;
+
+    if (address != INVALID_ADDRESS) {
+        // Unlink from the old bucket
+        uint8_t *link = &hashHeads[hashBucket(address)];
+        while (*link != id()) {
+            ASSERT(*link != NO_BLOCK);
+            link = &instances[*link].hashNext;
+        }
+        *link = hashNext;
+        hashNext = NO_BLOCK;
+    }
+
+    address = blockAddr;
+
+    if (blockAddr != INVALID_ADDRESS) {
+        // Link at the head of the new bucket
+        uint8_t &head = hashHeads[hashBucket(blockAddr)];
+        hashNext = head;
+        head = id();
+    }
+}
+
 void FlashBlock::load(uint32_t blockAddr, unsigned flags)
 {
     /*
@@ -203,8 +282,9 @@ void FlashBlock::load(uint32_t blockAddr, unsigned flags)
     ASSERT(blockAddr != INVALID_ADDRESS);
     ASSERT((blockAddr & (BLOCK_SIZE - 1)) == 0);
 
-    validCodeBundles[id()] = 0;
-    address = blockAddr;
+    invalidateCode();
+    setAddress(blockAddr);
+    state &= ~S_IN_FLIGHT;
 
     uint8_t *data = getData();
     ASSERT(isAddrValid(reinterpret_cast<uintptr_t>(data)));
@@ -213,7 +293,7 @@ void FlashBlock::load(uint32_t blockAddr, unsigned flags)
     if (LIKELY(!flags)) {
         // Normal cache miss; fetch from hardware
         FlashDevice::read(blockAddr, data, BLOCK_SIZE);
-        FLASHLAYER_STATS_ONLY(countBlockMiss(blockAddr));
+        FLASHLAYER_STATS_ONLY(countBlockMiss(blockAddr, id()));
 
     } else if (flags & F_ABORT_TRAP) {
         // Create a _SYS_abort() trap page. Any address in this page will cause
@@ -243,6 +323,20 @@ void FlashBlock::load(uint32_t blockAddr, unsigned flags)
     SvmDebugger::patchFlashBlock(blockAddr, data);
 }
 
+void FlashBlock::invalidateCode()
+{
+    /*
+     * This block's contents are about to change. Forget anything we
+     * knew about the code inside it.
+     */
+
+    validCodeBundles[id()] = 0;
+
+    #ifdef SIFTEO_SIMULATOR
+        SvmCpu::invalidateDecodedBlock(id());
+    #endif
+}
+
 void FlashBlockWriter::beginBlock(uint32_t blockAddr)
 {
     if (ref.isHeld() && ref->getAddress() == blockAddr) {
@@ -269,7 +363,7 @@ void FlashBlockWriter::beginBlock(const FlashBlockRef &r)
     ASSERT(ref.isHeld());
 
     // Prepare to write
-    ref->validCodeBundles[ref->id()] = 0;
+    ref->invalidateCode();
 }
 
 void FlashBlockWriter::beginBlock()
@@ -333,7 +427,7 @@ void FlashBlock::invalidateBlock(unsigned flags)
             load(address, flags);
     } else {
         // Nobody's using this block, quietly mark it as invalid / anonymous
-        address = INVALID_ADDRESS;
+        setAddress(INVALID_ADDRESS);
     }
 }
 
@@ -401,16 +495,107 @@ void FlashBlockWriter::relocate(uint32_t blockAddr)
                     ASSERT(0);
                 }
 
-                b->address = FlashBlock::INVALID_ADDRESS;
+                b->setAddress(FlashBlock::INVALID_ADDRESS);
             }
         }
 
         // Replace this block's address in the cache.
-        block->address = blockAddr;
+        block->setAddress(blockAddr);
     }
 }
 
 void FlashBlock::preload(uint32_t blockAddr)
 {
-    // XXX: Implement me
+    /*
+     * Start reading a block in the background, if it isn't cached already.
+     * We assign the block a cache slot right away, but the actual read
+     * happens later in prefetchTask(), or in get() if someone needs this
+     * block before then.
+     *
+     * This is only a hint. If the queue is full or every block is in
+     * use, we do nothing.
+     */
+
+    blockAddr &= ~BLOCK_MASK;
+    if (blockAddr >= FlashDevice::CAPACITY || lookupBlock(blockAddr))
+        return;
+    if (prefetchCount == PREFETCH_QUEUE_SIZE)
+        return;
+
+    FlashBlock *block = recycleBlock(false);
+    if (!block)
+        return;
+    ASSERT(block->refCount == 0);
+
+    block->invalidateCode();
+    block->setAddress(blockAddr);
+    block->state = S_ACCESSED | S_IN_FLIGHT;
+
+    prefetchQueue[(prefetchHead + prefetchCount) % PREFETCH_QUEUE_SIZE] = block->id();
+    prefetchCount++;
+    Tasks::trigger(Tasks::FlashPrefetch);
+
+    FLASHLAYER_STATS_ONLY(stats.periodic.prefetchIssued++);
+}
+
+void FlashBlock::readAhead(uint32_t blockAddr)
+{
+    /*
+     * Detect sequential access. We follow a few independent streams, so
+     * that (for example) audio playback and asset loading don't keep
+     * interrupting each other. Once a stream has hit a few consecutive
+     * blocks, keep the next PREFETCH_DEPTH blocks on their way.
+     */
+
+    const unsigned threshold = 2;
+    unsigned i;
+
+    for (i = 0; i < NUM_PREFETCH_STREAMS; ++i)
+        if (streamNext[i] == blockAddr)
+            break;
+
+    if (i == NUM_PREFETCH_STREAMS) {
+        // Revisiting the latest block of a stream doesn't count
+        for (i = 0; i < NUM_PREFETCH_STREAMS; ++i)
+            if (streamNext[i] == blockAddr + BLOCK_SIZE)
+                return;
+
+        // Not part of a known stream. Start tracking a new one.
+        i = streamVictim;
+        streamVictim = (streamVictim + 1) % NUM_PREFETCH_STREAMS;
+        streamLength[i] = 0;
+
+    } else if (streamLength[i] < 0xFF) {
+        streamLength[i]++;
+    }
+
+    streamNext[i] = blockAddr + BLOCK_SIZE;
+
+    if (streamLength[i] >= threshold)
+        for (unsigned j = 1; j <= PREFETCH_DEPTH; ++j)
+            preload(blockAddr + j * BLOCK_SIZE);
+}
+
+void FlashBlock::prefetchTask()
+{
+    /*
+     * Finish one queued read-ahead per invocation, so higher priority
+     * tasks can run in between. Reads for blocks that have been recycled
+     * or invalidated since are skipped.
+     */
+
+    if (!prefetchCount)
+        return;
+
+    FlashBlock *block = &instances[prefetchQueue[prefetchHead]];
+    prefetchHead = (prefetchHead + 1) % PREFETCH_QUEUE_SIZE;
+    prefetchCount--;
+
+    if (block->state & S_IN_FLIGHT) {
+        FlashBlockAccess access(FlashBlockAccess::PREFETCH);
+        block->load(block->address);
+    }
+
+    if (prefetchCount)
+        Tasks::trigger(Tasks::FlashPrefetch);
 }
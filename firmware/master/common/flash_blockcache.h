@@ -47,9 +47,62 @@
 #  define FLASHLAYER_STATS_ONLY(x)
 #endif
 
+/*
+ * Cache size, in blocks. Override at build time to experiment with
+ * other cache sizes; block IDs must fit in a byte.
+ */
+#ifndef FLASH_CACHE_BLOCKS
+#  define FLASH_CACHE_BLOCKS  64    // 16 kB of cache
+#endif
+
 class FlashBlockRef;
 class FlashBlockWriter;
 
+/**
+ * Tags the flash cache misses that happen during this object's lifetime
+ * with the kind of access that caused them, for the simulator's miss
+ * report. Scopes nest, and the innermost one wins. Compiles to nothing
+ * on hardware.
+ */
+class FlashBlockAccess
+{
+public:
+    enum Kind {
+        OTHER = 0,
+        CODE,           // SVM instruction fetch
+        RODATA,         // SVM read-only data
+        ASSET,          // Asset group streaming
+        LFS,            // Log-structured filesystem
+        PREFETCH,       // Read-ahead, finished in the background
+        NUM_KINDS
+    };
+
+#ifdef SIFTEO_SIMULATOR
+    // Object being accessed, if known. For ASSET, the group's header VA.
+    static Kind currentKind;
+    static uint32_t currentObject;
+
+    FlashBlockAccess(Kind kind, uint32_t object = 0)
+        : savedKind(currentKind), savedObject(currentObject)
+    {
+        currentKind = kind;
+        currentObject = object;
+    }
+
+    ~FlashBlockAccess()
+    {
+        currentKind = savedKind;
+        currentObject = savedObject;
+    }
+
+private:
+    Kind savedKind;
+    uint32_t savedObject;
+#else
+    ALWAYS_INLINE FlashBlockAccess(Kind kind, uint32_t object = 0) {}
+#endif
+};
+
 /**
  * A single flash block, fetched via a globally shared cache.
  * This is the general-purpose mechansim used to randomly access arbitrary
@@ -59,7 +112,8 @@ class FlashBlock
 {
 public:
     // Cache layout (Preferably a power of two)
-    static const unsigned NUM_CACHE_BLOCKS = 64;    // 16 kB of cache
+    static const unsigned NUM_CACHE_BLOCKS = FLASH_CACHE_BLOCKS;
+    static const unsigned NUM_HASH_BUCKETS = NUM_CACHE_BLOCKS;
     static const unsigned MAX_REFCOUNT = NUM_CACHE_BLOCKS;
 
     // Block size (Must be a power of two)
@@ -71,6 +125,11 @@ public:
     // Special address for anonymous blocks
     static const uint32_t INVALID_ADDRESS = (uint32_t)-1;
 
+    // Read-ahead: Sequential streams we track, and how far ahead we read
+    static const unsigned NUM_PREFETCH_STREAMS = 4;
+    static const unsigned PREFETCH_DEPTH = 4;
+    static const unsigned PREFETCH_QUEUE_SIZE = 8;
+
     /// Flags
     enum {
         F_KNOWN_ERASED  = (1 << 0),      // Contents known to be erased
@@ -81,9 +140,19 @@ private:
     friend class FlashBlockRef;
     friend class FlashBlockWriter;
 
+    // Marks the end of a hash chain
+    static const uint8_t NO_BLOCK = 0xFF;
+
+    // Bits in 'state'
+    enum {
+        S_ACCESSED      = (1 << 0),     // Cleared by the CLOCK hand in recycleBlock()
+        S_IN_FLIGHT     = (1 << 1),     // Address assigned, but data not read yet
+    };
+
     // Keep this packed and power-of-two length
     uint32_t address;
-    uint16_t stamp;
+    uint8_t state;
+    uint8_t hashNext;       // Next block ID in this address's hash bucket
     uint8_t refCount;
     uint8_t idByte;
 
@@ -97,6 +166,10 @@ private:
             unsigned blockHitOther;
             unsigned blockMiss;
             unsigned blockTotal;
+            unsigned recycles;
+            unsigned recycleSteps;
+            unsigned prefetchIssued;
+            unsigned prefetchWait;
 
             // Should be last, for efficiency. This is large!
             uint32_t blockMissCounts[FlashDevice::CAPACITY / BLOCK_SIZE];
@@ -107,7 +180,16 @@ private:
 
     static uint8_t mem[NUM_CACHE_BLOCKS][BLOCK_SIZE] SECTION(".blockcache");
     static FlashBlock instances[NUM_CACHE_BLOCKS];
-    static unsigned latestStamp;
+    static uint8_t hashHeads[NUM_HASH_BUCKETS];
+    static unsigned clockHand;
+
+    // Read-ahead state
+    static uint32_t streamNext[NUM_PREFETCH_STREAMS];
+    static uint8_t streamLength[NUM_PREFETCH_STREAMS];
+    static unsigned streamVictim;
+    static uint8_t prefetchQueue[PREFETCH_QUEUE_SIZE];
+    static unsigned prefetchHead;
+    static unsigned prefetchCount;
 
     // Stored out-of-line, to keep the main FlashBlock length a power-of-two
     static uint8_t validCodeBundles[NUM_CACHE_BLOCKS];
@@ -152,11 +234,23 @@ public:
     }
 
 #ifdef SIFTEO_SIMULATOR
+    static const unsigned CACHE_MEM_SIZE = NUM_CACHE_BLOCKS * BLOCK_SIZE;
+
+    // Offset of a physical address in cache memory. Invalid if >= CACHE_MEM_SIZE.
+    static ALWAYS_INLINE uintptr_t getCacheOffset(uintptr_t pa) {
+        return reinterpret_cast<uint8_t*>(pa) - &mem[0][0];
+    }
+
+    // Bytes of validated code at the start of a cache slot, or zero if not validated yet.
+    static ALWAYS_INLINE unsigned getValidCodeBytes(unsigned cacheBlockID) {
+        return validCodeBundles[cacheBlockID] * Svm::BUNDLE_SIZE;
+    }
+
     static bool isAddrValid(uintptr_t pa);
     static void resetStats();
     static void dumpStats();
     static bool hotBlockSort(unsigned i, unsigned j);
-    static void countBlockMiss(uint32_t blockAddr);
+    static void countBlockMiss(uint32_t blockAddr, unsigned cacheBlockID);
     void verify();
 #endif
 
@@ -168,6 +262,10 @@ public:
     // Cached block accessors
     static void preload(uint32_t blockAddr);
     static void get(FlashBlockRef &ref, uint32_t blockAddr, unsigned flags = 0);
+    static bool isCached(uint32_t blockAddr);
+
+    // Task handler, finishes reads started by preload()
+    static void prefetchTask();
 
     // Support for anonymous memory
     static void anonymous(FlashBlockRef &ref);
@@ -200,13 +298,16 @@ private:
         })
     }
     
-    ALWAYS_INLINE unsigned getAge(unsigned latest) {
-        return uint16_t(latest - stamp);
+    static ALWAYS_INLINE unsigned hashBucket(uint32_t blockAddr) {
+        return (blockAddr >> BLOCK_SIZE_LOG2) % NUM_HASH_BUCKETS;
     }
 
     static FlashBlock *lookupBlock(uint32_t blockAddr);
-    static FlashBlock *recycleBlock(uint32_t blockAddr);
+    static FlashBlock *recycleBlock(bool mustSucceed = true);
+    static void readAhead(uint32_t blockAddr);
+    void setAddress(uint32_t blockAddr);
     void load(uint32_t blockAddr, unsigned flags = 0);
+    void invalidateCode();
 };
 
 
@@ -277,3 +277,28 @@ void FlashEraseLog::clearBlocks(FlashMapBlock::Set &inventory)
         }
     }
 }
+
+unsigned FlashEraseLog::countRecords()
+{
+    /*
+     * How many records are waiting to be popped, across all erase log volumes?
+     * Only reads the record flags needed to find each volume's indices; any
+     * records that turn out to be invalid later are still counted here.
+     */
+
+    FlashVolumeIter vi;
+    FlashEraseLog log;
+    unsigned count = 0;
+    vi.begin();
+
+    while (vi.next(log.volume)) {
+        if (log.volume.getType() != FlashVolume::T_ERASE_LOG)
+            continue;
+
+        log.findIndices();
+        if (log.writeIndex > log.readIndex)
+            count += log.writeIndex - log.readIndex;
+    }
+
+    return count;
+}
@@ -69,6 +69,7 @@ public:
 
     // Block inventory
     static void clearBlocks(FlashMapBlock::Set &inventory);
+    static unsigned countRecords();
 
     FlashVolume currentVolume() const {
         return volume;
@@ -28,10 +28,16 @@
 #include "macros.h"
 #include "bits.h"
 #include "crc.h"
+#include "tasks.h"
 
 FlashLFS FlashLFSCache::instances[SIZE];
+FlashLFSDirectory FlashLFSCache::directories[SIZE];
 uint8_t FlashLFSCache::lastUsed = 0;
 
+FlashVolume FlashLFSBackgroundGC::target;
+bool FlashLFSBackgroundGC::pending = false;
+bool FlashLFSBackgroundGC::running = false;
+
 
 uint8_t LFS::computeCheckByte(uint8_t a, uint8_t b)
 {
@@ -94,6 +100,7 @@ FlashLFSVolumeHeader *FlashLFSVolumeHeader::fromVolume(FlashBlockRef &ref, Flash
      * data space allocated for this structure. Returns 0 on error.
      */
 
+    FlashBlockAccess access(FlashBlockAccess::LFS);
     unsigned size;
     uint8_t *data = vol.mapTypeSpecificData(ref, size);
     if (size >= sizeof(FlashLFSVolumeHeader))
@@ -204,6 +211,7 @@ bool FlashLFSIndexBlockIter::beginBlock(uint32_t blockAddr)
      * an anchor can't be found.
      */
 
+    FlashBlockAccess access(FlashBlockAccess::LFS);
     FlashBlock::get(blockRef, blockAddr);
 
     FlashLFSIndexAnchor *ptr = LFS::firstAnchor(&*blockRef);
@@ -227,6 +235,29 @@ bool FlashLFSIndexBlockIter::beginBlock(uint32_t blockAddr)
     return true;
 }
 
+bool FlashLFSIndexBlockIter::seekRecord(uint32_t blockAddr, unsigned index)
+{
+    /*
+     * Point the iterator at a specific record slot, as returned by
+     * getRecordIndex(). We still walk forward from the anchor, since
+     * that's how we find each record's object offset.
+     *
+     * Returns false if that slot doesn't hold a valid record.
+     */
+
+    if (!beginBlock(blockAddr))
+        return false;
+
+    FlashLFSIndexRecord *target = LFS::firstRecord(anchor) + index;
+    while (next()) {
+        if (currentRecord == target)
+            return true;
+        if (currentRecord > target)
+            break;
+    }
+    return false;
+}
+
 bool FlashLFSIndexBlockIter::previous(FlashLFSKeyQuery query)
 {
     /*
@@ -474,6 +505,9 @@ void FlashLFS::initWithVolumeVector(FlashVolume parent, FlashLFSVolumeVector::Se
 
     volumes.sort(si);
 
+    if (directory)
+        directory->clear();
+
     unsigned index = volumes.numSlotsInUse;
     lastSequenceNumber = index ? si.slots[index - 1] : 0;
 
@@ -501,7 +535,8 @@ bool FlashLFS::newVolume(unsigned volLimit)
     unsigned hdrSize = sizeof(FlashLFSVolumeHeader);
     unsigned payloadSize = FlashLFSVolumeVector::VOL_PAYLOAD_SIZE;
 
-    FlashBlockRecycler recycler;
+    // Background GC may only use blocks that are already erased
+    FlashBlockRecycler recycler(true, !FlashLFSBackgroundGC::isRunning());
     if (!vw.begin(recycler, FlashVolume::T_LFS, payloadSize, hdrSize, parent))
         return false;
 
@@ -513,6 +548,7 @@ bool FlashLFS::newVolume(unsigned volLimit)
     vw.commit();
     volumes.append(vw.volume);
 
+    FlashLFSBackgroundGC::notify(*this);
     return true;
 }
 
@@ -531,6 +567,7 @@ FlashLFS &FlashLFSCache::get(FlashVolume parent)
     // Cache miss
     lastUsed = (lastUsed + 1) % SIZE;
     FlashLFS &lfs = instances[lastUsed];
+    lfs.directory = &directories[lastUsed];
     lfs.init(parent);
     ASSERT(lfs.isMatchFor(parent));
     return lfs;
@@ -543,6 +580,67 @@ void FlashLFSCache::invalidate()
         instances[i].invalidate();
 }
 
+void FlashLFSBackgroundGC::notify(FlashLFS &lfs)
+{
+    STATIC_ASSERT(LOW_WATERMARK < HIGH_WATERMARK);
+    STATIC_ASSERT(HIGH_WATERMARK < FlashLFSVolumeVector::MAX_OBJ_VOLUMES);
+
+    // One LFS at a time. Others will notify us again when they grow.
+    if (!pending && lfs.volumes.numSlotsInUse >= HIGH_WATERMARK) {
+        target = lfs.parent;
+        pending = true;
+    }
+}
+
+bool FlashLFSBackgroundGC::isQuiet()
+{
+    /*
+     * Is anything with a deadline waiting on us? A step doesn't erase, so
+     * unlike pre-erasing it's fine to run while a game is playing. Just
+     * stay out of the way of audio, and of anything talking to the cubes.
+     */
+
+    return !Tasks::isPending(Tasks::AudioPull) &&
+           !Tasks::isPending(Tasks::AssetLoader) &&
+           !Tasks::isPending(Tasks::CubeConnector) &&
+           !Tasks::isPending(Tasks::UsbOUT);
+}
+
+void FlashLFSBackgroundGC::heartbeat()
+{
+    // Pace ourselves: one step per heartbeat, and only when it's quiet
+    if (pending && isQuiet())
+        Tasks::trigger(Tasks::FlashGC);
+}
+
+void FlashLFSBackgroundGC::task()
+{
+    // Conditions may have changed since our heartbeat
+    if (!pending || !isQuiet())
+        return;
+
+    /*
+     * Only work on an LFS that's still cached. If it was evicted or
+     * invalidated, it can wait for the next notify().
+     */
+
+    for (unsigned i = 0; i < FlashLFSCache::SIZE; ++i) {
+        FlashLFS &lfs = FlashLFSCache::instances[i];
+        if (lfs.isMatchFor(target)) {
+            if (lfs.volumes.numSlotsInUse > LOW_WATERMARK) {
+                running = true;
+                bool progress = lfs.collectLocalGarbageStep(STEP_BYTES);
+                running = false;
+                if (progress)
+                    return;
+            }
+            break;
+        }
+    }
+
+    pending = false;
+}
+
 FlashLFSObjectAllocator::FlashLFSObjectAllocator(FlashLFS &lfs, unsigned key,
     unsigned size, unsigned crc)
     : lfs(lfs), key(key),
@@ -739,9 +837,115 @@ bool FlashLFSObjectAllocator::allocInVolumeRow(FlashVolume vol,
         hdr->add(row, key);
     }
 
+    // This is now the newest record for 'key'. We only allocate in the last volume.
+    if (lfs.directory) {
+        ASSERT(lfs.volumes.last().block.code == vol.block.code);
+        lfs.directory->update(key, lfs.volumes.numSlotsInUse - 1,
+            row, iter.getRecordIndex());
+    }
+
     return true;
 }
 
+void FlashLFSDirectory::build(FlashLFS &lfs)
+{
+    /*
+     * One backwards pass over the index finds the newest record for every
+     * key, without reading any object data. If we run out of entries, the
+     * newest keys are the ones we keep.
+     */
+
+    FlashLFSIndexRecord::KeyVector_t seenKeys;
+    seenKeys.clear();
+
+    numEntries = 0;
+    state = S_COMPLETE;
+
+    FlashLFSObjectIter iter(lfs);
+    while (iter.previous(FlashLFSKeyQuery(&seenKeys))) {
+        unsigned key = iter.record()->getKey();
+        ASSERT(seenKeys.test(key) == false);
+        seenKeys.mark(key);
+
+        if (numEntries == CAPACITY) {
+            state = S_INCOMPLETE;
+            break;
+        }
+
+        Entry &e = entries[numEntries++];
+        e.key = key;
+        e.volume = iter.volumeIndex();
+        e.row = iter.rowIndex();
+        e.record = iter.recordIndex();
+    }
+}
+
+FlashLFSDirectory::Entry *FlashLFSDirectory::find(unsigned key)
+{
+    ASSERT(numEntries <= CAPACITY);
+    for (unsigned i = 0; i < numEntries; ++i)
+        if (entries[i].key == key)
+            return &entries[i];
+    return 0;
+}
+
+void FlashLFSDirectory::update(unsigned key, unsigned volume, unsigned row, unsigned record)
+{
+    // Entry fields are 8-bit
+    STATIC_ASSERT(FlashLFSIndexRecord::MAX_KEYS <= 0x100);
+    STATIC_ASSERT(FlashLFSVolumeVector::MAX_VOLUMES <= 0x100);
+    STATIC_ASSERT(FlashLFSVolumeHeader::NUM_ROWS <= 0x100);
+    STATIC_ASSERT(FlashBlock::BLOCK_SIZE / sizeof(FlashLFSIndexRecord) <= 0x100);
+
+    // Nothing to keep up to date until the first lookup builds us
+    if (!isBuilt())
+        return;
+
+    Entry *e = find(key);
+    if (!e) {
+        if (numEntries == CAPACITY) {
+            state = S_INCOMPLETE;
+            return;
+        }
+        e = &entries[numEntries++];
+        e->key = key;
+    }
+
+    e->volume = volume;
+    e->row = row;
+    e->record = record;
+}
+
+void FlashLFSDirectory::deleteVolume(unsigned volume)
+{
+    /*
+     * Garbage collection is about to delete this slot from the
+     * FlashLFSVolumeVector, and compact the slots after it.
+     *
+     * Entries in the deleted volume are dropped. They should only be
+     * there if the newest record for a key was corrupt, in which case
+     * a scan will find the right fallback copy.
+     */
+
+    if (!isBuilt())
+        return;
+
+    unsigned writeIdx = 0;
+    for (unsigned readIdx = 0; readIdx < numEntries; ++readIdx) {
+        Entry e = entries[readIdx];
+
+        if (e.volume == volume) {
+            state = S_INCOMPLETE;
+            continue;
+        }
+        if (e.volume > volume)
+            e.volume--;
+
+        entries[writeIdx++] = e;
+    }
+    numEntries = writeIdx;
+}
+
 // Start just past the last volume
 FlashLFSObjectIter::FlashLFSObjectIter(FlashLFS &lfs)
     : lfs(lfs), volumeCount(lfs.volumes.numSlotsInUse + 1), rowCount(0)
@@ -784,6 +988,7 @@ bool FlashLFSObjectIter::readAndCheckCRCOnly(uint32_t &crc) const
     unsigned addr = address();
     unsigned remaining = record()->getSizeInBytes();
     FlashBlockRef ref;
+    FlashBlockAccess access(FlashBlockAccess::LFS);
     CrcStream cs;
     cs.reset();
 
@@ -817,6 +1022,7 @@ void FlashLFSObjectIter::copyToFlash(unsigned dest) const
     unsigned src = address();
     unsigned remaining = record()->getSizeInBytes();
     FlashBlockRef ref;
+    FlashBlockAccess access(FlashBlockAccess::LFS);
 
     while (remaining) {
         unsigned blockPart = src & ~FlashBlock::BLOCK_MASK;
@@ -834,12 +1040,68 @@ void FlashLFSObjectIter::copyToFlash(unsigned dest) const
     }
 }
 
+bool FlashLFSObjectIter::seekDirectory(unsigned key, bool &found)
+{
+    /*
+     * Use the LFS's directory, if any, to start an exact-key search at the
+     * newest record for that key. Returns true if the directory had an
+     * answer, with 'found' telling us whether we're now pointing at a
+     * record. Returns false if we have to scan.
+     */
+
+    FlashLFSDirectory *dir = lfs.directory;
+    if (!dir)
+        return false;
+
+    if (!dir->isBuilt())
+        dir->build(lfs);
+
+    const FlashLFSDirectory::Entry *e = dir->find(key);
+    if (!e) {
+        found = false;
+        return dir->isComplete();
+    }
+
+    if (e->volume < lfs.volumes.numSlotsInUse) {
+        volumeCount = e->volume + 1;
+        FlashVolume vol = volume();
+
+        if (vol.block.isValid()) {
+            unsigned hdrSize = sizeof(FlashLFSVolumeHeader);
+            hdr = (FlashLFSVolumeHeader*) vol.mapTypeSpecificData(hdrRef, hdrSize);
+            ASSERT(hdrSize == sizeof(FlashLFSVolumeHeader));
+            rowCount = e->row + 1;
+
+            if (indexIter.seekRecord(LFS::indexBlockAddr(vol, e->row), e->record)
+                && indexIter->getKey() == key) {
+                found = true;
+                return true;
+            }
+        }
+    }
+
+    // Stale entry. Forget the whole directory, and fall back on scanning.
+    dir->clear();
+    volumeCount = lfs.volumes.numSlotsInUse + 1;
+    rowCount = 0;
+    return false;
+}
+
 bool FlashLFSObjectIter::previous(FlashLFSKeyQuery query)
 {
     ASSERT(lfs.isValid());
     ASSERT(volumeCount <= lfs.volumes.numSlotsInUse + 1);
     DEBUG_ONLY(lfs.volumes.debugChecks());
 
+    // An exact-key search may be able to skip straight to its newest record
+    bool found;
+    unsigned key = query.getExactKey();
+    if (isPastEnd() && key != LFS::KEY_ANY && seekDirectory(key, found)) {
+        if (found)
+            return true;
+        volumeCount = 0;
+    }
+
     while (volumeCount) {
 
         if (rowCount) {
@@ -1038,7 +1300,8 @@ bool FlashLFS::collectLocalGarbage()
      * that are mostly wasted space.
      */
 
-    scrubUnderutilizedVolumes(volumesToKeep, utilization);
+    unsigned budget = -1;   // No limit
+    scrubUnderutilizedVolumes(volumesToKeep, utilization, budget);
 
     /*
      * Delete obsolete volumes, i.e. any volume that we haven't marked
@@ -1053,6 +1316,40 @@ bool FlashLFS::collectLocalGarbage()
     return deleteGarbageVolumes(volumesToKeep, numSlotsInUse);
 }
 
+bool FlashLFS::collectLocalGarbageStep(unsigned budget)
+{
+    /*
+     * Like collectLocalGarbage(), but stop scrubbing after copying about
+     * 'budget' bytes. Returns 'true' if we made any progress.
+     *
+     * Nothing carries over from one step to the next, so it's fine if
+     * the LFS changes in between. Records we copied last time are now
+     * the newest versions of their keys, so the next step sees the
+     * originals as obsolete and picks up where we left off.
+     */
+
+    ASSERT(isValid());
+
+    unsigned numSlotsInUse = volumes.numSlotsInUse;
+    if (numSlotsInUse == 0)
+        return false;
+
+    VolumeIndexVector volumesToKeep;
+    VolumeUtilizationVector utilization;
+
+    findGarbageCandidates(volumesToKeep, utilization);
+
+    // Volumes that are already empty cost almost nothing to delete
+    if (deleteGarbageVolumes(volumesToKeep, numSlotsInUse))
+        return true;
+
+    unsigned remaining = budget;
+    scrubUnderutilizedVolumes(volumesToKeep, utilization, remaining);
+    deleteGarbageVolumes(volumesToKeep, numSlotsInUse);
+
+    return remaining != budget;
+}
+
 void FlashLFS::findGarbageCandidates(VolumeIndexVector &volumesToKeep, VolumeUtilizationVector &utilization)
 {
     /*
@@ -1116,21 +1413,33 @@ bool FlashLFS::deleteGarbageVolumes(const VolumeIndexVector &volumesToKeep, unsi
     /*
      * Compact the volume list. This can renumber volumes, making our
      * obsoleteKeys and utilization arrays above no longer meaningful.
+     *
+     * The directory gets renumbered to match. Going from the top down
+     * means each deleted index is still correct when we get to it.
      */
 
-    if (foundGarbage)
+    if (foundGarbage) {
+        if (directory) {
+            for (unsigned i = volumes.numSlotsInUse; i--;)
+                if (!volumes.slots[i].block.isValid())
+                    directory->deleteVolume(i);
+        }
         volumes.compact();
+    }
 
     return foundGarbage;
 }
 
-void FlashLFS::scrubUnderutilizedVolumes(VolumeIndexVector &volumesToKeep, const VolumeUtilizationVector &utilization)
+void FlashLFS::scrubUnderutilizedVolumes(VolumeIndexVector &volumesToKeep,
+    const VolumeUtilizationVector &utilization, unsigned &budget)
 {
     /*
      * Given some information about the utilization level of our volumes, iterate
      * through and look for volumes which aren't totally empty, but are mostly
      * obsolete. These volumes will be 'scrubbed' by scrubVolume(). Any volumes
      * which are successfully scrubbed will get removed from 'volumesToKeep'.
+     *
+     * Copying stops once 'budget' bytes have been used up.
      */
 
     // Scrub volumes after they're less than half full.
@@ -1151,6 +1460,10 @@ void FlashLFS::scrubUnderutilizedVolumes(VolumeIndexVector &volumesToKeep, const
      */
     for (int i = volumes.numSlotsInUse - 2; i > 0; --i) {
 
+        // Out of time for now?
+        if (budget == 0)
+            return;
+
         // Already planning on deleting this one?
         if (!volumesToKeep.test(i))
             continue;
@@ -1197,13 +1510,13 @@ void FlashLFS::scrubUnderutilizedVolumes(VolumeIndexVector &volumesToKeep, const
         }
 
         // Now try to scrub this particular volume. If successful, we'll mark it for deletion.
-        if (scrubVolume(i, iter, obsoleteKeys, crc))
+        if (scrubVolume(i, iter, obsoleteKeys, crc, budget))
             volumesToKeep.clear(i);
     }
 }
 
 bool FlashLFS::scrubVolume(unsigned volIndex, FlashLFSObjectIter &iter,
-    FlashLFSIndexRecord::KeyVector_t &obsoleteKeys, uint32_t &crc)
+    FlashLFSIndexRecord::KeyVector_t &obsoleteKeys, uint32_t &crc, unsigned &budget)
 {
     /*
      * Scrub the volume. If we're successful, we can return true and the volume will be deleted.
@@ -1217,19 +1530,27 @@ bool FlashLFS::scrubVolume(unsigned volIndex, FlashLFSObjectIter &iter,
      * the loop in scrubUnderutilizedVolumes().
      *
      * 'crc' must always be the CRC of the current record pointed to by 'iter'.
+     *
+     * Each copy is charged against 'budget'. If it runs out, we return false
+     * with the iterator still pointing at a record we haven't copied.
      */
 
     while (iter.isInVolumeIndex(volIndex)) {
 
         if (!iter.isPastEnd()) {
             unsigned key = iter.record()->getKey();
+            unsigned size = iter.record()->getSizeInBytes();
             ASSERT(obsoleteKeys.test(key) == false);
 
+            if (budget == 0)
+                return false;
+
             // Found a key that isn't yet obsolete. Copy it!
             if (!writeCopyOfRecord(iter.record(), crc, iter.address()))
                 return false;
 
             obsoleteKeys.mark(key);
+            budget -= MIN(budget, size);
         }
 
         // Move to the next non-obsolete record with a valid CRC
@@ -75,6 +75,7 @@
 #include "bits.h"
 #include <sifteo/abi.h>
 
+class FlashLFS;
 class FlashLFSObjectIter;
 
 
@@ -339,6 +340,11 @@ public:
 
     bool test(unsigned row, FlashLFSKeyFilter f);
     bool test(unsigned key);
+
+    // The one key this query matches, or KEY_ANY
+    ALWAYS_INLINE unsigned getExactKey() const {
+        return exactKey;
+    }
 };
 
 
@@ -459,6 +465,7 @@ class FlashLFSIndexBlockIter
 
 public:
     bool beginBlock(uint32_t blockAddr);
+    bool seekRecord(uint32_t blockAddr, unsigned index);
 
     bool previous(FlashLFSKeyQuery query);
     bool next();
@@ -481,6 +488,12 @@ public:
         return currentOffset;
     }
 
+    // Position of the current record slot, counting from the anchor
+    ALWAYS_INLINE unsigned getRecordIndex() const {
+        ASSERT(currentRecord);
+        return currentRecord - LFS::firstRecord(anchor);
+    }
+
     ALWAYS_INLINE unsigned getNextOffset() const
     {
         FlashLFSIndexRecord *p = currentRecord;
@@ -578,6 +591,66 @@ public:
 };
 
 
+/**
+ * FlashLFSDirectory is an in-RAM map from key to the newest index record
+ * for that key, for a single LFS. With it, a lookup by key can go straight
+ * to the right index block, instead of walking backwards through every
+ * newer volume and row.
+ *
+ * The directory is built lazily, with one index scan on the first exact-key
+ * lookup, and it's kept current by FlashLFSObjectAllocator and by garbage
+ * collection. Entries locate index records, not verified objects. If the
+ * newest copy of an object fails its CRC check, the reader keeps iterating
+ * backwards from there, exactly as it would have without the directory.
+ *
+ * Storage is fixed-size. If an LFS has more keys than we have entries, the
+ * directory is marked incomplete: keys we do have are still found directly,
+ * and any other key falls back to scanning.
+ */
+class FlashLFSDirectory
+{
+public:
+    static const unsigned CAPACITY = 64;
+
+    struct Entry {
+        uint8_t key;
+        uint8_t volume;     // Index in FlashLFSVolumeVector
+        uint8_t row;        // Meta-index row
+        uint8_t record;     // Record slot, from FlashLFSIndexBlockIter::getRecordIndex()
+    };
+
+    ALWAYS_INLINE void clear() {
+        numEntries = 0;
+        state = S_EMPTY;
+    }
+
+    ALWAYS_INLINE bool isBuilt() const {
+        return state != S_EMPTY;
+    }
+
+    // If a key isn't in a complete directory, it isn't in the LFS either
+    ALWAYS_INLINE bool isComplete() const {
+        return state == S_COMPLETE;
+    }
+
+    void build(FlashLFS &lfs);
+    Entry *find(unsigned key);
+    void update(unsigned key, unsigned volume, unsigned row, unsigned record);
+    void deleteVolume(unsigned volume);
+
+private:
+    enum State {
+        S_EMPTY = 0,        // Not built yet
+        S_COMPLETE,         // Every key in the LFS has an entry
+        S_INCOMPLETE,       // Ran out of entries; other keys need a scan
+    };
+
+    Entry entries[CAPACITY];
+    uint8_t numEntries;
+    uint8_t state;
+};
+
+
 /**
  * Represents the in-memory state associated with a single LFS.
  *
@@ -592,7 +665,8 @@ class FlashLFS
 public:
     FlashLFS()
         : lastSequenceNumber(INVALID_LSN),
-          parent(FlashMapBlock::invalid())
+          parent(FlashMapBlock::invalid()),
+          directory(0)
     {}
 
     void init(FlashVolume parent);
@@ -609,6 +683,9 @@ public:
     // Collect only local garbage on volumes owned by this LFS
     bool collectLocalGarbage();
 
+    // One bounded slice of collectLocalGarbage(), copying about 'budget' bytes at most
+    bool collectLocalGarbageStep(unsigned budget);
+
     ALWAYS_INLINE void invalidate() {
         lastSequenceNumber = INVALID_LSN;
     }
@@ -625,13 +702,16 @@ public:
     FlashVolume parent;
     FlashLFSVolumeVector volumes;
 
+    // Optional; only instances in FlashLFSCache have one
+    FlashLFSDirectory *directory;
+
 private:
     typedef BitVector<FlashLFSVolumeVector::MAX_VOLUMES> VolumeIndexVector;
     typedef uint16_t VolumeUtilizationVector[FlashLFSVolumeVector::MAX_VOLUMES];
 
     void findGarbageCandidates(VolumeIndexVector &volumesToKeep, VolumeUtilizationVector &utilization);
-    void scrubUnderutilizedVolumes(VolumeIndexVector &volumesToKeep, const VolumeUtilizationVector &utilization);
-    bool scrubVolume(unsigned volIndex, FlashLFSObjectIter &iter, FlashLFSIndexRecord::KeyVector_t &obsoleteKeys, uint32_t &crc);
+    void scrubUnderutilizedVolumes(VolumeIndexVector &volumesToKeep, const VolumeUtilizationVector &utilization, unsigned &budget);
+    bool scrubVolume(unsigned volIndex, FlashLFSObjectIter &iter, FlashLFSIndexRecord::KeyVector_t &obsoleteKeys, uint32_t &crc, unsigned &budget);
     bool deleteGarbageVolumes(const VolumeIndexVector &volumesToKeep, unsigned numSlotsInUse);
     bool writeCopyOfRecord(const FlashLFSIndexRecord *record, uint32_t crc, unsigned srcAddress);
 };
@@ -656,10 +736,61 @@ public:
     static FlashLFS instances[SIZE];
 
 private:
+    static FlashLFSDirectory directories[SIZE];
     static uint8_t lastUsed;
 };
 
 
+/**
+ * Collects LFS garbage in the background, a little at a time, so that
+ * saving an object rarely has to stop and scrub a whole volume first.
+ *
+ * We start once an LFS reaches HIGH_WATERMARK volumes, about halfway to
+ * the point where FlashLFSObjectAllocator::allocateAndCollectGarbage()
+ * would have to collect synchronously, and stop again at LOW_WATERMARK.
+ * Collecting that early only costs extra erases for volumes that are
+ * already mostly garbage, since well-utilized volumes are never scrubbed.
+ *
+ * We take at most one small step per heartbeat, from a low-priority Task.
+ * Each step deletes volumes that are already empty, or copies at most
+ * STEP_BYTES of live data out of under-utilized volumes. A step never
+ * erases anything: new volumes only come from blocks that were already
+ * pre-erased, and if there are none the copy fails and we wait for the
+ * next notify(). That keeps each step short enough to run while a game
+ * is playing, so we only hold off while isQuiet() says radio or audio
+ * work is waiting. We also stop when a step finds nothing worth doing,
+ * or when the LFS leaves FlashLFSCache.
+ *
+ * This never replaces the synchronous collection, which still runs if we
+ * actually run out of space.
+ */
+class FlashLFSBackgroundGC
+{
+public:
+    static const unsigned HIGH_WATERMARK = FlashLFSVolumeVector::MAX_OBJ_VOLUMES / 2;
+    static const unsigned LOW_WATERMARK = HIGH_WATERMARK - 1;
+    static const unsigned STEP_BYTES = 4096;
+
+    // Called when an LFS gains a volume
+    static void notify(FlashLFS &lfs);
+
+    static void heartbeat();
+    static void task();
+
+    // Are we inside task()? If so, new volumes must not erase anything.
+    static ALWAYS_INLINE bool isRunning() {
+        return running;
+    }
+
+private:
+    static FlashVolume target;
+    static bool pending;
+    static bool running;
+
+    static bool isQuiet();
+};
+
+
 /**
  * Manages the process of allocating a new object in an LFS. This
  * object keeps state which is accessed at several levels of the
@@ -747,6 +878,17 @@ public:
         return volumeCount - 1;
     }
 
+    // Current meta-index row within volume()
+    ALWAYS_INLINE unsigned rowIndex() const {
+        ASSERT(rowCount > 0);
+        return rowCount - 1;
+    }
+
+    // Current record slot within the row's index block
+    ALWAYS_INLINE unsigned recordIndex() const {
+        return indexIter.getRecordIndex();
+    }
+
     // Current volume
     ALWAYS_INLINE FlashVolume volume() const {
         return lfs.volumes.slots[volumeIndex()];
@@ -756,6 +898,8 @@ private:
     FlashLFS &lfs;
     FlashLFSIndexBlockIter indexIter;
 
+    bool seekDirectory(unsigned key, bool &found);
+
     // Counts of remaining volumes/rows, including the 'current' one
     unsigned volumeCount;
     unsigned rowCount;
@@ -46,7 +46,7 @@ void FlashMapBlock::erase() const
     }
 
     // Must take place after erasing the flash device, for debug-only verify checks
-    FlashBlock::invalidate(I, E, FlashBlock::F_KNOWN_ERASED);
+    FlashBlock::invalidate(address(), E, FlashBlock::F_KNOWN_ERASED);
 }
 
 bool FlashMapSpan::flashAddrToOffset(FlashAddr flashAddr, ByteOffset &byteOffset) const
@@ -88,14 +88,32 @@ bool FlashMapSpan::flashAddrToOffset(FlashAddr flashAddr, ByteOffset &byteOffset
 
 bool FlashMapSpan::copyBytes(FlashBlockRef &ref, ByteOffset byteOffset, uint8_t *dest, uint32_t length) const
 {
+    /*
+     * Long copies stream straight from the device into 'dest', reading
+     * whole contiguous runs at once. We still use any blocks that are
+     * already in the cache, and short copies always go through the cache.
+     */
+
+    bool bulk = length >= BULK_COPY_THRESHOLD;
+
     while (length) {
-        PhysAddr srcPA;
-        uint32_t chunk = length;
+        uint32_t chunk = bulk ? contiguousLength(byteOffset, length, true) : 0;
 
-        if (!getBytes(ref, byteOffset, srcPA, chunk))
-            return false;
+        if (chunk) {
+            FlashAddr fa;
+            offsetToFlashAddr(byteOffset, fa);
+            FlashDevice::read(fa, dest, chunk);
+
+        } else {
+            PhysAddr srcPA;
+            chunk = length;
+
+            if (!getBytes(ref, byteOffset, srcPA, chunk))
+                return false;
+
+            memcpy(dest, srcPA, chunk);
+        }
 
-        memcpy(dest, srcPA, chunk);
         dest += chunk;
         byteOffset += chunk;
         length -= chunk;
@@ -107,22 +125,13 @@ bool FlashMapSpan::copyBytes(FlashBlockRef &ref, ByteOffset byteOffset, uint8_t
 bool FlashMapSpan::copyBytesUncached(ByteOffset byteOffset, uint8_t *dest, uint32_t length) const
 {
     while (length) {
-        /*
-         * Note: Even though we are bypassing the cache, we still split on
-         *       cache block boundaries, since that's also the alignment
-         *       guaranteed by a FlashMapSpan.
-         */
-
-        ByteOffset blockPart = byteOffset & ~(ByteOffset)FlashBlock::BLOCK_MASK;
-        ByteOffset bytePart = byteOffset & FlashBlock::BLOCK_MASK;
-        uint32_t maxLength = FlashBlock::BLOCK_SIZE - bytePart;
-        uint32_t chunk = MIN(length, maxLength);
-
-        FlashAddr fa;
-        if (!offsetToFlashAddr(blockPart, fa))
+        uint32_t chunk = contiguousLength(byteOffset, length, false);
+        if (!chunk)
             return false;
 
-        FlashDevice::read(fa + bytePart, dest, chunk);
+        FlashAddr fa;
+        offsetToFlashAddr(byteOffset, fa);
+        FlashDevice::read(fa, dest, chunk);
 
         byteOffset += chunk;
         dest += chunk;
@@ -131,3 +140,39 @@ bool FlashMapSpan::copyBytesUncached(ByteOffset byteOffset, uint8_t *dest, uint3
 
     return true;
 }
+
+uint32_t FlashMapSpan::contiguousLength(ByteOffset byteOffset, uint32_t length, bool stopAtCached) const
+{
+    /*
+     * How many bytes starting at 'byteOffset' can we get with a single
+     * FlashDevice::read()? Runs continue across FlashMapBlock boundaries
+     * whenever the next map block happens to be physically adjacent.
+     *
+     * With 'stopAtCached', the run also ends at the first cache block
+     * that's already in the FlashBlock cache, so the caller can copy that
+     * one from RAM instead.
+     *
+     * Returns zero if 'byteOffset' is invalid, or if it's cached and we
+     * were asked to stop there.
+     */
+
+    FlashAddr start;
+    if (!offsetToFlashAddr(byteOffset, start))
+        return 0;
+
+    length = MIN(length, FlashDevice::MAX_READ_LENGTH);
+    uint32_t result = 0;
+
+    while (result < length) {
+        FlashAddr fa;
+        if (!offsetToFlashAddr(byteOffset + result, fa) || fa != start + result)
+            break;
+
+        if (stopAtCached && FlashBlock::isCached(fa & ~(FlashAddr)FlashBlock::BLOCK_MASK))
+            break;
+
+        result += FlashBlock::BLOCK_SIZE - (fa & FlashBlock::BLOCK_MASK);
+    }
+
+    return MIN(result, length);
+}
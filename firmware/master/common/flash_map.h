@@ -270,6 +270,10 @@ public:
 
     // Cache-bypassing data access
     bool copyBytesUncached(ByteOffset byteOffset, uint8_t *dest, uint32_t length) const;
+    uint32_t contiguousLength(ByteOffset byteOffset, uint32_t length, bool stopAtCached) const;
+
+    // copyBytes() reads straight from the device for copies at least this long
+    static const unsigned BULK_COPY_THRESHOLD = 4 * FlashBlock::BLOCK_SIZE;
 };
 
 
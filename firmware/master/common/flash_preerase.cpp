@@ -24,6 +24,21 @@
  */
 
 #include "flash_preerase.h"
+#include "tasks.h"
+#include "idletimeout.h"
+#include "homebutton.h"
+#include "audiomixer.h"
+#include "assetloader.h"
+#include "svmclock.h"
+#include "cubeslots.h"
+#include "usbvolumemanager.h"
+#include "svmloader.h"
+
+FlashPreEraseScheduler::Stats FlashPreEraseScheduler::stats;
+unsigned FlashPreEraseScheduler::backoff = 0;
+FlashMapBlock FlashPreEraseScheduler::erasing;
+FlashBlockRecycler::EraseCount FlashPreEraseScheduler::erasingCount;
+unsigned FlashPreEraseScheduler::erasingOffset;
 
 
 // Tell our FlashBlockRecycler not to use the erase log
@@ -50,3 +65,155 @@ bool FlashBlockPreEraser::next()
     log.commit(r);
     return true;
 }
+
+bool FlashPreEraseScheduler::isIdle()
+{
+    /*
+     * Is this a good time to tie up the flash device for a block erasure?
+     *
+     * Never while a game is running; its next flash access would stall.
+     * The launcher can live with that once nobody is touching it. Don't
+     * interrupt anything that streams from flash, talks to the cubes,
+     * or has a deadline, and never recycle blocks while an install is
+     * holding a T_INCOMPLETE volume open; the recycler would happily
+     * reclaim it.
+     */
+
+    if (!SvmClock::isPaused() && SvmLoader::getRunLevel() != SvmLoader::RUNLEVEL_LAUNCHER)
+        return false;
+
+    if (AudioMixer::instance.active() || AssetLoader::getActiveCubes())
+        return false;
+
+    if (CubeSlots::waitingOnCubes || CubeSlots::touch || Tasks::isPending(Tasks::CubeConnector))
+        return false;
+
+    if (HomeButton::isPressed() || Tasks::isPending(Tasks::UsbOUT) || Tasks::isPending(Tasks::UsbIN))
+        return false;
+
+    if (IdleTimeout::idleHeartbeats() < QUIET_HEARTBEATS)
+        return false;
+
+    return !UsbVolumeManager::isWriting();
+}
+
+void FlashPreEraseScheduler::heartbeat()
+{
+    if (backoff) {
+        backoff--;
+        return;
+    }
+
+    // One step per heartbeat at most. Each erase takes longer anyway.
+    if ((erasing.isValid() || stats.poolDepth < TARGET_POOL) && isIdle())
+        Tasks::trigger(Tasks::FlashPreErase);
+}
+
+void FlashPreEraseScheduler::task()
+{
+    // Conditions may have changed since our heartbeat
+    if (!isIdle())
+        return;
+
+    if (erasing.isValid()) {
+        continueErase();
+        return;
+    }
+
+    /*
+     * Re-count from the log itself. Foreground allocations and
+     * ShutdownManager::housekeeping() both change the pool behind our back.
+     */
+
+    stats.poolDepth = FlashEraseLog::countRecords();
+    if (stats.poolDepth >= TARGET_POOL)
+        return;
+
+    if (!beginErase()) {
+        // Nothing left to recycle. Don't keep rescanning every heartbeat.
+        backoff = EXHAUSTED_HEARTBEATS;
+    }
+}
+
+bool FlashPreEraseScheduler::beginErase()
+{
+    /*
+     * Pick a block and start erasing it. Like FlashBlockPreEraser, make
+     * sure there's room to log it before we take anything, and keep the
+     * recycler away from the erase log so we always make progress.
+     */
+
+    {
+        FlashEraseLog log;
+        FlashBlockRecycler recycler(false);
+
+        if (!log.allocate(recycler) || !recycler.nextUnerased(erasing, erasingCount))
+            return false;
+
+        // The recycler writes back the deleted volume's map as it goes out of scope
+    }
+
+    erasingOffset = 0;
+    continueErase();
+    return true;
+}
+
+void FlashPreEraseScheduler::continueErase()
+{
+    ASSERT(erasing.isValid());
+
+    // Still busy with the last part? Check again next heartbeat.
+    if (FlashDevice::busy())
+        return;
+
+    if (erasingOffset < FlashMapBlock::BLOCK_SIZE) {
+        FlashDevice::eraseBlock(erasing.address() + erasingOffset);
+        erasingOffset += FlashDevice::ERASE_BLOCK_SIZE;
+        return;
+    }
+
+    logErase();
+}
+
+void FlashPreEraseScheduler::finishErase()
+{
+    if (!erasing.isValid())
+        return;
+
+    for (; erasingOffset < FlashMapBlock::BLOCK_SIZE; erasingOffset += FlashDevice::ERASE_BLOCK_SIZE) {
+        Tasks::resetWatchdog();
+        FlashDevice::eraseBlock(erasing.address() + erasingOffset);
+    }
+
+    // Our next flash access waits for the last erase to finish
+    logErase();
+}
+
+void FlashPreEraseScheduler::logErase()
+{
+    /*
+     * Every part of 'erasing' has finished erasing. Add it to the pool.
+     *
+     * We're done with it either way, so forget it before doing anything
+     * that might construct another recycler. If there's suddenly no room
+     * in the log, only take room from the pool itself; the block becomes
+     * an orphan, which costs one extra erase whenever it's recycled again.
+     */
+
+    FlashEraseLog::Record rec;
+    rec.block = erasing;
+    rec.ec = erasingCount;
+    erasing.setInvalid();
+
+    // Must take place after erasing the flash device, for debug-only verify checks
+    FlashBlock::invalidate(rec.block.address(), rec.block.address() + FlashMapBlock::BLOCK_SIZE,
+        FlashBlock::F_KNOWN_ERASED);
+
+    FlashEraseLog log;
+    FlashBlockRecycler recycler(true, false);
+    if (log.allocate(recycler)) {
+        log.commit(rec);
+        stats.poolDepth++;
+        stats.preErased++;
+    }
+}
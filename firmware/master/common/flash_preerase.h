@@ -46,4 +46,63 @@ private:
 };
 
 
+/**
+ * Keeps a pool of pre-erased blocks in the FlashEraseLog topped up in the
+ * background, so that new volumes (USB installs especially) can be written
+ * at the speed of flash programming rather than flash erasure.
+ *
+ * We never wait on the device. A task run starts erasing one part of a
+ * block and returns; later runs poll FlashDevice::busy(), start the next
+ * part once the device is free, and log the block when it's all erased.
+ * The main thread keeps running in the meantime, but anything else that
+ * touches flash still waits for the erase in progress, which can take
+ * most of a second. No running game can afford that, so we only run while
+ * the game is paused (in the pause menu, or on the way to an idle
+ * shutdown) or the launcher is up, and nothing else is going on: no
+ * audio, asset loading, radio traffic to the cubes, or USB, and nobody
+ * has touched anything for a couple of seconds.
+ *
+ * A block we're still erasing isn't in any volume or in the erase log, so
+ * it looks orphaned. Any FlashBlockRecycler that might hand out orphans
+ * calls finishErase() first, which completes it synchronously.
+ */
+
+class FlashPreEraseScheduler {
+public:
+    static const unsigned TARGET_POOL = 16;                 // 2 MB of erased space
+    static const unsigned QUIET_HEARTBEATS = 20;            // 2 seconds
+    static const unsigned EXHAUSTED_HEARTBEATS = 300;       // Back off for 30 seconds
+
+    struct Stats {
+        unsigned poolDepth;     // Pre-erased blocks, as of our last count
+        unsigned poolHits;      // Recycled blocks that came from the pool
+        unsigned eraseStalls;   // Recycled blocks that had to be erased inline
+        unsigned preErased;     // Blocks we erased in the background
+    };
+
+    static Stats stats;
+
+    static void heartbeat();
+    static void task();
+
+    // Can we tie up flash without anyone noticing?
+    static bool isIdle();
+
+    // Complete and log the block we're erasing, if any, waiting if we must
+    static void finishErase();
+
+private:
+    static unsigned backoff;
+
+    // The block we're erasing, and how much of it we've started on
+    static FlashMapBlock erasing;
+    static FlashBlockRecycler::EraseCount erasingCount;
+    static unsigned erasingOffset;
+
+    static bool beginErase();
+    static void continueErase();
+    static void logErase();
+};
+
+
 #endif
@@ -27,15 +27,24 @@
 #include "flash_volumeheader.h"
 #include "flash_recycler.h"
 #include "flash_eraselog.h"
+#include "flash_preerase.h"
 #include "svmloader.h"
 
 
-FlashBlockRecycler::FlashBlockRecycler(bool useEraseLog)
-    : useEraseLog(useEraseLog)
+FlashBlockRecycler::FlashBlockRecycler(bool useEraseLog, bool allowErase)
+    : useEraseLog(useEraseLog), allowErase(allowErase)
 {
+    ASSERT(useEraseLog || allowErase);
     ASSERT(!dirtyVolume.ref.isHeld());
-    findOrphansAndDeletedVolumes();
-    findCandidateVolumes();
+
+    // Only needed if we're going to pick blocks to erase ourselves
+    if (allowErase) {
+        // A block the pre-eraser is still working on would look orphaned
+        FlashPreEraseScheduler::finishErase();
+
+        findOrphansAndDeletedVolumes();
+        findCandidateVolumes();
+    }
 }
 
 void FlashBlockRecycler::findOrphansAndDeletedVolumes()
@@ -186,12 +195,41 @@ bool FlashBlockRecycler::next(FlashMapBlock &block, EraseCount &eraseCount)
     if (useEraseLog) {
         FlashEraseLog::Record rec;
         if (eraseLog.pop(rec)) {
+            FlashPreEraseScheduler::Stats &stats = FlashPreEraseScheduler::stats;
+            stats.poolHits++;
+            if (stats.poolDepth)
+                stats.poolDepth--;
+
             block = rec.block;
             eraseCount = rec.ec;
             return true;
         }
+
+        if (!allowErase)
+            return false;
+
+        // The pool is dry. Our caller is about to wait on an erase.
+        FlashPreEraseScheduler::stats.eraseStalls++;
+        FlashPreEraseScheduler::stats.poolDepth = 0;
     }
 
+    if (!nextUnerased(block, eraseCount))
+        return false;
+
+    block.erase();
+    return true;
+}
+
+bool FlashBlockRecycler::nextUnerased(FlashMapBlock &block, EraseCount &eraseCount)
+{
+    /*
+     * Everything past this point hands out a block that's about to be
+     * erased, and which may hold part of a volume we've already enumerated.
+     */
+
+    ASSERT(allowErase);
+    FlashVolumeIter::invalidateCache();
+
     /*
      * We must start with orphaned blocks. See the explanation in the class
      * comment for FlashBlockRecycler. This part is easy- we assume they're
@@ -201,7 +239,6 @@ bool FlashBlockRecycler::next(FlashMapBlock &block, EraseCount &eraseCount)
     unsigned index;
     if (orphanBlocks.clearFirst(index)) {
         block.setIndex(index);
-        block.erase();
         eraseCount = averageEraseCount + 1;
         return true;
     }
@@ -269,7 +306,6 @@ bool FlashBlockRecycler::next(FlashMapBlock &block, EraseCount &eraseCount)
             map->blocks[I].setInvalid();
 
             block = candidate;
-            block.erase();
             eraseCount = 1 + hdr->getEraseCount(ref, vol.block, I, numMapEntries);
             return true;
         }
@@ -283,7 +319,6 @@ bool FlashBlockRecycler::next(FlashMapBlock &block, EraseCount &eraseCount)
     dirtyVolume.commitBlock();
 
     block = vol.block;
-    block.erase();
     eraseCount = 1 + hdr->getEraseCount(ref, vol.block, 0, numMapEntries);
     return true;
 }
@@ -84,7 +84,7 @@ class FlashBlockRecycler {
 public:
     typedef uint32_t EraseCount;
 
-    FlashBlockRecycler(bool useEraseLog=true);
+    FlashBlockRecycler(bool useEraseLog=true, bool allowErase=true);
 
     /**
      * Find the next recyclable block, as well as its erase count.
@@ -94,10 +94,19 @@ public:
      * erased first. We have a special cache of pre-erased blocks (the 'erase log')
      * which is optional. By default, it is consulted first.
      *
-     * The returned block is guaranteed to be erased.
+     * The returned block is guaranteed to be erased. With 'allowErase'
+     * false, we only hand out blocks that were pre-erased already, and
+     * fail instead of erasing anything ourselves.
      */
     bool next(FlashMapBlock &block, EraseCount &eraseCount);
 
+    /**
+     * Like next(), but never uses the erase log, and leaves erasing the
+     * block to the caller. Until it's erased and put to use (or logged),
+     * the block looks orphaned to everyone else.
+     */
+    bool nextUnerased(FlashMapBlock &block, EraseCount &eraseCount);
+
 private:
     FlashMapBlock::Set orphanBlocks;            // Not reachable from anywhere
     FlashMapBlock::Set deletedVolumes;          // Header blocks for deleted volumes
@@ -105,6 +114,7 @@ private:
     FlashMapBlock::Set candidateVolumes;        // Current list of recycling candidates
     uint32_t averageEraseCount;
     bool useEraseLog;
+    bool allowErase;
 
     FlashEraseLog eraseLog;
     FlashBlockWriter dirtyVolume;
@@ -37,6 +37,7 @@ void FlashStack::init()
 {
     FlashDevice::init();
     FlashBlock::init();
+    FlashVolumeIter::invalidateCache();
     FlashLFSCache::invalidate();
 }
 
@@ -44,6 +45,7 @@ void FlashStack::init()
 void FlashStack::invalidateCache(unsigned flags)
 {
     FlashBlock::invalidate(flags);
+    FlashVolumeIter::invalidateCache();
     FlashLFSCache::invalidate();
 }
 
@@ -34,6 +34,13 @@
 #include "event.h"
 #include "tasks.h"
 
+FlashMapBlock::Set FlashVolumeIter::cachedVolumes;
+uint16_t FlashVolumeIter::cachedTypes[FlashMapBlock::NUM_BLOCKS];
+uint8_t FlashVolumeIter::cachedParents[FlashMapBlock::NUM_BLOCKS];
+uint32_t FlashVolumeIter::cacheGeneration;
+bool FlashVolumeIter::cacheValid;
+
+
 bool FlashVolume::isValid() const
 {
     ASSERT(this);
@@ -92,6 +99,11 @@ bool FlashVolume::isValid() const
 unsigned FlashVolume::getType() const
 {
     ASSERT(isValid());
+
+    unsigned type, parentCode;
+    if (FlashVolumeIter::getCachedHeader(block, type, parentCode))
+        return type;
+
     FlashBlockRef ref;
     FlashVolumeHeader *hdr = FlashVolumeHeader::get(ref, block);
     ASSERT(hdr->isHeaderValid());
@@ -101,6 +113,11 @@ unsigned FlashVolume::getType() const
 FlashVolume FlashVolume::getParent() const
 {
     ASSERT(isValid());
+
+    unsigned type, parentCode;
+    if (FlashVolumeIter::getCachedHeader(block, type, parentCode))
+        return FlashMapBlock::fromCode(parentCode);
+
     FlashBlockRef ref;
     FlashVolumeHeader *hdr = FlashVolumeHeader::get(ref, block);
     ASSERT(hdr->isHeaderValid());
@@ -169,6 +186,8 @@ void FlashVolume::deleteSingleWithoutInvalidate() const
     FlashBlockWriter writer(ref);
     hdr->type = T_DELETED;
     hdr->typeCopy = T_DELETED;
+
+    FlashVolumeIter::invalidateCache();
 }
 
 void FlashVolume::deleteTree() const
@@ -248,30 +267,87 @@ bool FlashVolumeIter::next(FlashVolume &vol)
 
     ASSERT(initialized == true);
 
+    if (cacheValid && generation == cacheGeneration) {
+        // The directory describes this same flash; no need to touch it.
+        while (remaining.clearFirst(index)) {
+            if (cachedVolumes.test(index)) {
+                vol = FlashMapBlock::fromIndex(index);
+                ASSERT(vol.isValid());
+                found.mark(index);
+                skippedMaps = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (skippedMaps) {
+        /*
+         * The flash changed after we started iterating from the directory.
+         * Catch up on the map blocks we skipped, so we don't go probing
+         * blocks that belonged to volumes we've already visited.
+         */
+        FlashMapBlock::Set visited = found;
+        while (visited.clearFirst(index)) {
+            FlashVolume v(FlashMapBlock::fromIndex(index));
+            if (v.isValid())
+                clearMappedBlocks(v);
+        }
+        skippedMaps = false;
+    }
+
     while (remaining.clearFirst(index)) {
         FlashVolume v(FlashMapBlock::fromIndex(index));
 
         if (v.isValid()) {
-            FlashBlockRef ref;
-            FlashVolumeHeader *hdr = FlashVolumeHeader::get(ref, v.block);
-            ASSERT(hdr->isHeaderValid());
-            const FlashMap *map = hdr->getMap();
-
-            // Don't visit any future blocks that are part of this volume
-            for (unsigned I = 0, E = hdr->numMapEntries(); I != E; ++I) {
-                FlashMapBlock block = map->blocks[I];
-                if (block.isValid())
-                    block.clear(remaining);
-            }
-
+            clearMappedBlocks(v);
+            v.block.mark(found);
             vol = v;
             return true;
         }
     }
 
+    // A complete scan with no changes along the way can be reused
+    if (generation == cacheGeneration) {
+        cachedVolumes = found;
+        cacheValid = true;
+    }
+
     return false;
 }
 
+void FlashVolumeIter::clearMappedBlocks(FlashVolume vol)
+{
+    FlashBlockRef ref;
+    FlashVolumeHeader *hdr = FlashVolumeHeader::get(ref, vol.block);
+    ASSERT(hdr->isHeaderValid());
+    const FlashMap *map = hdr->getMap();
+
+    // Don't visit any future blocks that are part of this volume
+    for (unsigned I = 0, E = hdr->numMapEntries(); I != E; ++I) {
+        FlashMapBlock block = map->blocks[I];
+        if (block.isValid())
+            block.clear(remaining);
+    }
+
+    // Remember the header fields our callers most often filter on
+    unsigned index = vol.block.index();
+    cachedTypes[index] = hdr->type;
+    cachedParents[index] = hdr->parentBlock;
+}
+
+bool FlashVolumeIter::getCachedHeader(FlashMapBlock block,
+    unsigned &type, unsigned &parentCode)
+{
+    unsigned index = block.index();
+    if (!cacheValid || !cachedVolumes.test(index))
+        return false;
+
+    type = cachedTypes[index];
+    parentCode = cachedParents[index];
+    return true;
+}
+
 bool FlashVolumeWriter::begin(FlashBlockRecycler &recycler,
     unsigned type, unsigned payloadBytes, unsigned hdrDataBytes, FlashVolume parent)
 {
@@ -300,6 +376,7 @@ bool FlashVolumeWriter::begin(FlashBlockRecycler &recycler,
 
     // Finish writing
     writer.commitBlock();
+    FlashVolumeIter::invalidateCache();
     ASSERT(volume.isValid());
 
     return count == numMapEntries;
@@ -447,6 +524,7 @@ void FlashVolumeWriter::commit()
     FlashBlockWriter writer(ref);
     hdr->setType(type);
     writer.commitBlock();
+    FlashVolumeIter::invalidateCache();
 
     ASSERT(volume.isValid());
 
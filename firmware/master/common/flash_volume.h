@@ -171,6 +171,17 @@ private:
 /**
  * A lightweight iterator, capable of finding all valid FlashVolumes on
  * the device.
+ *
+ * Finding volumes from scratch means probing every FlashMapBlock for a
+ * header. So that we don't repeat this every time, each iterator that
+ * runs to completion leaves behind a RAM directory of the blocks where
+ * it found volumes, along with each volume's type and parent. Later
+ * iterators walk the directory without reading flash at all.
+ *
+ * Anything that may create, destroy, or modify a volume header must call
+ * invalidateCache(). Each invalidation starts a new generation. An iterator
+ * that sees the generation change partway through goes back to probing
+ * every block it has left, so it returns exactly what an uncached scan would.
  */
 class FlashVolumeIter
 {
@@ -179,14 +190,37 @@ public:
     void begin() {
         DEBUG_ONLY(initialized = true);
         remaining.mark();
+        found.clear();
+        generation = cacheGeneration;
+        skippedMaps = false;
     }
 
     /// Returns 'true' iff another FlashVolume can be found.
     bool next(FlashVolume &vol);
 
+    /// Forget the cached directory of volume header locations
+    static void invalidateCache() {
+        cacheGeneration++;
+        cacheValid = false;
+    }
+
+    /// Look up a volume's type and parent code in the directory, if present
+    static bool getCachedHeader(FlashMapBlock block, unsigned &type, unsigned &parentCode);
+
 private:
     FlashMapBlock::Set remaining;
+    FlashMapBlock::Set found;
+    uint32_t generation;
+    bool skippedMaps;
     DEBUG_ONLY(bool initialized;)
+
+    void clearMappedBlocks(FlashVolume vol);
+
+    static FlashMapBlock::Set cachedVolumes;
+    static uint16_t cachedTypes[FlashMapBlock::NUM_BLOCKS];
+    static uint8_t cachedParents[FlashMapBlock::NUM_BLOCKS];
+    static uint32_t cacheGeneration;
+    static bool cacheValid;
 };
 
 /**
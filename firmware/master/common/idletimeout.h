@@ -37,6 +37,11 @@ public:
 
     static void heartbeat();
 
+    /// Heartbeats elapsed since the last sign of user activity
+    static ALWAYS_INLINE unsigned idleHeartbeats() {
+        return IDLE_TIMEOUT_SYSTICKS - countdown;
+    }
+
 private:
     /*
      * Heartbeat is at 10Hz, our idle timeout is 10 minutes.
@@ -60,6 +60,14 @@ namespace SvmCpu {
 
     void run(reg_t sp, reg_t pc) SVM_RUN_ATTRS;
 
+#ifdef SIFTEO_SIMULATOR
+    // Discard any pre-decoded instructions for one FlashBlock cache slot
+    void invalidateDecodedBlock(unsigned cacheBlockID);
+
+    // Like reg(), but also valid while user code is running, for profiling
+    reg_t liveReg(unsigned r);
+#endif
+
     // Registers that get saved to the stack automatically by hardware
     struct HwContext {
         reg_t r0;
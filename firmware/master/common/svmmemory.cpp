@@ -73,6 +73,7 @@ bool SvmMemory::checkROData(VirtAddr va, uint32_t length)
 bool SvmMemory::mapROData(FlashBlockRef &ref, VirtAddr va,
     uint32_t &length, PhysAddr &pa)
 {
+    FlashBlockAccess access(FlashBlockAccess::RODATA);
     STATIC_ASSERT(arraysize(flashSeg) == 2);
     return mapRAM(va, length, pa) ||
            flashSeg[0].getBytes(ref, va - SEGMENT_0_VA, pa, length) ||
@@ -94,6 +95,7 @@ void SvmMemory::validateBase(FlashBlockRef &ref, VirtAddr va,
         return;
     }
 
+    FlashBlockAccess access(FlashBlockAccess::RODATA);
     STATIC_ASSERT(arraysize(flashSeg) == 2);
     brw = 0;
     if (!(flashSeg[0].getByte(ref, va - SEGMENT_0_VA, bro) ||
@@ -106,6 +108,7 @@ bool SvmMemory::mapROCode(FlashBlockRef &ref, VirtAddr va, PhysAddr &pa)
     // Callers expect us to ignore the two LSBs and 8 MSBs. All real branch addresses
     // are 32-bit aligned, and some callers use these bits for special purposes.
     uint32_t flashOffset = (uint32_t)va & 0xfffffc;
+    FlashBlockAccess access(FlashBlockAccess::CODE);
 
     // Code can only execute from segment 0.
     if (!flashSeg[0].getBlock(ref, flashOffset & ~FlashBlock::BLOCK_MASK))
@@ -130,6 +133,7 @@ bool SvmMemory::copyROData(FlashBlockRef &ref,
         return true;
     }
 
+    FlashBlockAccess access(FlashBlockAccess::RODATA);
     STATIC_ASSERT(arraysize(flashSeg) == 2);
     return flashSeg[0].copyBytes(ref, src - SEGMENT_0_VA, dest, length) ||
            flashSeg[1].copyBytes(ref, src - SEGMENT_1_VA, dest, length);
@@ -50,6 +50,10 @@ typedef uint64_t (*SvmSyscall)(reg_t p0, reg_t p1, reg_t p2, reg_t p3,
 
 #include "syscall-table.def"
 
+#ifdef SIFTEO_SIMULATOR
+#   include "mc_svmprofiler.h"
+#endif
+
 using namespace Svm;
 
 FlashBlockRef SvmRuntime::codeBlock;
@@ -448,6 +452,10 @@ void SvmRuntime::syscall(unsigned num)
             reinterpret_cast<void*>(SvmCpu::reg(7))));
     });
 
+    #ifdef SIFTEO_SIMULATOR
+        SvmProfiler::SyscallScope profilerScope(num);
+    #endif
+
     uint64_t result = fn(SvmCpu::reg(0), SvmCpu::reg(1),
                          SvmCpu::reg(2), SvmCpu::reg(3),
                          SvmCpu::reg(4), SvmCpu::reg(5),
@@ -465,6 +473,15 @@ void SvmRuntime::syscall(unsigned num)
     SvmCpu::setReg(1, result1);
 }
 
+#ifdef SIFTEO_SIMULATOR
+const char *SvmRuntime::syscallName(unsigned num)
+{
+    if (num < arraysize(SyscallNames) && SyscallNames[num])
+        return SyscallNames[num];
+    return "_SYS_unknown";
+}
+#endif
+
 ALWAYS_INLINE void SvmRuntime::tailSyscall(unsigned num)
 {
     /*
@@ -37,6 +37,9 @@
 #include "batterylevel.h"
 #include "volume.h"
 #include "btprotocol.h"
+#include "flash_blockcache.h"
+#include "flash_lfs.h"
+#include "flash_preerase.h"
 
 #ifdef SIFTEO_SIMULATOR
 #   include "mc_timing.h"
@@ -80,11 +83,14 @@ ALWAYS_INLINE void Tasks::taskInvoke(unsigned id)
         case Tasks::AudioPull:          return AudioMixer::pullAudio();
         case Tasks::Debugger:           return SvmDebugger::messageLoop();
         case Tasks::AssetLoader:        return AssetLoader::task();
+        case Tasks::FlashPrefetch:      return FlashBlock::prefetchTask();
         case Tasks::Pause:              return Pause::task();
         case Tasks::CubeConnector:      return CubeConnector::task();
         case Tasks::Heartbeat:          return heartbeatTask();
         case Tasks::FaultLogger:        return FaultLogger::task();
         case Tasks::BluetoothProtocol:  return BTProtocol::task();
+        case Tasks::FlashGC:            return FlashLFSBackgroundGC::task();
+        case Tasks::FlashPreErase:      return FlashPreEraseScheduler::task();
     #endif
 
     #if !defined(SIFTEO_SIMULATOR) && defined(HAVE_NRF8001) && !defined(BOOTLOADER)
@@ -124,6 +130,8 @@ void Tasks::heartbeatTask()
 
     Radio::heartbeat();
     AssetLoader::heartbeat();
+    FlashLFSBackgroundGC::heartbeat();
+    FlashPreEraseScheduler::heartbeat();
 
 #endif
 
@@ -65,12 +65,15 @@ public:
         FaultLogger,
         Debugger,
         AssetLoader,
+        FlashPrefetch,
         Pause,
         CubeConnector,
         BluetoothDriver,
         BluetoothProtocol,
         Heartbeat,
         UsbIN,
+        FlashGC,
+        FlashPreErase,
         Profiler,
         TestJig,
         FactoryTest
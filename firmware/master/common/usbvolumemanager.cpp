@@ -207,6 +207,18 @@ void UsbVolumeManager::onUsbData(const USBProtocolMsg &m)
 #endif
 }
 
+bool UsbVolumeManager::isWriting()
+{
+    /*
+     * Until commit(), the volume we're installing looks just like one that
+     * was abandoned, and the block recycler would reclaim it. Background
+     * flash maintenance checks this first.
+     */
+
+    return writer.volume.isValid()
+        && writer.volume.getType() == FlashVolume::T_INCOMPLETE;
+}
+
 void UsbVolumeManager::volumeOverview(USBProtocolMsg &reply)
 {
     /*
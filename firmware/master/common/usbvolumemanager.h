@@ -122,6 +122,9 @@ public:
 
     static void onUsbData(const USBProtocolMsg &m);
 
+    /// Is an install still filling in its T_INCOMPLETE volume?
+    static bool isWriting();
+
 private:
     static const unsigned SYSLFS_VOLUME_BLOCK_CODE = 0;
 
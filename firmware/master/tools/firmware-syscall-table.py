@@ -148,3 +148,15 @@ for i in range(highestNum+1):
     print "    /* %4d */ %s %s," % (i, typedef, name)
 
 print "};"
+
+#
+# Syscall names, for profiling in the simulator.
+#
+
+print "\n#ifdef SIFTEO_SIMULATOR"
+print "static const char * const SyscallNames[] = {"
+for i in range(highestNum+1):
+    name = callMap.get(i)
+    print "    /* %4d */ %s," % (i, name and '"%s"' % name or "0")
+print "};"
+print "#endif"
@@ -0,0 +1,378 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * STIR -- Sifteo Tiled Image Reducer
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#   include <direct.h>
+#   include <process.h>
+#   define mkdir(_path, _mode)  _mkdir(_path)
+#   define getpid               _getpid
+#else
+#   include <unistd.h>
+#endif
+
+#include "cache.h"
+
+#define STRINGIFY(_x)   #_x
+#define TOSTRING(_x)    STRINGIFY(_x)
+
+namespace Stir {
+
+const char AssetCache::MAGIC[8] = { 'S', 'T', 'I', 'R', 'C', 'A', 'C', 'H' };
+
+
+void CacheBlob::put(const void *bytes, size_t count)
+{
+    const uint8_t *p = static_cast<const uint8_t*>(bytes);
+    mData.insert(mData.end(), p, p + count);
+}
+
+void CacheBlob::put8(uint8_t v)
+{
+    mData.push_back(v);
+}
+
+void CacheBlob::put16(uint16_t v)
+{
+    put8(v);
+    put8(v >> 8);
+}
+
+void CacheBlob::put32(uint32_t v)
+{
+    put16(v);
+    put16(v >> 16);
+}
+
+void CacheBlob::put64(uint64_t v)
+{
+    put32(v);
+    put32(v >> 32);
+}
+
+void CacheBlob::putDouble(double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof bits);
+    put64(bits);
+}
+
+void CacheBlob::putString(const std::string &s)
+{
+    put32(s.size());
+    put(s.data(), s.size());
+}
+
+void CacheBlob::get(void *bytes, size_t count)
+{
+    if (mError || count > mData.size() - mOffset) {
+        mError = true;
+        memset(bytes, 0, count);
+        return;
+    }
+
+    if (count)
+        memcpy(bytes, &mData[mOffset], count);
+    mOffset += count;
+}
+
+uint8_t CacheBlob::get8()
+{
+    uint8_t v;
+    get(&v, 1);
+    return v;
+}
+
+uint16_t CacheBlob::get16()
+{
+    uint16_t lo = get8();
+    return lo | (get8() << 8);
+}
+
+uint32_t CacheBlob::get32()
+{
+    uint32_t lo = get16();
+    return lo | ((uint32_t)get16() << 16);
+}
+
+uint64_t CacheBlob::get64()
+{
+    uint64_t lo = get32();
+    return lo | ((uint64_t)get32() << 32);
+}
+
+double CacheBlob::getDouble()
+{
+    uint64_t bits = get64();
+    double v;
+    memcpy(&v, &bits, sizeof v);
+    return v;
+}
+
+bool AssetCache::setDirectory(const char *path)
+{
+    /*
+     * Use (and if necessary, create) a cache directory. Only the last
+     * path component is created; its parent must already exist.
+     */
+
+    mDirectory.clear();
+
+    if (mkdir(path, 0777) != 0 && errno != EEXIST)
+        return false;
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return false;
+
+    mDirectory = path;
+    return true;
+}
+
+static inline uint64_t rotl64(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (unsigned i = 0; i < 8; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+AssetCache::Digest AssetCache::hash(const uint8_t *bytes, size_t count)
+{
+    /*
+     * MurmurHash3, x64 128-bit variant (Austin Appleby, public domain).
+     * Blocks are read as little-endian, so digests are portable.
+     */
+
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const size_t nblocks = count / 16;
+
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k1 = load64(bytes + i*16);
+        uint64_t k2 = load64(bytes + i*16 + 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    const uint8_t *tail = bytes + nblocks*16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    switch (count & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48;
+    case 14: k2 ^= (uint64_t)tail[13] << 40;
+    case 13: k2 ^= (uint64_t)tail[12] << 32;
+    case 12: k2 ^= (uint64_t)tail[11] << 24;
+    case 11: k2 ^= (uint64_t)tail[10] << 16;
+    case 10: k2 ^= (uint64_t)tail[ 9] << 8;
+    case  9: k2 ^= (uint64_t)tail[ 8];
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+
+    case  8: k1 ^= (uint64_t)tail[ 7] << 56;
+    case  7: k1 ^= (uint64_t)tail[ 6] << 48;
+    case  6: k1 ^= (uint64_t)tail[ 5] << 40;
+    case  5: k1 ^= (uint64_t)tail[ 4] << 32;
+    case  4: k1 ^= (uint64_t)tail[ 3] << 24;
+    case  3: k1 ^= (uint64_t)tail[ 2] << 16;
+    case  2: k1 ^= (uint64_t)tail[ 1] << 8;
+    case  1: k1 ^= (uint64_t)tail[ 0];
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= count;
+    h2 ^= count;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    Digest d = { h1, h2 };
+    return d;
+}
+
+void AssetCache::fullKey(CacheBlob &full, const char *kind, const CacheBlob &key)
+{
+    /*
+     * The full key includes everything that could make an old entry
+     * wrong: the file format, the encoders, and the SDK build itself.
+     */
+
+    full.put32(FORMAT_VERSION);
+    full.put32(ENCODER_VERSION);
+    full.putString(TOSTRING(SDK_VERSION));
+    full.putString(kind);
+    full.put(key.data().empty() ? NULL : &key.data()[0], key.data().size());
+}
+
+std::string AssetCache::path(const char *kind, const Digest &d) const
+{
+    char name[64];
+    snprintf(name, sizeof name, "%016llx%016llx",
+        (unsigned long long) d.h1, (unsigned long long) d.h2);
+    return mDirectory + "/" + kind + "-" + name;
+}
+
+bool AssetCache::load(const char *kind, const CacheBlob &key, CacheBlob &value) const
+{
+    /*
+     * Look up an entry. Any missing, truncated, or corrupted file is
+     * just a cache miss.
+     */
+
+    if (!isEnabled())
+        return false;
+
+    CacheBlob full;
+    fullKey(full, kind, key);
+    const std::vector<uint8_t> &fullBytes = full.data();
+    Digest d = hash(&fullBytes[0], fullBytes.size());
+
+    FILE *f = fopen(path(kind, d).c_str(), "rb");
+    if (!f)
+        return false;
+
+    CacheBlob file;
+    uint8_t buffer[16 * 1024];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof buffer, f)) > 0)
+        file.put(buffer, count);
+    fclose(f);
+
+    char magic[sizeof MAGIC];
+    file.get(magic, sizeof magic);
+    uint32_t version = file.get32();
+    uint64_t h1 = file.get64();
+    uint64_t h2 = file.get64();
+    uint32_t keySize = file.get32();
+    uint32_t size = file.get32();
+    uint64_t check = file.get64();
+
+    if (file.hasError() || memcmp(magic, MAGIC, sizeof magic) ||
+        version != FORMAT_VERSION || h1 != d.h1 || h2 != d.h2 ||
+        keySize != fullBytes.size() || size > file.data().size())
+        return false;
+
+    // Same hash isn't enough; it must be the same key
+    std::vector<uint8_t> storedKey(keySize);
+    file.get(&storedKey[0], keySize);
+    if (file.hasError() || storedKey != fullBytes)
+        return false;
+
+    std::vector<uint8_t> payload(size);
+    file.get(size ? &payload[0] : NULL, size);
+    if (!file.isComplete())
+        return false;
+
+    if (hash(size ? &payload[0] : NULL, size).h1 != check)
+        return false;
+
+    value = CacheBlob();
+    value.data().swap(payload);
+    return true;
+}
+
+bool AssetCache::store(const char *kind, const CacheBlob &key, const CacheBlob &value) const
+{
+    /*
+     * Write an entry. We write to a private temporary file and rename
+     * it into place, so concurrent stir processes sharing a cache never
+     * see a partial entry.
+     */
+
+    if (!isEnabled())
+        return false;
+
+    CacheBlob full;
+    fullKey(full, kind, key);
+    const std::vector<uint8_t> &fullBytes = full.data();
+    Digest d = hash(&fullBytes[0], fullBytes.size());
+
+    const std::vector<uint8_t> &payload = value.data();
+    const uint8_t *bytes = payload.empty() ? NULL : &payload[0];
+
+    CacheBlob header;
+    header.put(MAGIC, sizeof MAGIC);
+    header.put32(FORMAT_VERSION);
+    header.put64(d.h1);
+    header.put64(d.h2);
+    header.put32(fullBytes.size());
+    header.put32(payload.size());
+    header.put64(hash(bytes, payload.size()).h1);
+    header.put(&fullBytes[0], fullBytes.size());
+
+    std::string finalPath = path(kind, d);
+    char suffix[32];
+    snprintf(suffix, sizeof suffix, ".%d.tmp", (int) getpid());
+    std::string tempPath = finalPath + suffix;
+
+    FILE *f = fopen(tempPath.c_str(), "wb");
+    if (!f)
+        return false;
+
+    bool success =
+        fwrite(&header.data()[0], header.data().size(), 1, f) == 1 &&
+        (payload.empty() || fwrite(bytes, payload.size(), 1, f) == 1);
+    success = (fclose(f) == 0) && success;
+
+    if (success && rename(tempPath.c_str(), finalPath.c_str()) == 0)
+        return true;
+
+    // Windows won't rename over an existing file; someone else won the race.
+    remove(tempPath.c_str());
+    struct stat st;
+    return success && stat(finalPath.c_str(), &st) == 0;
+}
+
+};  // namespace Stir
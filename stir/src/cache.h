@@ -0,0 +1,144 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * STIR -- Sifteo Tiled Image Reducer
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace Stir {
+
+/*
+ * CacheBlob --
+ *
+ *    A flat byte buffer used for both the keys and the values stored
+ *    in an AssetCache. Multi-byte values are always little-endian, so
+ *    cache directories may be shared between hosts.
+ *
+ *    Reads past the end of the buffer return zero and set an error
+ *    flag, so callers can decode a whole record and check once.
+ */
+
+class CacheBlob {
+ public:
+    CacheBlob() : mOffset(0), mError(false) {}
+
+    void put(const void *bytes, size_t count);
+    void put8(uint8_t v);
+    void put16(uint16_t v);
+    void put32(uint32_t v);
+    void put64(uint64_t v);
+    void putDouble(double v);
+    void putString(const std::string &s);
+
+    void get(void *bytes, size_t count);
+    uint8_t get8();
+    uint16_t get16();
+    uint32_t get32();
+    uint64_t get64();
+    double getDouble();
+
+    // True if every byte was consumed without any underruns
+    bool isComplete() const {
+        return !mError && mOffset == mData.size();
+    }
+
+    bool hasError() const {
+        return mError;
+    }
+
+    const std::vector<uint8_t> &data() const {
+        return mData;
+    }
+
+    std::vector<uint8_t> &data() {
+        return mData;
+    }
+
+ private:
+    std::vector<uint8_t> mData;
+    size_t mOffset;
+    bool mError;
+};
+
+
+/*
+ * AssetCache --
+ *
+ *    A persistent, content-addressed cache for stir's most expensive
+ *    results: optimized tile pools, DUB image encodings, and compressed
+ *    audio. Each entry is a separate file, named by a 128-bit hash of
+ *    its key. Keys describe every input the result depends on, and
+ *    they always include the cache format and encoder versions. The
+ *    file also stores the complete key, which load() compares, so a
+ *    hash collision is only ever a miss.
+ *
+ *    Entries are immutable. A changed input simply hashes to a new
+ *    file, so it's always safe to delete the cache directory, or to
+ *    share it between several projects. Stale entries are never
+ *    removed automatically.
+ *
+ *    An AssetCache with no directory is disabled; every load() misses
+ *    and every store() is ignored.
+ */
+
+class AssetCache {
+ public:
+    /*
+     * Bump this whenever the tile optimizer or any of the encoders
+     * changes its output for the same input. Every existing entry
+     * becomes unreachable.
+     */
+    static const uint32_t ENCODER_VERSION = 1;
+
+    bool setDirectory(const char *path);
+
+    bool isEnabled() const {
+        return !mDirectory.empty();
+    }
+
+    bool load(const char *kind, const CacheBlob &key, CacheBlob &value) const;
+    bool store(const char *kind, const CacheBlob &key, const CacheBlob &value) const;
+
+ private:
+    struct Digest {
+        uint64_t h1, h2;
+    };
+
+    static const uint32_t FORMAT_VERSION = 2;
+    static const char MAGIC[8];
+
+    std::string mDirectory;
+
+    static void fullKey(CacheBlob &full, const char *kind, const CacheBlob &key);
+    static Digest hash(const uint8_t *bytes, size_t count);
+    std::string path(const char *kind, const Digest &d) const;
+};
+
+};  // namespace Stir
+
+#endif
@@ -29,6 +29,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "tile.h"
@@ -52,6 +53,9 @@ static void usage()
             "Options:\n"
             "  -h            Show this help message, and exit\n"
             "  -v            Verbose mode, show progress as we work\n"
+            "  -j THREADS    Number of threads for tile optimization (default: one per CPU)\n"
+            "  -c DIR        Cache optimized tiles, images and sounds in DIR, and reuse\n"
+            "                them on later runs whose inputs haven't changed\n"
             "  -o FILE.cpp   Generate a C++ source file with your asset data\n"
             "  -o FILE.h     Generate a C++ header with metadata for your assets\n"
             "  -o FILE.html  Generate a proofing sheet for your assets, in HTML format\n"
@@ -85,6 +89,26 @@ int main(int argc, char **argv)
             continue;
         }
          
+        if (!strcmp(arg, "-j") && argv[c+1]) {
+            int threads = atoi(argv[c+1]);
+            if (threads < 1) {
+                log.error("Invalid thread count: '%s'", argv[c+1]);
+                return 1;
+            }
+            Stir::ThreadPool::setDefaultSize(threads);
+            c++;
+            continue;
+        }
+
+        if (!strcmp(arg, "-c") && argv[c+1]) {
+            if (!script.setCacheDirectory(argv[c+1])) {
+                log.error("Can't use cache directory: '%s'", argv[c+1]);
+                return 1;
+            }
+            c++;
+            continue;
+        }
+
         if (!strcmp(arg, "-o") && argv[c+1]) {
             if (script.addOutput(argv[c+1])) {
                 c++;
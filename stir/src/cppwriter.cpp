@@ -125,8 +125,8 @@ void CPPWriter::writeArray(const std::vector<uint16_t> &data)
     mStream << "\n";
 }
 
-CPPSourceWriter::CPPSourceWriter(Logger &log, const char *filename)
-    : CPPWriter(log, filename), nextGroupOrdinal(0) {}
+CPPSourceWriter::CPPSourceWriter(Logger &log, const char *filename, const AssetCache &cache)
+    : CPPWriter(log, filename), mCache(cache), nextGroupOrdinal(0) {}
 
 bool CPPSourceWriter::writeGroup(const Group &group)
 {
@@ -224,7 +224,20 @@ bool CPPSourceWriter::writeSound(const Sound &sound)
 
     uint32_t numSamples = raw.size() / sizeof(int16_t);
 
-    enc->encode(raw, data);
+    // The encoded audio depends only on the codec and the raw samples
+    CacheBlob key, value;
+    key.put32(enc->getType());
+    key.put(raw.empty() ? NULL : &raw[0], raw.size());
+
+    if (mCache.load("audio", key, value)) {
+        data.swap(value.data());
+    } else {
+        enc->encode(raw, data);
+        if (!data.empty()) {
+            value.put(&data[0], data.size());
+            mCache.store("audio", key, value);
+        }
+    }
 
     mLog.infoLineWithLabel(sound.getName().c_str(),
         "%7.02f kiB, %s (%s)",
@@ -363,7 +376,7 @@ void CPPSourceWriter::writeImage(const Image &image, bool writeDecl, bool writeA
     if (autoFormat) {
         std::vector<uint16_t> data;
         std::string format;
-        if (image.encodeDUB(data, mLog, format)) {
+        if (image.encodeDUB(data, mLog, format, mCache)) {
             if (writeAsset) {
                 mStream <<
                     indent << "/* format   */ " << format << ",\n" <<
@@ -33,6 +33,7 @@
 #include "tile.h"
 #include "script.h"
 #include "logger.h"
+#include "cache.h"
 
 namespace Stir {
 
@@ -72,7 +73,7 @@ class CPPWriter {
 
 class CPPSourceWriter : public CPPWriter {
  public:
-    CPPSourceWriter(Logger &log, const char *filename);
+    CPPSourceWriter(Logger &log, const char *filename, const AssetCache &cache);
     bool writeGroup(const Group &group);
     bool writeSound(const Sound &sound);
     void writeTrackerShared(const Tracker &tracker);
@@ -82,6 +83,7 @@ class CPPSourceWriter : public CPPWriter {
  private:
     void writeImage(const Image &image, bool writeDecl=true, bool writeAsset=true, bool writeData=true);
 
+    const AssetCache &mCache;
     unsigned nextGroupOrdinal;
 };
 
@@ -158,11 +158,13 @@ float DUBEncoder::getRatio() const
     return 100.0 - getCompressedWords() * 100.0 / getTileCount();
 }
 
-void DUBEncoder::logStats(const std::string &name, Logger &log)
+void DUBEncoder::logStats(const std::string &name, Logger &log,
+    unsigned tileCount, unsigned compressedWords, float ratio)
 {
+    // Static, so results loaded from the AssetCache log the same way
     log.infoLineWithLabel(name.c_str(),
         "%4d tiles, %4d words, % 5.01f%% compression",
-        getTileCount(), getCompressedWords(), getRatio());
+        tileCount, compressedWords, ratio);
 }
 
 void DUBEncoder::encodeBlock(uint16_t *pTopLeft,
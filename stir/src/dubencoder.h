@@ -56,7 +56,8 @@ public:
         : mWidth(width), mHeight(height), mFrames(frames) {}
 
     void encodeTiles(std::vector<uint16_t> &tiles);
-    void logStats(const std::string &name, Logger &log);
+    static void logStats(const std::string &name, Logger &log,
+        unsigned tileCount, unsigned compressedWords, float ratio);
 
     unsigned getTileCount() const;
     unsigned getCompressedWords() const;
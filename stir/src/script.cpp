@@ -29,6 +29,7 @@
 #include <assert.h>
 
 #include <sstream>
+#include <algorithm>
 
 #include "script.h"
 #include "proof.h"
@@ -104,25 +105,15 @@ bool Script::run(const char *filename)
 
     ProofWriter proof(log, outputProof);
     CPPHeaderWriter header(log, outputHeader);
-    CPPSourceWriter source(log, outputSource);
+    CPPSourceWriter source(log, outputSource, cache);
+    ThreadPool threads;
 
     for (std::set<Group*>::iterator i = groups.begin(); i != groups.end(); i++) {
         Group *group = *i;
-        TilePool &pool = group->getPool();
 
         log.heading(group->getName().c_str());
-        pool.optimize(log);
-
-        if (!group->isFixed()) {
-            if (pool.size() > pool.MAX_SIZE) {
-                log.error("Error: Group '%s' with %d tiles is too large (%.02f%% of %d-tile slot)",
-                    group->getName().c_str(), pool.size(), pool.size() * (100.0 / pool.MAX_SIZE),
-                    pool.MAX_SIZE);
-                return false;
-            }
-
-            pool.encode(group->getLoadstream(), &log);
-        }
+        if (!optimizeGroup(*group, threads))
+            return false;
 
         proof.writeGroup(*group);
         header.writeGroup(*group);
@@ -194,6 +185,58 @@ bool Script::run(const char *filename)
     return true;
 }
 
+bool Script::optimizeGroup(Group &group, ThreadPool &threads)
+{
+    /*
+     * Optimize and encode a group's tile pool, or reuse the results
+     * from an earlier run with identical tiles.
+     */
+
+    TilePool &pool = group.getPool();
+    std::vector<uint8_t> &loadstream = group.getLoadstream();
+
+    CacheBlob key, value;
+    pool.cacheKey(key);
+    key.put8(group.isFixed());
+
+    if (cache.load("pool", key, value)) {
+        std::vector<uint8_t> cachedLoadstream(
+            std::min<size_t>(value.get32(), value.data().size()));
+        value.get(cachedLoadstream.empty() ? NULL : &cachedLoadstream[0],
+            cachedLoadstream.size());
+
+        if (pool.loadCache(value)) {
+            log.taskBegin("Using cached tile pool");
+            log.taskProgress("%d tiles", pool.size());
+            log.taskEnd();
+
+            loadstream.swap(cachedLoadstream);
+            return true;
+        }
+    }
+
+    pool.optimize(log, threads);
+
+    if (!group.isFixed()) {
+        if (pool.size() > pool.MAX_SIZE) {
+            log.error("Error: Group '%s' with %d tiles is too large (%.02f%% of %d-tile slot)",
+                group.getName().c_str(), pool.size(), pool.size() * (100.0 / pool.MAX_SIZE),
+                pool.MAX_SIZE);
+            return false;
+        }
+
+        pool.encode(loadstream, &log);
+    }
+
+    value = CacheBlob();
+    value.put32(loadstream.size());
+    value.put(loadstream.empty() ? NULL : &loadstream[0], loadstream.size());
+    pool.saveCache(value);
+    cache.store("pool", key, value);
+
+    return true;
+}
+
 bool Script::luaRunFile(const char *filename)
 {
     int s = luaL_loadfile(L, filename);
@@ -243,6 +286,11 @@ void Script::setVariable(const char *key, const char *value)
     lua_setglobal(L, key);
 }
 
+bool Script::setCacheDirectory(const char *path)
+{
+    return cache.setDirectory(path);
+}
+
 bool Script::matchExtension(const char *filename, const char *ext)
 {
     const char *p = strrchr(filename, '.');
@@ -702,38 +750,118 @@ void Image::encodeFlat(std::vector<uint16_t> &data) const
     }
 }
 
-bool Image::encodeDUB(std::vector<uint16_t> &data, Logger &log, std::string &format) const
+namespace {
+
+    /*
+     * Everything we need from a DUBEncoder, in a form that can round-trip
+     * through the AssetCache.
+     */
+
+    struct DUBResult {
+        enum Status {
+            OK,
+            TOO_LARGE,
+            NOT_COMPRESSIBLE
+        };
+
+        uint8_t status;
+        uint32_t tileCount;
+        uint32_t compressedWords;
+        float ratio;
+        bool index16;
+        std::vector<uint16_t> data;
+
+        void save(CacheBlob &value) const {
+            value.put8(status);
+            value.put32(tileCount);
+            value.put32(compressedWords);
+            value.putDouble(ratio);
+            value.put8(index16);
+            value.put32(data.size());
+            for (unsigned i = 0; i < data.size(); i++)
+                value.put16(data[i]);
+        }
+
+        bool load(CacheBlob &value) {
+            status = value.get8();
+            tileCount = value.get32();
+            compressedWords = value.get32();
+            ratio = value.getDouble();
+            index16 = value.get8() != 0;
+            data.resize(std::min<size_t>(value.get32(), value.data().size()));
+            for (unsigned i = 0; i < data.size(); i++)
+                data[i] = value.get16();
+            return value.isComplete() && status <= NOT_COMPRESSIBLE;
+        }
+    };
+}
+
+bool Image::encodeDUB(std::vector<uint16_t> &data, Logger &log, std::string &format,
+    const AssetCache &cache) const
 {
     // Compressed image, encoded using the DUB codec.
-    
-    DUBEncoder encoder( mImages.getWidth() / Tile::SIZE,
-                        mImages.getHeight() / Tile::SIZE,
-                        mImages.getFrames() );
+
+    unsigned width = mImages.getWidth() / Tile::SIZE;
+    unsigned height = mImages.getHeight() / Tile::SIZE;
+    unsigned frames = mImages.getFrames();
 
     std::vector<uint16_t> tiles;
     encodeFlat(tiles);
 
-    encoder.encodeTiles(tiles);
-    
-    // Too large to encode correctly?
-    if (encoder.isTooLarge()) {
+    // The encoding depends only on the image's shape and its tile indices
+    CacheBlob key, value;
+    key.put32(width);
+    key.put32(height);
+    key.put32(frames);
+    for (unsigned i = 0; i < tiles.size(); i++)
+        key.put16(tiles[i]);
+
+    DUBResult result;
+    if (!cache.load("dub", key, value) || !result.load(value)) {
+        DUBEncoder encoder(width, height, frames);
+        encoder.encodeTiles(tiles);
+
+        result.tileCount = encoder.getTileCount();
+        result.compressedWords = encoder.getCompressedWords();
+        result.ratio = encoder.getRatio();
+        result.index16 = encoder.isIndex16();
+        result.data.clear();
+
+        if (encoder.isTooLarge()) {
+            // Too large to encode correctly?
+            result.status = DUBResult::TOO_LARGE;
+        } else if (encoder.getRatio() < 10.0f) {
+            // Not compressible enough to bother?
+            result.status = DUBResult::NOT_COMPRESSIBLE;
+        } else {
+            result.status = DUBResult::OK;
+            encoder.getResult(result.data);
+        }
+
+        value = CacheBlob();
+        result.save(value);
+        cache.store("dub", key, value);
+    }
+
+    if (result.status == DUBResult::TOO_LARGE) {
         log.infoLineWithLabel(getName().c_str(),
             "%4d tiles,      (too large for compression codec)",
-            encoder.getTileCount());
+            result.tileCount);
         return false;
     }
 
-    // Not compressible enough to bother?
-    if (encoder.getRatio() < 10.0f) {
+    if (result.status == DUBResult::NOT_COMPRESSIBLE) {
         log.infoLineWithLabel(getName().c_str(),
             "%4d tiles,      (not compressible)",
-            encoder.getTileCount());
+            result.tileCount);
         return false;
     }
-    
-    encoder.logStats(getName(), log);
-    encoder.getResult(data);
-    format = encoder.isIndex16() ? "_SYS_AIF_DUB_I16" : "_SYS_AIF_DUB_I8";
+
+    DUBEncoder::logStats(getName(), log,
+        result.tileCount, result.compressedWords, result.ratio);
+
+    data.swap(result.data);
+    format = result.index16 ? "_SYS_AIF_DUB_I16" : "_SYS_AIF_DUB_I8";
 
     return true;
 }
@@ -39,6 +39,7 @@ extern "C" {
 #include "lunar.h"
 #include "logger.h"
 #include "tile.h"
+#include "cache.h"
 #include "imagestack.h"
 #include "sifteo/abi.h"
 #include "tracker.h"
@@ -71,6 +72,7 @@ public:
 
     bool addOutput(const char *filename);
     void setVariable(const char *key, const char *value);
+    bool setCacheDirectory(const char *path);
 
  private:
     lua_State *L;
@@ -80,6 +82,7 @@ public:
     const char *outputHeader;
     const char *outputSource;
     const char *outputProof;
+    AssetCache cache;
 
     std::set<Group*> groups;
     std::set<Tracker*> trackers;
@@ -94,6 +97,7 @@ public:
 
     bool luaRunFile(const char *filename);
     bool collect();
+    bool optimizeGroup(Group &group, ThreadPool &threads);
     bool collectList(const char* name, int tableStackIndex);
 
     static bool matchExtension(const char *filename, const char *ext);
@@ -230,7 +234,8 @@ public:
 
     uint16_t encodePinned() const;
     void encodeFlat(std::vector<uint16_t> &data) const;
-    bool encodeDUB(std::vector<uint16_t> &data, Logger &log, std::string &format) const;
+    bool encodeDUB(std::vector<uint16_t> &data, Logger &log, std::string &format,
+                   const AssetCache &cache) const;
 
  private:
     Group *mGroup;
@@ -0,0 +1,134 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * STIR -- Sifteo Tiled Image Reducer
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "threadpool.h"
+
+namespace Stir {
+
+unsigned ThreadPool::sDefaultSize = 0;
+
+
+void ThreadPool::setDefaultSize(unsigned numThreads)
+{
+    sDefaultSize = numThreads;
+}
+
+unsigned ThreadPool::defaultSize()
+{
+    if (sDefaultSize)
+        return sDefaultSize;
+
+    unsigned cpus = tthread::thread::hardware_concurrency();
+    return cpus ? cpus : 1;
+}
+
+ThreadPool::ThreadPool(unsigned numThreads)
+    : mWorkers(0), mNumWorkers(numThreads > 1 ? numThreads - 1 : 0),
+      mShutdown(false), mJob(0), mContext(0), mCount(0), mNext(0),
+      mCompleted(0), mGeneration(0)
+{
+    if (mNumWorkers) {
+        mWorkers = new tthread::thread*[mNumWorkers];
+        for (unsigned i = 0; i < mNumWorkers; ++i)
+            mWorkers[i] = new tthread::thread(workerThread, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    mLock.lock();
+    mShutdown = true;
+    mWakeCond.notify_all();
+    mLock.unlock();
+
+    for (unsigned i = 0; i < mNumWorkers; ++i) {
+        mWorkers[i]->join();
+        delete mWorkers[i];
+    }
+    delete [] mWorkers;
+}
+
+void ThreadPool::run(Job job, void *context, unsigned count)
+{
+    if (count <= 1 || !mNumWorkers) {
+        // Not worth waking anyone up
+        for (unsigned i = 0; i < count; ++i)
+            job(context, i);
+        return;
+    }
+
+    tthread::lock_guard<tthread::mutex> guard(mLock);
+
+    mJob = job;
+    mContext = context;
+    mCount = count;
+    mNext = 0;
+    mCompleted = 0;
+    mGeneration++;
+    mWakeCond.notify_all();
+
+    workLocked();
+
+    while (mCompleted != mCount)
+        mDoneCond.wait(mLock);
+}
+
+void ThreadPool::workLocked()
+{
+    /*
+     * Claim and run jobs from the current batch until none are left.
+     * Called with mLock held; the lock is dropped while each job runs.
+     */
+
+    while (mNext < mCount) {
+        unsigned index = mNext++;
+
+        mLock.unlock();
+        mJob(mContext, index);
+        mLock.lock();
+
+        if (++mCompleted == mCount)
+            mDoneCond.notify_all();
+    }
+}
+
+void ThreadPool::workerThread(void *param)
+{
+    ThreadPool *self = static_cast<ThreadPool*>(param);
+    tthread::lock_guard<tthread::mutex> guard(self->mLock);
+    unsigned generation = 0;
+
+    while (1) {
+        while (!self->mShutdown && self->mGeneration == generation)
+            self->mWakeCond.wait(self->mLock);
+        if (self->mShutdown)
+            return;
+
+        generation = self->mGeneration;
+        self->workLocked();
+    }
+}
+
+};  // namespace Stir
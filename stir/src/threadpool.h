@@ -0,0 +1,91 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * STIR -- Sifteo Tiled Image Reducer
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include "tinythread.h"
+
+namespace Stir {
+
+/*
+ * ThreadPool --
+ *
+ *    A small fixed-size pool of worker threads, for running independent
+ *    jobs in parallel. run() hands out job indices in increasing order to
+ *    whichever thread is free, and the calling thread participates as
+ *    one of the workers. It returns only after every job has finished.
+ *
+ *    Jobs must not depend on the order they complete in. Callers that
+ *    need deterministic output should have each job write into its own
+ *    result slot, then merge the slots in index order afterwards.
+ */
+
+class ThreadPool {
+ public:
+    typedef void (*Job)(void *context, unsigned index);
+
+    explicit ThreadPool(unsigned numThreads = defaultSize());
+    ~ThreadPool();
+
+    // Total number of threads, including the caller of run()
+    unsigned size() const {
+        return mNumWorkers + 1;
+    }
+
+    void run(Job job, void *context, unsigned count);
+
+    // Default pool size. Zero means one thread per CPU.
+    static void setDefaultSize(unsigned numThreads);
+    static unsigned defaultSize();
+
+ private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    static unsigned sDefaultSize;
+
+    tthread::mutex mLock;
+    tthread::condition_variable mWakeCond;
+    tthread::condition_variable mDoneCond;
+    tthread::thread **mWorkers;
+    unsigned mNumWorkers;
+    bool mShutdown;
+
+    // Current batch; all protected by mLock
+    Job mJob;
+    void *mContext;
+    unsigned mCount;
+    unsigned mNext;
+    unsigned mCompleted;
+    unsigned mGeneration;
+
+    static void workerThread(void *param);
+    void workLocked();
+};
+
+};  // namespace Stir
+
+#endif
@@ -34,6 +34,7 @@
 
 #include "tile.h"
 #include "tilecodec.h"
+#include "tilemetric.h"
 
 
 /*
@@ -64,7 +65,7 @@ namespace Stir {
 std::tr1::unordered_map<Tile::Identity, TileRef> Tile::instances;
 
 Tile::Tile(const Identity &id)
-    : mHasSobel(false), mHasDec4(false), mID(id)
+    : mHasSobel(false), mHasDec4(false), mHasPlanar(false), mID(id)
     {}
 
 TileRef Tile::instance(const Identity &id)
@@ -295,18 +296,35 @@ double Tile::errorMetric(Tile &other, double limit)
     return error * 60.0;
 }
 
+void Tile::constructPlanar()
+{
+    /*
+     * Unpack our pixels into planar CIELab, so fineMSE() can run over
+     * whole planes at a time.
+     */
+
+    mHasPlanar = true;
+
+    for (unsigned i = 0; i < PIXELS; i++) {
+        CIELab lab(mID.pixels[i]);
+        mPlanar[i] = lab.L;
+        mPlanar[i + PIXELS] = lab.a;
+        mPlanar[i + PIXELS * 2] = lab.b;
+    }
+}
+
 double Tile::fineMSE(Tile &other)
 {
     /*
      * A normal pixel-wise mean squared error metric.
      */
 
-    double error = 0;
-
-    for (unsigned i = 0; i < PIXELS; i++)
-        error += CIELab(mID.pixels[i]).meanSquaredError(CIELab(other.mID.pixels[i]));
+    if (!mHasPlanar)
+        constructPlanar();
+    if (!other.mHasPlanar)
+        other.constructPlanar();
 
-    return error / PIXELS;
+    return TileMetric::sumSquaredDiff(mPlanar, other.mPlanar, 3 * PIXELS) / PIXELS;
 }
 
 double Tile::coarseMSE(Tile &other)
@@ -315,17 +333,15 @@ double Tile::coarseMSE(Tile &other)
      * A reduced scale MSE metric using the 2x2 pixel decimated version of our tile.
      */
 
-    double error = 0;
-
     if (!mHasDec4)
         constructDec4();
     if (!other.mHasDec4)
         other.constructDec4();
 
-    for (unsigned i = 0; i < 4; i++)
-        error += mDec4[i].meanSquaredError(other.mDec4[i]);
+    // Treat the Dec4 image as a flat array of 12 doubles
+    STATIC_ASSERT(sizeof mDec4 == 12 * sizeof(double));
 
-    return error / 4;
+    return TileMetric::sumSquaredDiff(mDec4[0].axis, other.mDec4[0].axis, 12) / 4;
 }
 
 double Tile::sobelError(Tile &other)
@@ -335,20 +351,14 @@ double Tile::sobelError(Tile &other)
      * differences using the Sobel operator.
      */
 
-    double error = 0;
-
     if (!mHasSobel)
         constructSobel();
     if (!other.mHasSobel)
         other.constructSobel();
 
-    for (unsigned i = 0; i < PIXELS; i++) {
-        double gx = mSobelGx[i] - other.mSobelGx[i];
-        double gy = mSobelGy[i] - other.mSobelGy[i];
+    double error = TileMetric::sumSquaredDiff(mSobelGx, other.mSobelGx, PIXELS)
+                 + TileMetric::sumSquaredDiff(mSobelGy, other.mSobelGy, PIXELS);
 
-        error += gx * gx + gy * gy;
-    }
-    
     // Contrast difference over total contrast
     return error / (1 + mSobelTotal + other.mSobelTotal);
 }
@@ -360,7 +370,19 @@ TileRef Tile::reduce(ColorReducer &reducer) const
      * ColorReducer instance.
      */
 
-    Identity reduced;   
+    Identity reduced;
+    reduce(reducer, reduced);
+    return instance(reduced);
+}
+
+void Tile::reduce(ColorReducer &reducer, Identity &reduced) const
+{
+    /*
+     * Just compute the reduced tile's identity, without looking up an
+     * instance. This doesn't touch any shared state, so it may run on
+     * a worker thread.
+     */
+
     reduced.options = mID.options;
 
     for (unsigned i = 0; i < PIXELS; i++) {
@@ -373,8 +395,6 @@ TileRef Tile::reduce(ColorReducer &reducer) const
             reduced.pixels[i] = reducer.nearest(original);
         }
     }
-
-    return instance(reduced);
 }
 
 TilePalette::TilePalette()
@@ -471,32 +491,265 @@ void TileStack::computeMedian()
     }
 }
 
-TileStack* TilePool::closest(TileRef t, double distance)
+/*
+ * Lower bounds on errorMetric(), which is 60 * (0.450 * coarseMSE + ...).
+ * coarseMSE() is the squared distance between Dec4 images, over 4. Our
+ * grid projection is orthonormal, so projected squared distances can
+ * only be smaller. A little slack covers floating point rounding.
+ */
+static const double COARSE_BOUND_SCALE = 0.450 * 60.0;
+static const double PROJECTED_BOUND_SCALE = COARSE_BOUND_SCALE / 4;
+static const double BOUND_SLACK = 1.000001;
+
+const double StackSearch::CELL_SIZE = 8.0;
+
+void StackSearch::project(const Tile &t, double coord[3])
+{
+    // Average color of the Dec4 image, scaled to keep the projection orthonormal
+    for (unsigned axis = 0; axis < 3; axis++) {
+        double sum = 0;
+        for (unsigned i = 0; i < 4; i++)
+            sum += t.mDec4[i].axis[axis];
+        coord[axis] = sum * 0.5;
+    }
+}
+
+int StackSearch::cellCoord(double v)
+{
+    double c = floor(v / CELL_SIZE);
+    return (int) std::max<double>(-CELL_RANGE / 2, std::min<double>(CELL_RANGE / 2 - 1, c));
+}
+
+void StackSearch::add(TileStack *stack)
+{
+    Entry e;
+    e.median = NULL;
+    e.cell = 0;
+    e.dirty = false;
+
+    positions[stack] = stacks.size();
+    stacks.push_back(stack);
+    entries.push_back(e);
+    invalidate(stack);
+}
+
+void StackSearch::invalidate(TileStack *stack)
+{
+    // This stack's median may have changed. Re-index it during prepare().
+
+    unsigned position = positions[stack];
+    Entry &e = entries[position];
+
+    if (!e.dirty) {
+        e.dirty = true;
+        dirty.push_back(position);
+    }
+}
+
+void StackSearch::prepare()
 {
     /*
-     * Search for the closest tile set for the provided tile image.
-     * Returns the tile stack, if any was found which meets the tile's
-     * stated maximum MSE requirement.
+     * Compute any out-of-date medians, build their metric caches, and
+     * move them to the right grid cell. Must run on the main thread.
      */
 
-    const double epsilon = 1e-3;
-    TileStack *closest = NULL;
+    for (std::vector<unsigned>::iterator i = dirty.begin(); i != dirty.end(); ++i) {
+        unsigned position = *i;
+        Entry &e = entries[position];
+        TileStack *stack = stacks[position];
 
-    for (std::list<TileStack>::iterator i = stackList.begin(); i != stackList.end(); i++) {
-        double err = i->median()->errorMetric(*t, distance);
+        if (e.median) {
+            std::vector<unsigned> &cell = cells[e.cell];
+            cell.erase(std::find(cell.begin(), cell.end(), position));
+            if (cell.empty())
+                cells.erase(e.cell);
+        }
+
+        e.median = &*stack->median();
+        e.median->prepareMetric();
+        e.dirty = false;
+
+        double coord[3];
+        project(*e.median, coord);
+        e.cell = cellKey(cellCoord(coord[0]), cellCoord(coord[1]), cellCoord(coord[2]));
+        cells[e.cell].push_back(position);
+    }
+
+    dirty.clear();
+}
+
+void StackSearch::candidates(Tile &t, double distance, unsigned begin,
+                             std::vector<unsigned> &result) const
+{
+    /*
+     * Collect every stack whose grid cell could hold a match within
+     * 'distance'. If that's more cells than we actually have occupied,
+     * it's cheaper to filter the occupied cells instead.
+     */
+
+    double coord[3];
+    int lo[3], hi[3];
+    double radius = sqrt(distance * BOUND_SLACK / PROJECTED_BOUND_SCALE) + 1e-3;
+    double numCells = 1;
+
+    project(t, coord);
+    for (unsigned axis = 0; axis < 3; axis++) {
+        lo[axis] = cellCoord(coord[axis] - radius);
+        hi[axis] = cellCoord(coord[axis] + radius);
+        numCells *= hi[axis] - lo[axis] + 1;
+    }
+
+    result.clear();
+
+    if (numCells > cells.size()) {
+        for (std::tr1::unordered_map<CellKey, std::vector<unsigned> >::const_iterator
+                i = cells.begin(); i != cells.end(); ++i) {
+            int x = int(i->first & 0x3FF) - CELL_RANGE / 2;
+            int y = int((i->first >> 10) & 0x3FF) - CELL_RANGE / 2;
+            int z = int(i->first >> 20) - CELL_RANGE / 2;
+
+            if (x >= lo[0] && x <= hi[0] && y >= lo[1] && y <= hi[1] && z >= lo[2] && z <= hi[2])
+                for (std::vector<unsigned>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+                    if (*j >= begin)
+                        result.push_back(*j);
+        }
+    } else {
+        for (int x = lo[0]; x <= hi[0]; x++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int z = lo[2]; z <= hi[2]; z++) {
+                    std::tr1::unordered_map<CellKey, std::vector<unsigned> >::const_iterator
+                        i = cells.find(cellKey(x, y, z));
+                    if (i != cells.end())
+                        for (std::vector<unsigned>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+                            if (*j >= begin)
+                                result.push_back(*j);
+                }
+    }
+
+    std::sort(result.begin(), result.end());
+}
+
+void StackSearch::search(Tile &t, double distance, const std::vector<unsigned> &candidates,
+                         unsigned first, unsigned last, Match &match) const
+{
+    /*
+     * Continue a search over part of a candidate list. On entry, 'match'
+     * holds the best result from any earlier stacks.
+     */
+
+    if (match.exact())
+        return;
+
+    for (unsigned i = first; i < last; ++i) {
+        unsigned position = candidates[i];
+        Tile *median = entries[position].median;
+        double limit = match.found() ? match.error : distance;
+
+        assert(!entries[position].dirty && median == &*stacks[position]->cache);
 
-        if (err <= distance) {
-            distance = err;
-            closest = &*i;
+        // errorMetric() can't be any smaller than this
+        if (COARSE_BOUND_SCALE * median->coarseMSE(t) > limit * BOUND_SLACK)
+            continue;
 
-            if (distance < epsilon) {
+        double err = median->errorMetric(t, limit);
+
+        if (match.found() ? err < match.error : err <= distance) {
+            match.position = position;
+            match.error = err;
+
+            if (match.exact()) {
                 // Not going to improve on this; early out.
                 break;
             }
         }
     }
+}
+
+void StackSearch::search(Tile &t, double distance, unsigned begin, Match &match) const
+{
+    std::vector<unsigned> list;
+    candidates(t, distance, begin, list);
+    search(t, distance, list, 0, list.size(), match);
+}
+
+struct TilePool::ClosestSearch {
+    const StackSearch *search;
+    Tile *tile;
+    double distance;
+    unsigned chunkSize;
+    std::vector<unsigned> candidates;
+    std::vector<StackSearch::Match> results;
+};
+
+struct TilePool::ClosestTileSearch {
+    const StackSearch *search;
+    const std::vector<Tile*> *tiles;
+    unsigned chunkSize;
+    std::vector<StackSearch::Match> *results;
+};
+
+void TilePool::closestJob(void *context, unsigned index)
+{
+    // One chunk of the candidate list, for a single tile
+    ClosestSearch *s = static_cast<ClosestSearch*>(context);
+    unsigned first = index * s->chunkSize;
+    unsigned last = std::min<unsigned>(first + s->chunkSize, s->candidates.size());
+
+    s->search->search(*s->tile, s->distance, s->candidates, first, last, s->results[index]);
+}
+
+void TilePool::closestTileJob(void *context, unsigned index)
+{
+    // One chunk of tiles, each searched against every stack
+    ClosestTileSearch *s = static_cast<ClosestTileSearch*>(context);
+    unsigned begin = index * s->chunkSize;
+    unsigned end = std::min<unsigned>(begin + s->chunkSize, s->tiles->size());
+
+    for (unsigned i = begin; i != end; ++i) {
+        Tile *t = (*s->tiles)[i];
+        s->search->search(*t, t->options().getMaxMSE(), 0, (*s->results)[i]);
+    }
+}
+
+TileStack* TilePool::closest(ThreadPool &threads, StackSearch &search,
+                             TileRef t, double distance)
+{
+    /*
+     * Search for the closest tile set for the provided tile image.
+     * Returns the tile stack, if any was found which meets the tile's
+     * stated maximum MSE requirement.
+     *
+     * Long candidate lists are split into contiguous chunks and searched
+     * in parallel. Merging the chunks in order gives the same answer as a
+     * single sequential search, regardless of the number of threads.
+     */
+
+    const unsigned minChunk = 256;
+
+    search.prepare();
+    t->prepareMetric();
+
+    ClosestSearch s;
+    s.search = &search;
+    s.tile = &*t;
+    s.distance = distance;
+    search.candidates(*t, distance, 0, s.candidates);
 
-    return closest;
+    unsigned numChunks = std::min<unsigned>(threads.size(),
+        (s.candidates.size() + minChunk - 1) / minChunk);
+    if (!numChunks)
+        return NULL;
+
+    s.chunkSize = (s.candidates.size() + numChunks - 1) / numChunks;
+    s.results.resize(numChunks);
+
+    threads.run(closestJob, &s, numChunks);
+
+    StackSearch::Match match;
+    for (unsigned i = 0; i < numChunks; ++i)
+        match.merge(s.results[i]);
+
+    return match.found() ? search.stack(match.position) : NULL;
 }
 
 TileGrid::TileGrid(TilePool *pool)
@@ -520,18 +773,18 @@ void TileGrid::load(const TileOptions &opt, uint8_t *rgba,
         }
 }
 
-void TilePool::optimize(Logger &log)
+void TilePool::optimize(Logger &log, ThreadPool &threads)
 {
     /*
      * Global optimizations to apply after filling a tile pool.
      */
 
     if (numFixed) {
-        optimizeFixedTiles(log);
+        optimizeFixedTiles(log, threads);
     } else {
         optimizePalette(log);
-        optimizeTiles(log);
-        optimizeTrueColorTiles(log);
+        optimizeTiles(log, threads);
+        optimizeTrueColorTiles(log, threads);
         optimizeOrder(log);
     }
 }
@@ -578,7 +831,7 @@ void TilePool::optimizePalette(Logger &log)
     }
 }
 
-void TilePool::optimizeFixedTiles(Logger &log)
+void TilePool::optimizeFixedTiles(Logger &log, ThreadPool &threads)
 {
     /*
      * This is an alternative optimization path for pools which contain
@@ -610,6 +863,10 @@ void TilePool::optimizeFixedTiles(Logger &log)
      * All remaining tile serials use closest() to find matches in the fixed stacks.
      */
 
+    StackSearch search;
+    for (unsigned i = 0; i < numFixed; ++i)
+        search.add(stackArray[i]);
+
     log.taskBegin("Matching fixed tiles");
 
     for (unsigned serial = numFixed; serial < tiles.size(); ++serial) {
@@ -624,7 +881,7 @@ void TilePool::optimizeFixedTiles(Logger &log)
         double distance = 1.0f;
         TileStack *c;
         do {
-            c = closest(tiles[serial], distance);
+            c = closest(threads, search, tiles[serial], distance);
             distance *= 100;
         } while (!c);
 
@@ -639,7 +896,7 @@ void TilePool::optimizeFixedTiles(Logger &log)
     log.taskEnd();
 }
 
-void TilePool::optimizeTiles(Logger &log)
+void TilePool::optimizeTiles(Logger &log, ThreadPool &threads)
 {
     /*
      * The tile optimizer is a greedy algorithm that works in two
@@ -666,26 +923,70 @@ void TilePool::optimizeTiles(Logger &log)
     stackIndex.resize(tiles.size());
 
     log.taskBegin("Gathering pinned tiles");
-    optimizeTilesPass(log, activeStacks, true, true);
+    optimizeTilesPass(log, threads, activeStacks, true, true);
     log.taskEnd();
 
     log.taskBegin("Gathering unpinned tiles");
-    optimizeTilesPass(log, activeStacks, true, false);
+    optimizeTilesPass(log, threads, activeStacks, true, false);
     log.taskEnd();
 
     log.taskBegin("Optimizing tiles");
-    optimizeTilesPass(log, activeStacks, false, false);
+    optimizeTilesPass(log, threads, activeStacks, false, false);
     log.taskEnd();
 }
     
-void TilePool::optimizeTilesPass(Logger &log,
+void TilePool::optimizeTilesPass(Logger &log, ThreadPool &threads,
                                  std::tr1::unordered_set<TileStack *> &activeStacks,
                                  bool gather, bool pinned)
 {
     // A single pass from the multi-pass optimizeTiles() algorithm
 
     std::tr1::unordered_map<Tile *, TileStack *> memo;
-    
+    StackSearch search;
+
+    for (std::list<TileStack>::iterator i = stackList.begin(); i != stackList.end(); i++)
+        search.add(&*i);
+
+    /*
+     * The optimization pass never modifies existing stacks, so every
+     * unique tile's search can run up front, in parallel. Stacks created
+     * later in the pass are searched as a continuation of these results.
+     */
+
+    std::tr1::unordered_map<Tile *, StackSearch::Match> prefetched;
+    unsigned numPrefetched = 0;
+
+    if (!gather && !pinned) {
+        const unsigned minChunk = 16;
+        std::vector<Tile*> queries;
+        std::vector<StackSearch::Match> results;
+
+        for (Serial serial = 0; serial < tiles.size(); serial++) {
+            Tile *t = &*tiles[serial];
+            if (!t->options().pinned && prefetched.insert(std::make_pair(t, StackSearch::Match())).second) {
+                t->prepareMetric();
+                queries.push_back(t);
+            }
+        }
+
+        numPrefetched = search.size();
+        search.prepare();
+        results.resize(queries.size());
+
+        ClosestTileSearch s;
+        unsigned numChunks = std::min<unsigned>(threads.size() * 4,
+            (queries.size() + minChunk - 1) / minChunk);
+        s.search = &search;
+        s.tiles = &queries;
+        s.chunkSize = numChunks ? (queries.size() + numChunks - 1) / numChunks : 0;
+        s.results = &results;
+
+        threads.run(closestTileJob, &s, numChunks);
+
+        for (unsigned i = 0; i < queries.size(); ++i)
+            prefetched[queries[i]] = results[i];
+    }
+
     for (Serial serial = 0; serial < tiles.size(); serial++) {
         TileRef tr = tiles[serial];
 
@@ -716,7 +1017,14 @@ void TilePool::optimizeTilesPass(Logger &log,
 
                 std::tr1::unordered_map<Tile *, TileStack *>::iterator i = memo.find(&*tr);
                 if (i == memo.end()) {
-                    c = closest(tr, tr->options().getMaxMSE());
+                    if (gather) {
+                        c = closest(threads, search, tr, tr->options().getMaxMSE());
+                    } else {
+                        StackSearch::Match match = prefetched[&*tr];
+                        search.prepare();
+                        search.search(*tr, tr->options().getMaxMSE(), numPrefetched, match);
+                        c = match.found() ? search.stack(match.position) : NULL;
+                    }
                     memo[&*tr] = c;
                 } else {
                     c = memo[&*tr];
@@ -728,9 +1036,11 @@ void TilePool::optimizeTilesPass(Logger &log,
                 stackList.push_back(TileStack());
                 c = &stackList.back();
                 c->add(tr);
+                search.add(c);
             } else if (gather) {
                 // Add to an existing stack
                 c->add(tr);
+                search.invalidate(c);
             }
 
             if (!gather || pinned) {
@@ -764,7 +1074,34 @@ void TilePool::optimizeTilesPass(Logger &log,
     }
 }
 
-void TilePool::optimizeTrueColorTiles(Logger &log)
+struct TilePool::TrueColorReduction {
+    const std::vector<Tile*> *medians;
+    unsigned base;
+    std::vector<Tile::Identity> results;
+};
+
+void TilePool::reduceTrueColorJob(void *context, unsigned index)
+{
+    TrueColorReduction *r = static_cast<TrueColorReduction*>(context);
+    const Tile *tile = (*r->medians)[r->base + index];
+
+    /*
+     * Use an unlimited MSE but bounded number of colors, to forcibly
+     * limit this tile to the maximum LUT size (16 colors) without
+     * regard to quality settings.
+     *
+     * The reducer is much too large for a worker thread's stack.
+     */
+
+    ColorReducer *reducer = new ColorReducer();
+    for (unsigned j = 0; j < Tile::PIXELS; j++)
+        reducer->add(tile->pixel(j));
+    reducer->reduce(0, TilePalette::LUT_MAX);
+    tile->reduce(*reducer, r->results[index]);
+    delete reducer;
+}
+
+void TilePool::optimizeTrueColorTiles(Logger &log, ThreadPool &threads)
 {
     /*
      * Look at just the remaining tiles which have too many colors
@@ -776,17 +1113,25 @@ void TilePool::optimizeTrueColorTiles(Logger &log)
      * more likely to result in uniform color tones across an entire
      * asset group (and avoiding tile discontinuities), whereas this is
      * intended more for tiles that already use a bunch of colors.
+     *
+     * Each stack is reduced independently, so the color reduction itself
+     * runs in parallel batches. Instancing and checking the reduced tiles
+     * stays on this thread, in stack order.
      */
 
     if (stackList.empty())
         return;
 
+    const double epsilon = 1e-3;
     unsigned totalCount = 0;
     unsigned reducedCount = 0;
     log.taskBegin("Optimizing true color tiles");
 
-    std::list<TileStack>::iterator i = stackList.begin();
-    while (1) {
+    // Lossy true color stacks, and their current medians
+    std::vector<TileStack*> candidates;
+    std::vector<Tile*> medians;
+
+    for (std::list<TileStack>::iterator i = stackList.begin(); i != stackList.end(); i++) {
         TileStack &stack = *i;
         TileRef tile = stack.median();
         bool isTrueColor = !tile->palette().hasLUT();
@@ -795,51 +1140,50 @@ void TilePool::optimizeTrueColorTiles(Logger &log)
             totalCount++;
 
             // Don't modify tiles that are marked as lossless
-            const double epsilon = 1e-3;
-            double maxMSE = tile->options().getMaxMSE();
-            if (maxMSE > epsilon) {
+            if (tile->options().getMaxMSE() > epsilon) {
+                candidates.push_back(&stack);
+                medians.push_back(&*tile);
+            }
+        }
+    }
 
-                /*
-                 * Use an unlimited MSE but bounded number of colors, to forcibly
-                 * limit this tile to the maximum LUT size (16 colors) without
-                 * regard to quality settings.
-                 */
+    const unsigned batchSize = std::max<unsigned>(16, threads.size());
+    TrueColorReduction r;
+    r.medians = &medians;
+    r.results.resize(batchSize);
 
-                ColorReducer reducer;
-                for (unsigned j = 0; j < Tile::PIXELS; j++)
-                    reducer.add(tile->pixel(j));
-                reducer.reduce(0, TilePalette::LUT_MAX);
-                TileRef reduced = tile->reduce(reducer);
+    r.base = 0;
+    do {
+        unsigned count = std::min<unsigned>(batchSize, candidates.size() - r.base);
 
-                /*
-                 * Check the results, and decide whether they're adequate
-                 * according to the tile's compression quality.
-                 */
+        threads.run(reduceTrueColorJob, &r, count);
 
-                // Try extra hard to avoid CM_TRUE
-                double limit = maxMSE * 2.0;
+        for (unsigned j = 0; j < count; j++) {
+            TileStack &stack = *candidates[r.base + j];
+            TileRef tile = stack.median();
+            TileRef reduced = Tile::instance(r.results[j]);
 
-                if (tile->errorMetric(*reduced, limit) < limit) {
-                    stack.replace(reduced);
-                    reducedCount++;
-                }
-            }
-        }
+            /*
+             * Check the results, and decide whether they're adequate
+             * according to the tile's compression quality.
+             */
 
-        ++i;
-        bool last = i == stackList.end();
+            // Try extra hard to avoid CM_TRUE
+            double limit = tile->options().getMaxMSE() * 2.0;
 
-        // Update status periodically as well as on completion.
-        if (last || (isTrueColor && (totalCount % 16) == 0)) {
-            log.taskProgress("%u of %u tile%s reduced (%.03f%%)",
-                reducedCount, totalCount,
-                totalCount == 1 ? "" : "s",
-                totalCount ? (reducedCount * 100.0 / totalCount) : 0);
+            if (tile->errorMetric(*reduced, limit) < limit) {
+                stack.replace(reduced);
+                reducedCount++;
+            }
         }
 
-        if (last)
-            break;
-    }
+        log.taskProgress("%u of %u tile%s reduced (%.03f%%)",
+            reducedCount, totalCount,
+            totalCount == 1 ? "" : "s",
+            totalCount ? (reducedCount * 100.0 / totalCount) : 0);
+
+        r.base += batchSize;
+    } while (r.base < candidates.size());
 
     log.taskEnd();
 }
@@ -993,5 +1337,101 @@ void TilePool::calculateCRC(std::vector<uint8_t> &crcbuf) const
     }
 }
 
+static void putTile(CacheBlob &blob, const Tile &t)
+{
+    for (unsigned i = 0; i < Tile::PIXELS; i++)
+        blob.put16(t.pixel(i).value);
+
+    const TileOptions &opt = t.options();
+    blob.putDouble(opt.quality);
+    blob.put8(opt.pinned);
+    blob.put8(opt.chromaKey);
+}
+
+static void getTile(CacheBlob &blob, Tile::Identity &id)
+{
+    for (unsigned i = 0; i < Tile::PIXELS; i++)
+        id.pixels[i] = RGB565(blob.get16());
+
+    id.options.quality = blob.getDouble();
+    id.options.pinned = blob.get8() != 0;
+    id.options.chromaKey = blob.get8() != 0;
+}
+
+void TilePool::cacheKey(CacheBlob &key) const
+{
+    /*
+     * Describe every input to optimize(). This must be called before
+     * optimizing, while 'tiles' still holds the original images.
+     */
+
+    key.put32(numFixed);
+    key.put32(tiles.size());
+    for (std::vector<TileRef>::const_iterator i = tiles.begin(); i != tiles.end(); i++)
+        putTile(key, **i);
+}
+
+void TilePool::saveCache(CacheBlob &value) const
+{
+    /*
+     * Save the results of optimize(): every tile image in index order,
+     * and the optimized index for each serial number.
+     */
+
+    value.put32(size());
+    for (unsigned i = 0; i < size(); i++)
+        putTile(value, *tile(i));
+
+    value.put32(stackIndex.size());
+    for (unsigned s = 0; s < stackIndex.size(); s++)
+        value.put16(index(s));
+}
+
+bool TilePool::loadCache(CacheBlob &value)
+{
+    /*
+     * Replace optimize() with results from saveCache(). This must be the
+     * last thing in 'value'. On failure, the pool is left untouched.
+     */
+
+    unsigned count = value.get32();
+    if (value.hasError() || count > tiles.size())
+        return false;
+
+    std::vector<Tile::Identity> images(count);
+    for (unsigned i = 0; i < count; i++)
+        getTile(value, images[i]);
+
+    if (value.get32() != tiles.size())
+        return false;
+
+    std::vector<Index> indices(tiles.size());
+    for (unsigned s = 0; s < indices.size(); s++)
+        if ((indices[s] = value.get16()) >= count)
+            return false;
+
+    if (!value.isComplete())
+        return false;
+
+    stackList.clear();
+    stackArray.resize(count);
+    stackIndex.resize(tiles.size());
+
+    for (unsigned i = 0; i < count; i++) {
+        stackList.push_back(TileStack());
+        TileStack *c = &stackList.back();
+        c->add(Tile::instance(images[i]));
+        c->index = i;
+        stackArray[i] = c;
+    }
+
+    for (unsigned s = 0; s < indices.size(); s++) {
+        stackIndex[s] = stackArray[indices[s]];
+        tiles[s] = stackIndex[s]->median();
+    }
+
+    return true;
+}
+
 
 };  // namespace Stir
@@ -36,6 +36,13 @@
 
 #include "color.h"
 #include "logger.h"
+#include "cache.h"
+#include "threadpool.h"
+
+// Same as the firmware and SDK: 'size of array is negative' when the assert fails
+#ifndef STATIC_ASSERT
+#define STATIC_ASSERT(_x)  ((void)sizeof(char[1 - 2*!(_x)]))
+#endif
 
 namespace Stir {
 
@@ -185,11 +192,26 @@ class Tile {
 
     double errorMetric(Tile &other, double limit=DBL_MAX);
 
+    void prepareMetric() {
+        /*
+         * Build every lazy cache errorMetric() needs. After this, calling
+         * errorMetric() on two prepared tiles only reads them, so it's
+         * safe to do from multiple threads at once.
+         */
+        if (!mHasDec4)
+            constructDec4();
+        if (!mHasSobel)
+            constructSobel();
+        if (!mHasPlanar)
+            constructPlanar();
+    }
+
     double fineMSE(Tile &other); 
     double coarseMSE(Tile &other);
     double sobelError(Tile &other);
 
     TileRef reduce(ColorReducer &reducer) const;
+    void reduce(ColorReducer &reducer, Identity &result) const;
 
  private:
     Tile(const Identity &id);
@@ -199,17 +221,21 @@ class Tile {
     void constructPalette();
     void constructSobel();
     void constructDec4();
+    void constructPlanar();
 
     friend class TileStack;
+    friend class StackSearch;
     
     bool mHasSobel;
     bool mHasDec4;
+    bool mHasPlanar;
     TilePalette mPalette;
     Identity mID;
     CIELab mDec4[4];
     double mSobelGx[PIXELS];
     double mSobelGy[PIXELS];
     double mSobelTotal;
+    double mPlanar[3 * PIXELS];     // CIELab image; all L, then all a, then all b
 };
 
 
@@ -259,6 +285,7 @@ class TileStack {
     static const unsigned NO_INDEX = (unsigned)-1;
 
     friend class TilePool;
+    friend class StackSearch;
 
     std::vector<TileRef> tiles;
     TileRef cache;
@@ -270,6 +297,98 @@ class TileStack {
 };
 
 
+/*
+ * StackSearch --
+ *
+ *    Nearest-stack search over an ordered list of TileStacks. The winner
+ *    is the lowest error within the search distance, with ties going to
+ *    the earliest stack. The first stack that's a near-exact match ends
+ *    the search early.
+ *
+ *    Candidates come from a bucket grid over each median's decimated
+ *    (Dec4) image, projected down to its average L*a*b* color. Both the
+ *    projected distance and coarseMSE() are lower bounds on errorMetric(),
+ *    so we skip stacks without changing the result of a full linear scan.
+ *
+ *    Stacks whose median changes must be invalidate()'d. After prepare(),
+ *    searches only read shared state, so any thread may run them.
+ */
+
+class StackSearch {
+ public:
+    struct Match {
+        static const unsigned NONE = (unsigned)-1;
+
+        unsigned position;      // Position in the search order, or NONE
+        double error;
+
+        Match() : position(NONE), error(DBL_MAX) {}
+
+        bool found() const {
+            return position != NONE;
+        }
+
+        bool exact() const {
+            const double epsilon = 1e-3;
+            return found() && error < epsilon;
+        }
+
+        void merge(const Match &later) {
+            // Merge with a search over later stacks
+            if (!exact() && later.found() && (!found() || later.error < error))
+                *this = later;
+        }
+    };
+
+    void add(TileStack *stack);
+    void invalidate(TileStack *stack);
+    void prepare();
+
+    unsigned size() const {
+        return stacks.size();
+    }
+
+    TileStack *stack(unsigned position) const {
+        return stacks[position];
+    }
+
+    // Candidate positions >= 'begin', sorted in search order
+    void candidates(Tile &t, double distance, unsigned begin,
+                    std::vector<unsigned> &result) const;
+
+    // Continue 'match' over candidates[first, last)
+    void search(Tile &t, double distance, const std::vector<unsigned> &candidates,
+                unsigned first, unsigned last, Match &match) const;
+
+    // Continue 'match' over every stack at position 'begin' or later
+    void search(Tile &t, double distance, unsigned begin, Match &match) const;
+
+ private:
+    typedef uint32_t CellKey;
+
+    struct Entry {
+        Tile *median;           // Prepared median, as of the last prepare()
+        CellKey cell;
+        bool dirty;
+    };
+
+    static const double CELL_SIZE;
+    static const int CELL_RANGE = 512;
+
+    std::vector<TileStack*> stacks;
+    std::vector<Entry> entries;
+    std::vector<unsigned> dirty;
+    std::tr1::unordered_map<TileStack*, unsigned> positions;
+    std::tr1::unordered_map<CellKey, std::vector<unsigned> > cells;
+
+    static void project(const Tile &t, double coord[3]);
+    static int cellCoord(double v);
+    static CellKey cellKey(int x, int y, int z) {
+        return (x + CELL_RANGE / 2) | ((y + CELL_RANGE / 2) << 10) | ((z + CELL_RANGE / 2) << 20);
+    }
+};
+
+
 /*
  * TilePool --
  *
@@ -287,7 +406,7 @@ class TilePool {
     TilePool() : numFixed(0) {}
 
     // Normal optimization flow
-    void optimize(Logger &log);
+    void optimize(Logger &log, ThreadPool &threads);
     void encode(std::vector<uint8_t>& out, Logger *log = NULL);
 
     // All previous tiles are set in stone, no new tiles can be added
@@ -335,6 +454,11 @@ class TilePool {
 
     void calculateCRC(std::vector<uint8_t> &crcbuf) const;
 
+    // Persistent caching of optimize() results. See AssetCache.
+    void cacheKey(CacheBlob &key) const;
+    void saveCache(CacheBlob &value) const;
+    bool loadCache(CacheBlob &value);
+
  private:
     unsigned numFixed;
 
@@ -343,16 +467,25 @@ class TilePool {
     std::vector<TileRef> tiles;           // Current best image for each tile, by Serial
     std::vector<TileStack*> stackIndex;   // Current optimized stack for each tile, by Serial
  
-    void optimizeFixedTiles(Logger &log);
+    void optimizeFixedTiles(Logger &log, ThreadPool &threads);
     void optimizePalette(Logger &log);
     void optimizeOrder(Logger &log);
-    void optimizeTiles(Logger &log);
-    void optimizeTrueColorTiles(Logger &log);
-    void optimizeTilesPass(Logger &log,
+    void optimizeTiles(Logger &log, ThreadPool &threads);
+    void optimizeTrueColorTiles(Logger &log, ThreadPool &threads);
+    void optimizeTilesPass(Logger &log, ThreadPool &threads,
                            std::tr1::unordered_set<TileStack *> &activeStacks,
                            bool gather, bool pinned);
 
-    TileStack *closest(TileRef t, double distance);
+    struct ClosestSearch;
+    struct ClosestTileSearch;
+    struct TrueColorReduction;
+
+    static void closestJob(void *context, unsigned index);
+    static void closestTileJob(void *context, unsigned index);
+    static void reduceTrueColorJob(void *context, unsigned index);
+
+    TileStack *closest(ThreadPool &threads, StackSearch &search,
+                       TileRef t, double distance);
 };
 
 
@@ -0,0 +1,199 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * STIR -- Sifteo Tiled Image Reducer
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include "tilemetric.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define TILEMETRIC_X86
+#   include <cpuid.h>
+#   include <immintrin.h>
+#endif
+
+namespace Stir {
+
+TileMetric::Implementation TileMetric::current = TileMetric::SCALAR;
+TileMetric::Kernel TileMetric::kernel = TileMetric::autoSelect();
+
+
+#ifdef TILEMETRIC_X86
+
+static bool cpuHasSSE2()
+{
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return false;
+    return (d & (1 << 26)) != 0;
+}
+
+static bool cpuHasAVX2()
+{
+    unsigned a, b, c, d;
+
+    // The CPU must support AVX, and the OS must save YMM state for us
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return false;
+    const unsigned osxsave = 1 << 27, avx = 1 << 28;
+    if ((c & (osxsave | avx)) != (osxsave | avx))
+        return false;
+
+    unsigned xcr0, xcr0High;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0High) : "c" (0));
+    if ((xcr0 & 6) != 6)
+        return false;
+
+    if (__get_cpuid_max(0, 0) < 7)
+        return false;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1 << 5)) != 0;
+}
+
+#endif  // TILEMETRIC_X86
+
+
+bool TileMetric::isSupported(Implementation impl)
+{
+    switch (impl) {
+    case SCALAR:    return true;
+#ifdef TILEMETRIC_X86
+    case SSE2:      return cpuHasSSE2();
+    case AVX2:      return cpuHasAVX2();
+#endif
+    default:        return false;
+    }
+}
+
+const char *TileMetric::name(Implementation impl)
+{
+    switch (impl) {
+    case SCALAR:    return "scalar";
+    case SSE2:      return "SSE2";
+    case AVX2:      return "AVX2";
+    default:        return "<invalid>";
+    }
+}
+
+TileMetric::Kernel TileMetric::kernelFor(Implementation impl)
+{
+    switch (impl) {
+    case SSE2:      return sse2;
+    case AVX2:      return avx2;
+    default:        return scalar;
+    }
+}
+
+TileMetric::Kernel TileMetric::autoSelect()
+{
+    for (int impl = NUM_IMPLEMENTATIONS - 1; impl > SCALAR; --impl)
+        if (isSupported((Implementation) impl)) {
+            current = (Implementation) impl;
+            break;
+        }
+
+    return kernelFor(current);
+}
+
+void TileMetric::setImplementation(Implementation impl)
+{
+    assert(isSupported(impl));
+    current = impl;
+    kernel = kernelFor(impl);
+}
+
+TileMetric::Implementation TileMetric::implementation()
+{
+    return current;
+}
+
+double TileMetric::scalar(const double *a, const double *b, unsigned count)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+    for (unsigned i = 0; i < count; i += 4) {
+        double d0 = a[i+0] - b[i+0];
+        double d1 = a[i+1] - b[i+1];
+        double d2 = a[i+2] - b[i+2];
+        double d3 = a[i+3] - b[i+3];
+
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+    }
+
+    return (s0 + s2) + (s1 + s3);
+}
+
+#ifdef TILEMETRIC_X86
+
+__attribute__ ((target ("sse2")))
+double TileMetric::sse2(const double *a, const double *b, unsigned count)
+{
+    __m128d s01 = _mm_setzero_pd();
+    __m128d s23 = _mm_setzero_pd();
+
+    for (unsigned i = 0; i < count; i += 4) {
+        __m128d d01 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        __m128d d23 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+
+        s01 = _mm_add_pd(s01, _mm_mul_pd(d01, d01));
+        s23 = _mm_add_pd(s23, _mm_mul_pd(d23, d23));
+    }
+
+    // (s0 + s2, s1 + s3)
+    __m128d s = _mm_add_pd(s01, s23);
+    return _mm_cvtsd_f64(s) + _mm_cvtsd_f64(_mm_unpackhi_pd(s, s));
+}
+
+__attribute__ ((target ("avx2")))
+double TileMetric::avx2(const double *a, const double *b, unsigned count)
+{
+    __m256d s0123 = _mm256_setzero_pd();
+
+    for (unsigned i = 0; i < count; i += 4) {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        s0123 = _mm256_add_pd(s0123, _mm256_mul_pd(d, d));
+    }
+
+    // (s0 + s2, s1 + s3)
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(s0123), _mm256_extractf128_pd(s0123, 1));
+    return _mm_cvtsd_f64(s) + _mm_cvtsd_f64(_mm_unpackhi_pd(s, s));
+}
+
+#else  // !TILEMETRIC_X86
+
+double TileMetric::sse2(const double *a, const double *b, unsigned count)
+{
+    return scalar(a, b, count);
+}
+
+double TileMetric::avx2(const double *a, const double *b, unsigned count)
+{
+    return scalar(a, b, count);
+}
+
+#endif  // TILEMETRIC_X86
+
+};  // namespace Stir
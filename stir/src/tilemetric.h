@@ -0,0 +1,85 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * STIR -- Sifteo Tiled Image Reducer
+ *
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _TILEMETRIC_H
+#define _TILEMETRIC_H
+
+namespace Stir {
+
+/*
+ * TileMetric --
+ *
+ *    Vectorized inner loops for the Tile error metrics, with runtime CPU
+ *    dispatch. At startup we pick the widest implementation this CPU
+ *    supports.
+ *
+ *    Every implementation sums in the same order: four interleaved
+ *    partial sums, combined as (s0 + s2) + (s1 + s3). So they all give
+ *    bit-identical results, and an asset build doesn't depend on which
+ *    CPU it ran on. (This file is built without -ffast-math, so the
+ *    compiler can't reorder the sums either.)
+ */
+
+class TileMetric {
+ public:
+    enum Implementation {
+        SCALAR,
+        SSE2,
+        AVX2,
+        NUM_IMPLEMENTATIONS
+    };
+
+    /*
+     * Sum of squared differences between two arrays of doubles.
+     * 'count' must be a multiple of 4.
+     */
+    static double sumSquaredDiff(const double *a, const double *b, unsigned count) {
+        return kernel(a, b, count);
+    }
+
+    static bool isSupported(Implementation impl);
+    static const char *name(Implementation impl);
+
+    // Override the automatic choice. The implementation must be supported.
+    static void setImplementation(Implementation impl);
+    static Implementation implementation();
+
+ private:
+    typedef double (*Kernel)(const double *a, const double *b, unsigned count);
+
+    static Kernel kernel;
+    static Implementation current;
+
+    static Kernel autoSelect();
+    static Kernel kernelFor(Implementation impl);
+
+    static double scalar(const double *a, const double *b, unsigned count);
+    static double sse2(const double *a, const double *b, unsigned count);
+    static double avx2(const double *a, const double *b, unsigned count);
+};
+
+};  // namespace Stir
+
+#endif
@@ -0,0 +1,126 @@
+#include "flash_map.h"
+#include "flash_device.h"
+#include "flash_blockcache.h"
+#include "tasks.h"
+#include "macros.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * FlashMapSpan::copyBytes() streams long copies straight from the device,
+ * in runs of physically adjacent blocks. Check it against a byte-at-a-time
+ * reference, over random maps, offsets, lengths, and cache states.
+ */
+
+static uint8_t flash[FlashDevice::CAPACITY];
+static unsigned deviceReads;
+
+void FlashDevice::init()
+{
+    for (unsigned i = 0; i < sizeof flash; i++)
+        flash[i] = (i * 2654435761u) >> 24;
+}
+
+void FlashDevice::read(uint32_t address, uint8_t *buf, unsigned len)
+{
+    ASSERT(address + len <= sizeof flash);
+    ASSERT(len <= MAX_READ_LENGTH);
+    deviceReads++;
+    memcpy(buf, flash + address, len);
+}
+
+void FlashDevice::write(uint32_t, const uint8_t*, unsigned) {}
+void FlashDevice::eraseBlock(uint32_t) {}
+void FlashDevice::eraseAll() {}
+bool FlashDevice::busy() { return false; }
+
+static FlashMap map;
+static uint8_t result[FlashMap::NUM_BYTES];
+static uint8_t reference[FlashMap::NUM_BYTES];
+
+static void randomMap()
+{
+    // Runs of 1-5 physically adjacent blocks, in shuffled order
+
+    unsigned runs[FlashMap::NUM_MAP_BLOCKS][2];
+    unsigned numRuns = 0;
+
+    for (unsigned i = 0; i < FlashMap::NUM_MAP_BLOCKS;) {
+        unsigned len = 1 + rand() % 5;
+        len = MIN(len, FlashMap::NUM_MAP_BLOCKS - i);
+        runs[numRuns][0] = i;
+        runs[numRuns][1] = len;
+        numRuns++;
+        i += len;
+    }
+
+    for (unsigned i = numRuns; i > 1; i--) {
+        unsigned j = rand() % i;
+        for (unsigned k = 0; k < 2; k++) {
+            unsigned t = runs[i-1][k];
+            runs[i-1][k] = runs[j][k];
+            runs[j][k] = t;
+        }
+    }
+
+    unsigned n = 0;
+    for (unsigned r = 0; r < numRuns; r++)
+        for (unsigned k = 0; k < runs[r][1]; k++)
+            map.blocks[n++] = FlashMapBlock::fromIndex(runs[r][0] + k);
+}
+
+static void copyTest(const FlashMapSpan &span)
+{
+    unsigned size = span.sizeInBytes();
+    unsigned offset = rand() % (size + 64);
+    unsigned len = (rand() % 4) ? (rand() % 2000) : (rand() % 200000);
+    bool inRange = offset < size && offset + len <= size;
+
+    if (rand() % 8 == 0)
+        FlashBlock::invalidate();
+
+    // Warm up a few random blocks, so some of the copy comes from RAM
+    for (unsigned i = rand() % 8; i; i--) {
+        FlashBlockRef ref;
+        span.getBlock(ref, (rand() % size) & ~FlashBlock::BLOCK_MASK);
+    }
+
+    for (unsigned i = 0; inRange && i < len; i++) {
+        FlashBlockRef ref;
+        FlashMapSpan::PhysAddr pa;
+        span.getByte(ref, offset + i, pa);
+        reference[i] = *pa;
+    }
+
+    FlashBlockRef ref;
+    memset(result, 0xAA, len);
+    bool ok = span.copyBytes(ref, offset, result, len);
+    ASSERT(!len || ok == inRange);
+    ASSERT(!ok || !memcmp(result, reference, len));
+
+    memset(result, 0xAA, len);
+    ok = span.copyBytesUncached(offset, result, len);
+    ASSERT(!len || ok == inRange);
+    ASSERT(!ok || !memcmp(result, reference, len));
+}
+
+int main()
+{
+    FlashDevice::init();
+    FlashBlock::init();
+    srand(1);
+
+    for (unsigned i = 0; i < 2000; i++) {
+        randomMap();
+
+        unsigned first = rand() % 300;
+        unsigned num = 1 + rand() % 3000;
+        num = MIN(num, FlashMap::NUM_CACHE_BLOCKS - first - 1);
+
+        copyTest(FlashMapSpan::create(&map, first, num));
+    }
+
+    LOG(("flashmap: Success, %u device reads.\n", deviceReads));
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "flash_device.h"
+#include "flash_blockcache.h"
+#include "flash_volume.h"
+#include "tasks.h"
+#include "event.h"
+#include "svmloader.h"
+#include "svmmemory.h"
+#include "elfprogram.h"
+#include "macros.h"
+
+/*
+ * The rest of the system, as far as the flash stack is concerned.
+ *
+ * Shared by the host tests that link real flash code.
+ * Each test still provides its own FlashDevice read/write/erase, since
+ * that's where they differ.
+ */
+
+void FlashDevice::setStealthIO(int) {}
+void FlashDevice::verify(uint32_t, const uint8_t*, unsigned) {}
+
+uint32_t Tasks::pendingMask;
+uint32_t Tasks::iterationMask;
+uint32_t Tasks::watchdogCounter;
+
+FlashBlock::FlashStats FlashBlock::stats;
+FlashBlockAccess::Kind FlashBlockAccess::currentKind = FlashBlockAccess::OTHER;
+uint32_t FlashBlockAccess::currentObject;
+bool FlashBlock::isAddrValid(uintptr_t) { return true; }
+void FlashBlock::verify() {}
+void FlashBlock::resetStats() {}
+void FlashBlock::countBlockMiss(uint32_t, unsigned) {}
+void FlashBlock::dumpStats() {}
+
+FlashVolume SvmLoader::mapVols[SvmMemory::NUM_FLASH_SEGMENTS];
+bool Elf::Program::init(const FlashMapSpan&) { return false; }
+const char *Elf::Program::getMetaString(FlashBlockRef&, uint16_t) const { return 0; }
+void Event::setBasePending(Event::PriorityID, uint32_t) {}
+
+namespace SysLFS { void cleanupDeletedVolumes() {} void invalidateClients() {} }
+namespace SvmCpu { void invalidateDecodedBlock(unsigned) {} }
+namespace SvmDebugger { void patchFlashBlock(uint32_t, uint8_t*) {} }
+namespace FaultLogger { void internalError(uint32_t) { ASSERT(0); } }
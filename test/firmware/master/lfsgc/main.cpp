@@ -0,0 +1,213 @@
+#include "flash_lfs.h"
+#include "flash_volume.h"
+#include "flash_eraselog.h"
+#include "flash_preerase.h"
+#include "flash_device.h"
+#include "flash_blockcache.h"
+#include "tasks.h"
+#include "crc.h"
+#include "macros.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Random object saves, with FlashLFSBackgroundGC steps in between.
+ * Every object must read back as last written, the background task must
+ * hold off while audio work is pending, and it must never erase anything
+ * itself. While it's allowed to run, it has to stay far enough ahead that
+ * saves almost never need to collect garbage synchronously.
+ */
+
+static uint8_t flash[FlashDevice::CAPACITY];
+static unsigned deviceErases;
+
+void FlashDevice::init()
+{
+    memset(flash, 0xFF, sizeof flash);
+}
+
+void FlashDevice::read(uint32_t address, uint8_t *buf, unsigned len)
+{
+    ASSERT(address + len <= sizeof flash);
+    memcpy(buf, flash + address, len);
+}
+
+void FlashDevice::write(uint32_t address, const uint8_t *buf, unsigned len)
+{
+    ASSERT(address + len <= sizeof flash);
+    for (unsigned i = 0; i < len; i++)
+        flash[address + i] &= buf[i];
+}
+
+void FlashDevice::eraseBlock(uint32_t address)
+{
+    address &= ~(ERASE_BLOCK_SIZE - 1);
+    memset(flash + address, 0xFF, ERASE_BLOCK_SIZE);
+    deviceErases++;
+}
+
+void FlashDevice::eraseAll() { memset(flash, 0xFF, sizeof flash); }
+bool FlashDevice::busy() { return false; }
+
+// Software CRC-32, same polynomial as the hardware engine
+
+static uint32_t crcState;
+
+void Crc32::init() { crcState = 0xFFFFFFFF; }
+void Crc32::deinit() {}
+void Crc32::reset() { crcState = 0xFFFFFFFF; }
+uint32_t Crc32::get() { return crcState; }
+void Crc32::addUniqueness() { add(0x12345678); }
+
+void Crc32::add(uint32_t word)
+{
+    addInline(word);
+}
+
+void Crc32::addInline(uint32_t word)
+{
+    crcState ^= word;
+    for (unsigned i = 0; i < 32; i++)
+        crcState = (crcState << 1) ^ ((crcState & 0x80000000) ? 0x04c11db7 : 0);
+}
+
+FlashPreEraseScheduler::Stats FlashPreEraseScheduler::stats;
+void FlashPreEraseScheduler::finishErase() {}
+
+// Every key in use keeps enough live data around that GC sometimes
+// needs a fresh volume at a time when nothing is pre-erased.
+static const unsigned NUM_KEYS = FlashLFSIndexRecord::MAX_KEYS;
+static int versions[NUM_KEYS];
+
+// Are we simulating a game that's busy with audio?
+static bool busy;
+
+// Saves that had to collect garbage first, with and without background GC
+static unsigned syncCollections[2];
+static unsigned backgroundSteps;
+
+static unsigned objectSize(unsigned key)
+{
+    return 16 + (key % 16) * 128;
+}
+
+static void writeObject(FlashLFS &lfs, unsigned key, unsigned version)
+{
+    uint8_t buf[FlashLFSIndexRecord::MAX_SIZE];
+    unsigned size = objectSize(key);
+    memset(buf, version, size);
+    buf[0] = key;
+
+    CrcStream cs;
+    cs.reset();
+    cs.addBytes(buf, size);
+
+    // Same as allocateAndCollectGarbage(), but count the collections
+    FlashLFSObjectAllocator allocator(lfs, key, size, cs.get(FlashLFSIndexRecord::SIZE_UNIT));
+    if (!allocator.allocate()) {
+        syncCollections[busy]++;
+        bool success = lfs.collectGarbage() && allocator.allocate();
+        ASSERT(success);
+    }
+
+    FlashBlock::invalidate(allocator.address(), allocator.address() + size);
+    FlashDevice::write(allocator.address(), buf, size);
+}
+
+static void checkObject(FlashLFS &lfs, unsigned key)
+{
+    uint8_t buf[FlashLFSIndexRecord::MAX_SIZE];
+    unsigned size = objectSize(key);
+
+    FlashLFSObjectIter iter(lfs);
+    bool found = false;
+    while (!found && iter.previous(FlashLFSKeyQuery(key)))
+        found = iter.record()->getSizeInBytes() == size && iter.readAndCheck(buf, size);
+
+    ASSERT(found == (versions[key] >= 0));
+    ASSERT(!found || (buf[0] == key && buf[size - 1] == uint8_t(versions[key])));
+}
+
+static void preErase(unsigned count)
+{
+    // What FlashBlockPreEraser does, minus the rest of the scheduler
+    for (unsigned i = 0; i < count; i++) {
+        FlashEraseLog log;
+        FlashBlockRecycler recycler(false);
+        FlashEraseLog::Record rec;
+
+        if (!log.allocate(recycler) || !recycler.next(rec.block, rec.ec))
+            return;
+        log.commit(rec);
+    }
+}
+
+static void backgroundStep(FlashLFS &lfs)
+{
+    if (busy)
+        Tasks::trigger(Tasks::AudioPull);
+
+    FlashLFSBackgroundGC::heartbeat();
+    Tasks::cancel(Tasks::AudioPull);
+
+    if (!Tasks::isPending(Tasks::FlashGC))
+        return;
+
+    ASSERT(!busy);
+    Tasks::cancel(Tasks::FlashGC);
+
+    unsigned erases = deviceErases;
+    unsigned volumes = lfs.volumes.numSlotsInUse;
+    FlashLFSBackgroundGC::task();
+    ASSERT(erases == deviceErases);
+
+    if (lfs.volumes.numSlotsInUse < volumes)
+        backgroundSteps++;
+}
+
+int main()
+{
+    Crc32::init();
+    FlashDevice::init();
+    FlashBlock::init();
+    srand(1);
+    memset(versions, -1, sizeof versions);
+
+    for (unsigned i = 0; i < 30000; i++) {
+        FlashLFS &lfs = FlashLFSCache::get(FlashMapBlock::invalid());
+        unsigned key = rand() % NUM_KEYS;
+
+        if (rand() % 2) {
+            versions[key] = (versions[key] + 1) & 0xFF;
+            writeObject(lfs, key, versions[key]);
+        } else {
+            checkObject(lfs, key);
+        }
+
+        // Busy periods come and go, each long enough to run out of space
+        // without help. Sometimes there's nothing pre-erased.
+        if (i % 3000 == 0) {
+            busy = rand() % 2;
+            if (rand() % 2)
+                preErase(2);
+        }
+
+        backgroundStep(lfs);
+    }
+
+    FlashLFS &lfs = FlashLFSCache::get(FlashMapBlock::invalid());
+    for (unsigned key = 0; key < NUM_KEYS; key++)
+        checkObject(lfs, key);
+
+    LOG(("lfsgc: %u background steps, %u/%u synchronous collections when quiet/busy\n",
+        backgroundSteps, syncCollections[0], syncCollections[1]));
+
+    // Busy saves ran out of space, but background GC kept quiet ones ahead
+    ASSERT(syncCollections[1] > 0);
+    ASSERT(syncCollections[0] == 0);
+    ASSERT(backgroundSteps > 0);
+
+    LOG(("lfsgc: Success, %u erases.\n", deviceErases));
+    return 0;
+}
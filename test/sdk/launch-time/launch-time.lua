@@ -0,0 +1,68 @@
+--[[
+    Lua code specific to the "launch-time" SDK test.
+
+    The app calls beginLaunch() just before exec'ing itself, and
+    endLaunch() first thing in main(). We time each launch in virtual
+    time, so results are the same on any machine.
+
+    Every exec() starts a brand new Lua environment, so nothing we keep
+    in globals survives from one launch to the next. Our bookkeeping
+    lives in STATE_FILE instead. The app knows which launch is the first,
+    and calls resetLaunches() to discard anything left from an earlier run.
+]]--
+
+STATE_FILE = "launch-time.state"
+
+
+local function loadState()
+    local s = { count=0, total=0, worst=0, start=-1 }
+    local f = io.open(STATE_FILE, "r")
+    if f then
+        s.count, s.total, s.worst, s.start = f:read("*n", "*n", "*n", "*n")
+        f:close()
+    end
+    return s
+end
+
+
+local function saveState(s)
+    local f = assert(io.open(STATE_FILE, "w"))
+    f:write(string.format("%d %.17g %.17g %.17g\n", s.count, s.total, s.worst, s.start))
+    f:close()
+end
+
+
+function resetLaunches()
+    saveState{ count=0, total=0, worst=0, start=-1 }
+end
+
+
+function beginLaunch()
+    local s = loadState()
+    s.start = System():vclock()
+    saveState(s)
+end
+
+
+function endLaunch()
+    local s = loadState()
+    if s.start >= 0 then
+        local t = System():vclock() - s.start
+        s.count = s.count + 1
+        s.total = s.total + t
+        s.worst = math.max(s.worst, t)
+        s.start = -1
+        saveState(s)
+    end
+end
+
+
+function reportLaunches(expected)
+    local s = loadState()
+    if s.count ~= expected then
+        error(string.format("Timed %d launches, expected %d", s.count, expected))
+    end
+
+    print(string.format("Launch time: %d launches, average %.3f ms, worst %.3f ms",
+        s.count, s.total * 1000 / s.count, s.worst * 1000))
+end
@@ -0,0 +1,79 @@
+/*
+ * Benchmark for game launch time.
+ *
+ * We exec() ourselves over and over, timing each launch in Lua. A large
+ * initialized data segment makes loading RWDATA a big part of that time,
+ * and we check that it arrives intact every time.
+ *
+ * RAM doesn't survive an exec(), so we count launches in a StoredObject.
+ */
+
+#include <sifteo.h>
+using namespace Sifteo;
+
+static Metadata M = Metadata()
+    .title("Launch Time Test");
+
+static const unsigned NUM_LAUNCHES = 16;
+static StoredObject LaunchCounter = StoredObject::allocate();
+
+// A pattern that FastLZ can't do much with, so the segment stays large
+#define W(i)        ((i) * 2654435761u)
+#define W4(i)       W(i), W(i+1), W(i+2), W(i+3)
+#define W16(i)      W4(i), W4(i+4), W4(i+8), W4(i+12)
+#define W64(i)      W16(i), W16(i+16), W16(i+32), W16(i+48)
+#define W256(i)     W64(i), W64(i+64), W64(i+128), W64(i+192)
+#define W1024(i)    W256(i), W256(i+256), W256(i+512), W256(i+768)
+
+static uint32_t data[4096] = {
+    W1024(0), W1024(1024), W1024(2048), W1024(3072)
+};
+
+
+static void checkData()
+{
+    for (unsigned i = 0; i != arraysize(data); ++i) {
+        if (data[i] != W(i)) {
+            LOG("--- RWDATA mismatch at index %d: expected %08x, found %08x\n",
+                i, W(i), data[i]);
+            ASSERT(0);
+        }
+    }
+}
+
+static void scribbleData()
+{
+    // The next launch must reload every word of this
+    for (unsigned i = 0; i != arraysize(data); ++i)
+        data[i] = ~data[i];
+}
+
+void main()
+{
+    // First thing, so the time we measure is all in the launch itself
+    SCRIPT(LUA,
+        package.path = package.path .. ";../../lib/?.lua"
+        require('launch-time')
+        endLaunch()
+    );
+
+    unsigned launches = 0;
+    if (LaunchCounter.readObject(launches) <= 0) {
+        launches = 0;
+        SCRIPT(LUA, resetLaunches());
+    }
+
+    checkData();
+
+    if (launches < NUM_LAUNCHES) {
+        scribbleData();
+        launches++;
+        LaunchCounter.writeObject(launches);
+
+        SCRIPT(LUA, beginLaunch());
+        Volume::running().exec();
+    }
+
+    SCRIPT_FMT(LUA, "reportLaunches(%d)", NUM_LAUNCHES);
+    LOG("Success.\n");
+}
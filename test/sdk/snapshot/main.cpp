@@ -0,0 +1,37 @@
+#include <sifteo.h>
+using namespace Sifteo;
+
+static Metadata M = Metadata()
+    .title("Snapshot test")
+    .cubeRange(2);
+
+static VideoBuffer vid[2];
+
+void main()
+{
+    // Wait for both cubes, so the snapshot has real cube state in it
+    while (CubeSet::connected().count() < 2)
+        System::yield();
+
+    SCRIPT(LUA,
+        package.path = package.path .. ";../../lib/?.lua"
+        require('test-snapshot')
+    );
+
+    // Something different on each cube, so a mixed-up restore would show
+    for (int i = 0; i < 2; ++i) {
+        String<32> str;
+        str << "Snapshot of cube " << i;
+
+        vid[i].initMode(BG0_ROM);
+        vid[i].attach(CubeID(i));
+        vid[i].bg0rom.text(vec(1, 1 + 2 * i), str);
+    }
+
+    System::paint();
+    System::finish();
+
+    SCRIPT(LUA, saveRoundTrip());
+
+    LOG("Success.\n");
+}
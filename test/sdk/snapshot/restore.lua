@@ -0,0 +1,7 @@
+--[[
+    Boot a fresh Siftulator from the snapshot the game saved.
+    Run with "siftulator -e restore.lua", plus the same flash options.
+]]--
+
+require('test-snapshot')
+restoreRoundTrip()
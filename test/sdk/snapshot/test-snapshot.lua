@@ -0,0 +1,116 @@
+--[[
+    Lua code specific to the "snapshot" SDK test.
+
+    The game saves a snapshot of itself while running, alongside the state
+    it expects to get back. restore.lua then boots a fresh Siftulator from
+    that snapshot, and checks the restored state against it.
+]]--
+
+SNAPSHOT_FILE = "roundtrip.snap"
+NUM_CUBES = 2
+
+-- Cube state we can compare byte-for-byte
+VRAM_SIZE = 1024
+
+local function writeFile(name, data)
+    local f = assert(io.open(name, "wb"))
+    f:write(data)
+    f:close()
+end
+
+local function readFile(name)
+    local f = assert(io.open(name, "rb"))
+    local data = f:read("*a")
+    f:close()
+    return data
+end
+
+local function cubeVRAM(cube)
+    local bytes = {}
+    for addr = 0, VRAM_SIZE - 1 do
+        bytes[#bytes + 1] = string.char(cube:xbPeek(addr))
+    end
+    return table.concat(bytes)
+end
+
+local function flashContents()
+    return Filesystem():rawRead(0, 16 * 1024 * 1024)
+end
+
+function saveRoundTrip()
+    -- Save a snapshot from inside the running game, and record what's in it
+
+    local sys = System()
+    local before = sys:vclock()
+    sys:saveSnapshot(SNAPSHOT_FILE)
+    local after = sys:vclock()
+
+    local expected = { string.format("%.17g %.17g", before, after) }
+    for i = 0, NUM_CUBES - 1 do
+        local cube = Cube(i)
+        cube:saveScreenshot(string.format("expected-cube%d.png", i))
+        writeFile(string.format("expected-cube%d.vram", i), cubeVRAM(cube))
+        expected[#expected + 1] = tostring(cube:lcdFrameCount())
+    end
+
+    writeFile("expected.txt", table.concat(expected, "\n"))
+    writeFile("expected.flash", flashContents())
+end
+
+function restoreRoundTrip()
+    -- Restore into a freshly initialized system, and compare
+
+    local sys = System()
+    sys:init()
+    sys:loadSnapshot(SNAPSHOT_FILE)
+
+    local expected = {}
+    for line in io.lines("expected.txt") do
+        expected[#expected + 1] = line
+    end
+
+    local before, after = string.match(expected[1], "(%S+) (%S+)")
+    local now = sys:vclock()
+    if now < tonumber(before) or now > tonumber(after) then
+        error(string.format("Restored clock %f, expected between %s and %s", now, before, after))
+    end
+
+    if sys:numCubes() ~= NUM_CUBES then
+        error(string.format("Restored %d cubes, expected %d", sys:numCubes(), NUM_CUBES))
+    end
+
+    for i = 0, NUM_CUBES - 1 do
+        local cube = Cube(i)
+
+        if cube:lcdFrameCount() ~= tonumber(expected[i + 2]) then
+            error(string.format("Cube %d restored at LCD frame %d, expected %s",
+                i, cube:lcdFrameCount(), expected[i + 2]))
+        end
+
+        if cubeVRAM(cube) ~= readFile(string.format("expected-cube%d.vram", i)) then
+            error(string.format("Cube %d VRAM doesn't match the snapshot", i))
+        end
+
+        local x, y = cube:testScreenshot(string.format("expected-cube%d.png", i))
+        if x then
+            cube:saveScreenshot(string.format("restored-cube%d.png", i))
+            error(string.format("Cube %d LCD doesn't match the snapshot, at (%d, %d)", i, x, y))
+        end
+    end
+
+    if flashContents() ~= readFile("expected.flash") then
+        error("Flash memory doesn't match the snapshot")
+    end
+
+    -- The cubes should keep running from where they left off
+    sys:start()
+    sys:vsleep(0.5)
+
+    for i = 0, NUM_CUBES - 1 do
+        if Cube(i):exceptionCount() ~= 0 then
+            error(string.format("Cube %d crashed after restoring", i))
+        end
+    end
+
+    print("Snapshot restored successfully.")
+end
@@ -0,0 +1,98 @@
+/*
+ * Unit test for stir's TileMetric kernels.
+ *
+ * Every implementation this CPU supports must agree bit-for-bit with the
+ * scalar one, and all of them must be within rounding error of a plain
+ * sequential sum.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "tilemetric.h"
+
+using namespace Stir;
+
+static unsigned failures = 0;
+
+static void check(bool cond, const char *what, const char *impl, unsigned count)
+{
+    if (!cond) {
+        fprintf(stderr, "tilemetric: FAILED %s (%s, count=%u)\n", what, impl, count);
+        failures++;
+    }
+}
+
+static double randomDouble(double range)
+{
+    return (rand() / (double)RAND_MAX - 0.5) * range;
+}
+
+static double reference(const double *a, const double *b, unsigned count)
+{
+    double sum = 0;
+    for (unsigned i = 0; i < count; i++)
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+static void testCount(unsigned count, double range)
+{
+    // Offset by one element so we also exercise unaligned loads
+    double bufA[1 + 256], bufB[1 + 256];
+    double *a = bufA + 1, *b = bufB + 1;
+
+    for (unsigned i = 0; i < count; i++) {
+        a[i] = randomDouble(range);
+        b[i] = randomDouble(range);
+    }
+
+    double ref = reference(a, b, count);
+
+    TileMetric::setImplementation(TileMetric::SCALAR);
+    double scalar = TileMetric::sumSquaredDiff(a, b, count);
+    check(fabs(scalar - ref) <= 1e-12 * ref, "scalar vs. reference", "scalar", count);
+
+    for (int i = 0; i < TileMetric::NUM_IMPLEMENTATIONS; i++) {
+        TileMetric::Implementation impl = (TileMetric::Implementation) i;
+        if (!TileMetric::isSupported(impl))
+            continue;
+
+        TileMetric::setImplementation(impl);
+        double result = TileMetric::sumSquaredDiff(a, b, count);
+        check(result == scalar, "bit-exact match with scalar", TileMetric::name(impl), count);
+
+        // Identical inputs must give exactly zero
+        check(TileMetric::sumSquaredDiff(a, a, count) == 0, "zero distance", TileMetric::name(impl), count);
+    }
+}
+
+int main()
+{
+    const TileMetric::Implementation automatic = TileMetric::implementation();
+    check(TileMetric::isSupported(automatic), "automatic choice is supported",
+          TileMetric::name(automatic), 0);
+
+    srand(1234);
+
+    for (unsigned iter = 0; iter < 1000; iter++) {
+        testCount(12, 200.0);       // Tile::coarseMSE, a Dec4 image
+        testCount(64, 2000.0);      // Tile::sobelError, one gradient plane
+        testCount(192, 200.0);      // Tile::fineMSE, a planar CIELab image
+        testCount(4 * (1 + rand() % 64), 1.0);
+    }
+
+    for (int i = 0; i < TileMetric::NUM_IMPLEMENTATIONS; i++) {
+        TileMetric::Implementation impl = (TileMetric::Implementation) i;
+        printf("tilemetric: %s %s\n", TileMetric::name(impl),
+               TileMetric::isSupported(impl) ? (impl == automatic ? "(default)" : "") : "(unsupported)");
+    }
+
+    if (failures) {
+        fprintf(stderr, "tilemetric: %u failures\n", failures);
+        return 1;
+    }
+
+    printf("tilemetric: Success.\n");
+    return 0;
+}
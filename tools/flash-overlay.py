@@ -0,0 +1,116 @@
+#!/usr/bin/env python
+
+#
+# Manage copy-on-write flash overlays created by the Siftulator when run with
+# both -F BASE.bin and --flash-overlay OVERLAY.bin.
+#
+# usage: flash-overlay.py info OVERLAY
+#        flash-overlay.py commit BASE OVERLAY
+#        flash-overlay.py discard OVERLAY
+#
+# 'commit' writes the overlay's modified pages back into its base image and
+# removes the overlay. 'discard' just removes the overlay. No Siftulator
+# process may be using the base image during a commit.
+#
+# Overlay format: OverlayHeader in emulator/src/flash_storage.h
+#
+
+import sys, os, struct
+import SiftulatorFlash
+
+OVERLAY_MAGIC = 0x564f4c4674666953
+OVERLAY_VERSION = 1
+OVERLAY_HEADER_FORMAT = "<QIIIIII"
+
+####################################################
+# Overlay parsing
+####################################################
+
+class Overlay:
+    def __init__(self, path):
+        self.path = path
+        f = open(path, 'rb')
+
+        hdr = f.read(struct.calcsize(OVERLAY_HEADER_FORMAT))
+        if len(hdr) != struct.calcsize(OVERLAY_HEADER_FORMAT):
+            raise ValueError("%s is not a flash overlay file" % path)
+
+        (magic, version, self.pageSize, self.baseFileSize, self.baseUniqueID,
+            numPages, reserved) = struct.unpack(OVERLAY_HEADER_FORMAT, hdr)
+
+        if magic != OVERLAY_MAGIC or version != OVERLAY_VERSION:
+            raise ValueError("%s is not a flash overlay file" % path)
+
+        # List of (index, data) tuples. The last page of the file may be short.
+        self.pages = []
+        for i in range(numPages):
+            index = struct.unpack("<I", f.read(4))[0]
+            offset = index * self.pageSize
+            length = min(self.pageSize, self.baseFileSize - offset)
+            data = f.read(length)
+            if length <= 0 or len(data) != length:
+                raise ValueError("%s is truncated or corrupted" % path)
+            self.pages.append((index, data))
+
+####################################################
+# Commands
+####################################################
+
+def info(overlayPath):
+    overlay = Overlay(overlayPath)
+    modified = len(overlay.pages) * overlay.pageSize
+    print "Base image ID:   %08x" % overlay.baseUniqueID
+    print "Base image size: %d bytes" % overlay.baseFileSize
+    print "Modified pages:  %d x %d bytes (%.2f%% of base)" % (
+        len(overlay.pages), overlay.pageSize,
+        100.0 * modified / overlay.baseFileSize)
+
+
+def commit(basePath, overlayPath):
+    overlay = Overlay(overlayPath)
+    f = open(basePath, 'r+b')
+
+    hdr = f.read(struct.calcsize(SiftulatorFlash.HEADER_FORMAT))
+    fields = struct.unpack(SiftulatorFlash.HEADER_FORMAT, hdr)
+    magic, fileSize, uniqueID = fields[0], fields[2], fields[10]
+
+    if magic != SiftulatorFlash.MAGIC:
+        raise ValueError("%s is not a Siftulator flash file" % basePath)
+    if fileSize != overlay.baseFileSize or uniqueID != overlay.baseUniqueID:
+        raise ValueError("%s was not created from %s" % (overlayPath, basePath))
+
+    for index, data in overlay.pages:
+        f.seek(index * overlay.pageSize)
+        f.write(data)
+
+    f.close()
+    os.remove(overlayPath)
+    print "Committed %d pages to %s" % (len(overlay.pages), basePath)
+
+
+def discard(overlayPath):
+    # Parse it first, so we never delete something that isn't an overlay
+    Overlay(overlayPath)
+    os.remove(overlayPath)
+
+####################################################
+# main
+####################################################
+
+def main(argv):
+    if len(argv) == 3 and argv[1] == 'info':
+        info(argv[2])
+    elif len(argv) == 4 and argv[1] == 'commit':
+        commit(argv[2], argv[3])
+    elif len(argv) == 3 and argv[1] == 'discard':
+        discard(argv[2])
+    else:
+        sys.stderr.write("usage: %s info OVERLAY\n"
+                         "       %s commit BASE OVERLAY\n"
+                         "       %s discard OVERLAY\n" % (argv[0], argv[0], argv[0]))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,233 @@
+#!/usr/bin/env python
+
+#
+# Run a batch of independent Siftulator jobs in parallel, and collect
+# their results. Every job runs with --headless --lockstep, so a job
+# produces the same output every time it runs, on any machine.
+#
+# usage: siftulator-batch.py [options] MANIFEST
+#
+# options:
+#   -j NUM             Number of jobs to run at once (default: number of CPUs)
+#   -o DIR             Output directory (default: batch-results)
+#   --timeout SEC      Kill any job that runs for longer than SEC seconds
+#   --siftulator PATH  Siftulator binary to use (default: siftulator)
+#
+# Each non-empty line of the manifest describes one job:
+#
+#   GAME.elf  SCRIPT.lua  SEED  [extra siftulator arguments...]
+#
+# Use '-' in place of SCRIPT.lua to run the game on its own. Paths are
+# relative to the manifest file. Lines beginning with '#' are comments.
+#
+# Each job runs in its own subdirectory of the output directory, where its
+# console output is saved as 'output.txt'. A summary of all jobs is written
+# to 'results.txt'. We exit with a nonzero status if any job failed.
+#
+
+import sys, os, time, shlex, threading, subprocess
+
+####################################################
+# Manifest parsing
+####################################################
+
+class Job:
+    def __init__(self, index, game, script, seed, extraArgs):
+        self.index = index
+        self.game = game
+        self.script = script
+        self.seed = seed
+        self.extraArgs = extraArgs
+        self.exitCode = None
+        self.timedOut = False
+        self.seconds = 0
+
+    def name(self):
+        return 'job-%04d' % self.index
+
+    def passed(self):
+        return self.exitCode == 0 and not self.timedOut
+
+    def status(self):
+        if self.timedOut:
+            return 'TIMEOUT'
+        if self.exitCode == 0:
+            return 'PASS'
+        return 'FAIL'
+
+
+def readManifest(path):
+    jobs = []
+    base = os.path.dirname(os.path.abspath(path))
+
+    for lineNum, line in enumerate(open(path)):
+        tokens = shlex.split(line, comments=True)
+        if not tokens:
+            continue
+        if len(tokens) < 3:
+            raise ValueError("%s:%d: expected GAME SCRIPT SEED" % (path, lineNum + 1))
+
+        game = os.path.join(base, tokens[0])
+        script = tokens[1] != '-' and os.path.join(base, tokens[1]) or None
+        seed = int(tokens[2], 0)
+        jobs.append(Job(len(jobs), game, script, seed, tokens[3:]))
+
+    return jobs
+
+####################################################
+# Job execution
+####################################################
+
+class Runner:
+    def __init__(self, jobs, outputDir, siftulator, timeout):
+        self.pending = list(jobs)
+        self.outputDir = outputDir
+        self.siftulator = siftulator
+        self.timeout = timeout
+        self.lock = threading.Lock()
+        self.finished = 0
+        self.total = len(jobs)
+
+    def command(self, job):
+        cmd = [self.siftulator, '--headless', '--lockstep', '--seed', str(job.seed)]
+        cmd += job.extraArgs
+        if job.script:
+            cmd += ['-e', job.script]
+        cmd += ['-l', job.game]
+        return cmd
+
+    def runJob(self, job):
+        jobDir = os.path.join(self.outputDir, job.name())
+        if not os.path.isdir(jobDir):
+            os.makedirs(jobDir)
+
+        output = open(os.path.join(jobDir, 'output.txt'), 'w')
+        output.write('# %s\n' % ' '.join(self.command(job)))
+        output.flush()
+
+        start = time.time()
+        proc = subprocess.Popen(self.command(job), cwd=jobDir,
+            stdout=output, stderr=subprocess.STDOUT)
+
+        timer = None
+        if self.timeout:
+            def kill():
+                job.timedOut = True
+                try:
+                    proc.kill()
+                except OSError:
+                    # Already exited
+                    pass
+            timer = threading.Timer(self.timeout, kill)
+            timer.start()
+
+        job.exitCode = proc.wait()
+        job.seconds = time.time() - start
+        if timer:
+            timer.cancel()
+        output.close()
+
+    def worker(self):
+        while True:
+            self.lock.acquire()
+            job = self.pending and self.pending.pop(0) or None
+            self.lock.release()
+            if not job:
+                return
+
+            self.runJob(job)
+
+            self.lock.acquire()
+            self.finished += 1
+            print "[%d/%d] %-8s %s (%.1fs)" % (self.finished, self.total,
+                job.status(), job.name(), job.seconds)
+            sys.stdout.flush()
+            self.lock.release()
+
+    def run(self, numThreads):
+        threads = [threading.Thread(target=self.worker) for i in range(numThreads)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+####################################################
+# Results
+####################################################
+
+def writeResults(jobs, path):
+    f = open(path, 'w')
+    f.write("# job\tstatus\texit\tseconds\tseed\tgame\tscript\n")
+    for job in jobs:
+        f.write("%s\t%s\t%s\t%.2f\t%d\t%s\t%s\n" % (job.name(), job.status(),
+            job.exitCode, job.seconds, job.seed, job.game, job.script or '-'))
+    f.close()
+
+
+def cpuCount():
+    try:
+        import multiprocessing
+        return multiprocessing.cpu_count()
+    except (ImportError, NotImplementedError):
+        return 1
+
+####################################################
+# main
+####################################################
+
+def usage(argv):
+    sys.stderr.write("usage: %s [-j NUM] [-o DIR] [--timeout SEC] "
+                     "[--siftulator PATH] MANIFEST\n" % argv[0])
+    return 1
+
+
+def main(argv):
+    numThreads = cpuCount()
+    outputDir = 'batch-results'
+    siftulator = 'siftulator'
+    timeout = None
+    manifest = None
+
+    args = list(argv[1:])
+    while args:
+        arg = args.pop(0)
+        if arg == '-j' and args:
+            numThreads = max(1, int(args.pop(0)))
+        elif arg == '-o' and args:
+            outputDir = args.pop(0)
+        elif arg == '--timeout' and args:
+            timeout = float(args.pop(0))
+        elif arg == '--siftulator' and args:
+            siftulator = args.pop(0)
+        elif arg.startswith('-') or manifest:
+            return usage(argv)
+        else:
+            manifest = arg
+
+    if not manifest:
+        return usage(argv)
+
+    # Jobs run in their own directories
+    if os.sep in siftulator:
+        siftulator = os.path.abspath(siftulator)
+
+    jobs = readManifest(manifest)
+    outputDir = os.path.abspath(outputDir)
+    if not os.path.isdir(outputDir):
+        os.makedirs(outputDir)
+
+    start = time.time()
+    Runner(jobs, outputDir, siftulator, timeout).run(numThreads)
+    writeResults(jobs, os.path.join(outputDir, 'results.txt'))
+
+    failed = [job for job in jobs if not job.passed()]
+    print "\n%d jobs, %d passed, %d failed, in %.1f seconds" % (
+        len(jobs), len(jobs) - len(failed), len(failed), time.time() - start)
+    for job in failed:
+        print "  %-8s %s" % (job.status(), os.path.join(outputDir, job.name(), 'output.txt'))
+
+    return failed and 1 or 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
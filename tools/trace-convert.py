@@ -0,0 +1,274 @@
+#!/usr/bin/env python
+
+#
+# Convert a binary trace.bin from the Siftulator's tracer into the
+# traditional text log and VCD waveform files.
+#
+# usage: trace-convert.py [trace.bin] [--text trace.txt] [--vcd trace.vcd]
+#
+# With no output options, both trace.txt and trace.vcd are written to the
+# current directory. Either output can be suppressed by passing '-' as its
+# file name.
+#
+# Trace format: emulator/src/tracebuffer.h
+#
+
+import sys, re, struct
+
+MAGIC = b'TCTRACE1'
+
+T_TIMESCALE = 0x01
+T_SCOPE     = 0x02
+T_UPSCOPE   = 0x03
+T_VAR       = 0x04
+T_TIME      = 0x10
+T_VALUE     = 0x11
+T_FORMAT    = 0x20
+T_LOG       = 0x21
+T_HEX       = 0x22
+T_TRUNCATED = 0x30
+
+# Must parse format strings the same way as Tracer::logWork()
+FORMAT_SPEC = re.compile(r'%([-+ #0-9.*]*)([hlLqjzt]*)(.?)')
+
+
+class TraceReader:
+    def __init__(self, data, pos=0):
+        self.data = data
+        self.pos = pos
+
+    def done(self):
+        return self.pos >= len(self.data)
+
+    def byte(self):
+        b = self.data[self.pos]
+        self.pos += 1
+        return b
+
+    def varint(self):
+        result = shift = 0
+        while True:
+            b = self.byte()
+            result |= (b & 0x7F) << shift
+            shift += 7
+            if not (b & 0x80):
+                return result
+
+    def signed(self):
+        v = self.varint()
+        return (v >> 1) ^ -(v & 1)
+
+    def double(self):
+        return struct.unpack('<d', struct.pack('<Q', self.varint()))[0]
+
+    def bytes(self):
+        n = self.varint()
+        b = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return b
+
+    def string(self):
+        return self.bytes().decode('latin-1')
+
+
+####################################################
+# Output formatting
+####################################################
+
+def vcdIdentifier(id):
+    # Same identifier scheme the emulator used when it wrote VCD directly
+    first, last = ord('!'), ord('}')
+    base = last - first + 1
+    s = ''
+    while True:
+        s += chr(first + id % base)
+        id //= base
+        if not id:
+            return s
+
+
+def formatFlags(flags, reader):
+    # Each '*' width or precision was stored as an int argument of its own
+    out = ''
+    for part in re.split(r'(\*)', flags):
+        if part != '*':
+            out += part
+            continue
+        value = reader.signed()
+        if out.endswith('.') and value < 0:
+            out = out[:-1]      # Negative precision means none at all
+        else:
+            out += str(value)
+    return out
+
+
+def formatLog(fmt, reader):
+    out = []
+    pos = 0
+
+    try:
+        for m in FORMAT_SPEC.finditer(fmt):
+            out.append(fmt[pos:m.start()])
+            pos = m.end()
+            conv = m.group(3)
+
+            if conv == '%':
+                out.append('%')
+                continue
+
+            flags = formatFlags(m.group(1), reader)
+            if conv == 's':
+                out.append(('%' + flags + 's') % reader.string())
+            elif conv == 'c':
+                out.append(('%' + flags + 'c') % chr(reader.signed() & 0xFF))
+            elif conv and conv in 'di':
+                out.append(('%' + flags + 'd') % reader.signed())
+            elif conv and conv in 'ouxX':
+                out.append(('%' + flags + conv) % reader.varint())
+            elif conv == 'p':
+                out.append(('%' + flags + 's') % ('0x%x' % reader.varint()))
+            elif conv and conv in 'aA':
+                value = reader.double().hex()
+                out.append(('%' + flags + 's') % (conv == 'A' and value.upper() or value))
+            elif conv and conv in 'eEfFgG':
+                out.append(('%' + flags + conv) % reader.double())
+            else:
+                # Unsupported conversion; the emulator stopped recording here too
+                out.append('<unsupported %' + m.group(0)[1:] + '>')
+                break
+
+    except IndexError:
+        # Ran off the end of a truncated record
+        out.append('<truncated>')
+
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+
+def convert(data, textFile, vcdFile):
+    if data[:len(MAGIC)] != MAGIC:
+        raise ValueError("not a binary trace file")
+
+    reader = TraceReader(data)
+    reader.pos = len(MAGIC)
+
+    formats = {}
+    signalBits = {}
+    clock = 0
+    vcdClock = None
+    inHeader = True
+
+    while not reader.done():
+        tag = reader.byte()
+        rec = reader
+        truncated = tag == T_TRUNCATED
+
+        if truncated:
+            # Parse the wrapped record on its own, so a missing field
+            # can't run into the next record.
+            rec = TraceReader(reader.bytes())
+            tag = rec.byte()
+
+        if tag == T_TIMESCALE:
+            hz = rec.varint()
+            if vcdFile:
+                vcdFile.write("$timescale\n  %d fs\n$end\n" % (10**15 // hz))
+
+        elif tag == T_SCOPE:
+            name = rec.string()
+            if vcdFile:
+                vcdFile.write("$scope module %s $end\n" % name)
+
+        elif tag == T_UPSCOPE:
+            if vcdFile:
+                vcdFile.write("$upscope $end\n")
+
+        elif tag == T_VAR:
+            id = rec.varint()
+            bits = rec.varint()
+            name = rec.string()
+            signalBits[id] = bits
+            if vcdFile:
+                if bits > 1:
+                    name += "[%d:0]" % (bits - 1)
+                vcdFile.write("$var reg %d %s %s $end\n" % (bits, vcdIdentifier(id), name))
+
+        elif tag == T_TIME:
+            clock += rec.signed()
+
+        elif tag == T_VALUE:
+            id = rec.varint()
+            value = rec.varint()
+            if vcdFile:
+                if inHeader:
+                    vcdFile.write("$enddefinitions $end\n")
+                    inHeader = False
+                if clock != vcdClock:
+                    vcdFile.write("#%d\n" % clock)
+                    vcdClock = clock
+                bits = signalBits[id]
+                digits = ''.join(str((value >> b) & 1) for b in range(bits - 1, -1, -1))
+                if bits > 1:
+                    digits = 'b' + digits
+                vcdFile.write("%s %s\n" % (digits, vcdIdentifier(id)))
+
+        elif tag == T_FORMAT:
+            id = rec.varint()
+            formats[id] = rec.string()
+
+        elif tag == T_LOG:
+            cube = rec.varint()
+            fmt = formats[rec.varint()]
+            msg = formatLog(fmt, rec)
+            if truncated and '<truncated>' not in msg:
+                msg += ' <truncated>'
+            if textFile:
+                textFile.write("[%02d t=%d] %s\n" % (cube, clock, msg))
+
+        elif tag == T_HEX:
+            cube = rec.varint()
+            msg = rec.string()
+            payload = not rec.done() and rec.bytes() or b''
+            if textFile:
+                textFile.write("[%02d t=%d] %s [%d]%s%s\n" % (cube, clock, msg, len(payload),
+                    ''.join(" %02x" % b for b in payload), truncated and ' <truncated>' or ''))
+
+        else:
+            raise ValueError("unknown record tag 0x%02x at offset %d" % (tag, reader.pos - 1))
+
+    if vcdFile and inHeader:
+        vcdFile.write("$enddefinitions $end\n")
+
+
+####################################################
+# main
+####################################################
+
+def main(argv):
+    inputPath = 'trace.bin'
+    textPath = 'trace.txt'
+    vcdPath = 'trace.vcd'
+
+    args = list(argv[1:])
+    while args:
+        arg = args.pop(0)
+        if arg == '--text' and args:
+            textPath = args.pop(0)
+        elif arg == '--vcd' and args:
+            vcdPath = args.pop(0)
+        elif arg.startswith('-'):
+            sys.stderr.write("usage: %s [trace.bin] [--text trace.txt] [--vcd trace.vcd]\n" % argv[0])
+            return 1
+        else:
+            inputPath = arg
+
+    data = bytearray(open(inputPath, 'rb').read())
+    textFile = textPath != '-' and open(textPath, 'w') or None
+    vcdFile = vcdPath != '-' and open(vcdPath, 'w') or None
+
+    convert(data, textFile, vcdFile)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,322 @@
+/* -*- mode: C; c-basic-offset: 4; intent-tabs-mode: nil -*-
+ *
+ * Sifteo VM (SVM) Target for LLVM
+ *
+ * Micah Elizabeth Scott <micah@misc.name>
+ * Copyright <c> 2012 Sifteo, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Profile-guided function ordering.
+ *
+ * Every function starts on a fresh flash block, so the order of functions
+ * in the module is the order of their code in flash. Normally that's just
+ * link order. Given a profile from Siftulator's --svm-profile option, we
+ * instead place each hot function right next to the callers and callees it
+ * is hottest with, so that a hot call chain occupies a contiguous run of
+ * blocks that the flash cache's read-ahead can stream in together. Code
+ * that never showed up in the profile is moved to the end.
+ *
+ * The profile is in "collapsed stack" format, one stack per line, with
+ * frames separated by semicolons and a sample count at the end:
+ *
+ *   main;Game::run;Game::draw 1234
+ *
+ * Frames that don't name a function in this module (syscalls, annotations
+ * in brackets, or functions that have since been inlined) are skipped.
+ *
+ * Functions are grouped into chains using the classic Pettis-Hansen
+ * approach: visit caller/callee edges from heaviest to lightest, joining
+ * the chains at either end of each edge. Each pair of chains is merged at
+ * the endpoints nearest the edge's two functions, reversing a chain if
+ * needed, so the hottest pairs end up adjacent. Chains are then sorted by
+ * weight.
+ */
+
+#include "llvm/Pass.h"
+#include "llvm/Module.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/system_error.h"
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+using namespace llvm;
+
+static cl::opt<std::string> LayoutProfile("layout-profile",
+    cl::desc("Order functions in flash using a profile from Siftulator's --svm-profile"),
+    cl::value_desc("filename"));
+
+namespace llvm {
+    ModulePass *createProfileLayoutPass();
+}
+
+namespace {
+    class ProfileLayoutPass : public ModulePass {
+    public:
+        static char ID;
+        ProfileLayoutPass()
+            : ModulePass(ID) {}
+
+        virtual bool runOnModule(Module &M);
+
+        virtual const char *getPassName() const {
+            return "Profile-guided function layout";
+        }
+
+    private:
+        typedef std::map<std::string, Function*> NameMap_t;
+        typedef std::map<Function*, uint64_t> WeightMap_t;
+        typedef std::map<std::pair<Function*, Function*>, uint64_t> EdgeMap_t;
+        typedef std::vector<Function*> Chain_t;
+
+        NameMap_t Names;
+        WeightMap_t Weights;
+        EdgeMap_t Edges;
+
+        void mapNames(Module &M);
+        void readProfile(StringRef Data);
+        void addStack(StringRef Stack, uint64_t Count);
+        void buildChains(Module &M, std::vector<Chain_t> &Chains);
+        uint64_t chainWeight(const Chain_t &C);
+        static unsigned chainPosition(const Chain_t &C, Function *F);
+
+        static bool edgeSort(const EdgeMap_t::value_type *a,
+            const EdgeMap_t::value_type *b);
+    };
+}
+
+char ProfileLayoutPass::ID = 0;
+
+static StringRef trimSpace(StringRef S)
+{
+    const char *Space = " \t\r";
+    size_t Begin = S.find_first_not_of(Space);
+    if (Begin == StringRef::npos)
+        return StringRef();
+
+    size_t End = S.size();
+    while (End > Begin && strchr(Space, S[End - 1]))
+        End--;
+
+    return S.slice(Begin, End);
+}
+
+
+bool ProfileLayoutPass::runOnModule(Module &M)
+{
+    if (LayoutProfile.empty())
+        return false;
+
+    OwningPtr<MemoryBuffer> Buffer;
+    if (error_code ec = MemoryBuffer::getFile(LayoutProfile, Buffer))
+        report_fatal_error("Can't read layout profile '" + Twine(LayoutProfile)
+            + "': " + ec.message());
+
+    mapNames(M);
+    readProfile(Buffer->getBuffer());
+
+    std::vector<Chain_t> Chains;
+    buildChains(M, Chains);
+
+    /*
+     * Move every function to the end of the list, hot chains first, in
+     * order of decreasing weight. Unprofiled functions are left behind,
+     * which puts them after all of the profiled code.
+     */
+
+    std::vector<std::pair<uint64_t, unsigned> > Order;
+    for (unsigned i = 0, e = Chains.size(); i != e; ++i)
+        Order.push_back(std::make_pair(~chainWeight(Chains[i]), i));
+    std::sort(Order.begin(), Order.end());
+
+    std::vector<Function*> Cold;
+    for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F)
+        if (!F->isDeclaration() && !Weights.count(F))
+            Cold.push_back(F);
+
+    Module::FunctionListType &FL = M.getFunctionList();
+    for (unsigned i = 0, e = Order.size(); i != e; ++i) {
+        const Chain_t &C = Chains[Order[i].second];
+        for (Chain_t::const_iterator I = C.begin(), E = C.end(); I != E; ++I) {
+            (*I)->removeFromParent();
+            FL.push_back(*I);
+        }
+    }
+    for (unsigned i = 0, e = Cold.size(); i != e; ++i) {
+        Cold[i]->removeFromParent();
+        FL.push_back(Cold[i]);
+    }
+
+    return true;
+}
+
+void ProfileLayoutPass::mapNames(Module &M)
+{
+    /*
+     * Siftulator reports demangled names, but also match the raw
+     * symbol name, for C functions and hand-written profiles.
+     */
+
+    for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+        if (F->isDeclaration())
+            continue;
+
+        std::string Name = F->getName();
+        Names[Name] = F;
+
+        int status;
+        char *Demangled = abi::__cxa_demangle(Name.c_str(), 0, 0, &status);
+        if (status == 0) {
+            Names[Demangled] = F;
+            free(Demangled);
+        }
+    }
+}
+
+void ProfileLayoutPass::readProfile(StringRef Data)
+{
+    while (!Data.empty()) {
+        std::pair<StringRef, StringRef> Line = Data.split('\n');
+        Data = Line.second;
+
+        StringRef Text = trimSpace(Line.first);
+        if (Text.empty() || Text[0] == '#')
+            continue;
+
+        std::pair<StringRef, StringRef> Fields = Text.rsplit(' ');
+        unsigned long long Count;
+        if (Fields.second.empty() || Fields.second.getAsInteger(10, Count))
+            report_fatal_error("Malformed line in layout profile '"
+                + Twine(LayoutProfile) + "': " + Text);
+
+        addStack(Fields.first, Count);
+    }
+}
+
+void ProfileLayoutPass::addStack(StringRef Stack, uint64_t Count)
+{
+    /*
+     * Every function on the stack is active during this sample, so it
+     * gets the whole count. Consecutive known frames are a caller/callee
+     * edge. Recursion counts only once per stack.
+     */
+
+    SmallVector<StringRef, 32> Frames;
+    Stack.split(Frames, ";");
+
+    Function *Caller = 0;
+    std::vector<Function*> Seen;
+
+    for (unsigned i = 0, e = Frames.size(); i != e; ++i) {
+        NameMap_t::iterator I = Names.find(trimSpace(Frames[i]));
+        if (I == Names.end())
+            continue;
+        Function *F = I->second;
+
+        if (std::find(Seen.begin(), Seen.end(), F) == Seen.end()) {
+            Seen.push_back(F);
+            Weights[F] += Count;
+        }
+
+        if (Caller && Caller != F)
+            Edges[std::make_pair(Caller, F)] += Count;
+        Caller = F;
+    }
+}
+
+bool ProfileLayoutPass::edgeSort(const EdgeMap_t::value_type *a,
+    const EdgeMap_t::value_type *b)
+{
+    return a->second > b->second;
+}
+
+void ProfileLayoutPass::buildChains(Module &M, std::vector<Chain_t> &Chains)
+{
+    // Start with one chain per profiled function, in link order
+    std::map<Function*, unsigned> ChainOf;
+    for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+        if (Weights.count(F)) {
+            ChainOf[F] = Chains.size();
+            Chains.push_back(Chain_t(1, F));
+        }
+    }
+
+    std::vector<const EdgeMap_t::value_type*> SortedEdges;
+    for (EdgeMap_t::const_iterator I = Edges.begin(), E = Edges.end(); I != E; ++I)
+        SortedEdges.push_back(&*I);
+    std::stable_sort(SortedEdges.begin(), SortedEdges.end(), edgeSort);
+
+    for (unsigned i = 0, e = SortedEdges.size(); i != e; ++i) {
+        Function *Caller = SortedEdges[i]->first.first;
+        Function *Callee = SortedEdges[i]->first.second;
+        unsigned A = ChainOf[Caller];
+        unsigned B = ChainOf[Callee];
+        if (A == B)
+            continue;
+
+        /*
+         * Join the chains at whichever ends bring Caller and Callee closest
+         * together: Caller toward the tail of its chain, Callee toward the
+         * head of its own. If both are already at an end, they come out
+         * adjacent. Then append B to A, leaving B empty.
+         */
+
+        Chain_t &CA = Chains[A];
+        Chain_t &CB = Chains[B];
+
+        if (chainPosition(CA, Caller) * 2 < CA.size() - 1)
+            std::reverse(CA.begin(), CA.end());
+        if (chainPosition(CB, Callee) * 2 > CB.size() - 1)
+            std::reverse(CB.begin(), CB.end());
+
+        for (Chain_t::iterator I = CB.begin(), E = CB.end(); I != E; ++I)
+            ChainOf[*I] = A;
+        CA.insert(CA.end(), CB.begin(), CB.end());
+        CB.clear();
+    }
+}
+
+unsigned ProfileLayoutPass::chainPosition(const Chain_t &C, Function *F)
+{
+    return std::find(C.begin(), C.end(), F) - C.begin();
+}
+
+uint64_t ProfileLayoutPass::chainWeight(const Chain_t &C)
+{
+    // A chain is as hot as its hottest function
+    uint64_t W = 0;
+    for (Chain_t::const_iterator I = C.begin(), E = C.end(); I != E; ++I)
+        W = std::max(W, Weights[*I]);
+    return W;
+}
+
+ModulePass *llvm::createProfileLayoutPass()
+{
+    return new ProfileLayoutPass();
+}
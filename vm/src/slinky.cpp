@@ -80,6 +80,7 @@ namespace llvm {
     BasicBlockPass *createLateLTIPass();
     BasicBlockPass *createMisalignStackPass();
     FunctionPass *createStaticAllocaPass();
+    ModulePass *createProfileLayoutPass();
 }
 
 static const char HelpText[] =
@@ -336,6 +337,10 @@ static void AddPasses(PassManagerBase &PM,
 
     // Just before code generation, make all stack allocations static.
     PM.add(createStaticAllocaPass());
+
+    // Functions are emitted in module order. If we have a profile, put
+    // hot call chains next to each other and cold code at the end.
+    PM.add(createProfileLayoutPass());
 }
 
 int main(int argc, char **argv)